@@ -0,0 +1,145 @@
+/*
+ Archive compression benchmark. Builds a few series shaped like the xforms we keep - daily
+ call counts, hourly means and maxes of wait times, five minute counts which are mostly
+ zero - compresses them in blocks as the archive does and reports the size against the
+ ring's 32 bytes a point (rrdbTimePoint plus a long double) and how fast blocks decode.
+
+ make bench && bench/archive [decode passes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "rrdb.h"
+
+/* xorshift, so every run sees the same series */
+static uint64_t state = 88172645463325252ull;
+
+static double uniform( void ) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return ( double ) ( state >> 11 ) / ( double ) ( 1ull << 53 );
+}
+
+typedef struct series {
+  const char *name;
+  unsigned int count;
+  rrdbArchivePoint *points;
+} series;
+
+static series generate( const char *name, unsigned int count, int64_t step, int kind ) {
+  series s = { name, count, malloc( sizeof( rrdbArchivePoint ) * count ) };
+  int64_t start = 1577836800;
+
+  for ( unsigned int i = 0; i < count; i++ ) {
+    double weekly = 1.0 + 0.3 * ( ( i % 7 ) < 5 );
+    double v = 0;
+
+    switch ( kind ) {
+      /* calls a day */
+      case 0: v = ( double ) ( int ) ( 1200 * weekly + 200 * uniform() ); break;
+      /* mean wait an hour - sum of waits over the calls */
+      case 1: v = ( double ) ( int ) ( 3000 + 2000 * uniform() ) / ( double ) ( 1 + ( int ) ( 60 * uniform() ) ); break;
+      /* max wait an hour - whole seconds, often repeating */
+      case 2: v = ( double ) ( 30 * ( int ) ( 4 * uniform() ) + 60 ); break;
+      /* abandoned calls in five minutes */
+      case 3: v = uniform() < 0.85 ? 0 : ( double ) ( int ) ( 1 + 3 * uniform() ); break;
+    }
+
+    s.points[ i ] = ( rrdbArchivePoint ) { start + i * step, v };
+  }
+
+  return s;
+}
+
+static void visit( int64_t time, double value, void *arg ) {
+  double *sum = arg;
+  *sum += value + ( double ) ( time & 1 );
+}
+
+typedef struct check {
+  const rrdbArchivePoint *expected;
+  unsigned int at;
+  unsigned int bad;
+} check;
+
+static void verify( int64_t time, double value, void *arg ) {
+  check *c = arg;
+  if ( time != c->expected[ c->at ].time || value != c->expected[ c->at ].value ) c->bad++;
+  c->at++;
+}
+
+static double seconds( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main( int argc, char **argv ) {
+  unsigned int passes = argc > 1 ? ( unsigned int ) atoi( argv[ 1 ] ) : 50;
+  series all[] = {
+    generate( "ONEDAY calls (3 years)", 1095, 86400, 0 ),
+    generate( "ONEHOUR mean wait (3 years)", 26280, 3600, 1 ),
+    generate( "ONEHOUR max wait (3 years)", 26280, 3600, 2 ),
+    generate( "FIVEMINUTE abandoned (1 year)", 105120, 300, 3 ),
+  };
+
+  printf( "%-32s %8s %10s %10s %8s %12s\n", "series", "points", "raw", "archived", "ratio", "decode/s" );
+
+  for ( unsigned int s = 0; s < sizeof( all ) / sizeof( all[ 0 ] ); s++ ) {
+    unsigned int blocks = all[ s ].count / RRDBARCHIVEPOINTS;
+    unsigned char *data = malloc( ( size_t ) blocks * RRDBARCHIVEBLOCKBYTES );
+    size_t *bytes = malloc( sizeof( size_t ) * blocks );
+    size_t archived = 0;
+    double sum = 0;
+
+    for ( unsigned int b = 0; b < blocks; b++ ) {
+      bytes[ b ] = rrdbArchiveEncode( &all[ s ].points[ b * RRDBARCHIVEPOINTS ], RRDBARCHIVEPOINTS,
+                                      data + ( size_t ) b * RRDBARCHIVEBLOCKBYTES, RRDBARCHIVEBLOCKBYTES );
+      archived += sizeof( rrdbArchiveBlock ) + bytes[ b ];
+    }
+
+    /* everything comes back as it went in */
+    check c = { all[ s ].points, 0, 0 };
+    for ( unsigned int b = 0; b < blocks; b++ ) {
+      rrdbArchiveDecode( data + ( size_t ) b * RRDBARCHIVEBLOCKBYTES, bytes[ b ], RRDBARCHIVEPOINTS, verify, &c );
+    }
+    if ( c.bad > 0 ) {
+      fprintf( stderr, "%u points of %s did not decode to what was encoded\n", c.bad, all[ s ].name );
+      return 1;
+    }
+
+    double started = seconds();
+    for ( unsigned int p = 0; p < passes; p++ ) {
+      for ( unsigned int b = 0; b < blocks; b++ ) {
+        if ( -1 == rrdbArchiveDecode( data + ( size_t ) b * RRDBARCHIVEBLOCKBYTES, bytes[ b ], RRDBARCHIVEPOINTS, visit, &sum ) ) {
+          fprintf( stderr, "block %u of %s failed to decode\n", b, all[ s ].name );
+          return 1;
+        }
+      }
+    }
+    double elapsed = seconds() - started;
+
+    size_t points = ( size_t ) blocks * RRDBARCHIVEPOINTS;
+    size_t raw = points * ( sizeof( rrdbTimePoint ) + sizeof( rrdbNumber ) );
+    printf( "%-32s %8zu %10zu %10zu %7.1fx %12.0f\n", all[ s ].name, points, raw, archived,
+            ( double ) raw / archived, points * passes / elapsed );
+
+    /* keep the decode from being optimised away */
+    if ( sum < 0 ) printf( "%f\n", sum );
+
+    free( data );
+    free( bytes );
+    free( all[ s ].points );
+  }
+
+  return 0;
+}
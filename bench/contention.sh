@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Multi-process touch contention benchmark. Starts PROCS pipe mode rrdb processes,
+# each touching its own path in the same touch file TOUCHES times, and reports
+# touches/sec for each lock mode. With byte range locks (fast) the processes only
+# meet on the header lock, with debug every touch takes the whole file.
+#
+# bench/contention.sh [procs] [touches] [rrdb binary]
+
+PROCS=${1:-8}
+TOUCHES=${2:-2000}
+RRDB=${3:-./rrdb}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+case "$RRDB" in
+  /*) ;;
+  *) RRDB="$PWD/$RRDB" ;;
+esac
+
+for MODE in fast debug; do
+  FILE=bench-$MODE.rrdb
+
+  # create the sets up front so we measure touching rather than allocating
+  i=0
+  while [ $i -lt "$PROCS" ]; do
+    echo "touch $FILE 100 100 path$i ONEHOUR"
+    i=$((i + 1))
+  done | "$RRDB" --command=- --dir="$DIR" --lockmode=$MODE > /dev/null
+
+  i=0
+  while [ $i -lt "$PROCS" ]; do
+    awk -v n="$TOUCHES" -v f="$FILE" -v p="path$i" \
+      'BEGIN { for( i = 0; i < n; i++ ) print "touch " f " 100 100 " p " ONEHOUR" }' > "$DIR/input$i"
+    i=$((i + 1))
+  done
+
+  START=$(date +%s%N)
+  i=0
+  while [ $i -lt "$PROCS" ]; do
+    "$RRDB" --command=- --dir="$DIR" --lockmode=$MODE --lockstats < "$DIR/input$i" > /dev/null 2> "$DIR/stats$i" &
+    i=$((i + 1))
+  done
+  wait
+  END=$(date +%s%N)
+
+  MS=$(( ( END - START ) / 1000000 ))
+  [ "$MS" -eq 0 ] && MS=1
+  TOTAL=$(( PROCS * TOUCHES ))
+  CONTENDED=$(cat "$DIR"/stats* | awk -F: '/^contended/ { c += $2 } END { print c }')
+  WAIT=$(cat "$DIR"/stats* | awk -F: '/^waitus/ { c += $2 } END { print c }')
+
+  echo "$MODE: $PROCS procs x $TOUCHES touches in ${MS}ms, $(( TOTAL * 1000 / MS )) touches/sec, $CONTENDED contended locks, ${WAIT}us waiting"
+done
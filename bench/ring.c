@@ -0,0 +1,82 @@
+/*
+ Shared memory ring producer benchmark. Producer threads each queue touches (path p<thread>)
+ into the ring of a running server as fast as they can and report how many went in, how many
+ were dropped when the ring stayed full for spins tries and the rate. Only needs rrdbring.h.
+
+ rrdb --command=- --dir=/tmp --ring=bench &
+ make bench && bench/ring bench ring.rrdb [producers] [touches each] [spins]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rrdbring.h"
+
+typedef struct producer {
+  pthread_t thread;
+  rrdb_ring *ring;
+  const char *filename;
+  unsigned int index;
+  unsigned int touches;
+  unsigned int spins;
+  uint64_t pushed;
+} producer;
+
+static void *produce( void *arg ) {
+  producer *p = arg;
+  char path[ 32 ];
+
+  snprintf( path, sizeof( path ), "p%u", p->index );
+  for ( unsigned int i = 0; i < p->touches; i++ ) {
+    if ( 0 == rrdb_ring_touch( p->ring, p->filename, path, "ONEHOUR", 0, 0, 1, 0, p->spins ) ) p->pushed++;
+  }
+
+  return NULL;
+}
+
+int main( int argc, char **argv ) {
+  unsigned int producers = argc > 3 ? atoi( argv[ 3 ] ) : 4;
+  unsigned int touches = argc > 4 ? atoi( argv[ 4 ] ) : 100000;
+  unsigned int spins = argc > 5 ? atoi( argv[ 5 ] ) : 100000;
+  struct timespec start, end;
+  uint64_t pushed = 0, dropped;
+
+  if ( argc < 3 || 0 == producers ) {
+    fprintf( stderr, "usage: %s <ring> <filename> [producers] [touches each] [spins]\n", argv[ 0 ] );
+    return 1;
+  }
+
+  rrdb_ring *ring = rrdb_ring_open( argv[ 1 ] );
+  if ( NULL == ring ) {
+    fprintf( stderr, "no ring %s\n", argv[ 1 ] );
+    return 1;
+  }
+
+  producer *p = calloc( producers, sizeof( producer ) );
+  if ( NULL == p ) return 1;
+
+  dropped = __atomic_load_n( &ring->dropped, __ATOMIC_RELAXED );
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  for ( unsigned int i = 0; i < producers; i++ ) {
+    p[ i ] = ( producer ) { .ring = ring, .filename = argv[ 2 ], .index = i, .touches = touches, .spins = spins };
+    pthread_create( &p[ i ].thread, NULL, produce, &p[ i ] );
+  }
+  for ( unsigned int i = 0; i < producers; i++ ) {
+    pthread_join( p[ i ].thread, NULL );
+    pushed += p[ i ].pushed;
+  }
+  clock_gettime( CLOCK_MONOTONIC, &end );
+
+  double seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+  printf( "pushed:%" PRIu64 "\n", pushed );
+  printf( "dropped:%" PRIu64 "\n", __atomic_load_n( &ring->dropped, __ATOMIC_RELAXED ) - dropped );
+  printf( "persec:%.0f\n", seconds > 0 ? pushed / seconds : 0 );
+
+  rrdb_ring_close( ring );
+  free( p );
+  return 0;
+}
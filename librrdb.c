@@ -0,0 +1,8073 @@
+
+/* F_OFD_SETLK and friends */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <sys/time.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+
+#include <sys/file.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sched.h>
+#include <stddef.h>
+#include <endian.h>
+#include <ftw.h>
+#include <glob.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+#ifndef NAME_MAX
+#define NAME_MAX 4096
+#endif
+
+#include "rrdb.h"
+
+/*
+ The library half of rrdb - file formats, locking, touch coalescing and the public
+ interface in librrdb.h. rrdb.c is the command line and pipe front end over it.
+ */
+
+/*
+ Everything we send back to the caller goes through rrdbprintf. Normally that is stdout,
+ but a request can point it somewhere else (i.e. a memstream) so that its output can be
+ captured and framed - see the binary protocol.
+ */
+static __thread FILE *outputstream = NULL;
+
+/* pending touches (see coalesceTouches), NULL until rrdb_coalesce switches it on */
+rrdbCoalescer *touchcoalescer = NULL;
+
+/* the shared memory ring being drained (see ringservercreate), NULL until rrdb_ring_serve */
+static rrdbRingServer *ringserver = NULL;
+
+int rrdbprintf( const char *format, ... ) {
+  va_list ap;
+  int ret;
+
+  va_start( ap, format );
+  ret = vfprintf( NULL == outputstream ? stdout : outputstream, format, ap );
+  va_end( ap );
+
+  return ret;
+}
+
+/**
+ * @return { FILE * } the previous output (NULL being stdout)
+ */
+FILE *rrdbsetoutput( FILE *out ) {
+  FILE *previous = outputstream;
+  outputstream = out;
+  return previous;
+}
+
+/*
+ Some notes on file locking.
+
+ Only two functions can open a file: initRRDBFile and readRRDBFile. Both of which apply a lock
+ at the beggining of the file. Which must be released when the file is closed. Nothing clever
+ at the moment, a lock we use as an advisor for the whole file.
+
+ How the lock is taken is up to the lock manager (--lockmode):
+ debug - flock a <file>.lock side file and stamp it with our pid and the time, so a stuck
+         lock can be traced to whoever holds it. Costs a write and an fsync per lock. The
+         default, as it is the lock every earlier rrdb takes.
+ fast  - an OFD fcntl lock on the data file itself. No side file, no writes, released on close.
+ The two don't see each other, so every process working on a file has to use the same one.
+
+ Writers which only change part of a file can instead open it with openforrangelocks and
+ lock byte ranges as they go with lockrange (see touchRRDBFileDeltas) so writers to different
+ parts of the same file don't queue behind each other. Byte ranges are fcntl locks so only the
+ fast lock manager can do them; debug takes the whole file exclusively on open and lockrange
+ does nothing. Always lock the header range before any other range in the file.
+
+ Every lock is timed - wait (to acquire) and hold (acquire to release) - see lockstats.
+ */
+typedef struct rrdbLockManager {
+  const char *name;
+  /* lock and open filename with flags, fill in lf, -1 on failure */
+  int ( *openandlock )( locked_file_t *lf, const char *filename, int flags, int exclusive );
+  /* open for writing with byte range locks to follow */
+  int ( *openforranges )( locked_file_t *lf, const char *filename, int flags );
+  /* F_RDLCK, F_WRLCK or F_UNLCK length bytes from start */
+  int ( *lockrange )( locked_file_t *lf, off_t start, off_t length, int type );
+  void ( *unlockandclose )( locked_file_t *lf );
+} rrdbLockManager;
+
+static rrdbLockStats lockstats;
+
+static uint64_t monotonicns( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint64_t ) ts.tv_sec * 1000000000ull + ( uint64_t ) ts.tv_nsec;
+}
+
+static void atomicmax( uint64_t *target, uint64_t value ) {
+  uint64_t current = __atomic_load_n( target, __ATOMIC_RELAXED );
+  while ( value > current &&
+          !__atomic_compare_exchange_n( target, &current, value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+}
+
+static void lockacquired( locked_file_t *lf, uint64_t started, int contended ) {
+  lf->lockedat = monotonicns();
+  uint64_t wait = lf->lockedat - started;
+
+  __atomic_fetch_add( &lockstats.acquired, 1, __ATOMIC_RELAXED );
+  if ( contended ) __atomic_fetch_add( &lockstats.contended, 1, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &lockstats.waitns, wait, __ATOMIC_RELAXED );
+  atomicmax( &lockstats.maxwaitns, wait );
+}
+
+static void lockreleased( locked_file_t *lf ) {
+  uint64_t hold = monotonicns() - lf->lockedat;
+
+  __atomic_fetch_add( &lockstats.holdns, hold, __ATOMIC_RELAXED );
+  atomicmax( &lockstats.maxholdns, hold );
+}
+
+static int buildlockpath( const char *path, char *out, size_t outlen ) {
+    size_t len = strlen(path);
+
+    if (len + 5 >= outlen)  /* ".lock" + NUL */
+        return -1;
+
+    memcpy(out, path, len);
+    memcpy(out + len, ".lock", 6); /* includes NUL */
+    return 0;
+}
+
+static int lockacquire( const char *path, int lock_mode, int *contended ) {
+  char lockpath[PATH_MAX];
+
+  if (buildlockpath(path, lockpath, sizeof(lockpath)) < 0)
+    return -1;
+
+  int fd = open(lockpath, O_CREAT | O_RDWR, 0644);
+  if (fd < 0)
+    return -1;
+
+  *contended = FALSE;
+  if( flock(fd, lock_mode | LOCK_NB) < 0 ) {
+    *contended = TRUE;
+    if( EWOULDBLOCK != errno || flock(fd, lock_mode) < 0 ) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  /* Optional debug info */
+  if (ftruncate(fd, 0) == 0) {
+      dprintf(fd, "pid=%ld time=%ld\n",
+              (long)getpid(), (long)time(NULL));
+      fsync(fd);
+  }
+
+  return fd;
+}
+
+static int lockrelease( int lockfd ) {
+  if( lockfd < 0 )
+    return -1;
+
+  /* flock unlock is optional; close() releases it anyway */
+  if ( flock( lockfd, LOCK_UN ) < 0 ) {
+    close( lockfd );
+    return -1;
+  }
+
+
+  return close( lockfd );
+}
+
+static int debugopenandlock( locked_file_t *lf, const char *filename, int flags, int exclusive ) {
+  int contended;
+  uint64_t started = monotonicns();
+
+  lf->lock_fd = lockacquire( filename, exclusive ? LOCK_EX : LOCK_SH, &contended );
+  if( -1 == lf->lock_fd ) return -1;
+  lockacquired( lf, started, contended );
+
+  lf->data_fd = open( filename, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH );
+  if( -1 == lf->data_fd ) {
+    lockreleased( lf );
+    lockrelease( lf->lock_fd );
+    lf->lock_fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int debugopenforranges( locked_file_t *lf, const char *filename, int flags ) {
+  return debugopenandlock( lf, filename, flags, TRUE );
+}
+
+static int debuglockrange( locked_file_t *lf, off_t start, off_t length, int type ) {
+  /* we already hold the whole file */
+  UNUSED( lf );
+  UNUSED( start );
+  UNUSED( length );
+  UNUSED( type );
+  return 0;
+}
+
+static void debugunlockandclose( locked_file_t *lf ) {
+  close( lf->data_fd );
+  if( -1 != lf->lock_fd ) lockreleased( lf );
+  lockrelease( lf->lock_fd );
+}
+
+static int fastopenandlock( locked_file_t *lf, const char *filename, int flags, int exclusive ) {
+  struct flock fl;
+  struct stat opened, named;
+  int contended = FALSE;
+  uint64_t started = monotonicns();
+
+  while( TRUE ) {
+    lf->data_fd = open( filename, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH );
+    if( -1 == lf->data_fd ) return -1;
+
+    memset( &fl, 0, sizeof( fl ) );
+    fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    fl.l_whence = SEEK_SET;
+
+    if( -1 == fcntl( lf->data_fd, F_OFD_SETLK, &fl ) ) {
+      int ret;
+      contended = TRUE;
+      while( -1 == ( ret = fcntl( lf->data_fd, F_OFD_SETLKW, &fl ) ) && EINTR == errno );
+      if( -1 == ret ) {
+        close( lf->data_fd );
+        lf->data_fd = -1;
+        return -1;
+      }
+    }
+
+    /* the file may have been replaced (rename) while we waited - lock the new one */
+    if( 0 == fstat( lf->data_fd, &opened ) && 0 == stat( filename, &named ) &&
+        opened.st_ino == named.st_ino && opened.st_dev == named.st_dev ) break;
+
+    close( lf->data_fd );
+    lf->data_fd = -1;
+    if( 0 == ( flags & O_CREAT ) && 0 != stat( filename, &named ) ) return -1;
+  }
+
+  lockacquired( lf, started, contended );
+  return 0;
+}
+
+static int fastopenforranges( locked_file_t *lf, const char *filename, int flags ) {
+  lf->lockedat = 0;
+  lf->data_fd = open( filename, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH );
+  return -1 == lf->data_fd ? -1 : 0;
+}
+
+static int fastlockrange( locked_file_t *lf, off_t start, off_t length, int type ) {
+  struct flock fl;
+  int ret, contended = FALSE;
+  uint64_t started;
+
+  memset( &fl, 0, sizeof( fl ) );
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = length;
+
+  if( F_UNLCK == type ) return fcntl( lf->data_fd, F_OFD_SETLK, &fl );
+
+  started = monotonicns();
+  if( -1 == fcntl( lf->data_fd, F_OFD_SETLK, &fl ) ) {
+    contended = TRUE;
+    while( -1 == ( ret = fcntl( lf->data_fd, F_OFD_SETLKW, &fl ) ) && EINTR == errno );
+    if( -1 == ret ) return -1;
+  }
+
+  /* hold time is from the first range we take until we close */
+  uint64_t lockedat = lf->lockedat;
+  lockacquired( lf, started, contended );
+  if( 0 != lockedat ) lf->lockedat = lockedat;
+  return 0;
+}
+
+static void fastunlockandclose( locked_file_t *lf ) {
+  /* closing our only descriptor of the open file description drops the OFD lock(s) */
+  if( 0 != lf->lockedat ) lockreleased( lf );
+  close( lf->data_fd );
+}
+
+static const rrdbLockManager lockmanagers[] = {
+  { "debug", debugopenandlock, debugopenforranges, debuglockrange, debugunlockandclose },
+  { "fast", fastopenandlock, fastopenforranges, fastlockrange, fastunlockandclose }
+};
+
+static const rrdbLockManager *lockmanager = &lockmanagers[ 0 ];
+
+/**
+ * Select the lock manager by name.
+ * @return { int } 0 on success -1 if we don't know it
+ */
+int rrdbsetlockmode( const char *name ) {
+  for( unsigned int i = 0; i < sizeof( lockmanagers ) / sizeof( lockmanagers[ 0 ] ); i++ ) {
+    if( 0 == strcmp( name, lockmanagers[ i ].name ) ) {
+      lockmanager = &lockmanagers[ i ];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Snapshot of the lock timings since we started.
+ */
+void rrdbgetlockstats( rrdbLockStats *stats ) {
+  stats->acquired = __atomic_load_n( &lockstats.acquired, __ATOMIC_RELAXED );
+  stats->contended = __atomic_load_n( &lockstats.contended, __ATOMIC_RELAXED );
+  stats->waitns = __atomic_load_n( &lockstats.waitns, __ATOMIC_RELAXED );
+  stats->maxwaitns = __atomic_load_n( &lockstats.maxwaitns, __ATOMIC_RELAXED );
+  stats->holdns = __atomic_load_n( &lockstats.holdns, __ATOMIC_RELAXED );
+  stats->maxholdns = __atomic_load_n( &lockstats.maxholdns, __ATOMIC_RELAXED );
+  stats->snapshots = __atomic_load_n( &lockstats.snapshots, __ATOMIC_RELAXED );
+  stats->snapshotretries = __atomic_load_n( &lockstats.snapshotretries, __ATOMIC_RELAXED );
+  stats->snapshotfallbacks = __atomic_load_n( &lockstats.snapshotfallbacks, __ATOMIC_RELAXED );
+  stats->iosubmits = __atomic_load_n( &lockstats.iosubmits, __ATOMIC_RELAXED );
+  stats->iorequests = __atomic_load_n( &lockstats.iorequests, __ATOMIC_RELAXED );
+  stats->iomaxbatch = __atomic_load_n( &lockstats.iomaxbatch, __ATOMIC_RELAXED );
+}
+
+/**
+ * Print the lock timings (microseconds).
+ */
+void printlockstats( void ) {
+  rrdbLockStats stats;
+  rrdbgetlockstats( &stats );
+
+  rrdbprintf( "lockmode:%s\n", lockmanager->name );
+  rrdbprintf( "acquired:%" PRIu64 "\n", stats.acquired );
+  rrdbprintf( "contended:%" PRIu64 "\n", stats.contended );
+  rrdbprintf( "waitus:%" PRIu64 "\n", stats.waitns / 1000 );
+  rrdbprintf( "maxwaitus:%" PRIu64 "\n", stats.maxwaitns / 1000 );
+  rrdbprintf( "holdus:%" PRIu64 "\n", stats.holdns / 1000 );
+  rrdbprintf( "maxholdus:%" PRIu64 "\n", stats.maxholdns / 1000 );
+  rrdbprintf( "snapshots:%" PRIu64 "\n", stats.snapshots );
+  rrdbprintf( "snapshotretries:%" PRIu64 "\n", stats.snapshotretries );
+  rrdbprintf( "snapshotfallbacks:%" PRIu64 "\n", stats.snapshotfallbacks );
+  rrdbprintf( "iosubmits:%" PRIu64 "\n", stats.iosubmits );
+  rrdbprintf( "iorequests:%" PRIu64 "\n", stats.iorequests );
+  rrdbprintf( "iomaxbatch:%" PRIu64 "\n", stats.iomaxbatch );
+}
+
+/**
+ * The version of a file without saying anything if it is too short to have one (new).
+ * @return { int } version or -1
+ */
+static int peekversion( int fd ) {
+  int version;
+
+  if( sizeof( version ) != pread( fd, &version, sizeof( version ), 0 ) ) return -1;
+  return version;
+}
+
+/**
+ * @return { int } TRUE if files of version have a seqlock after it (see RRDBVERSIONFIELDS)
+ */
+static int seqlocked( int version ) {
+  return RRDBV3 == version || RRDBTOUCHV4 == version || RRDBV5 == version || RRDBCONTAINER == version;
+}
+
+/**
+ * @return { int } TRUE if version is the V1 layout, with (RRDBV5) or without a seqlock
+ */
+static int seriesversion( int version ) {
+  return RRDBV1 == version || RRDBV5 == version;
+}
+
+/**
+ * @return { size_t } bytes of the header of a V1 layout file of version
+ */
+static size_t seriesheadersize( int version ) {
+  return RRDBV1 == version ? sizeof( rrdbHeaderV1 ) : sizeof( rrdbHeader );
+}
+
+/**
+ * A header read as rrdbHeader from a V1 file, which has no seqlock, moved to where
+ * rrdbHeader keeps it.
+ */
+static void seriesheaderread( rrdbHeader *header ) {
+  rrdbHeaderV1 v1;
+
+  if ( RRDBV1 != header->fileVersion ) return;
+  memcpy( &v1, header, sizeof( v1 ) );
+  *header = ( rrdbHeader ) { .fileVersion = RRDBV1, .windowPosition = v1.windowPosition, .setCount = v1.setCount, .sampleCount = v1.sampleCount };
+}
+
+/**
+ * @return { int } TRUE if files of version are decoded to be worked on (see storedstage)
+ */
+static int storedlayout( int version ) {
+  return RRDBV3 == version || RRDBTOUCHV2 == version;
+}
+
+/**
+ * Decode the V3 or version 2 touch file fd into a new memfd.
+ * @return { int } the memfd or -1 on failure
+ */
+static int storeddecode( int fd ) {
+  struct stat sb;
+  char *data;
+  int memfd, decoded, retval = -1;
+
+  if ( -1 == fstat( fd, &sb ) || 0 == sb.st_size ) return -1;
+  data = mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  if ( MAP_FAILED == data ) return -1;
+
+  memfd = memfd_create( "rrdb", MFD_CLOEXEC );
+  if ( -1 != memfd ) {
+    if ( RRDBTOUCHV2 == ( ( rrdbVersionHeader * ) data )->fileVersion ) decoded = touchV2Decode( data, sb.st_size, memfd );
+    else decoded = rrdbV3Decode( data, sb.st_size, memfd );
+
+    if ( 1 == decoded ) retval = memfd;
+    else close( memfd );
+  }
+
+  munmap( data, sb.st_size );
+  return retval;
+}
+
+/**
+ * Swap a file we have just locked for what it decodes to if it is V3 or a version 2 touch file.
+ * @return { locked_file_t } .data_fd -1 on failure
+ */
+static locked_file_t storeddivert( locked_file_t lf, int exclusive ) {
+  if( -1 == lf.data_fd || !storedlayout( peekversion( lf.data_fd ) ) ) return lf;
+  return storedstage( lf, exclusive );
+}
+
+/**
+ * @return { int } open file id or -1 on failure.
+*/
+locked_file_t createopenandlock( char *filename ) {
+
+  if( 0 != containeraddress( filename, NULL, 0, NULL ) ) return containeropen( filename, O_CREAT | O_RDWR, TRUE );
+
+  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+
+  if( -1 == lockmanager->openandlock( &lf, filename, O_CREAT | O_RDWR, TRUE ) ) {
+    fprintf( stderr, "failed to lock and open file '%s' for writing\n", filename );
+  }
+
+  return storeddivert( lf, TRUE );
+}
+
+/**
+ * We have to be writable to gain a lock.
+ * @return { locked_file_t } .data_fd -1 on failure
+*/
+locked_file_t readwriteopenandlock( char *  filename ) {
+
+  if( 0 != containeraddress( filename, NULL, 0, NULL ) ) return containeropen( filename, O_RDWR, TRUE );
+
+  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+
+  if( -1 == lockmanager->openandlock( &lf, filename, O_RDWR, TRUE ) ) {
+    fprintf( stderr, "failed to lock read write rrdb file '%s'\n", filename );
+  }
+
+  return storeddivert( lf, TRUE );
+}
+
+/**
+ * Open for read and get a read lock.
+ * @return { locked_file_t } .data_fd -1 on failure
+ */
+locked_file_t readopenandlock( char *  filename ) {
+
+  if( 0 != containeraddress( filename, NULL, 0, NULL ) ) return containeropen( filename, O_RDONLY, FALSE );
+
+  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+
+  if( -1 == lockmanager->openandlock( &lf, filename, O_RDONLY, FALSE ) ) {
+    fprintf( stderr, "failed to lock read rrdb file '%s'\n", filename );
+  }
+
+  return storeddivert( lf, FALSE );
+}
+
+/**
+ * Range locks are taken on the file we opened, which convert may have renamed a new one over
+ * before we got them (a file we have decoded is already ours).
+ * @return { int } TRUE if filename is no longer the file we have open
+ */
+static int replacedfile( locked_file_t *pfd, const char *filename ) {
+  struct stat opened, named;
+
+  if ( NULL != pfd->staged ) return FALSE;
+  if ( -1 == fstat( pfd->data_fd, &opened ) || -1 == stat( filename, &named ) ) return TRUE;
+  return opened.st_ino != named.st_ino || opened.st_dev != named.st_dev;
+}
+
+/**
+ * Open (creating if need be) for writing without locking anything yet, the caller
+ * then locks what it needs with lockrange.
+ * @return { locked_file_t } .data_fd -1 on failure
+ */
+locked_file_t openforrangelocks( char *filename ) {
+
+  if( 0 != containeraddress( filename, NULL, 0, NULL ) ) return containeropen( filename, O_CREAT | O_RDWR, TRUE );
+
+  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+
+  for( int attempt = 0; attempt < RRDBSEQRETRIES; attempt++ ) {
+    if( -1 == lockmanager->openforranges( &lf, filename, O_CREAT | O_RDWR ) ) {
+      fprintf( stderr, "failed to open file '%s' for writing\n", filename );
+      return lf;
+    }
+
+    /* there are no ranges in a V3 or version 2 touch file to lock - it is decoded, which needs all of it */
+    if( !storedlayout( peekversion( lf.data_fd ) ) ) return lf;
+
+    if( -1 == lockmanager->lockrange( &lf, 0, 0, F_WRLCK ) ) break;
+    if( !replacedfile( &lf, filename ) ) return storeddivert( lf, TRUE );
+
+    /* converted again while we waited for it */
+    lockmanager->unlockandclose( &lf );
+    lf.data_fd = -1;
+  }
+
+  if( -1 != lf.data_fd ) lockmanager->unlockandclose( &lf );
+  lf.data_fd = -1;
+  return lf;
+}
+
+/**
+ * Lock (F_RDLCK, F_WRLCK) or unlock (F_UNLCK) length bytes from start of a file
+ * opened with openforrangelocks, waiting if need be.
+ * @return { int } 0 on success -1 on failure
+ */
+int lockrange( locked_file_t *lf, off_t start, off_t length, int type ) {
+  /* we already hold the whole container */
+  if( NULL != lf->staged ) return 0;
+  return lockmanager->lockrange( lf, start, length, type );
+}
+
+/*
+ Seqlock writers, see RRDBVERSIONFIELDS. These are for writers which hold the file
+ exclusively (pread/pwrite), touchExistingSets bumps the counters in its mapping with
+ atomics as it shares the file with other writers. A file without a seqlock gets 0 in
+ both and nothing written.
+ */
+static int seqwritebegin( int fd, rrdbVersionHeader *v ) {
+  if( sizeof( v->fileVersion ) != pread( fd, &v->fileVersion, sizeof( v->fileVersion ), 0 ) ) return -1;
+  v->seqBegin = v->seqEnd = 0;
+  if( !seqlocked( v->fileVersion ) ) return 0;
+
+  if( sizeof( *v ) != pread( fd, v, sizeof( *v ), 0 ) ) return -1;
+  v->seqBegin++;
+  if( sizeof( v->seqBegin ) != pwrite( fd, &v->seqBegin, sizeof( v->seqBegin ), offsetof( rrdbVersionHeader, seqBegin ) ) ) return -1;
+  return 0;
+}
+
+static int seqwriteend( int fd, rrdbVersionHeader *v ) {
+  if( !seqlocked( v->fileVersion ) ) return 0;
+  v->seqEnd = v->seqBegin;
+  if( sizeof( v->seqEnd ) != pwrite( fd, &v->seqEnd, sizeof( v->seqEnd ), offsetof( rrdbVersionHeader, seqEnd ) ) ) return -1;
+  return 0;
+}
+
+/*
+ Containers (see rrdbContainerHeader). Opening container:series takes the lock on the
+ container and copies the series into a memfd, so everything else works on it as it would
+ on its own file. Readers let the container go straight away, writers keep it locked until
+ unlockandclose writes the series back - moving it to a bigger region if it has grown.
+ */
+static int containerread( int fd, void *buf, size_t len, uint64_t offset ) {
+  return ( ssize_t ) len == pread( fd, buf, len, offset ) ? 0 : -1;
+}
+
+static int containerwrite( int fd, const void *buf, size_t len, uint64_t offset ) {
+  return ( ssize_t ) len == pwrite( fd, buf, len, offset ) ? 0 : -1;
+}
+
+/* everything but the version and seqlock, which have their own writers */
+static int containerwriteheader( int fd, const rrdbContainerHeader *h ) {
+  return containerwrite( fd, ( const char * ) h + sizeof( rrdbVersionHeader ),
+                         sizeof( rrdbContainerHeader ) - sizeof( rrdbVersionHeader ), sizeof( rrdbVersionHeader ) );
+}
+
+static uint64_t containerround( uint64_t size ) {
+  return ( size + RRDBCONTAINERALIGN - 1 ) / RRDBCONTAINERALIGN * RRDBCONTAINERALIGN;
+}
+
+static unsigned int containerslot( const char *name, unsigned int capacity ) {
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  for ( const char *c = name; *c; c++ ) hash = ( hash ^ ( unsigned char ) *c ) * 16777619u;
+  return hash % capacity;
+}
+
+/**
+ * Split name.rrdbc:series. Only a name ending .rrdbc is a container, ordinary files can
+ * have colons in their names. container can be NULL to just ask.
+ * @return { int } 1 if filename is a series in a container, 0 if not, -1 if the series name is no good
+ */
+int containeraddress( const char *filename, char *container, size_t containerlen, char *series ) {
+  const char *slash = strrchr( filename, '/' );
+  const char *colon = strstr( NULL == slash ? filename : slash, RRDBCONTAINERSUFFIX ":" );
+
+  if ( NULL == colon ) return 0;
+  colon += strlen( RRDBCONTAINERSUFFIX );
+
+  size_t namelen = strlen( colon + 1 );
+  if ( 0 == namelen || namelen >= RRDBCONTAINERNAME ) return -1;
+  if ( NULL == container ) return 1;
+  if ( ( size_t ) ( colon - filename ) >= containerlen ) return -1;
+
+  memcpy( container, filename, colon - filename );
+  container[ colon - filename ] = 0;
+  strcpy( series, colon + 1 );
+  return 1;
+}
+
+/**
+ * Look name up in the directory.
+ * @return { int } 1 found (in entry and slot), 0 not (slot being where it would go), -1 on failure
+ */
+static int containerfind( int fd, const rrdbContainerHeader *h, const char *name, rrdbContainerEntry *entry, unsigned int *slot ) {
+  unsigned int i = containerslot( name, h->dirCapacity );
+
+  for ( unsigned int probes = 0; probes < h->dirCapacity; probes++, i = ( i + 1 ) % h->dirCapacity ) {
+    if ( -1 == containerread( fd, entry, sizeof( rrdbContainerEntry ), h->dirOffset + ( uint64_t ) i * sizeof( rrdbContainerEntry ) ) ) return -1;
+
+    if ( 0 == entry->name[ 0 ] ) {
+      *slot = i;
+      return 0;
+    }
+
+    if ( 0 == strncmp( entry->name, name, RRDBCONTAINERNAME ) ) {
+      *slot = i;
+      return 1;
+    }
+  }
+
+  /* we grow long before we get full */
+  return -1;
+}
+
+/* point the free region at prev (or the head if 0) on to next */
+static int containerlink( int fd, rrdbContainerHeader *h, uint64_t prev, uint64_t next ) {
+  rrdbContainerFree region;
+
+  if ( 0 == prev ) {
+    h->freeHead = next;
+    return 0;
+  }
+
+  if ( -1 == containerread( fd, &region, sizeof( region ), prev ) ) return -1;
+  region.next = next;
+  return containerwrite( fd, &region, sizeof( region ), prev );
+}
+
+/**
+ * First fit from the free list, otherwise from the end of the container.
+ * @return { uint64_t } the offset of a region of at least size (its size in capacity), 0 on failure
+ */
+static uint64_t containeralloc( int fd, rrdbContainerHeader *h, uint64_t size, uint64_t *capacity ) {
+  rrdbContainerFree region;
+  uint64_t prev = 0, at = h->freeHead;
+
+  size = containerround( size );
+
+  while ( 0 != at ) {
+    if ( -1 == containerread( fd, &region, sizeof( region ), at ) ) return 0;
+
+    if ( region.size >= size ) {
+      uint64_t next = region.next;
+
+      if ( region.size - size >= RRDBCONTAINERALIGN ) {
+        /* the rest stays free */
+        rrdbContainerFree rest = { region.size - size, region.next };
+        if ( -1 == containerwrite( fd, &rest, sizeof( rest ), at + size ) ) return 0;
+        next = at + size;
+      } else {
+        size = region.size;
+      }
+
+      if ( -1 == containerlink( fd, h, prev, next ) ) return 0;
+      *capacity = size;
+      return at;
+    }
+
+    prev = at;
+    at = region.next;
+  }
+
+  at = h->end;
+  h->end += size;
+  *capacity = size;
+  return at;
+}
+
+/**
+ * Return a region to the free list, merging it with its neighbours. Free space at the end
+ * of the container is given back to the filesystem.
+ * @return { int } 0 on success -1 on failure
+ */
+static int containerfree( int fd, rrdbContainerHeader *h, uint64_t offset, uint64_t size ) {
+  rrdbContainerFree region = { size, 0 }, prevregion = { 0, 0 }, current;
+  uint64_t before = 0, prev = 0, at = h->freeHead;
+
+  /* the list is in offset order */
+  while ( 0 != at && at < offset ) {
+    if ( -1 == containerread( fd, &current, sizeof( current ), at ) ) return -1;
+    before = prev;
+    prev = at;
+    prevregion = current;
+    at = current.next;
+  }
+
+  region.next = at;
+  if ( 0 != at && offset + size == at ) {
+    if ( -1 == containerread( fd, &current, sizeof( current ), at ) ) return -1;
+    region.size += current.size;
+    region.next = current.next;
+  }
+
+  if ( 0 != prev && prev + prevregion.size == offset ) {
+    offset = prev;
+    region.size += prevregion.size;
+    prev = before;
+  }
+
+  if ( offset + region.size == h->end ) {
+    h->end = offset;
+    if ( -1 == ftruncate( fd, h->end ) ) return -1;
+    return containerlink( fd, h, prev, region.next );
+  }
+
+  if ( -1 == containerwrite( fd, &region, sizeof( region ), offset ) ) return -1;
+  return containerlink( fd, h, prev, offset );
+}
+
+/**
+ * Move the directory to a region twice the size, rehashing as we go.
+ * @return { int } 0 on success -1 on failure
+ */
+static int containergrow( int fd, rrdbContainerHeader *h ) {
+  unsigned int capacity = h->dirCapacity * 2;
+  uint64_t regionsize;
+  rrdbContainerEntry *old = malloc( sizeof( rrdbContainerEntry ) * h->dirCapacity );
+  rrdbContainerEntry *grown = calloc( capacity, sizeof( rrdbContainerEntry ) );
+  int retval = -1;
+
+  if ( NULL == old || NULL == grown ) goto done;
+  if ( -1 == containerread( fd, old, sizeof( rrdbContainerEntry ) * h->dirCapacity, h->dirOffset ) ) goto done;
+
+  for ( unsigned int i = 0; i < h->dirCapacity; i++ ) {
+    if ( 0 == old[ i ].name[ 0 ] ) continue;
+    unsigned int slot = containerslot( old[ i ].name, capacity );
+    while ( 0 != grown[ slot ].name[ 0 ] ) slot = ( slot + 1 ) % capacity;
+    grown[ slot ] = old[ i ];
+  }
+
+  uint64_t offset = containeralloc( fd, h, sizeof( rrdbContainerEntry ) * capacity, &regionsize );
+  if ( 0 == offset ) goto done;
+  if ( -1 == containerwrite( fd, grown, sizeof( rrdbContainerEntry ) * capacity, offset ) ) goto done;
+  if ( -1 == containerfree( fd, h, h->dirOffset, containerround( sizeof( rrdbContainerEntry ) * h->dirCapacity ) ) ) goto done;
+
+  h->dirOffset = offset;
+  h->dirCapacity = capacity;
+  retval = 0;
+
+done:
+  free( old );
+  free( grown );
+  return retval;
+}
+
+static int containerinit( int fd, rrdbContainerHeader *h ) {
+  uint64_t regionsize;
+  rrdbContainerEntry *directory = calloc( RRDBCONTAINERSLOTS, sizeof( rrdbContainerEntry ) );
+  int retval = -1;
+
+  if ( NULL == directory ) return -1;
+
+  memset( h, 0, sizeof( rrdbContainerHeader ) );
+  h->fileVersion = RRDBCONTAINER;
+  h->dirCapacity = RRDBCONTAINERSLOTS;
+  h->end = containerround( sizeof( rrdbContainerHeader ) );
+  h->dirOffset = containeralloc( fd, h, sizeof( rrdbContainerEntry ) * RRDBCONTAINERSLOTS, &regionsize );
+
+  if ( 0 == containerwrite( fd, directory, sizeof( rrdbContainerEntry ) * RRDBCONTAINERSLOTS, h->dirOffset ) &&
+       0 == containerwrite( fd, h, sizeof( rrdbContainerHeader ), 0 ) ) {
+    retval = 0;
+  }
+
+  free( directory );
+  return retval;
+}
+
+/**
+ * Open container:series as if it were a file of its own (flags and exclusive as the lock
+ * manager's openandlock). A series which doesn't exist yet is an empty file if we are
+ * allowed to create it.
+ * @return { locked_file_t } .data_fd -1 on failure
+ */
+locked_file_t containeropen( const char *filename, int flags, int exclusive ) {
+  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+  locked_file_t container = { .data_fd = -1, .lock_fd = -1 };
+  char path[ PATH_MAX ];
+  char series[ RRDBCONTAINERNAME ];
+  rrdbContainerHeader h;
+  rrdbContainerEntry entry;
+  unsigned int slot;
+  struct stat sb;
+  int found;
+
+  if ( 1 != containeraddress( filename, path, sizeof( path ), series ) ) return lf;
+  if ( -1 == lockmanager->openandlock( &container, path, flags, exclusive ) ) return lf;
+
+  if ( -1 == fstat( container.data_fd, &sb ) ) goto fail;
+  if ( 0 == sb.st_size ) {
+    if ( 0 == ( flags & O_CREAT ) || -1 == containerinit( container.data_fd, &h ) ) goto fail;
+  } else if ( -1 == containerread( container.data_fd, &h, sizeof( h ), 0 ) || RRDBCONTAINER != h.fileVersion || 0 == h.dirCapacity ) {
+    goto fail;
+  }
+
+  found = containerfind( container.data_fd, &h, series, &entry, &slot );
+  if ( -1 == found || ( 0 == found && 0 == ( flags & O_CREAT ) ) ) goto fail;
+
+  lf.data_fd = memfd_create( "rrdb", MFD_CLOEXEC );
+  if ( -1 == lf.data_fd ) goto fail;
+
+  if ( found ) {
+    off_t offset = entry.offset;
+    size_t remaining = entry.length;
+
+    while ( remaining > 0 ) {
+      ssize_t sent = sendfile( lf.data_fd, container.data_fd, &offset, remaining );
+      if ( sent <= 0 ) goto fail;
+      remaining -= sent;
+    }
+
+    /* a version 2 touch series is worked on, and written back, as version 4 */
+    if ( storedlayout( peekversion( lf.data_fd ) ) ) {
+      int decoded = storeddecode( lf.data_fd );
+      close( lf.data_fd );
+      lf.data_fd = decoded;
+      if ( -1 == decoded ) goto fail;
+    }
+  }
+
+  if ( !exclusive ) {
+    /* the copy is ours - like a snapshot */
+    lockmanager->unlockandclose( &container );
+    return lf;
+  }
+
+  lf.staged = malloc( sizeof( rrdbStaged ) );
+  if ( NULL == lf.staged ) goto fail;
+  lf.staged->version = RRDBCONTAINER;
+  lf.staged->file = container;
+  strcpy( lf.staged->series, series );
+  return lf;
+
+fail:
+  if ( -1 != lf.data_fd ) close( lf.data_fd );
+  lockmanager->unlockandclose( &container );
+  lf.data_fd = -1;
+  return lf;
+}
+
+/**
+ * Write a staged series back to its container.
+ * @return { int } 1 on success -1 on failure
+ */
+static int containerwriteback( rrdbStaged *staged, int memfd ) {
+  int fd = staged->file.data_fd;
+  rrdbContainerHeader h;
+  rrdbContainerEntry entry;
+  rrdbVersionHeader seq;
+  unsigned int slot;
+  struct stat sb;
+  char *data;
+  int found, retval = -1;
+
+  if ( -1 == fstat( memfd, &sb ) || -1 == containerread( fd, &h, sizeof( h ), 0 ) ) return -1;
+
+  found = containerfind( fd, &h, staged->series, &entry, &slot );
+  if ( -1 == found ) return -1;
+  /* opened to create but never written */
+  if ( 0 == found && 0 == sb.st_size ) return 1;
+
+  data = 0 == sb.st_size ? NULL : mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, memfd, 0 );
+  if ( MAP_FAILED == data ) return -1;
+
+  if ( -1 == seqwritebegin( fd, &seq ) ) goto done;
+
+  if ( !found ) {
+    memset( &entry, 0, sizeof( entry ) );
+    strcpy( entry.name, staged->series );
+  }
+
+  if ( ( uint64_t ) sb.st_size > entry.capacity ) {
+    uint64_t capacity;
+    /* with room to grow - touch files gain a set at a time */
+    uint64_t offset = containeralloc( fd, &h, sb.st_size + sb.st_size / 4, &capacity );
+
+    if ( 0 == offset ) goto done;
+    if ( 0 != entry.capacity && -1 == containerfree( fd, &h, entry.offset, entry.capacity ) ) goto done;
+
+    entry.offset = offset;
+    entry.capacity = capacity;
+  }
+
+  entry.length = sb.st_size;
+  if ( NULL != data && -1 == containerwrite( fd, data, entry.length, entry.offset ) ) goto done;
+  if ( -1 == containerwrite( fd, &entry, sizeof( entry ), h.dirOffset + ( uint64_t ) slot * sizeof( rrdbContainerEntry ) ) ) goto done;
+
+  if ( !found ) {
+    h.dirCount++;
+    /* keep probe chains short */
+    if ( h.dirCount * 10 > h.dirCapacity * 7 && -1 == containergrow( fd, &h ) ) goto done;
+  }
+
+  if ( -1 == containerwriteheader( fd, &h ) ) goto done;
+  retval = 1;
+
+done:
+  seqwriteend( fd, &seq );
+  if ( NULL != data ) munmap( data, sb.st_size );
+  return retval;
+}
+
+/**
+ * List the series in a container: a line of the count and then name:version:length.
+ * @return { int } 1 on success -1 on failure
+ */
+int printContainerInfo( int pfd ) {
+  rrdbContainerHeader h;
+  rrdbContainerEntry entry;
+  rrdbVersionHeader version;
+
+  if ( -1 == containerread( pfd, &h, sizeof( h ), 0 ) ) {
+    rrdbprintf( "ERROR: failed to read container header\n" );
+    return -1;
+  }
+
+  rrdbprintf( "%i:%u\n", RRDBCONTAINER, h.dirCount );
+
+  for ( unsigned int i = 0; i < h.dirCapacity; i++ ) {
+    if ( -1 == containerread( pfd, &entry, sizeof( entry ), h.dirOffset + ( uint64_t ) i * sizeof( entry ) ) ) {
+      rrdbprintf( "ERROR: failed to read container directory\n" );
+      return -1;
+    }
+
+    if ( 0 == entry.name[ 0 ] ) continue;
+    if ( -1 == containerread( pfd, &version, sizeof( version ), entry.offset ) ) version.fileVersion = 0;
+    rrdbprintf( "%.*s:%i:%" PRIu64 "\n", RRDBCONTAINERNAME, entry.name, version.fileVersion, entry.length );
+  }
+
+  return 1;
+}
+
+/*
+ V3 files (see rrdbV3Header) are worked on as the V1 or touch file they hold, and version 2
+ touch files as version 4. Opening one decodes it into a memfd - as a container series is
+ copied out - so everything else only knows the one layout of each. Writers keep the file
+ locked until unlockandclose encodes it back as it was stored.
+ */
+
+/**
+ * Replace the whole of fd with data (a file in another layout), as a writer to the seqlock.
+ * @return { int } 1 on success -1 on failure
+ */
+static int replacecontents( int fd, char *data, size_t size ) {
+  rrdbVersionHeader seq, *v = ( rrdbVersionHeader * ) data;
+  int retval = -1;
+
+  if ( size < sizeof( rrdbVersionHeader ) || -1 == seqwritebegin( fd, &seq ) ) return -1;
+
+  /* still mid write until seqwriteend */
+  if ( seqlocked( v->fileVersion ) ) {
+    v->seqBegin = seq.seqBegin;
+    v->seqEnd = seq.seqEnd;
+  }
+
+  if ( ( ssize_t ) size == pwrite( fd, data, size, 0 ) && 0 == ftruncate( fd, size ) ) retval = 1;
+
+  seqwriteend( fd, &seq );
+  return retval;
+}
+
+/**
+ * The whole of fd.
+ * @return { int } 1 on success (*data malloc'd, of *size bytes) -1 on failure
+ */
+static int readcontents( int fd, char **data, size_t *size ) {
+  struct stat sb;
+
+  if ( -1 == fstat( fd, &sb ) || NULL == ( *data = malloc( sb.st_size + 1 ) ) ) return -1;
+  if ( sb.st_size != pread( fd, *data, sb.st_size, 0 ) ) {
+    free( *data );
+    return -1;
+  }
+  *size = sb.st_size;
+  return 1;
+}
+
+/**
+ * Decode the V3 or version 2 touch file we hold locked (file) into a memfd. Readers let the
+ * file go straight away, writers keep it until unlockandclose.
+ * @return { locked_file_t } .data_fd -1 on failure
+ */
+locked_file_t storedstage( locked_file_t file, int exclusive ) {
+  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+  int stored = peekversion( file.data_fd );
+
+  lf.data_fd = storeddecode( file.data_fd );
+  if ( -1 == lf.data_fd ) {
+    fprintf( stderr, "failed to decode version %i file\n", stored );
+    lockmanager->unlockandclose( &file );
+    return lf;
+  }
+
+  lf.stored = stored;
+  if ( !exclusive ) {
+    lockmanager->unlockandclose( &file );
+    return lf;
+  }
+
+  lf.staged = malloc( sizeof( rrdbStaged ) );
+  if ( NULL == lf.staged ) {
+    close( lf.data_fd );
+    lockmanager->unlockandclose( &file );
+    lf.data_fd = -1;
+    return lf;
+  }
+
+  lf.staged->version = stored;
+  lf.staged->file = file;
+  lf.staged->series[ 0 ] = 0;
+  return lf;
+}
+
+/**
+ * Encode what a writer left in memfd back to its V3 or version 2 touch file. A version 2
+ * file which now has a path too long for it is written as version 4.
+ * @return { int } 1 on success -1 on failure
+ */
+static int storedwriteback( rrdbStaged *staged, int memfd ) {
+  char *data;
+  size_t size;
+  int retval;
+
+  if ( RRDBTOUCHV2 == staged->version ) retval = touchV2Encode( memfd, &data, &size );
+  else retval = rrdbV3Encode( memfd, &data, &size );
+  if ( 0 == retval ) retval = readcontents( memfd, &data, &size );
+  if ( -1 == retval ) return -1;
+  retval = replacecontents( staged->file.data_fd, data, size );
+  free( data );
+  return retval;
+}
+
+/**
+ * Open a copy of a file for reading without taking a lock - so readers never hold up
+ * writers. The file is copied (in the kernel) to a memfd and the copy is kept if the
+ * seqlock says no writer was active. If writers keep getting in the way, the file is
+ * too new to have a header or it has no seqlock (V1 and version 2 touch files), we fall
+ * back to a read lock on the file itself.
+ * @return { locked_file_t } .data_fd -1 on failure
+ */
+locked_file_t snapshotopen( char *filename ) {
+
+  /* series in a container are copied out under a read lock on the container */
+  if( 0 != containeraddress( filename, NULL, 0, NULL ) ) return containeropen( filename, O_RDONLY, FALSE );
+
+  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+  rrdbVersionHeader before, after;
+  struct stat sb;
+  int fd, copy = -1;
+
+  fd = open( filename, O_RDONLY );
+  if( -1 == fd ) return lf;
+
+  copy = memfd_create( "rrdb", MFD_CLOEXEC );
+
+  for( int attempt = 0; -1 != copy && attempt < RRDBSEQRETRIES; attempt++ ) {
+    off_t offset = 0;
+
+    if( attempt > 0 ) {
+      __atomic_fetch_add( &lockstats.snapshotretries, 1, __ATOMIC_RELAXED );
+      sched_yield();
+    }
+
+    if( sizeof( before ) != pread( fd, &before, sizeof( before ), 0 ) || !seqlocked( before.fileVersion ) ) break;
+    if( before.seqBegin != before.seqEnd ) continue;
+    if( -1 == fstat( fd, &sb ) ) break;
+
+    if( -1 == ftruncate( copy, 0 ) ) break;
+    while( offset < sb.st_size ) {
+      ssize_t sent = sendfile( copy, fd, &offset, sb.st_size - offset );
+      if( sent <= 0 ) break;
+    }
+    if( offset != sb.st_size ) continue;
+
+    if( sizeof( after ) != pread( fd, &after, sizeof( after ), 0 ) ) break;
+    if( after.seqBegin != before.seqBegin || after.seqEnd != before.seqEnd ) continue;
+
+    close( fd );
+    __atomic_fetch_add( &lockstats.snapshots, 1, __ATOMIC_RELAXED );
+    lf.data_fd = copy;
+    lf.lockedat = 0;
+    /* the copy is ours, so no lock to hold while it is decoded */
+    return storeddivert( lf, FALSE );
+  }
+
+  __atomic_fetch_add( &lockstats.snapshotfallbacks, 1, __ATOMIC_RELAXED );
+  if( -1 != copy ) close( copy );
+  close( fd );
+  return readopenandlock( filename );
+}
+
+/**
+ * If unlocking fails we still try to close the file.
+ * @return { locked_file_t } .data_fd -1 on failure
+*/
+locked_file_t unlockandclose( locked_file_t lf ) {
+
+  if( NULL != lf.staged ) {
+    if( storedlayout( lf.staged->version ) ) {
+      if( -1 == storedwriteback( lf.staged, lf.data_fd ) ) fprintf( stderr, "failed to write a version %i file back\n", lf.staged->version );
+    } else if( -1 == containerwriteback( lf.staged, lf.data_fd ) ) {
+      fprintf( stderr, "failed to write series '%s' back to its container\n", lf.staged->series );
+    }
+    close( lf.data_fd );
+    lockmanager->unlockandclose( &lf.staged->file );
+    free( lf.staged );
+    lf.staged = NULL;
+  } else if( -1 != lf.data_fd ) {
+    lockmanager->unlockandclose( &lf );
+  }
+
+  lf.data_fd = -1;
+  lf.lock_fd = -1;
+  return lf;
+}
+
+/************************************************************************************
+ * Function: freeRRDBFile
+ *
+ * Purpose: free any memory allocations within the RRDB file structure - clean up.
+ *
+ * Written: 9th March 2013 By: Nick Knight
+ ************************************************************************************/
+int freeRRDBFile(rrdbFile *fileData) {
+    unsigned int i;
+
+    if ( fileData->times ) {
+        free(fileData->times);
+        fileData->times = NULL;
+    }
+
+    unsigned int it = fileData->header.setCount;
+    if( it > MAXNUMSETS ) it = MAXNUMSETS;
+
+    for ( i = 0 ; i < it; i++ ) {
+         free(fileData->sets[i]);
+         fileData->sets[i] = NULL;
+    }
+
+    for ( i = 0 ; i < fileData->xformheader.xformCount; i++ ) {
+        free(fileData->xformdata[i]);
+        free(fileData->xformtimes[i]);
+
+        fileData->xformdata[i] = NULL;
+        fileData->xformtimes[i] = NULL;
+    }
+
+    fileData->header.setCount = 0;
+    fileData->xformheader.xformCount = 0;
+
+    return 1;
+}
+
+/************************************************************************************
+ * Function: printRRDBFile
+ *
+ * Purpose: output to stdout the data form the sets.
+ *
+ * Written: 9th March 2013 By: Nick Knight
+ ************************************************************************************/
+int printRRDBFile(rrdbFile *fileData)
+{
+  unsigned int i,j;
+  unsigned int runs[ 2 ][ 2 ];
+  unsigned int runcount;
+
+  if ( 0 == fileData->header.sampleCount ) return 1;
+
+  /* + 1 so that we start after the newest and print them in time order */
+  runcount = ringRuns( ( fileData->header.windowPosition + 1 ) % fileData->header.sampleCount, fileData->header.sampleCount, runs );
+
+  for ( unsigned int r = 0; r < runcount; r++ )
+  {
+    for ( i = runs[ r ][ 0 ]; i < runs[ r ][ 0 ] + runs[ r ][ 1 ]; i++ )
+    {
+      if ( 1 == fileData->times[i].valid )
+      {
+        rrdbprintf("%ld.%i", fileData->times[i].time, fileData->times[i].uSecs);
+        for ( j = 0 ; j < fileData->header.setCount; j++ )
+        {
+          rrdbprintf(":%Lf", fileData->sets[j][i]);
+        }
+        rrdbprintf("\n");
+      }
+    }
+  }
+
+  return 1;
+}
+
+/*
+ Split count entries of a ring, starting at first and wrapping at count, into at most two
+ runs of { start, length } in order.
+ @return { unsigned int } the number of runs
+ */
+unsigned int ringRuns( unsigned int first, unsigned int count, unsigned int runs[ 2 ][ 2 ] )
+{
+  if ( 0 == count ) return 0;
+
+  runs[ 0 ][ 0 ] = first;
+  runs[ 0 ][ 1 ] = count - first;
+  if ( 0 == first ) return 1;
+
+  runs[ 1 ][ 0 ] = 0;
+  runs[ 1 ][ 1 ] = first;
+  return 2;
+}
+
+/*
+ The bins of a file which keeps values (walkTouchValues), as walkTouchSet visits them.
+ */
+typedef struct rrdbTouchCountVisit {
+  touchBinVisitor visit;
+  void *arg;
+} rrdbTouchCountVisit;
+
+static void count_bin(intmax_t ts, const rrdbTouchValueBin *bin, void *arg)
+{
+  rrdbTouchCountVisit *v = arg;
+  v->visit(ts, bin->count, v->arg);
+}
+
+/*
+ Walk a touch set newest bin first, calling visit for every non zero bin with the bin
+ labelled by its start time. ring is the set's ring, dense or sparse as the set says.
+ */
+void walkTouchSet(const rrdbTouchHeader *header,
+                  const rrdbTouchSet *setHeader,
+                  const void *ring,
+                  touchBinVisitor visit, void *arg)
+{
+  const unsigned int N = header->samplesPerSet;
+  const time_t tps = (time_t)getTimePerSample(setHeader->period);
+  const rrdbInt *values = ring;
+
+  // Anchor window to the last write
+  const time_t last_tick = setHeader->lastTouch / tps;  // tick we last touched
+  time_t end_tick  = last_tick;                         // print up to here
+  time_t start_tick = end_tick - (time_t)(N - 1);
+  if (start_tick < 0) start_tick = 0;
+
+  // The counts of the bins of a file which keeps values
+  if (header->values) {
+    rrdbTouchCountVisit v = { visit, arg };
+    walkTouchValues(header, setHeader, ring, count_bin, &v);
+    return;
+  }
+
+  // Sparse: only the bins touched, in order
+  if (TOUCHRINGDENSE != setHeader->bins) {
+    const rrdbTouchBin *bins = ring;
+    for (unsigned int i = setHeader->bins; i > 0; --i) {
+      time_t tick = bins[i - 1].tick;
+      if (tick < start_tick || tick > end_tick) continue;
+      if (bins[i - 1].count != 0) visit((intmax_t)(tick * tps), bins[i - 1].count, arg);
+    }
+    return;
+  }
+
+  for (time_t tick = end_tick; ; --tick) {
+    unsigned int idx = (unsigned int)(tick % N);
+    rrdbInt v = values[idx];
+    // label with START of bin
+    intmax_t ts = (intmax_t)(tick * tps);
+    if (v != 0) visit(ts, v, arg);
+    if (tick == start_tick) break;
+  }
+}
+
+/*
+ As walkTouchSet, for a file which keeps values - visit gets the whole bin.
+ */
+void walkTouchValues(const rrdbTouchHeader *header,
+                     const rrdbTouchSet *setHeader,
+                     const void *ring,
+                     touchValueVisitor visit, void *arg)
+{
+  const unsigned int N = header->samplesPerSet;
+  const time_t tps = (time_t)getTimePerSample(setHeader->period);
+  const rrdbTouchValueBin *bins = ring;
+  const time_t end_tick = setHeader->lastTouch / tps;
+  time_t start_tick = end_tick - (time_t)(N - 1);
+  if (start_tick < 0) start_tick = 0;
+
+  if (TOUCHRINGDENSE != setHeader->bins) {
+    for (unsigned int i = setHeader->bins; i > 0; --i) {
+      time_t tick = bins[i - 1].tick;
+      if (tick < start_tick || tick > end_tick) continue;
+      if (bins[i - 1].count != 0) visit((intmax_t)(tick * tps), &bins[i - 1], arg);
+    }
+    return;
+  }
+
+  for (time_t tick = end_tick; tick >= start_tick; --tick) {
+    const rrdbTouchValueBin *bin = &bins[tick % N];
+    // a bin left from an earlier time round the ring is empty
+    if ((time_t)bin->tick == tick && bin->count != 0) visit((intmax_t)(tick * tps), bin, arg);
+  }
+}
+
+/**
+ * Add the values of some touches to into, the values of had touches.
+ */
+void touchValuesAdd( rrdbTouchValues *into, rrdbInt had, const rrdbTouchValues *values ) {
+  if ( 0 == had ) {
+    *into = *values;
+    return;
+  }
+  into->sum += values->sum;
+  into->min = MIN( into->min, values->min );
+  into->max = MAX( into->max, values->max );
+}
+
+static void print_bin(intmax_t ts, rrdbInt v, void *arg)
+{
+  UNUSED(arg);
+  rrdbprintf("%" PRIdMAX ":%d\n", ts, (int)v);
+}
+
+/* time:count:sum:min:max:mean */
+static void print_value_bin(intmax_t ts, const rrdbTouchValueBin *bin, void *arg)
+{
+  UNUSED(arg);
+  rrdbprintf("%" PRIdMAX ":%d:%f:%f:%f:%f\n", ts, (int)bin->count, bin->values.sum, bin->values.min, bin->values.max,
+             bin->values.sum / bin->count);
+}
+
+static void sum_bin(intmax_t ts, rrdbInt v, void *arg)
+{
+  UNUSED(ts);
+  *(uint64_t *)arg += v;
+}
+
+/*
+ Where the parts of a touch file are (see rrdbTouchHeader): the set table, the rings of the
+ sets in the table, then the string table.
+ */
+rrdbTouchSet *touchSetAt( const rrdbTouchHeader *header, unsigned int index ) {
+  return ( rrdbTouchSet * ) ( header + 1 ) + index;
+}
+
+/* a bin of a sparse ring, and of a dense one */
+static size_t touchBinSize( const rrdbTouchHeader *header ) {
+  return header->values ? sizeof( rrdbTouchValueBin ) : sizeof( rrdbTouchBin );
+}
+
+static size_t touchDenseBinSize( const rrdbTouchHeader *header ) {
+  return header->values ? sizeof( rrdbTouchValueBin ) : sizeof( rrdbInt );
+}
+
+/* the room a dense ring takes */
+static size_t touchRingSize( const rrdbTouchHeader *header ) {
+  return ( size_t ) header->samplesPerSet * touchDenseBinSize( header );
+}
+
+/**
+ * @return { unsigned int } the room for a ring of bins touched bins - sparse, doubling from
+ * TOUCHSPARSEMIN, until that is as much as a dense ring
+ */
+static unsigned int touchRoomFor( const rrdbTouchHeader *header, size_t bins ) {
+  size_t room = TOUCHSPARSEMIN * touchBinSize( header );
+
+  while ( room < bins * touchBinSize( header ) ) room *= 2;
+  return MIN( room, touchRingSize( header ) );
+}
+
+static size_t touchRingsAt( const rrdbTouchHeader *header ) {
+  return sizeof( rrdbTouchHeader ) + ( size_t ) header->capacity * sizeof( rrdbTouchSet );
+}
+
+void *touchSetRing( const rrdbTouchHeader *header, const rrdbTouchSet *setHeader ) {
+  return ( char * ) header + touchRingsAt( header ) + setHeader->ring;
+}
+
+static size_t touchStringsAt( const rrdbTouchHeader *header ) {
+  return touchRingsAt( header ) + header->rings;
+}
+
+static size_t touchSetsEnd( const rrdbTouchHeader *header ) {
+  return touchStringsAt( header ) + header->strings;
+}
+
+/**
+ * Copy a set's ring, as a dense ring, to dense (touchRingSize bytes).
+ */
+void touchSetDense( const rrdbTouchHeader *header, const rrdbTouchSet *setHeader, void *dense ) {
+  const rrdbTouchBin *bins = touchSetRing( header, setHeader );
+  const rrdbTouchValueBin *valuebins = touchSetRing( header, setHeader );
+  const time_t tps = getTimePerSample( setHeader->period );
+  const time_t N = header->samplesPerSet;
+
+  if ( TOUCHRINGDENSE == setHeader->bins ) {
+    memcpy( dense, touchSetRing( header, setHeader ), touchRingSize( header ) );
+    return;
+  }
+
+  memset( dense, 0, touchRingSize( header ) );
+  for ( unsigned int i = 0; i < setHeader->bins; i++ ) {
+    /* only those still inside the ring */
+    if ( header->values ) {
+      if ( ( time_t ) valuebins[ i ].tick > setHeader->lastTouch / tps - N ) ( ( rrdbTouchValueBin * ) dense )[ valuebins[ i ].tick % N ] = valuebins[ i ];
+    } else if ( ( time_t ) bins[ i ].tick > setHeader->lastTouch / tps - N ) {
+      ( ( rrdbInt * ) dense )[ bins[ i ].tick % N ] = bins[ i ].count;
+    }
+  }
+}
+
+/**
+ * @return { uint64_t } the touches in a set's ring
+ */
+static uint64_t touchSetTotal( const rrdbTouchHeader *header, const rrdbTouchSet *setHeader ) {
+  uint64_t total = 0;
+
+  walkTouchSet( header, setHeader, touchSetRing( header, setHeader ), sum_bin, &total );
+  return total;
+}
+
+/* an entry of the string table: its length, the path, a NUL then padding to 4 bytes */
+static size_t touchStringSize( size_t length ) {
+  return ( sizeof( uint32_t ) + length + 1 + 3 ) & ~( size_t ) 3;
+}
+
+const char *touchSetPath( const rrdbTouchHeader *header, const rrdbTouchSet *setHeader ) {
+  return ( const char * ) header + touchStringsAt( header ) + setHeader->path + sizeof( uint32_t );
+}
+
+/**
+ * @return { uint64_t } FNV-1a of the path, which set headers keep to compare before the path itself
+ */
+uint64_t touchPathHash( const char *path, size_t length ) {
+  uint64_t hash = 14695981039346656037ull;
+  for ( size_t i = 0; i < length; i++ ) hash = ( hash ^ ( unsigned char ) path[ i ] ) * 1099511628211ull;
+  return hash;
+}
+
+/**
+ * Check the touch file mapped at addr (size bytes) before anything looks at its sets - that
+ * everything is inside the file, every path inside the string table.
+ * @return { int } TRUE if it is
+ */
+int touchFileValid( const char *addr, size_t size ) {
+  const rrdbTouchHeader *header = ( const rrdbTouchHeader * ) addr;
+
+  if ( size < sizeof( rrdbTouchHeader ) || RRDBTOUCHV4 != header->fileVersion || 0 == header->samplesPerSet ||
+       header->values > 1 || header->samplesPerSet > UINT32_MAX / touchDenseBinSize( header ) || header->sets > header->capacity ||
+       header->capacity > size / sizeof( rrdbTouchSet ) || touchSetsEnd( header ) > size ) return FALSE;
+
+  for ( unsigned int i = 0; i < header->sets; i++ ) {
+    const rrdbTouchSet *setHeader = touchSetAt( header, i );
+
+    /* free sets keep their room, so every set's ring is checked */
+    if ( setHeader->ring % 4 || setHeader->room > header->rings || setHeader->ring > header->rings - setHeader->room ||
+         setHeader->room > touchRingSize( header ) ||
+         ( TOUCHRINGDENSE == setHeader->bins ? setHeader->room != touchRingSize( header ) :
+                                                setHeader->bins > setHeader->room / touchBinSize( header ) ) ) return FALSE;
+
+    if ( 0 == setHeader->length ) continue;
+    if ( setHeader->path % 4 || setHeader->path >= header->strings ||
+         touchStringSize( setHeader->length ) > header->strings - setHeader->path ||
+         0 != touchSetPath( header, setHeader )[ setHeader->length ] ) return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * @return { unsigned int } the sets of the mapped touch file header which aren't free
+ */
+unsigned int touchSetsInUse( const rrdbTouchHeader *header ) {
+  unsigned int count = 0;
+
+  for ( unsigned int i = 0; i < header->sets; i++ ) {
+    if ( 0 != touchSetAt( header, i )->length ) count++;
+  }
+  return count;
+}
+
+/**
+ * @return { rrdbTouchSketch * } the sketch after the string table of the touch file mapped at addr, or NULL if it hasn't one
+ */
+static rrdbTouchSketch *touchSketch( char *addr, size_t size ) {
+  size_t end = touchSetsEnd( ( rrdbTouchHeader * ) addr );
+  rrdbTouchSketch *sketch = ( rrdbTouchSketch * ) ( addr + end );
+
+  if ( size < end + sizeof( rrdbTouchSketch ) || TOUCHSKETCHMAGIC != sketch->magic ) return NULL;
+  return sketch;
+}
+
+/**
+ * The set of path (length bytes, its hash) and period - the hash, period and length are
+ * compared first so the path itself is only compared for what is almost certainly it.
+ * @return { rrdbTouchSet * } or NULL
+ */
+static rrdbTouchSet *touchFind( const rrdbTouchHeader *header, const char *path, size_t length, uint64_t hash, unsigned int period ) {
+  for ( unsigned int i = 0; i < header->sets; i++ ) {
+    rrdbTouchSet *setHeader = touchSetAt( header, i );
+
+    /* a free set has no length */
+    if ( setHeader->hash != hash || setHeader->period != period || setHeader->length != length ) continue;
+    if ( 0 == memcmp( touchSetPath( header, setHeader ), path, length ) ) return setHeader;
+  }
+  return NULL;
+}
+
+/*
+ Find the first set matching path (if given) and period in a touch file mapped at addr.
+ */
+rrdbTouchSet *findTouchSetByName(char *addr, size_t size, char *path, unsigned int iperiod)
+{
+  rrdbTouchHeader *header = (rrdbTouchHeader *)addr;
+
+  if ( !touchFileValid( addr, size ) ) return NULL;
+
+  if( path && path[0] != '\0' ) {
+    size_t length = strlen( path );
+    return touchFind( header, path, length, touchPathHash( path, length ), iperiod );
+  }
+
+  for( unsigned int i = 0; i < header->sets; i++ ) {
+    rrdbTouchSet *setHeader = touchSetAt( header, i );
+    // free sets have no path
+    if ( 0 != setHeader->length && setHeader->period == iperiod ) return setHeader;
+  }
+
+  return NULL;
+}
+
+/*
+ Convert the name of a period (i.e. ONEHOUR) to RRDBTimePeriods.
+ @return { int } the period or -1 if we don't recognise it
+ */
+int getPeriodFromName(const char *name)
+{
+  if( strcmp( name, "FIVEMINUTE" ) == 0 ) return FIVEMINUTE;
+  if( strcmp( name, "QUARTERHOUR" ) == 0 ) return QUARTERHOUR;
+  if( strcmp( name, "ONEHOUR" ) == 0 ) return ONEHOUR;
+  if( strcmp( name, "SIXHOUR" ) == 0 ) return SIXHOUR;
+  if( strcmp( name, "TWELVEHOUR" ) == 0 ) return TWELVEHOUR;
+  if( strcmp( name, "ONEDAY" ) == 0 ) return ONEDAY;
+  return -1;
+}
+
+int printRRDBTouchFile(int pfd, char *filename, char *path, char *period)
+{
+  struct stat sb;
+  if (fstat(pfd, &sb) == -1) return -1;
+
+  int iperiod = getPeriodFromName( period );
+  if( -1 == iperiod ) iperiod = ONEHOUR;
+
+  char *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, pfd, 0);
+  if( addr == MAP_FAILED ) return -1;
+
+  rrdbTouchSet *owned;
+  const void *ring;
+  rrdbTouchSet *setHeader = touchFetchSet( filename, addr, sb.st_size, path, iperiod, &ring, &owned );
+
+  // print only first matching set
+  if( NULL != setHeader && ( ( rrdbTouchHeader * ) addr )->values ) walkTouchValues( (rrdbTouchHeader *)addr, setHeader, ring, print_value_bin, NULL );
+  else if( NULL != setHeader ) walkTouchSet( (rrdbTouchHeader *)addr, setHeader, ring, print_bin, NULL );
+  free( owned );
+
+  munmap( addr, sb.st_size );
+  return 0;
+}
+
+/************************************************************************************
+ * Function: printRRDBFileXform
+ *
+ * Purpose: output to stdout the xfomr data form the sets.
+ *
+ * Written: 12th March 2013 By: Nick Knight
+ ************************************************************************************/
+int printRRDBFileXform(rrdbFile *fileData, unsigned int index)
+{
+    unsigned int i;
+    unsigned int runs[ 2 ][ 2 ];
+    unsigned int runcount;
+
+    if ( index >= fileData->xformheader.xformCount ) {
+        rrdbprintf("ERROR: xform index out of bounds\n");
+        return -1;
+    }
+
+    if ( 0 == fileData->header.sampleCount ) return 1;
+
+    /* + 1 so that we start after the newest and print them in time order */
+    runcount = ringRuns( ( fileData->xforms[index].windowPosition + 1 ) % fileData->header.sampleCount, fileData->header.sampleCount, runs );
+
+    for ( unsigned int r = 0; r < runcount; r++ ) {
+        for ( i = runs[ r ][ 0 ]; i < runs[ r ][ 0 ] + runs[ r ][ 1 ]; i++ ) {
+            if ( 1 == fileData->xformtimes[index][i].valid ) {
+                rrdbprintf("%ld:%Lf\n", fileData->xformtimes[index][i].time, fileData->xformdata[index][i]);
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ Archives. Points which fall off the end of an xform ring are kept: each xform collects
+ them in its stage and when the stage is full they are compressed into a block appended
+ to the file. Times are delta of delta encoded and values XOR'd with the last, so regular
+ series (which is what xforms are) cost a bit or two a point. Values are kept as doubles.
+ */
+typedef struct rrdbBits {
+  unsigned char *data;
+  size_t size;
+  /* bit position */
+  size_t at;
+  int overrun;
+} rrdbBits;
+
+static void bitsput( rrdbBits *b, uint64_t v, unsigned int n ) {
+  while ( n > 0 ) {
+    size_t byte = b->at >> 3;
+    unsigned int free = 8 - ( b->at & 7 );
+    unsigned int take = MIN( free, n );
+
+    if ( byte >= b->size ) {
+      b->overrun = TRUE;
+      return;
+    }
+
+    if ( 0 == ( b->at & 7 ) ) b->data[ byte ] = 0;
+    b->data[ byte ] |= ( ( v >> ( n - take ) ) & ( ( 1u << take ) - 1 ) ) << ( free - take );
+    b->at += take;
+    n -= take;
+  }
+}
+
+static uint64_t bitsget( rrdbBits *b, unsigned int n ) {
+  uint64_t v = 0;
+
+  while ( n > 0 ) {
+    size_t byte = b->at >> 3;
+    unsigned int avail = 8 - ( b->at & 7 );
+    unsigned int take = MIN( avail, n );
+
+    if ( byte >= b->size ) {
+      b->overrun = TRUE;
+      return 0;
+    }
+
+    v = ( v << take ) | ( ( b->data[ byte ] >> ( avail - take ) ) & ( ( 1u << take ) - 1 ) );
+    b->at += take;
+    n -= take;
+  }
+
+  return v;
+}
+
+/* sign extend the bottom n bits */
+static int64_t bitssigned( uint64_t v, unsigned int n ) {
+  return ( int64_t ) ( v << ( 64 - n ) ) >> ( 64 - n );
+}
+
+static uint64_t doublebits( double d ) {
+  uint64_t v;
+  memcpy( &v, &d, sizeof( v ) );
+  return v;
+}
+
+/**
+ * Compress count points into out.
+ * @return { size_t } bytes used, 0 if out is too small
+ */
+size_t rrdbArchiveEncode( const rrdbArchivePoint *points, unsigned int count, unsigned char *out, size_t size ) {
+  rrdbBits b = { out, size, 0, FALSE };
+  int64_t delta = 0;
+  unsigned int lead = 65, trail = 0;
+
+  if ( 0 == count ) return 0;
+
+  bitsput( &b, ( uint64_t ) points[ 0 ].time, 64 );
+  bitsput( &b, doublebits( points[ 0 ].value ), 64 );
+
+  for ( unsigned int i = 1; i < count; i++ ) {
+    int64_t d = points[ i ].time - points[ i - 1 ].time;
+    int64_t dod = d - delta;
+    delta = d;
+
+    if ( 0 == dod ) {
+      bitsput( &b, 0, 1 );
+    } else if ( dod >= -64 && dod <= 63 ) {
+      bitsput( &b, 2, 2 );
+      bitsput( &b, ( uint64_t ) dod, 7 );
+    } else if ( dod >= -256 && dod <= 255 ) {
+      bitsput( &b, 6, 3 );
+      bitsput( &b, ( uint64_t ) dod, 9 );
+    } else if ( dod >= -2048 && dod <= 2047 ) {
+      bitsput( &b, 14, 4 );
+      bitsput( &b, ( uint64_t ) dod, 12 );
+    } else {
+      bitsput( &b, 15, 4 );
+      bitsput( &b, ( uint64_t ) dod, 64 );
+    }
+
+    uint64_t x = doublebits( points[ i ].value ) ^ doublebits( points[ i - 1 ].value );
+    if ( 0 == x ) {
+      bitsput( &b, 0, 1 );
+      continue;
+    }
+
+    unsigned int l = MIN( __builtin_clzll( x ), 31 );
+    unsigned int t = __builtin_ctzll( x );
+
+    if ( lead <= 64 && l >= lead && t >= trail ) {
+      /* fits in the last window */
+      bitsput( &b, 2, 2 );
+      bitsput( &b, x >> trail, 64 - lead - trail );
+    } else {
+      lead = l;
+      trail = t;
+      bitsput( &b, 3, 2 );
+      bitsput( &b, lead, 5 );
+      bitsput( &b, 64 - lead - trail - 1, 6 );
+      bitsput( &b, x >> trail, 64 - lead - trail );
+    }
+  }
+
+  if ( b.overrun ) return 0;
+  return ( b.at + 7 ) / 8;
+}
+
+/**
+ * Decompress count points, calling visit for each in order.
+ * @return { int } 0 on success -1 if the block is corrupt
+ */
+int rrdbArchiveDecode( const unsigned char *in, size_t bytes, unsigned int count, archivePointVisitor visit, void *arg ) {
+  rrdbBits b = { ( unsigned char * ) in, bytes, 0, FALSE };
+  int64_t time, delta = 0;
+  uint64_t value;
+  unsigned int lead = 0, trail = 0;
+
+  if ( 0 == count ) return 0;
+
+  time = ( int64_t ) bitsget( &b, 64 );
+  value = bitsget( &b, 64 );
+  if ( b.overrun ) return -1;
+
+  for ( unsigned int i = 0; ; ) {
+    double d;
+    memcpy( &d, &value, sizeof( d ) );
+    visit( time, d, arg );
+
+    if ( ++i == count ) break;
+
+    int64_t dod;
+    if ( 0 == bitsget( &b, 1 ) ) dod = 0;
+    else if ( 0 == bitsget( &b, 1 ) ) dod = bitssigned( bitsget( &b, 7 ), 7 );
+    else if ( 0 == bitsget( &b, 1 ) ) dod = bitssigned( bitsget( &b, 9 ), 9 );
+    else if ( 0 == bitsget( &b, 1 ) ) dod = bitssigned( bitsget( &b, 12 ), 12 );
+    else dod = ( int64_t ) bitsget( &b, 64 );
+
+    delta += dod;
+    time += delta;
+
+    if ( 1 == bitsget( &b, 1 ) ) {
+      if ( 1 == bitsget( &b, 1 ) ) {
+        lead = bitsget( &b, 5 );
+        trail = 64 - lead - ( bitsget( &b, 6 ) + 1 );
+      }
+      value ^= bitsget( &b, 64 - lead - trail ) << trail;
+    }
+
+    if ( b.overrun ) return -1;
+  }
+
+  return 0;
+}
+
+/* where the archive starts - just after the last xform */
+static uint64_t v1FileSize( const rrdbFile *fileData ) {
+  uint64_t ring = fileData->header.sampleCount;
+
+  return seriesheadersize( fileData->header.fileVersion ) + ring * sizeof( rrdbTimePoint ) + fileData->header.setCount * ring * sizeof( rrdbNumber ) +
+         sizeof( rrdbXformsHeader ) + fileData->xformheader.xformCount * ( sizeof( rrdbXformHeader ) + ring * ( sizeof( rrdbTimePoint ) + sizeof( rrdbNumber ) ) );
+}
+
+static uint64_t archiveStageOffset( uint64_t base, unsigned int xform ) {
+  return base + sizeof( rrdbArchiveHeader ) + ( uint64_t ) xform * sizeof( rrdbArchiveStage );
+}
+
+/**
+ * @return { int } 1 if the file has an archive (read into archive), 0 if not, -1 on failure
+ */
+int readArchiveHeader( int pfd, const rrdbFile *fileData, rrdbArchiveHeader *archive, uint64_t *base ) {
+  *base = v1FileSize( fileData );
+
+  ssize_t got = pread( pfd, archive, sizeof( rrdbArchiveHeader ), *base );
+  if ( -1 == got ) return -1;
+  if ( sizeof( rrdbArchiveHeader ) != got || RRDBARCHIVEMAGIC != archive->magic ) return 0;
+  return 1;
+}
+
+/**
+ * Add a point which has fallen off the ring of xform, sealing a block if its stage is full.
+ * @return { int } 1 on success -1 on failure
+ */
+int archivePoint( int pfd, rrdbArchiveHeader *archive, uint64_t base, unsigned int xform, int64_t time, double value ) {
+  rrdbArchiveStage stage;
+  uint64_t offset = archiveStageOffset( base, xform );
+  rrdbArchivePoint point = { time, value };
+
+  /* an xform added since we started archiving */
+  if ( xform >= archive->xformCount ) return 1;
+
+  if ( sizeof( stage.count ) != pread( pfd, &stage.count, sizeof( stage.count ), offset ) ) return -1;
+  if ( stage.count >= RRDBARCHIVEPOINTS ) stage.count = 0;
+
+  if ( sizeof( point ) != pwrite( pfd, &point, sizeof( point ), offset + offsetof( rrdbArchiveStage, points ) + stage.count * sizeof( point ) ) ) return -1;
+  stage.count++;
+
+  if ( RRDBARCHIVEPOINTS == stage.count ) {
+    unsigned char data[ sizeof( rrdbArchiveBlock ) + RRDBARCHIVEBLOCKBYTES ];
+    rrdbArchiveBlock *block = ( rrdbArchiveBlock * ) data;
+
+    if ( sizeof( stage ) != pread( pfd, &stage, sizeof( stage ), offset ) ) return -1;
+
+    block->xform = xform;
+    block->points = RRDBARCHIVEPOINTS;
+    block->unused = 0;
+    block->first = stage.points[ 0 ].time;
+    block->last = stage.points[ RRDBARCHIVEPOINTS - 1 ].time;
+    block->bytes = rrdbArchiveEncode( stage.points, RRDBARCHIVEPOINTS, data + sizeof( rrdbArchiveBlock ), RRDBARCHIVEBLOCKBYTES );
+    if ( 0 == block->bytes ) return -1;
+
+    size_t length = sizeof( rrdbArchiveBlock ) + block->bytes;
+    if ( ( ssize_t ) length != pwrite( pfd, data, length, archive->end ) ) return -1;
+
+    archive->end += length;
+    archive->blockCount++;
+    archive->points += RRDBARCHIVEPOINTS;
+    if ( sizeof( rrdbArchiveHeader ) != pwrite( pfd, archive, sizeof( rrdbArchiveHeader ), base ) ) return -1;
+
+    stage.count = 0;
+  }
+
+  if ( sizeof( stage.count ) != pwrite( pfd, &stage.count, sizeof( stage.count ), offset ) ) return -1;
+  return 1;
+}
+
+/************************************************************************************
+ * Function: archiveRRDBFile
+ *
+ * Purpose: Start keeping the points which fall off the xform rings of a V1 or V5 file.
+ ************************************************************************************/
+int archiveRRDBFile( char *filename ) {
+  rrdbFile fileData;
+  rrdbArchiveHeader archive;
+  rrdbVersionHeader seq;
+  uint64_t base;
+  int retval = -1;
+
+  locked_file_t pfd = readwriteopenandlock( filename );
+  if ( -1 == pfd.data_fd ) {
+    rrdbprintf( "ERROR: failed to open %s\n", filename );
+    return -1;
+  }
+
+  if ( !seriesversion( getFileVersion( pfd.data_fd ) ) ) {
+    rrdbprintf( "ERROR: only V1 files can be archived\n" );
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  memset( &fileData, 0, sizeof( rrdbFile ) );
+  if ( -1 == readRRDBFile( pfd.data_fd, &fileData ) ) {
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  switch ( readArchiveHeader( pfd.data_fd, &fileData, &archive, &base ) ) {
+    case 1:
+      /* nothing to do */
+      retval = 1;
+      break;
+
+    case 0:
+    {
+      size_t stagesize = sizeof( rrdbArchiveStage ) * fileData.xformheader.xformCount;
+      rrdbArchiveStage *stages = calloc( 1, stagesize + 1 );
+
+      memset( &archive, 0, sizeof( archive ) );
+      archive.magic = RRDBARCHIVEMAGIC;
+      archive.xformCount = fileData.xformheader.xformCount;
+      archive.end = archiveStageOffset( base, archive.xformCount );
+
+      if ( NULL != stages && -1 != seqwritebegin( pfd.data_fd, &seq ) ) {
+        if ( ( ssize_t ) stagesize == pwrite( pfd.data_fd, stages, stagesize, archiveStageOffset( base, 0 ) ) &&
+             sizeof( archive ) == pwrite( pfd.data_fd, &archive, sizeof( archive ), base ) ) {
+          retval = 1;
+        }
+        seqwriteend( pfd.data_fd, &seq );
+      }
+
+      free( stages );
+      if ( -1 == retval ) rrdbprintf( "ERROR: failed to write the archive header\n" );
+      break;
+    }
+
+    default:
+      rrdbprintf( "ERROR: failed to read %s\n", filename );
+      break;
+  }
+
+  freeRRDBFile( &fileData );
+  unlockandclose( pfd );
+  return retval;
+}
+
+static void print_archived( int64_t time, double value, void *arg ) {
+  UNUSED( arg );
+  rrdbprintf( "%" PRId64 ":%Lf\n", time, ( rrdbNumber ) value );
+}
+
+/**
+ * Visit the archived points of an xform, oldest first, a block at a time.
+ * @return { int } 1 on success (including no archive) -1 on failure
+ */
+int visitRRDBArchive( int pfd, const rrdbFile *fileData, unsigned int index, archivePointVisitor visit, void *arg ) {
+  rrdbArchiveHeader archive;
+  rrdbArchiveStage stage;
+  rrdbArchiveBlock block;
+  unsigned char data[ RRDBARCHIVEBLOCKBYTES ];
+  uint64_t base, offset;
+
+  switch ( readArchiveHeader( pfd, fileData, &archive, &base ) ) {
+    case 0:
+      return 1;
+    case -1:
+      return -1;
+  }
+
+  if ( index >= archive.xformCount ) return 1;
+
+  offset = archiveStageOffset( base, archive.xformCount );
+  for ( unsigned int i = 0; i < archive.blockCount; i++ ) {
+    if ( sizeof( block ) != pread( pfd, &block, sizeof( block ), offset ) || block.bytes > sizeof( data ) ) {
+      rrdbprintf( "ERROR: archive block corrupt\n" );
+      return -1;
+    }
+
+    offset += sizeof( block );
+    if ( index == block.xform ) {
+      if ( ( ssize_t ) block.bytes != pread( pfd, data, block.bytes, offset ) ||
+           -1 == rrdbArchiveDecode( data, block.bytes, block.points, visit, arg ) ) {
+        rrdbprintf( "ERROR: archive block corrupt\n" );
+        return -1;
+      }
+    }
+    offset += block.bytes;
+  }
+
+  /* then what is waiting to be compressed */
+  if ( sizeof( stage ) != pread( pfd, &stage, sizeof( stage ), archiveStageOffset( base, index ) ) ) return -1;
+  for ( unsigned int i = 0; i < stage.count && i < RRDBARCHIVEPOINTS; i++ ) {
+    visit( stage.points[ i ].time, stage.points[ i ].value, arg );
+  }
+
+  return 1;
+}
+
+/**
+ * Print the archived points of an xform, oldest first.
+ * @return { int } 1 on success (including no archive) -1 on failure
+ */
+int printRRDBArchive( int pfd, const rrdbFile *fileData, unsigned int index ) {
+  return visitRRDBArchive( pfd, fileData, index, print_archived, NULL );
+}
+
+/*
+ V3 encoding (see rrdbV3Header). Tables and arrays are built in host order and converted
+ as they are written, which is nothing on a little endian host.
+ */
+_Static_assert( 64 == sizeof( rrdbV3Header ) && 32 == sizeof( rrdbV3Section ), "V3 header and sections must be packed" );
+
+static uint64_t v3align( uint64_t n ) {
+  return ( n + RRDBV3ALIGN - 1 ) & ~( ( uint64_t ) RRDBV3ALIGN - 1 );
+}
+
+/* lay out the next section after the ones before it, *end is where the one after goes */
+static rrdbV3Section *v3section( rrdbV3Section *table, unsigned int *count, uint64_t *end,
+                                 uint32_t type, uint32_t index, uint32_t width, uint32_t elements ) {
+  rrdbV3Section *s = &table[ ( *count )++ ];
+
+  s->type = type;
+  s->index = index;
+  s->width = width;
+  s->count = elements;
+  s->offset = *end;
+  s->length = ( uint64_t ) width * elements;
+  *end = v3align( *end + s->length );
+  return s;
+}
+
+static void v3puttimes( char *data, const rrdbV3Section *sections, const rrdbTimePoint *points, unsigned int n ) {
+  int64_t *times = ( int64_t * ) ( data + sections[ 0 ].offset );
+  uint16_t *usecs = ( uint16_t * ) ( data + sections[ 1 ].offset );
+  uint64_t *valid = ( uint64_t * ) ( data + sections[ 2 ].offset );
+
+  for ( unsigned int i = 0; i < n; i++ ) {
+    times[ i ] = htole64( points[ i ].time );
+    usecs[ i ] = htole16( points[ i ].uSecs );
+    if ( points[ i ].valid ) valid[ i / 64 ] |= htole64( 1ull << ( i % 64 ) );
+  }
+}
+
+static void v3gettimes( const char *data, const rrdbV3Section *times, const rrdbV3Section *usecs, const rrdbV3Section *valid,
+                        rrdbTimePoint *points, unsigned int n ) {
+  const int64_t *t = ( const int64_t * ) ( data + times->offset );
+  const uint16_t *u = ( const uint16_t * ) ( data + usecs->offset );
+  const uint64_t *v = ( const uint64_t * ) ( data + valid->offset );
+
+  memset( points, 0, sizeof( rrdbTimePoint ) * n );
+  for ( unsigned int i = 0; i < n; i++ ) {
+    points[ i ].time = le64toh( t[ i ] );
+    points[ i ].uSecs = le16toh( u[ i ] );
+    points[ i ].valid = ( le64toh( v[ i / 64 ] ) >> ( i % 64 ) ) & 1;
+  }
+}
+
+static void v3putvalues( char *data, const rrdbV3Section *s, const rrdbNumber *values, unsigned int n ) {
+  uint64_t *out = ( uint64_t * ) ( data + s->offset );
+
+  for ( unsigned int i = 0; i < n; i++ ) out[ i ] = htole64( doublebits( values[ i ] ) );
+}
+
+static void v3getvalues( const char *data, const rrdbV3Section *s, rrdbNumber *values, unsigned int n ) {
+  const uint64_t *in = ( const uint64_t * ) ( data + s->offset );
+
+  for ( unsigned int i = 0; i < n; i++ ) {
+    uint64_t bits = le64toh( in[ i ] );
+    double d;
+    memcpy( &d, &bits, sizeof( d ) );
+    values[ i ] = d;
+  }
+}
+
+/* the bins of a touch file which keeps values, each a uint32 tick and count then the 3 values */
+static void v3putvaluebins( void *data, const rrdbTouchValueBin *bins, uint64_t n ) {
+  uint32_t *out = data;
+
+  for ( uint64_t i = 0; i < n; i++, out += sizeof( rrdbTouchValueBin ) / sizeof( uint32_t ) ) {
+    uint64_t words[ 3 ] = { htole64( doublebits( bins[ i ].values.sum ) ), htole64( doublebits( bins[ i ].values.min ) ),
+                            htole64( doublebits( bins[ i ].values.max ) ) };
+    out[ 0 ] = htole32( bins[ i ].tick );
+    out[ 1 ] = htole32( bins[ i ].count );
+    memcpy( out + 2, words, sizeof( words ) );
+  }
+}
+
+static void v3getvaluebins( const void *data, rrdbTouchValueBin *bins, uint64_t n ) {
+  const uint32_t *in = data;
+
+  for ( uint64_t i = 0; i < n; i++, in += sizeof( rrdbTouchValueBin ) / sizeof( uint32_t ) ) {
+    uint64_t words[ 3 ];
+    double values[ 3 ];
+
+    memcpy( words, in + 2, sizeof( words ) );
+    for ( int j = 0; j < 3; j++ ) {
+      words[ j ] = le64toh( words[ j ] );
+      memcpy( &values[ j ], &words[ j ], sizeof( double ) );
+    }
+    bins[ i ].tick = le32toh( in[ 0 ] );
+    bins[ i ].count = le32toh( in[ 1 ] );
+    bins[ i ].values = ( rrdbTouchValues ) { values[ 0 ], values[ 1 ], values[ 2 ] };
+  }
+}
+
+/**
+ * Allocate the file (zeroed) and write the header and section table.
+ * @return { char * } NULL on failure
+ */
+static char *v3begin( rrdbV3Header *h, const rrdbV3Section *table, uint64_t end ) {
+  char *data = calloc( 1, end );
+  if ( NULL == data ) return NULL;
+
+  rrdbV3Header *out = ( rrdbV3Header * ) data;
+  out->fileVersion = htole32( RRDBV3 );
+  out->magic = htole32( RRDBV3MAGIC );
+  out->kind = htole32( h->kind );
+  out->sectionCount = htole32( h->sectionCount );
+  out->windowPosition = htole32( h->windowPosition );
+  out->setCount = htole32( h->setCount );
+  out->sampleCount = htole32( h->sampleCount );
+  out->xformCount = htole32( h->xformCount );
+  out->sectionOffset = htole64( sizeof( rrdbV3Header ) );
+
+  rrdbV3Section *sections = ( rrdbV3Section * ) ( data + sizeof( rrdbV3Header ) );
+  for ( unsigned int i = 0; i < h->sectionCount; i++ ) {
+    sections[ i ].type = htole32( table[ i ].type );
+    sections[ i ].index = htole32( table[ i ].index );
+    sections[ i ].width = htole32( table[ i ].width );
+    sections[ i ].count = htole32( table[ i ].count );
+    sections[ i ].offset = htole64( table[ i ].offset );
+    sections[ i ].length = htole64( table[ i ].length );
+  }
+
+  return data;
+}
+
+static int v3encodeseries( int pfd, char **out, uint64_t *size ) {
+  rrdbFile fileData;
+  rrdbV3Header h;
+  rrdbV3Section *table, *times, *xforms;
+  struct stat sb;
+  uint64_t end, base, archived = 0;
+  unsigned int n, count = 0;
+  int retval = -1;
+
+  memset( &fileData, 0, sizeof( rrdbFile ) );
+  if ( -1 == readRRDBFile( pfd, &fileData ) ) return -1;
+  if ( -1 == fstat( pfd, &sb ) ) goto done;
+
+  /* an archive is kept as it is */
+  base = v1FileSize( &fileData );
+  if ( ( uint64_t ) sb.st_size > base ) archived = sb.st_size - base;
+
+  n = fileData.header.sampleCount;
+  memset( &h, 0, sizeof( h ) );
+  h.kind = fileData.header.fileVersion;
+  h.sectionCount = 3 + fileData.header.setCount + 1 + 4 * fileData.xformheader.xformCount + ( archived > 0 ? 1 : 0 );
+  h.windowPosition = fileData.header.windowPosition;
+  h.setCount = fileData.header.setCount;
+  h.sampleCount = n;
+  h.xformCount = fileData.xformheader.xformCount;
+
+  table = calloc( h.sectionCount, sizeof( rrdbV3Section ) );
+  if ( NULL == table ) goto done;
+
+  end = v3align( sizeof( rrdbV3Header ) + h.sectionCount * sizeof( rrdbV3Section ) );
+  times = v3section( table, &count, &end, RRDBV3TIMES, 0, sizeof( int64_t ), n );
+  v3section( table, &count, &end, RRDBV3USECS, 0, sizeof( uint16_t ), n );
+  v3section( table, &count, &end, RRDBV3VALID, 0, sizeof( uint64_t ), ( n + 63 ) / 64 );
+  for ( unsigned int i = 0; i < h.setCount; i++ ) v3section( table, &count, &end, RRDBV3SET, i, sizeof( double ), n );
+
+  xforms = v3section( table, &count, &end, RRDBV3XFORMS, 0, sizeof( rrdbXformHeader ), h.xformCount );
+  for ( unsigned int i = 0; i < h.xformCount; i++ ) {
+    v3section( table, &count, &end, RRDBV3XFORMTIMES, i, sizeof( int64_t ), n );
+    v3section( table, &count, &end, RRDBV3XFORMUSECS, i, sizeof( uint16_t ), n );
+    v3section( table, &count, &end, RRDBV3XFORMVALID, i, sizeof( uint64_t ), ( n + 63 ) / 64 );
+    v3section( table, &count, &end, RRDBV3XFORMDATA, i, sizeof( double ), n );
+  }
+  if ( archived > 0 ) v3section( table, &count, &end, RRDBV3ARCHIVE, 0, 1, archived );
+
+  *out = v3begin( &h, table, end );
+  if ( NULL == *out ) goto freetable;
+
+  v3puttimes( *out, times, fileData.times, n );
+  for ( unsigned int i = 0; i < h.setCount; i++ ) v3putvalues( *out, &times[ 3 + i ], fileData.sets[ i ], n );
+
+  uint32_t *xformheaders = ( uint32_t * ) ( *out + xforms->offset );
+  for ( unsigned int i = 0; i < h.xformCount; i++ ) {
+    xformheaders[ i * 4 ] = htole32( fileData.xforms[ i ].period );
+    xformheaders[ i * 4 + 1 ] = htole32( fileData.xforms[ i ].calc );
+    xformheaders[ i * 4 + 2 ] = htole32( fileData.xforms[ i ].setIndex );
+    xformheaders[ i * 4 + 3 ] = htole32( fileData.xforms[ i ].windowPosition );
+
+    v3puttimes( *out, &xforms[ 1 + i * 4 ], fileData.xformtimes[ i ], n );
+    v3putvalues( *out, &xforms[ 4 + i * 4 ], fileData.xformdata[ i ], n );
+  }
+
+  if ( archived > 0 && ( ssize_t ) archived != pread( pfd, *out + table[ count - 1 ].offset, archived, base ) ) {
+    free( *out );
+    goto freetable;
+  }
+
+  *size = end;
+  retval = 1;
+
+freetable:
+  free( table );
+done:
+  freeRRDBFile( &fileData );
+  return retval;
+}
+
+/*
+ Version 2 touch files kept each set's path in a fixed TOUCHMAXPATHLENGTH bytes in front of
+ its ring (rrdbTouchSetV2). They are worked on as version 4 (see storedstage), converting
+ to it and back.
+ */
+
+/**
+ * Convert the version 2 touch file (size bytes at data) to version 4, written to the empty pfd.
+ * @return { int } 1 on success -1 on failure
+ */
+int touchV2Decode( const char *data, size_t size, int pfd ) {
+  const rrdbTouchHeaderV2 *in = ( const rrdbTouchHeaderV2 * ) data;
+  const char *sketch = NULL;
+  rrdbTouchHeader *header;
+  uint64_t insetsize, end;
+  size_t outsize;
+  char *out;
+  int retval = -1;
+
+  if ( size < sizeof( rrdbTouchHeaderV2 ) || RRDBTOUCHV2 != in->fileVersion || 0 == in->samplesPerSet ) return -1;
+  insetsize = sizeof( rrdbTouchSetV2 ) + ( uint64_t ) in->samplesPerSet * sizeof( rrdbInt );
+  if ( in->sets > ( size - sizeof( rrdbTouchHeaderV2 ) ) / insetsize || in->sets * insetsize > UINT32_MAX ) return -1;
+
+  /* only a file which has been full has one */
+  end = sizeof( rrdbTouchHeaderV2 ) + in->sets * insetsize;
+  if ( size >= end + sizeof( rrdbTouchSketch ) && TOUCHSKETCHMAGIC == ( ( const rrdbTouchSketch * ) ( data + end ) )->magic ) sketch = data + end;
+
+  /* as big as it can be - every path different */
+  outsize = sizeof( rrdbTouchHeader ) + ( size_t ) in->sets * ( sizeof( rrdbTouchSet ) + insetsize + touchStringSize( TOUCHMAXPATHLENGTH ) ) +
+            sizeof( rrdbTouchSketch );
+  out = calloc( 1, outsize );
+  if ( NULL == out ) return -1;
+
+  header = ( rrdbTouchHeader * ) out;
+  header->fileVersion = RRDBTOUCHV4;
+  header->sets = header->capacity = in->sets;
+  header->samplesPerSet = in->samplesPerSet;
+  header->rings = in->sets * touchRingSize( header );
+
+  for ( unsigned int i = 0; i < in->sets; i++ ) {
+    const rrdbTouchSetV2 *inset = ( const rrdbTouchSetV2 * ) ( data + sizeof( rrdbTouchHeaderV2 ) + i * insetsize );
+    rrdbTouchSet *setHeader = touchSetAt( header, i );
+    size_t length = strnlen( inset->path, TOUCHMAXPATHLENGTH - 1 );
+
+    /* every ring dense, as it was */
+    setHeader->ring = i * touchRingSize( header );
+    setHeader->room = touchRingSize( header );
+    setHeader->bins = TOUCHRINGDENSE;
+
+    /* free */
+    if ( 0 == length ) continue;
+
+    setHeader->lastTouch = inset->lastTouch;
+    setHeader->period = inset->period;
+    setHeader->hash = touchPathHash( inset->path, length );
+    setHeader->length = length;
+    memcpy( touchSetRing( header, setHeader ), inset + 1, touchRingSize( header ) );
+
+    /* the path of a set of another period may be there already */
+    rrdbTouchSet *same = NULL;
+    for ( unsigned int j = 0; j < i && NULL == same; j++ ) {
+      rrdbTouchSet *other = touchSetAt( header, j );
+      if ( other->hash == setHeader->hash && other->length == length &&
+           0 == memcmp( touchSetPath( header, other ), inset->path, length ) ) same = other;
+    }
+
+    if ( NULL != same ) {
+      setHeader->path = same->path;
+    } else {
+      uint32_t prefix = length;
+      char *entry = out + touchStringsAt( header ) + header->strings;
+
+      memcpy( entry, &prefix, sizeof( prefix ) );
+      memcpy( entry + sizeof( prefix ), inset->path, length );
+      setHeader->path = header->strings;
+      header->strings += touchStringSize( length );
+    }
+  }
+
+  end = touchSetsEnd( header );
+  if ( NULL != sketch ) {
+    memcpy( out + end, sketch, sizeof( rrdbTouchSketch ) );
+    end += sizeof( rrdbTouchSketch );
+  }
+
+  if ( ( ssize_t ) end == pwrite( pfd, out, end, 0 ) ) retval = 1;
+
+  free( out );
+  return retval;
+}
+
+/**
+ * Convert the version 4 touch file pfd back to version 2, leaving out its free sets.
+ * @return { int } 1 on success (*data malloc'd, of *size bytes), 0 if it has a path too
+ * long for version 2 (or keeps values, which version 2 can't) or -1 on failure
+ */
+int touchV2Encode( int pfd, char **data, size_t *size ) {
+  rrdbTouchHeader *header;
+  rrdbTouchHeaderV2 *out;
+  rrdbTouchSketch *sketch;
+  struct stat sb;
+  size_t outsetsize, end;
+  unsigned int sets = 0;
+  char *addr;
+  int retval = -1;
+
+  if ( -1 == fstat( pfd, &sb ) ) return -1;
+  addr = mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, pfd, 0 );
+  if ( MAP_FAILED == addr ) return -1;
+
+  header = ( rrdbTouchHeader * ) addr;
+  if ( !touchFileValid( addr, sb.st_size ) ) goto done;
+
+  if ( header->values ) {
+    retval = 0;
+    goto done;
+  }
+
+  for ( unsigned int i = 0; i < header->sets; i++ ) {
+    if ( touchSetAt( header, i )->length >= TOUCHMAXPATHLENGTH ) {
+      retval = 0;
+      goto done;
+    }
+  }
+
+  sketch = touchSketch( addr, sb.st_size );
+  outsetsize = sizeof( rrdbTouchSetV2 ) + touchRingSize( header );
+  end = sizeof( rrdbTouchHeaderV2 ) + touchSetsInUse( header ) * outsetsize;
+
+  *data = calloc( 1, end + sizeof( rrdbTouchSketch ) );
+  if ( NULL == *data ) goto done;
+
+  out = ( rrdbTouchHeaderV2 * ) *data;
+  out->fileVersion = RRDBTOUCHV2;
+  out->samplesPerSet = header->samplesPerSet;
+
+  for ( unsigned int i = 0; i < header->sets; i++ ) {
+    const rrdbTouchSet *setHeader = touchSetAt( header, i );
+    rrdbTouchSetV2 *outset = ( rrdbTouchSetV2 * ) ( *data + sizeof( rrdbTouchHeaderV2 ) + sets * outsetsize );
+
+    if ( 0 == setHeader->length ) continue;
+
+    outset->lastTouch = setHeader->lastTouch;
+    outset->period = setHeader->period;
+    memcpy( outset->path, touchSetPath( header, setHeader ), setHeader->length );
+    touchSetDense( header, setHeader, ( rrdbInt * ) ( outset + 1 ) );
+    sets++;
+  }
+  out->sets = sets;
+
+  if ( NULL != sketch ) {
+    memcpy( *data + end, sketch, sizeof( rrdbTouchSketch ) );
+    end += sizeof( rrdbTouchSketch );
+  }
+
+  *size = end;
+  retval = 1;
+
+done:
+  munmap( addr, sb.st_size );
+  return retval;
+}
+
+static int v3encodetouch( int pfd, char **out, uint64_t *size ) {
+  rrdbTouchHeader *header;
+  rrdbTouchSketch *sketch;
+  rrdbV3Header h;
+  rrdbV3Section *table, *sets, *strings, *sketchsection = NULL;
+  struct stat sb;
+  uint64_t end;
+  unsigned int count = 0;
+  char *addr;
+  int retval = -1;
+
+  if ( -1 == fstat( pfd, &sb ) ) return -1;
+  addr = mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, pfd, 0 );
+  if ( MAP_FAILED == addr ) return -1;
+
+  header = ( rrdbTouchHeader * ) addr;
+  if ( !touchFileValid( addr, sb.st_size ) ) goto done;
+
+  sketch = touchSketch( addr, sb.st_size );
+
+  memset( &h, 0, sizeof( h ) );
+  h.kind = RRDBTOUCHV4;
+  h.sectionCount = 2 + header->sets + ( NULL != sketch );
+  h.setCount = header->sets;
+  h.sampleCount = header->samplesPerSet;
+  h.xformCount = header->values;
+
+  table = calloc( h.sectionCount, sizeof( rrdbV3Section ) );
+  if ( NULL == table ) goto done;
+
+  end = v3align( sizeof( rrdbV3Header ) + h.sectionCount * sizeof( rrdbV3Section ) );
+  sets = v3section( table, &count, &end, RRDBV3TOUCHTABLE, 0, sizeof( rrdbV3TouchEntry ), h.setCount );
+  for ( unsigned int i = 0; i < h.setCount; i++ ) {
+    const rrdbTouchSet *set = touchSetAt( header, i );
+    if ( header->values && TOUCHRINGDENSE == set->bins ) v3section( table, &count, &end, RRDBV3TOUCHVALUERING, i, sizeof( rrdbTouchValueBin ), h.sampleCount );
+    else if ( header->values ) v3section( table, &count, &end, RRDBV3TOUCHVALUEBINS, i, sizeof( rrdbTouchValueBin ), set->bins );
+    else if ( TOUCHRINGDENSE == set->bins ) v3section( table, &count, &end, RRDBV3TOUCHRING, i, sizeof( uint32_t ), h.sampleCount );
+    else v3section( table, &count, &end, RRDBV3TOUCHBINS, i, sizeof( rrdbTouchBin ), set->bins );
+  }
+  strings = v3section( table, &count, &end, RRDBV3TOUCHSTRINGS, 0, 1, header->strings );
+  if ( NULL != sketch ) sketchsection = v3section( table, &count, &end, RRDBV3TOUCHSKETCH, 0, sizeof( uint32_t ), sizeof( rrdbTouchSketch ) / sizeof( uint32_t ) );
+
+  *out = v3begin( &h, table, end );
+  if ( NULL != *out ) {
+    rrdbV3TouchEntry *entries = ( rrdbV3TouchEntry * ) ( *out + sets->offset );
+    char *outstrings = *out + strings->offset;
+
+    for ( unsigned int i = 0; i < h.setCount; i++ ) {
+      const rrdbTouchSet *set = touchSetAt( header, i );
+      const uint32_t *ring = touchSetRing( header, set );
+      uint32_t *outring = ( uint32_t * ) ( *out + sets[ 1 + i ].offset );
+
+      entries[ i ].lastTouch = htole64( set->lastTouch );
+      entries[ i ].hash = htole64( set->hash );
+      entries[ i ].path = htole32( set->path );
+      entries[ i ].length = htole32( set->length );
+      entries[ i ].period = htole32( set->period );
+
+      /* a bin is a tick and a count, both uint32 */
+      if ( header->values ) v3putvaluebins( outring, ( const rrdbTouchValueBin * ) ring, sets[ 1 + i ].count );
+      else for ( uint64_t j = 0; j < sets[ 1 + i ].length / sizeof( uint32_t ); j++ ) outring[ j ] = htole32( ring[ j ] );
+    }
+
+    /* the string table as it is, but for the length in front of each path */
+    memcpy( outstrings, addr + touchStringsAt( header ), header->strings );
+    for ( uint64_t at = 0; at + sizeof( uint32_t ) <= header->strings; ) {
+      uint32_t length;
+      memcpy( &length, outstrings + at, sizeof( length ) );
+      *( uint32_t * ) ( outstrings + at ) = htole32( length );
+      at += touchStringSize( length );
+    }
+
+    if ( NULL != sketch ) {
+      const uint32_t *words = ( const uint32_t * ) sketch;
+      uint32_t *outwords = ( uint32_t * ) ( *out + sketchsection->offset );
+      for ( unsigned int j = 0; j < sketchsection->count; j++ ) outwords[ j ] = htole32( words[ j ] );
+    }
+
+    *size = end;
+    retval = 1;
+  }
+
+  free( table );
+done:
+  munmap( addr, sb.st_size );
+  return retval;
+}
+
+/**
+ * Encode the V1 or touch file pfd as V3.
+ * @return { int } 1 on success (*data malloc'd, of *size bytes) -1 on failure
+ */
+int rrdbV3Encode( int pfd, char **data, size_t *size ) {
+  uint64_t length = 0;
+  int retval;
+
+  switch ( peekversion( pfd ) ) {
+    case RRDBV1:
+    case RRDBV5:
+      retval = v3encodeseries( pfd, data, &length );
+      break;
+    case RRDBTOUCHV4:
+      retval = v3encodetouch( pfd, data, &length );
+      break;
+    default:
+      return -1;
+  }
+
+  *size = length;
+  return retval;
+}
+
+/**
+ * The section of type and index, if it is there and holds what we expect.
+ * @return { const rrdbV3Section * } or NULL
+ */
+static const rrdbV3Section *v3find( const rrdbV3Section *table, unsigned int count, uint32_t type, uint32_t index, uint32_t width, uint32_t elements ) {
+  for ( unsigned int i = 0; i < count; i++ ) {
+    if ( type != table[ i ].type || index != table[ i ].index ) continue;
+    if ( width != table[ i ].width || ( UINT32_MAX != elements && elements != table[ i ].count ) ) return NULL;
+    return &table[ i ];
+  }
+  return NULL;
+}
+
+static int v3decodeseries( const char *data, const rrdbV3Header *h, const rrdbV3Section *table, int pfd ) {
+  rrdbFile fileData;
+  const rrdbV3Section *times, *usecs, *valid, *xforms, *archive, *s;
+  unsigned int n = h->sampleCount, words = ( n + 63 ) / 64;
+  int retval = -1;
+
+  if ( h->setCount > MAXNUMSETS || h->xformCount > MAXNUMSETS * MAXNUMXFORMPERSET ) return -1;
+
+  times = v3find( table, h->sectionCount, RRDBV3TIMES, 0, sizeof( int64_t ), n );
+  usecs = v3find( table, h->sectionCount, RRDBV3USECS, 0, sizeof( uint16_t ), n );
+  valid = v3find( table, h->sectionCount, RRDBV3VALID, 0, sizeof( uint64_t ), words );
+  xforms = v3find( table, h->sectionCount, RRDBV3XFORMS, 0, sizeof( rrdbXformHeader ), h->xformCount );
+  if ( NULL == times || NULL == usecs || NULL == valid || NULL == xforms ) return -1;
+
+  memset( &fileData, 0, sizeof( rrdbFile ) );
+  fileData.header.fileVersion = h->kind;
+  fileData.header.windowPosition = h->windowPosition;
+  fileData.header.sampleCount = n;
+
+  fileData.times = malloc( sizeof( rrdbTimePoint ) * n + 1 );
+  if ( NULL == fileData.times ) return -1;
+  v3gettimes( data, times, usecs, valid, fileData.times, n );
+
+  for ( unsigned int i = 0; i < h->setCount; i++ ) {
+    s = v3find( table, h->sectionCount, RRDBV3SET, i, sizeof( double ), n );
+    fileData.sets[ i ] = malloc( sizeof( rrdbNumber ) * n + 1 );
+    fileData.header.setCount = i + 1;
+    if ( NULL == s || NULL == fileData.sets[ i ] ) goto done;
+    v3getvalues( data, s, fileData.sets[ i ], n );
+  }
+
+  const uint32_t *xformheaders = ( const uint32_t * ) ( data + xforms->offset );
+  for ( unsigned int i = 0; i < h->xformCount; i++ ) {
+    const rrdbV3Section *xtimes = v3find( table, h->sectionCount, RRDBV3XFORMTIMES, i, sizeof( int64_t ), n );
+    const rrdbV3Section *xusecs = v3find( table, h->sectionCount, RRDBV3XFORMUSECS, i, sizeof( uint16_t ), n );
+    const rrdbV3Section *xvalid = v3find( table, h->sectionCount, RRDBV3XFORMVALID, i, sizeof( uint64_t ), words );
+
+    s = v3find( table, h->sectionCount, RRDBV3XFORMDATA, i, sizeof( double ), n );
+    fileData.xformtimes[ i ] = malloc( sizeof( rrdbTimePoint ) * n + 1 );
+    fileData.xformdata[ i ] = malloc( sizeof( rrdbNumber ) * n + 1 );
+    fileData.xformheader.xformCount = i + 1;
+    if ( NULL == xtimes || NULL == xusecs || NULL == xvalid || NULL == s ||
+         NULL == fileData.xformtimes[ i ] || NULL == fileData.xformdata[ i ] ) goto done;
+
+    fileData.xforms[ i ].period = le32toh( xformheaders[ i * 4 ] );
+    fileData.xforms[ i ].calc = le32toh( xformheaders[ i * 4 + 1 ] );
+    fileData.xforms[ i ].setIndex = le32toh( xformheaders[ i * 4 + 2 ] );
+    fileData.xforms[ i ].windowPosition = le32toh( xformheaders[ i * 4 + 3 ] );
+
+    v3gettimes( data, xtimes, xusecs, xvalid, fileData.xformtimes[ i ], n );
+    v3getvalues( data, s, fileData.xformdata[ i ], n );
+  }
+
+  if ( -1 == writeRRDBFile( pfd, &fileData ) ) goto done;
+
+  /* the archive goes back where it was, just after the last xform */
+  archive = v3find( table, h->sectionCount, RRDBV3ARCHIVE, 0, 1, UINT32_MAX );
+  if ( NULL != archive &&
+       ( ssize_t ) archive->length != pwrite( pfd, data + archive->offset, archive->length, v1FileSize( &fileData ) ) ) goto done;
+
+  retval = 1;
+
+done:
+  freeRRDBFile( &fileData );
+  return retval;
+}
+
+/* a V3 file from before version 4 touch files, rebuilt as the version 2 file it was then converted */
+static int v3decodetouchv2( const char *data, const rrdbV3Header *h, const rrdbV3Section *table, int pfd ) {
+  const rrdbV3Section *sets, *sketch;
+  uint64_t setsize = sizeof( rrdbTouchSetV2 ) + ( uint64_t ) h->sampleCount * sizeof( rrdbInt );
+  uint64_t size = sizeof( rrdbTouchHeaderV2 ) + h->setCount * setsize;
+  rrdbTouchHeaderV2 *header;
+  char *out;
+  int retval = -1;
+
+  sets = v3find( table, h->sectionCount, RRDBV3TOUCHSETS, 0, sizeof( rrdbV3TouchSet ), h->setCount );
+  if ( NULL == sets ) return -1;
+
+  /* only a file which has been full has one */
+  sketch = v3find( table, h->sectionCount, RRDBV3TOUCHSKETCH, 0, sizeof( uint32_t ), sizeof( rrdbTouchSketch ) / sizeof( uint32_t ) );
+  if ( NULL != sketch ) size += sizeof( rrdbTouchSketch );
+
+  out = calloc( 1, size );
+  if ( NULL == out ) return -1;
+
+  header = ( rrdbTouchHeaderV2 * ) out;
+  header->fileVersion = RRDBTOUCHV2;
+  header->sets = h->setCount;
+  header->samplesPerSet = h->sampleCount;
+
+  const rrdbV3TouchSet *insets = ( const rrdbV3TouchSet * ) ( data + sets->offset );
+  for ( unsigned int i = 0; i < h->setCount; i++ ) {
+    const rrdbV3Section *ring = v3find( table, h->sectionCount, RRDBV3TOUCHRING, i, sizeof( uint32_t ), h->sampleCount );
+    rrdbTouchSetV2 *set = ( rrdbTouchSetV2 * ) ( out + sizeof( rrdbTouchHeaderV2 ) + i * setsize );
+    rrdbInt *outring = ( rrdbInt * ) ( set + 1 );
+
+    if ( NULL == ring ) goto done;
+
+    const uint32_t *inring = ( const uint32_t * ) ( data + ring->offset );
+    set->lastTouch = le64toh( insets[ i ].lastTouch );
+    set->period = le32toh( insets[ i ].period );
+    memcpy( set->path, insets[ i ].path, TOUCHMAXPATHLENGTH );
+    set->path[ TOUCHMAXPATHLENGTH - 1 ] = 0;
+    for ( unsigned int j = 0; j < h->sampleCount; j++ ) outring[ j ] = le32toh( inring[ j ] );
+  }
+
+  if ( NULL != sketch ) {
+    const uint32_t *inwords = ( const uint32_t * ) ( data + sketch->offset );
+    uint32_t *words = ( uint32_t * ) ( out + size - sizeof( rrdbTouchSketch ) );
+    for ( unsigned int j = 0; j < sketch->count; j++ ) words[ j ] = le32toh( inwords[ j ] );
+  }
+
+  retval = touchV2Decode( out, size, pfd );
+
+done:
+  free( out );
+  return retval;
+}
+
+/** @return { int } TRUE if a touch ring section is of a dense ring */
+static int touchV3Dense( const rrdbV3Section *ring ) {
+  return RRDBV3TOUCHRING == ring->type || RRDBV3TOUCHVALUERING == ring->type;
+}
+
+static int v3decodetouch( const char *data, const rrdbV3Header *h, const rrdbV3Section *table, int pfd ) {
+  const rrdbV3Section *sets, *strings, *sketch, **rings;
+  rrdbTouchHeader shape = { .samplesPerSet = h->sampleCount, .values = h->xformCount };
+  uint64_t size, ringsize = 0;
+  rrdbTouchHeader *header;
+  char *out = NULL, *outstrings;
+  int retval = -1;
+
+  if ( 0 == h->sampleCount || shape.values > 1 || h->sampleCount > UINT32_MAX / touchDenseBinSize( &shape ) ) return -1;
+
+  sets = v3find( table, h->sectionCount, RRDBV3TOUCHTABLE, 0, sizeof( rrdbV3TouchEntry ), h->setCount );
+  strings = v3find( table, h->sectionCount, RRDBV3TOUCHSTRINGS, 0, 1, UINT32_MAX );
+  if ( NULL == sets || NULL == strings ) return -1;
+
+  /* only a file which has been full has one */
+  sketch = v3find( table, h->sectionCount, RRDBV3TOUCHSKETCH, 0, sizeof( uint32_t ), sizeof( rrdbTouchSketch ) / sizeof( uint32_t ) );
+
+  /* each ring is dense or sparse, with as much room as touching it would have given it */
+  rings = malloc( sizeof( rrdbV3Section * ) * h->setCount + 1 );
+  if ( NULL == rings ) return -1;
+  for ( unsigned int i = 0; i < h->setCount; i++ ) {
+    if ( shape.values ) {
+      rings[ i ] = v3find( table, h->sectionCount, RRDBV3TOUCHVALUERING, i, sizeof( rrdbTouchValueBin ), h->sampleCount );
+      if ( NULL == rings[ i ] ) rings[ i ] = v3find( table, h->sectionCount, RRDBV3TOUCHVALUEBINS, i, sizeof( rrdbTouchValueBin ), UINT32_MAX );
+    } else {
+      rings[ i ] = v3find( table, h->sectionCount, RRDBV3TOUCHRING, i, sizeof( uint32_t ), h->sampleCount );
+      if ( NULL == rings[ i ] ) rings[ i ] = v3find( table, h->sectionCount, RRDBV3TOUCHBINS, i, sizeof( rrdbTouchBin ), UINT32_MAX );
+    }
+    if ( NULL == rings[ i ] || rings[ i ]->length > touchRingSize( &shape ) ) goto done;
+    ringsize += touchV3Dense( rings[ i ] ) ? touchRingSize( &shape ) : touchRoomFor( &shape, rings[ i ]->count );
+  }
+  if ( ringsize > UINT32_MAX ) goto done;
+
+  size = sizeof( rrdbTouchHeader ) + h->setCount * sizeof( rrdbTouchSet ) + ringsize +
+         strings->count + ( NULL != sketch ? sizeof( rrdbTouchSketch ) : 0 );
+  out = calloc( 1, size );
+  if ( NULL == out ) goto done;
+
+  header = ( rrdbTouchHeader * ) out;
+  header->fileVersion = RRDBTOUCHV4;
+  header->sets = header->capacity = h->setCount;
+  header->samplesPerSet = h->sampleCount;
+  header->strings = strings->count;
+  header->values = shape.values;
+
+  const rrdbV3TouchEntry *entries = ( const rrdbV3TouchEntry * ) ( data + sets->offset );
+  for ( unsigned int i = 0; i < h->setCount; i++ ) {
+    const uint32_t *inring = ( const uint32_t * ) ( data + rings[ i ]->offset );
+    rrdbTouchSet *set = touchSetAt( header, i );
+    uint32_t *outring;
+
+    set->lastTouch = le64toh( entries[ i ].lastTouch );
+    set->hash = le64toh( entries[ i ].hash );
+    set->path = le32toh( entries[ i ].path );
+    set->length = le32toh( entries[ i ].length );
+    set->period = le32toh( entries[ i ].period );
+
+    set->ring = header->rings;
+    if ( touchV3Dense( rings[ i ] ) ) {
+      set->room = touchRingSize( header );
+      set->bins = TOUCHRINGDENSE;
+    } else {
+      set->room = touchRoomFor( header, rings[ i ]->count );
+      set->bins = rings[ i ]->count;
+    }
+    header->rings += set->room;
+
+    outring = touchSetRing( header, set );
+    if ( header->values ) v3getvaluebins( inring, ( rrdbTouchValueBin * ) outring, rings[ i ]->count );
+    else for ( uint64_t j = 0; j < rings[ i ]->length / sizeof( uint32_t ); j++ ) outring[ j ] = le32toh( inring[ j ] );
+  }
+
+  outstrings = out + touchStringsAt( header );
+  memcpy( outstrings, data + strings->offset, strings->count );
+  for ( uint64_t at = 0; at + sizeof( uint32_t ) <= header->strings; ) {
+    uint32_t length = le32toh( *( const uint32_t * ) ( outstrings + at ) );
+    *( uint32_t * ) ( outstrings + at ) = length;
+    at += touchStringSize( length );
+  }
+
+  if ( NULL != sketch ) {
+    const uint32_t *inwords = ( const uint32_t * ) ( data + sketch->offset );
+    uint32_t *words = ( uint32_t * ) ( out + size - sizeof( rrdbTouchSketch ) );
+    for ( unsigned int j = 0; j < sketch->count; j++ ) words[ j ] = le32toh( inwords[ j ] );
+  }
+
+  /* as every touch file is checked before its sets are looked at */
+  if ( touchFileValid( out, size ) && ( ssize_t ) size == pwrite( pfd, out, size, 0 ) ) retval = 1;
+
+done:
+  free( rings );
+  free( out );
+  return retval;
+}
+
+/**
+ * Decode a V3 file (size bytes at data, which must be 8 byte aligned) into the V1 or touch
+ * file it holds, written to the empty pfd.
+ * @return { int } 1 on success -1 on failure
+ */
+int rrdbV3Decode( const char *data, size_t size, int pfd ) {
+  const rrdbV3Header *in = ( const rrdbV3Header * ) data;
+  const rrdbV3Section *insections;
+  rrdbV3Section *table;
+  rrdbV3Header h;
+  int retval = -1;
+
+  if ( size < sizeof( rrdbV3Header ) || RRDBV3 != le32toh( in->fileVersion ) || RRDBV3MAGIC != le32toh( in->magic ) ) return -1;
+
+  h.kind = le32toh( in->kind );
+  h.sectionCount = le32toh( in->sectionCount );
+  h.windowPosition = le32toh( in->windowPosition );
+  h.setCount = le32toh( in->setCount );
+  h.sampleCount = le32toh( in->sampleCount );
+  h.xformCount = le32toh( in->xformCount );
+  h.sectionOffset = le64toh( in->sectionOffset );
+
+  if ( h.sectionOffset % sizeof( uint64_t ) || h.sectionOffset > size ||
+       ( size - h.sectionOffset ) / sizeof( rrdbV3Section ) < h.sectionCount ) return -1;
+
+  table = malloc( sizeof( rrdbV3Section ) * h.sectionCount + 1 );
+  if ( NULL == table ) return -1;
+
+  /* check every section is in the file and aligned before anything looks at them */
+  insections = ( const rrdbV3Section * ) ( data + h.sectionOffset );
+  for ( unsigned int i = 0; i < h.sectionCount; i++ ) {
+    table[ i ].type = le32toh( insections[ i ].type );
+    table[ i ].index = le32toh( insections[ i ].index );
+    table[ i ].width = le32toh( insections[ i ].width );
+    table[ i ].count = le32toh( insections[ i ].count );
+    table[ i ].offset = le64toh( insections[ i ].offset );
+    table[ i ].length = le64toh( insections[ i ].length );
+
+    if ( table[ i ].offset % RRDBV3ALIGN || table[ i ].offset > size || table[ i ].length > size - table[ i ].offset ||
+         table[ i ].length != ( uint64_t ) table[ i ].width * table[ i ].count ) goto done;
+  }
+
+  switch ( h.kind ) {
+    case RRDBV1:
+    case RRDBV5:
+      retval = v3decodeseries( data, &h, table, pfd );
+      break;
+    case RRDBTOUCHV2:
+      retval = v3decodetouchv2( data, &h, table, pfd );
+      break;
+    case RRDBTOUCHV4:
+      retval = v3decodetouch( data, &h, table, pfd );
+      break;
+  }
+
+done:
+  free( table );
+  return retval;
+}
+
+/**
+ * Replace filename, which we hold locked (lf), with data: written to a temporary file which
+ * is renamed over it. Anyone waiting for the lock finds the new file once they get it (see
+ * fastopenandlock), readers which already have the old one open keep reading it.
+ * @return { int } 1 on success -1 on failure
+ */
+static int renamecontents( locked_file_t *lf, const char *filename, char *data, size_t size ) {
+  char temp[ PATH_MAX ];
+  struct stat sb;
+  rrdbVersionHeader *v = ( rrdbVersionHeader * ) data;
+  int fd, retval = -1;
+
+  if ( size < sizeof( rrdbVersionHeader ) || -1 == fstat( lf->data_fd, &sb ) ) return -1;
+  if ( snprintf( temp, sizeof( temp ), "%s%s", filename, RRDBCONVERTTEMP ) >= ( int ) sizeof( temp ) ) return -1;
+
+  /* a new file has no writers */
+  if ( seqlocked( v->fileVersion ) ) v->seqBegin = v->seqEnd = 0;
+
+  fd = open( temp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, sb.st_mode & 0777 );
+  if ( -1 == fd ) return -1;
+
+  if ( 0 == fchmod( fd, sb.st_mode & 07777 ) && ( ssize_t ) size == pwrite( fd, data, size, 0 ) && 0 == fsync( fd ) ) retval = 1;
+  close( fd );
+
+  if ( 1 == retval && -1 == rename( temp, filename ) ) retval = -1;
+  if ( -1 == retval ) unlink( temp );
+  return retval;
+}
+
+/**
+ * Move the V1 or V5 file in *data to version, the other of the two. Only the header differs
+ * so everything after it moves along, and an archive's end with it.
+ * @return { int } 1 on success (*data replaced, of *size bytes) -1 on failure
+ */
+static int seriesrelayout( char **data, size_t *size, int version ) {
+  rrdbFile fileData;
+  rrdbArchiveHeader archive;
+  size_t from = seriesheadersize( *( int * ) *data ), to = seriesheadersize( version );
+  uint64_t base, xformsat;
+  char *out;
+
+  if ( *size < from ) return -1;
+
+  memset( &fileData, 0, sizeof( rrdbFile ) );
+  memcpy( &fileData.header, *data, from );
+  seriesheaderread( &fileData.header );
+  if ( fileData.header.setCount > MAXNUMSETS ) return -1;
+
+  xformsat = from + ( uint64_t ) fileData.header.sampleCount * ( sizeof( rrdbTimePoint ) + fileData.header.setCount * sizeof( rrdbNumber ) );
+  if ( xformsat + sizeof( rrdbXformsHeader ) > *size ) return -1;
+  memcpy( &fileData.xformheader, *data + xformsat, sizeof( rrdbXformsHeader ) );
+  base = v1FileSize( &fileData );
+
+  out = malloc( *size - from + to );
+  if ( NULL == out ) return -1;
+
+  if ( RRDBV1 == version ) {
+    rrdbHeaderV1 v1 = { RRDBV1, fileData.header.windowPosition, fileData.header.setCount, fileData.header.sampleCount };
+    memcpy( out, &v1, sizeof( v1 ) );
+  } else {
+    fileData.header.fileVersion = version;
+    memcpy( out, &fileData.header, sizeof( rrdbHeader ) );
+  }
+  memcpy( out + to, *data + from, *size - from );
+
+  if ( base + sizeof( archive ) <= *size ) {
+    memcpy( &archive, *data + base, sizeof( archive ) );
+    if ( RRDBARCHIVEMAGIC == archive.magic ) {
+      archive.end = archive.end - from + to;
+      memcpy( out + base - from + to, &archive, sizeof( archive ) );
+    }
+  }
+
+  free( *data );
+  *data = out;
+  *size = *size - from + to;
+  return 1;
+}
+
+/** @return { int } TRUE if the touch file pfd keeps values */
+static int touchfilevalues( int pfd ) {
+  rrdbTouchHeader header;
+  return sizeof( header ) == pread( pfd, &header, sizeof( header ), 0 ) && header.values;
+}
+
+/**
+ * V3 keeps values as doubles, V1 as long doubles - the sums and means of xforms mostly
+ * need more than a double has.
+ * @return { int } TRUE if every value of the V1 or V5 file pfd is a double as it is
+ */
+static int seriesfitsdoubles( int pfd ) {
+  rrdbFile fileData;
+  int fits = TRUE;
+
+  memset( &fileData, 0, sizeof( rrdbFile ) );
+  if ( -1 == readRRDBFile( pfd, &fileData ) ) return TRUE;
+
+  for ( unsigned int i = 0; fits && i < fileData.header.setCount + fileData.xformheader.xformCount; i++ ) {
+    const rrdbNumber *values = i < fileData.header.setCount ? fileData.sets[ i ] : fileData.xformdata[ i - fileData.header.setCount ];
+    for ( unsigned int j = 0; fits && j < fileData.header.sampleCount; j++ )
+      fits = isnan( values[ j ] ) || ( rrdbNumber ) ( double ) values[ j ] == values[ j ];
+  }
+
+  freeRRDBFile( &fileData );
+  return fits;
+}
+
+/**
+ * Convert filename (see convertRRDBFile), *bytes is the size it was.
+ * @return { int } 1 converted, 0 already version, -1 failed, -2 not a file we convert
+ */
+static int convertfile( const char *filename, int version, uint64_t *bytes ) {
+  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+  int stored, holds, working, decoded = -1, encoded = -1, lossy = FALSE, retval = -1;
+  char *data = NULL;
+  size_t size = 0;
+  struct stat sb;
+
+  if ( 0 != containeraddress( filename, NULL, 0, NULL ) ) {
+    rrdbprintf( "ERROR: series in a container can't be converted\n" );
+    return -1;
+  }
+
+  /* the file as it is on disk, not decoded */
+  if ( -1 == lockmanager->openandlock( &lf, filename, O_RDWR, TRUE ) ) {
+    rrdbprintf( "ERROR: failed to open %s\n", filename );
+    return -1;
+  }
+
+  *bytes = 0 == fstat( lf.data_fd, &sb ) ? sb.st_size : 0;
+  stored = holds = peekversion( lf.data_fd );
+  if ( !seriesversion( stored ) && RRDBTOUCHV2 != stored && RRDBV3 != stored && RRDBTOUCHV4 != stored ) {
+    rrdbprintf( "ERROR: %s isn't a V1, touch or V3 file\n", filename );
+    lockmanager->unlockandclose( &lf );
+    return -2;
+  }
+
+  /* what it holds - V1, V5 or a version 4 touch file */
+  if ( storedlayout( stored ) ) {
+    decoded = storeddecode( lf.data_fd );
+    holds = -1 == decoded ? -1 : peekversion( decoded );
+  }
+  working = -1 == decoded ? lf.data_fd : decoded;
+
+  if ( !seriesversion( holds ) && RRDBTOUCHV4 != holds ) {
+    rrdbprintf( "ERROR: failed to read %s\n", filename );
+  } else if ( seriesversion( holds ) && !seriesversion( version ) && RRDBV3 != version ) {
+    rrdbprintf( "ERROR: a V1 file converts to version %i, %i or %i\n", RRDBV1, RRDBV3, RRDBV5 );
+  } else if ( RRDBTOUCHV4 == holds && RRDBTOUCHV2 != version && RRDBV3 != version && RRDBTOUCHV4 != version ) {
+    rrdbprintf( "ERROR: a touch file converts to version %i, %i or %i\n", RRDBTOUCHV2, RRDBV3, RRDBTOUCHV4 );
+  } else if ( RRDBTOUCHV2 == version && touchfilevalues( working ) ) {
+    rrdbprintf( "ERROR: %s keeps values, which version %i can't\n", filename, RRDBTOUCHV2 );
+  } else if ( stored == version ) {
+    retval = 0;
+  } else {
+    if ( RRDBV3 == version ) {
+      lossy = seriesversion( holds ) && !seriesfitsdoubles( working );
+      if ( -1 == rrdbV3Encode( working, &data, &size ) ) data = NULL;
+    } else if ( RRDBTOUCHV2 == version ) {
+      encoded = touchV2Encode( working, &data, &size );
+      if ( 1 != encoded ) data = NULL;
+    } else if ( -1 == readcontents( working, &data, &size ) ) {
+      data = NULL;
+    } else if ( holds != version && -1 == seriesrelayout( &data, &size, version ) ) {
+      free( data );
+      data = NULL;
+    }
+
+    if ( 0 == encoded ) rrdbprintf( "ERROR: %s has a path too long for version %i\n", filename, RRDBTOUCHV2 );
+    else if ( NULL == data ) rrdbprintf( "ERROR: failed to convert %s\n", filename );
+    else if ( -1 == ( retval = renamecontents( &lf, filename, data, size ) ) ) rrdbprintf( "ERROR: failed to write %s\n", filename );
+    else if ( lossy ) rrdbprintf( "WARNING: %s has values version %i keeps less precisely\n", filename, RRDBV3 );
+  }
+
+  free( data );
+  if ( -1 != decoded ) close( decoded );
+  lockmanager->unlockandclose( &lf );
+  return retval;
+}
+
+/************************************************************************************
+ * Function: convertRRDBFile
+ *
+ * Purpose: Rewrite a V1 or touch file in another layout - RRDBV3, or back to the one
+ * it holds (RRDBV1, RRDBV5 or RRDBTOUCHV4) - a touch file can also go back to RRDBTOUCHV2
+ * if its paths fit. V1 and V5 convert to each other, V5 having the seqlock V1 lacks. The
+ * new file is written alongside and renamed over the old one while we hold its lock, so
+ * it can be converted while it is in use.
+ ************************************************************************************/
+int convertRRDBFile( char *filename, int version ) {
+  uint64_t bytes;
+
+  return convertfile( filename, version, &bytes ) < 0 ? -1 : 1;
+}
+
+/*
+ Converting a directory tree (convertRRDBTree). Each file is a job for a pool of workers
+ and each one done is appended to a journal (RRDBCONVERTJOURNAL at the top of the tree) so
+ a run which is stopped part way can be started again and pick up where it left off. The
+ journal goes once everything has converted.
+ */
+static int comparestrings( const void *a, const void *b ) {
+  return strcmp( *( char * const * ) a, *( char * const * ) b );
+}
+
+/**
+ * Read the paths a previous run to version finished, sorted. A journal for another version
+ * is no use to us.
+ * @return { int } 0 (with run->done and run->donecount) or -1 if there is nothing to resume
+ */
+static int convertresume( rrdbConvertRun *run, const char *journal ) {
+  char line[ PATH_MAX + 2 ];
+  unsigned int size = 0;
+  int version;
+  FILE *in = fopen( journal, "r" );
+
+  if ( NULL == in ) return -1;
+  if ( NULL == fgets( line, sizeof( line ), in ) || 1 != sscanf( line, "format:%i", &version ) || version != run->version ) {
+    fclose( in );
+    return -1;
+  }
+
+  while ( NULL != fgets( line, sizeof( line ), in ) ) {
+    line[ strcspn( line, "\n" ) ] = 0;
+    if ( 0 == line[ 0 ] ) continue;
+
+    if ( run->donecount == size ) {
+      size = MAX( 64, size * 2 );
+      char **done = realloc( run->done, sizeof( char * ) * size );
+      if ( NULL == done ) break;
+      run->done = done;
+    }
+
+    run->done[ run->donecount ] = strdup( line );
+    if ( NULL != run->done[ run->donecount ] ) run->donecount++;
+  }
+
+  fclose( in );
+  qsort( run->done, run->donecount, sizeof( char * ), comparestrings );
+  return 0;
+}
+
+static void convertjob( void *arg ) {
+  rrdbConvertJob *job = ( rrdbConvertJob * ) arg;
+  rrdbConvertRun *run = job->run;
+  char *message = NULL;
+  size_t messagelength = 0;
+  uint64_t bytes = 0;
+  int ret;
+
+  /* anything convertfile has to say goes to stderr with the file it is about */
+  FILE *stream = open_memstream( &message, &messagelength );
+  FILE *previous = rrdbsetoutput( NULL == stream ? stderr : stream );
+  ret = convertfile( job->path, run->version, &bytes );
+  rrdbsetoutput( previous );
+  if ( NULL != stream ) fclose( stream );
+
+  pthread_mutex_lock( &run->lock );
+  switch ( ret ) {
+    case 1:
+      run->converted++;
+      break;
+    case 0:
+      run->unchanged++;
+      break;
+    case -2:
+      run->skipped++;
+      break;
+    default:
+      run->failed++;
+      break;
+  }
+
+  if ( ret >= 0 ) {
+    run->bytes += bytes;
+    if ( NULL != run->journal ) {
+      fprintf( run->journal, "%s\n", job->path + run->dirlength + 1 );
+      fflush( run->journal );
+    }
+  } else if ( -1 == ret && NULL != message && messagelength > 0 ) {
+    fprintf( stderr, "%s", message );
+  }
+  pthread_mutex_unlock( &run->lock );
+
+  free( message );
+  free( job );
+}
+
+/* nftw has no argument for us */
+static __thread rrdbConvertRun *convertwalking = NULL;
+
+static int endswith( const char *name, size_t namelength, const char *suffix ) {
+  size_t length = strlen( suffix );
+  return namelength > length && 0 == strcmp( name + namelength - length, suffix );
+}
+
+/**
+ * @return { int } TRUE for the files we leave about the place (convert's and the debug lock manager's)
+ */
+static int sidefile( const char *name ) {
+  size_t namelength = strlen( name );
+  return 0 == strcmp( name, RRDBCONVERTJOURNAL ) || endswith( name, namelength, ".lock" ) || endswith( name, namelength, RRDBCONVERTTEMP );
+}
+
+static int convertvisit( const char *path, const struct stat *sb, int type, struct FTW *ftw ) {
+  rrdbConvertRun *run = convertwalking;
+  const char *name = path + ftw->base;
+  const char *relative = path + run->dirlength + 1;
+  rrdbConvertJob *job;
+
+  UNUSED( sb );
+  if ( FTW_F != type ) return 0;
+
+  /* ours, the debug lock manager's and containers */
+  if ( sidefile( name ) || endswith( name, strlen( name ), RRDBCONTAINERSUFFIX ) ) return 0;
+
+  if ( run->donecount > 0 && NULL != bsearch( &relative, run->done, run->donecount, sizeof( char * ), comparestrings ) ) {
+    run->resumed++;
+    return 0;
+  }
+
+  job = malloc( sizeof( rrdbConvertJob ) + strlen( path ) + 1 );
+  if ( NULL == job ) return 0;
+  job->run = run;
+  strcpy( job->path, path );
+
+  if ( NULL == run->pool || -1 == rrdbpoolsubmit( run->pool, convertjob, job ) ) convertjob( job );
+  return 0;
+}
+
+/************************************************************************************
+ * Function: convertRRDBTree
+ *
+ * Purpose: Convert every V1, touch and V3 file under dir to version (as convertRRDBFile)
+ * on threads workers, then report what happened and how fast.
+ ************************************************************************************/
+int convertRRDBTree( char *dir, int version, unsigned int threads ) {
+  rrdbConvertRun run;
+  char journal[ PATH_MAX ];
+  uint64_t started = monotonicns();
+  double seconds;
+  int walked;
+
+  if ( !seriesversion( version ) && RRDBTOUCHV2 != version && RRDBV3 != version && RRDBTOUCHV4 != version ) {
+    rrdbprintf( "ERROR: can't convert to version %i\n", version );
+    return -1;
+  }
+
+  memset( &run, 0, sizeof( run ) );
+  run.version = version;
+  run.dirlength = strlen( dir );
+  while ( run.dirlength > 1 && '/' == dir[ run.dirlength - 1 ] ) run.dirlength--;
+
+  if ( snprintf( journal, sizeof( journal ), "%.*s/%s", ( int ) run.dirlength, dir, RRDBCONVERTJOURNAL ) >= ( int ) sizeof( journal ) ) {
+    rrdbprintf( "ERROR: path too long\n" );
+    return -1;
+  }
+
+  run.journal = 0 == convertresume( &run, journal ) ? fopen( journal, "a" ) : fopen( journal, "w" );
+  if ( NULL == run.journal ) {
+    rrdbprintf( "ERROR: failed to open the journal %s\n", journal );
+    return -1;
+  }
+  if ( 0 == run.donecount ) fprintf( run.journal, "format:%i\n", version );
+  fflush( run.journal );
+
+  pthread_mutex_init( &run.lock, NULL );
+  if ( threads > 1 ) run.pool = rrdbpoolcreate( threads );
+
+  convertwalking = &run;
+  walked = nftw( dir, convertvisit, 16, FTW_PHYS );
+  convertwalking = NULL;
+
+  if ( NULL != run.pool ) rrdbpooldestroy( run.pool );
+  pthread_mutex_destroy( &run.lock );
+  fclose( run.journal );
+
+  for ( unsigned int i = 0; i < run.donecount; i++ ) free( run.done[ i ] );
+  free( run.done );
+
+  if ( -1 == walked ) {
+    rrdbprintf( "ERROR: failed to read the directory %s\n", dir );
+    return -1;
+  }
+
+  /* finished - the next run starts afresh */
+  if ( 0 == run.failed ) unlink( journal );
+
+  seconds = ( monotonicns() - started ) / 1e9;
+  rrdbprintf( "converted:%" PRIu64 "\n", run.converted );
+  rrdbprintf( "unchanged:%" PRIu64 "\n", run.unchanged );
+  rrdbprintf( "resumed:%" PRIu64 "\n", run.resumed );
+  rrdbprintf( "skipped:%" PRIu64 "\n", run.skipped );
+  rrdbprintf( "failed:%" PRIu64 "\n", run.failed );
+  rrdbprintf( "seconds:%.3f\n", seconds );
+  rrdbprintf( "filespersec:%.1f\n", ( run.converted + run.unchanged + run.skipped + run.failed ) / MAX( seconds, 1e-6 ) );
+  rrdbprintf( "mbpersec:%.1f\n", run.bytes / 1e6 / MAX( seconds, 1e-6 ) );
+
+  return 0 == run.failed ? 1 : -1;
+}
+
+/*
+ Scanning a directory tree (scanRRDBTree). The files are found first, then each is a job
+ for the pool which renders its record into a buffer - printed straight away, or once
+ the records before it have been if the output is ordered.
+ */
+static __thread rrdbScanRun *scanwalking = NULL;
+
+static int scanvisit( const char *path, const struct stat *sb, int type, struct FTW *ftw ) {
+  rrdbScanRun *run = scanwalking;
+
+  UNUSED( sb );
+  if ( FTW_F != type || sidefile( path + ftw->base ) ) return 0;
+
+  if ( run->count == run->size ) {
+    size_t size = MAX( 256, run->size * 2 );
+    rrdbScanJob *jobs = realloc( run->jobs, sizeof( rrdbScanJob ) * size );
+    if ( NULL == jobs ) return -1;
+    run->jobs = jobs;
+    run->size = size;
+  }
+
+  rrdbScanJob *job = &run->jobs[ run->count ];
+  memset( job, 0, sizeof( rrdbScanJob ) );
+  job->path = strdup( path );
+  if ( NULL == job->path ) return -1;
+  run->count++;
+  return 0;
+}
+
+static int comparescanjobs( const void *a, const void *b ) {
+  return strcmp( ( ( const rrdbScanJob * ) a )->path, ( ( const rrdbScanJob * ) b )->path );
+}
+
+/* each line of the record tagged with the file (as a pipe response), then END */
+static void scanprint( rrdbScanRun *run, rrdbScanJob *job ) {
+  const char *relative = job->path + run->dirlength + 1;
+  char *line = job->record;
+
+  while ( NULL != line && line < job->record + job->length ) {
+    char *end = memchr( line, '\n', job->record + job->length - line );
+    int length = NULL == end ? ( int ) ( job->record + job->length - line ) : ( int ) ( end - line );
+
+    fprintf( run->out, "@%s %.*s\n", relative, length, line );
+    line += length + 1;
+  }
+  fprintf( run->out, "@%s END\n", relative );
+
+  free( job->record );
+  job->record = NULL;
+}
+
+static void scanjob( void *arg ) {
+  rrdbScanJob *job = ( rrdbScanJob * ) arg;
+  rrdbScanRun *run = job->run;
+  int retval = 1;
+
+  FILE *stream = open_memstream( &job->record, &job->length );
+  if ( NULL == stream ) {
+    retval = -1;
+  } else {
+    FILE *previous = rrdbsetoutput( stream );
+    if ( run->info && -1 == printRRDBFileInfo( job->path ) ) retval = -1;
+    if ( run->fetch && -1 == runfetch( job->path, run->selector, run->period ) ) retval = -1;
+    rrdbsetoutput( previous );
+    fclose( stream );
+  }
+
+  pthread_mutex_lock( &run->lock );
+  if ( -1 == retval ) run->failed++;
+  job->done = TRUE;
+
+  if ( !run->ordered ) {
+    scanprint( run, job );
+  } else {
+    /* this and any after it which were waiting for it */
+    while ( run->printed < run->count && run->jobs[ run->printed ].done ) scanprint( run, &run->jobs[ run->printed++ ] );
+  }
+  pthread_mutex_unlock( &run->lock );
+}
+
+/************************************************************************************
+ * Function: scanRRDBTree
+ *
+ * Purpose: Run info and/or fetch (selector and period as fetch) on every file under dir
+ * on threads workers (0 for one a cpu), each file's output a record of lines tagged with
+ * its path. what is a comma list of info, fetch and ordered - records in path order
+ * rather than as they finish. Then how many there were and how fast.
+ ************************************************************************************/
+int scanRRDBTree( char *dir, char *what, char *selector, char *period, unsigned int threads ) {
+  rrdbScanRun run;
+  char *saveptr = NULL;
+  uint64_t started = monotonicns();
+  double seconds;
+  int walked;
+
+  memset( &run, 0, sizeof( run ) );
+  for ( char *w = strtok_r( what, ",", &saveptr ); NULL != w; w = strtok_r( NULL, ",", &saveptr ) ) {
+    if ( 0 == strcmp( "info", w ) ) run.info = TRUE;
+    else if ( 0 == strcmp( "fetch", w ) ) run.fetch = TRUE;
+    else if ( 0 == strcmp( "ordered", w ) ) run.ordered = TRUE;
+    else {
+      rrdbprintf( "ERROR: scan for info, fetch or ordered not '%s'\n", w );
+      return -1;
+    }
+  }
+  if ( !run.fetch ) run.info = TRUE;
+
+  run.selector = selector;
+  run.period = period;
+  run.out = NULL == outputstream ? stdout : outputstream;
+  run.dirlength = strlen( dir );
+  while ( run.dirlength > 1 && '/' == dir[ run.dirlength - 1 ] ) run.dirlength--;
+
+  scanwalking = &run;
+  walked = nftw( dir, scanvisit, 16, FTW_PHYS );
+  scanwalking = NULL;
+
+  if ( -1 == walked ) {
+    rrdbprintf( "ERROR: failed to read the directory %s\n", dir );
+  } else {
+    if ( run.ordered ) qsort( run.jobs, run.count, sizeof( rrdbScanJob ), comparescanjobs );
+
+    if ( 0 == threads ) threads = MAX( 1, sysconf( _SC_NPROCESSORS_ONLN ) );
+    rrdbPool *pool = threads > 1 && run.count > 1 ? rrdbpoolcreate( MIN( threads, run.count ) ) : NULL;
+
+    pthread_mutex_init( &run.lock, NULL );
+    for ( size_t i = 0; i < run.count; i++ ) {
+      run.jobs[ i ].run = &run;
+      if ( NULL == pool || -1 == rrdbpoolsubmit( pool, scanjob, &run.jobs[ i ] ) ) scanjob( &run.jobs[ i ] );
+    }
+    if ( NULL != pool ) rrdbpooldestroy( pool );
+    pthread_mutex_destroy( &run.lock );
+
+    seconds = ( monotonicns() - started ) / 1e9;
+    rrdbprintf( "files:%zu\n", run.count );
+    rrdbprintf( "failed:%" PRIu64 "\n", run.failed );
+    rrdbprintf( "seconds:%.3f\n", seconds );
+    rrdbprintf( "filespersec:%.1f\n", run.count / MAX( seconds, 1e-6 ) );
+  }
+
+  for ( size_t i = 0; i < run.count; i++ ) {
+    free( run.jobs[ i ].path );
+    free( run.jobs[ i ].record );
+  }
+  free( run.jobs );
+  return -1 == walked ? -1 : 1;
+}
+
+/**
+ * Parse xformations into the xform headers of fileData (xformCount of them), which takes the
+ * format of RRDBCOUNT:ONEHOUR:RRDBCOUNT:ONEDAY:RRDBMEAN:ONEDAY:0 - for all but RRDBCOUNT
+ * another param which is the index into the set. Says what is wrong with rrdbprintf.
+ * @return { int } 0 on success -1 on failure
+ */
+static int parseXforms( char *xformations, rrdbFile *fileData ) {
+  char *result = NULL;
+  char *saveptr = NULL;
+  const char delims[] = ":";
+  unsigned int i = 0;
+  unsigned int setIndexRequired;
+
+  fileData->xformheader.xformCount = 0;
+
+  result = strtok_r( xformations, delims, &saveptr );
+  while ( result ) {
+    if ( i >= MAXNUMSETS * MAXNUMXFORMPERSET ) {
+      rrdbprintf( "ERROR: too many xforms\n" );
+      return -1;
+    }
+
+    setIndexRequired = FALSE;
+
+    if ( 0 == strcmp("RRDBMAX", result)) {
+      fileData->xforms[i].calc = RRDBMAX;
+      setIndexRequired = TRUE;
+    } else if ( 0 == strcmp("RRDBMIN", result)) {
+      fileData->xforms[i].calc = RRDBMIN;
+      setIndexRequired = TRUE;
+    } else if ( 0 == strcmp("RRDBCOUNT", result)) {
+      fileData->xforms[i].calc = RRDBCOUNT;
+    } else if ( 0 == strcmp("RRDBMEAN", result)) {
+      fileData->xforms[i].calc = RRDBMEAN;
+      setIndexRequired = TRUE;
+    } else if ( 0 == strcmp("RRDBSUM", result)) {
+      fileData->xforms[i].calc = RRDBSUM;
+      setIndexRequired = TRUE;
+    } else {
+      rrdbprintf( "ERROR: unknown xform '%s'\n", result );
+      return -1;
+    }
+
+    /* then get the time span */
+    result = strtok_r( NULL, delims, &saveptr );
+    if ( NULL == result ) {
+      rrdbprintf( "ERROR: xform without a period\n" );
+      return -1;
+    }
+
+    int period = getPeriodFromName( result );
+    if ( -1 == period ) {
+      rrdbprintf( "ERROR: unknown period '%s'\n", result );
+      return -1;
+    }
+    fileData->xforms[i].period = period;
+
+    fileData->xforms[i].setIndex = 0;
+    fileData->xforms[i].windowPosition = 0;
+
+    if ( TRUE == setIndexRequired ) {
+      result = strtok_r( NULL, delims, &saveptr );
+      if ( NULL == result ) {
+        rrdbprintf( "ERROR: xform without a set index\n" );
+        return -1;
+      }
+      fileData->xforms[i].setIndex = atoi(result);
+    }
+
+    i++;
+    /* we can repeat until we get all of xforms required */
+
+    result = strtok_r( NULL, delims, &saveptr );
+  }
+
+  fileData->xformheader.xformCount = i;
+  return 0;
+}
+
+/**
+ * Initialize a file with zeroed out data. Locks the file. This function
+ * must not output error as this is the job of the caller.
+ * Written: 9th March 2013 By: Nick Knight
+ * @returns { int } - an open file or -1 on failure.
+ */
+locked_file_t initRRDBFile(char *filename, unsigned int setCount, unsigned int sampleCount , char *xformations) {
+
+  locked_file_t pfd;
+  rrdbFile fileData;
+  long long totalSizeRequired;
+  unsigned int setCountSize;
+
+  pfd = createopenandlock( filename );
+  if( -1 == pfd.data_fd ) return pfd;
+
+  unsigned int i;
+
+  /* every build reads V1 - the seqlock of V5 is for convert to add */
+  fileData.header.fileVersion = RRDBV1;
+  fileData.header.windowPosition = 0;
+  fileData.header.setCount = setCount;
+  fileData.header.sampleCount = sampleCount;
+  fileData.xformheader.xformCount = 0;
+
+  /* read time data */
+  totalSizeRequired = (fileData.header.sampleCount * sizeof (rrdbTimePoint));
+
+  fileData.times = malloc(totalSizeRequired);
+  memset(fileData.times, 0, totalSizeRequired);
+
+
+  /* data sets */
+  setCountSize = ( fileData.header.sampleCount * sizeof (rrdbNumber));
+  for ( i = 0 ; i < fileData.header.setCount; i++ ) {
+    fileData.sets[i] = malloc(setCountSize);
+    memset(fileData.sets[i], 0, setCountSize);
+  }
+
+  /* now xform data */
+  if ( -1 == parseXforms( xformations, &fileData ) ) {
+    pfd = unlockandclose( pfd );
+    freeRRDBFile(&fileData);
+    return pfd;
+  }
+
+  for ( i = 0; i < fileData.xformheader.xformCount; i++ ) {
+    fileData.xformdata[i] = malloc(setCountSize);
+    memset(fileData.xformdata[i], 0, setCountSize);
+
+    fileData.xformtimes[i] = malloc(totalSizeRequired);
+    memset(fileData.xformtimes[i], 0, totalSizeRequired);
+  }
+
+  if ( -1 == writeRRDBFile( pfd.data_fd, &fileData ) ) {
+    pfd = unlockandclose( pfd );
+  }
+  freeRRDBFile(&fileData);
+
+  return pfd;
+}
+
+
+/*
+ I/O layer. Reads and writes of RRDB files are described as a batch of vectored
+ requests and handed to rrdbiosubmit. When built with liburing (the Makefile probes
+ for it) the whole batch - possibly covering many files - is queued on an io_uring
+ and submitted with a single syscall, we then reap the completions in whatever order
+ they arrive. Without liburing, or if the ring cannot be set up on this kernel, we
+ fall back to blocking preadv/pwritev - still one syscall per file section rather
+ than one per array.
+ */
+static size_t rrdbiolength( const rrdbIoRequest *req ) {
+  size_t total = 0;
+  for ( int i = 0; i < req->iovcnt; i++ ) total += req->iov[ i ].iov_len;
+  return total;
+}
+
+/**
+ * Complete a request (from 'done' bytes in) with blocking calls.
+ * @return { ssize_t } bytes transferred in total or -1
+ */
+static ssize_t rrdbioblocking( rrdbIoRequest *req, size_t done ) {
+  struct iovec iov[ RRDBMAXIOV ];
+  int iovcnt = 0;
+  size_t skip = done;
+  ssize_t amount;
+
+  if ( req->iovcnt > RRDBMAXIOV ) return -1;
+
+  for ( int i = 0; i < req->iovcnt; i++ ) {
+    if ( skip >= req->iov[ i ].iov_len ) {
+      skip -= req->iov[ i ].iov_len;
+      continue;
+    }
+    iov[ iovcnt ].iov_base = ( char * ) req->iov[ i ].iov_base + skip;
+    iov[ iovcnt ].iov_len = req->iov[ i ].iov_len - skip;
+    skip = 0;
+    iovcnt++;
+  }
+
+  int first = 0;
+  while ( first < iovcnt ) {
+    if ( req->write )
+      amount = pwritev( req->fd, &iov[ first ], iovcnt - first, req->offset + done );
+    else
+      amount = preadv( req->fd, &iov[ first ], iovcnt - first, req->offset + done );
+
+    if ( amount < 0 && EINTR == errno ) continue;
+    if ( amount <= 0 ) break; /* error or EOF - caller sees the short count */
+
+    done += amount;
+    while ( first < iovcnt && ( size_t ) amount >= iov[ first ].iov_len ) {
+      amount -= iov[ first ].iov_len;
+      first++;
+    }
+    if ( first < iovcnt ) {
+      iov[ first ].iov_base = ( char * ) iov[ first ].iov_base + amount;
+      iov[ first ].iov_len -= amount;
+    }
+  }
+
+  return done;
+}
+
+#ifdef HAVE_LIBURING
+/* one ring per thread, so worker threads don't have to share */
+static __thread struct io_uring ring;
+/* 0 = not tried yet, 1 = ready, -1 = unavailable (use the blocking path) */
+static __thread int ringstate = 0;
+
+static int rrdbiouring( rrdbIoRequest *reqs, unsigned int count ) {
+  struct io_uring_cqe *cqe;
+  unsigned int submitted = 0, completed = 0;
+
+  if ( 0 == ringstate ) {
+    ringstate = ( 0 == io_uring_queue_init( RRDBURINGDEPTH, &ring, 0 ) ) ? 1 : -1;
+  }
+  if ( 1 != ringstate ) return -1;
+
+  while ( completed < count ) {
+    /* queue as many as the ring will take */
+    while ( submitted < count ) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe( &ring );
+      if ( NULL == sqe ) break;
+
+      rrdbIoRequest *req = &reqs[ submitted ];
+      if ( req->write )
+        io_uring_prep_writev( sqe, req->fd, req->iov, req->iovcnt, req->offset );
+      else
+        io_uring_prep_readv( sqe, req->fd, req->iov, req->iovcnt, req->offset );
+      io_uring_sqe_set_data( sqe, req );
+      submitted++;
+    }
+
+    if ( io_uring_submit_and_wait( &ring, 1 ) < 0 ) {
+      /* don't trust the ring again, everything we do is positional so can be redone */
+      io_uring_queue_exit( &ring );
+      ringstate = -1;
+      return -1;
+    }
+
+    while ( completed < submitted && 0 == io_uring_peek_cqe( &ring, &cqe ) ) {
+      rrdbIoRequest *req = io_uring_cqe_get_data( cqe );
+      req->result = cqe->res;
+      io_uring_cqe_seen( &ring, cqe );
+      completed++;
+    }
+  }
+
+  return 0;
+}
+#endif
+
+/**
+ * Submit a batch of requests and wait for them all to complete. Each request's result
+ * is the number of bytes transferred (short or -1 on failure) - it is for the caller to check.
+ * @return { int } 0
+ */
+int rrdbiosubmit( rrdbIoRequest *reqs, unsigned int count ) {
+  unsigned int i;
+
+  if ( 0 == count ) return 0;
+  __atomic_fetch_add( &lockstats.iosubmits, 1, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &lockstats.iorequests, count, __ATOMIC_RELAXED );
+  atomicmax( &lockstats.iomaxbatch, count );
+
+#ifdef HAVE_LIBURING
+  if ( 0 == rrdbiouring( reqs, count ) ) {
+    /* a ring can legitimately return a short transfer, finish those off */
+    for ( i = 0; i < count; i++ ) {
+      if ( reqs[ i ].result >= 0 && ( size_t ) reqs[ i ].result < rrdbiolength( &reqs[ i ] ) )
+        reqs[ i ].result = rrdbioblocking( &reqs[ i ], reqs[ i ].result );
+    }
+    return 0;
+  }
+#endif
+
+  for ( i = 0; i < count; i++ ) {
+    reqs[ i ].result = rrdbioblocking( &reqs[ i ], 0 );
+  }
+
+  return 0;
+}
+
+static int rrdbiocomplete( const rrdbIoRequest *req ) {
+  return req->result >= 0 && ( size_t ) req->result == rrdbiolength( req );
+}
+
+/************************************************************************************
+ * Function: writeRRDBFiles
+ *
+ * Purpose: Write the contents of a number of RRDB strctures to their files in one
+ * batch. A file which fails to write has its pfds entry set to -1, one which is
+ * already -1 is skipped.
+ *
+ * @returns { int } the number of files written successfully
+ ************************************************************************************/
+int writeRRDBFiles(int *pfds, rrdbFile *fileData, unsigned int count)
+{
+  long long totalSizeRequired;
+  long long setCountSize;
+  unsigned int i, f, pendingcount = 0;
+  int written = 0;
+
+  struct iovec *iov = malloc( sizeof( struct iovec ) * RRDBMAXIOV * count );
+  rrdbIoRequest *reqs = malloc( sizeof( rrdbIoRequest ) * count );
+  rrdbVersionHeader *seq = malloc( sizeof( rrdbVersionHeader ) * count );
+  rrdbHeaderV1 *v1 = malloc( sizeof( rrdbHeaderV1 ) * count );
+  unsigned int *pending = malloc( sizeof( unsigned int ) * count );
+
+  if ( NULL == iov || NULL == reqs || NULL == seq || NULL == v1 || NULL == pending ) {
+    free( iov );
+    free( reqs );
+    free( seq );
+    free( v1 );
+    free( pending );
+    return 0;
+  }
+
+  for ( f = 0; f < count; f++ ) {
+    if ( -1 == pfds[ f ] ) continue;
+
+    struct iovec *fiov = &iov[ f * RRDBMAXIOV ];
+    rrdbFile *file = &fileData[ f ];
+    int n = 0;
+
+    /* tell lock free readers we are writing, the header we write keeps the counters as they now are */
+    if ( -1 == seqwritebegin( pfds[ f ], &seq[ f ] ) ) memset( &seq[ f ], 0, sizeof( rrdbVersionHeader ) );
+    file->header.seqBegin = seq[ f ].seqBegin;
+    file->header.seqEnd = seq[ f ].seqEnd;
+
+    totalSizeRequired = ( file->header.sampleCount * sizeof (rrdbTimePoint));
+    setCountSize = ( file->header.sampleCount * sizeof (rrdbNumber));
+
+    if ( RRDBV1 == file->header.fileVersion ) {
+      v1[ f ] = ( rrdbHeaderV1 ) { RRDBV1, file->header.windowPosition, file->header.setCount, file->header.sampleCount };
+      fiov[ n++ ] = ( struct iovec ) { &v1[ f ], sizeof( rrdbHeaderV1 ) };
+    } else {
+      fiov[ n++ ] = ( struct iovec ) { &file->header, sizeof( rrdbHeader ) };
+    }
+    /* time points ( and valid flags etc ) */
+    fiov[ n++ ] = ( struct iovec ) { file->times, totalSizeRequired };
+
+    for ( i = 0 ; i < file->header.setCount; i++ )
+      fiov[ n++ ] = ( struct iovec ) { file->sets[ i ], setCountSize };
+
+    /* now our xform data */
+    fiov[ n++ ] = ( struct iovec ) { &file->xformheader, sizeof( rrdbXformsHeader ) };
+    for ( i = 0 ; i < file->xformheader.xformCount; i++ ) {
+      fiov[ n++ ] = ( struct iovec ) { &file->xforms[ i ], sizeof( rrdbXformHeader ) };
+      fiov[ n++ ] = ( struct iovec ) { file->xformtimes[ i ], totalSizeRequired };
+      fiov[ n++ ] = ( struct iovec ) { file->xformdata[ i ], setCountSize };
+    }
+
+    reqs[ pendingcount ] = ( rrdbIoRequest ) { .fd = pfds[ f ], .iov = fiov, .iovcnt = n, .offset = 0, .write = TRUE };
+    pending[ pendingcount++ ] = f;
+  }
+
+  rrdbiosubmit( reqs, pendingcount );
+
+  for ( i = 0; i < pendingcount; i++ ) {
+    f = pending[ i ];
+    if ( rrdbiocomplete( &reqs[ i ] ) ) {
+      seqwriteend( pfds[ f ], &seq[ f ] );
+      fileData[ f ].header.seqEnd = seq[ f ].seqEnd;
+      written++;
+    } else {
+      rrdbprintf("ERROR: failed to write data to RRDB file\n");
+      pfds[ f ] = -1;
+    }
+  }
+
+  free( iov );
+  free( reqs );
+  free( seq );
+  free( v1 );
+  free( pending );
+  return written;
+}
+
+/************************************************************************************
+ * Function: writeRRDBFile
+ *
+ * Purpose: Write the contents of an RRDB strcture to a file.
+ *
+ * Written: 9th March 2013 By: Nick Knight
+ ************************************************************************************/
+int writeRRDBFile(int pfd, rrdbFile *fileData)
+{
+  if ( 1 != writeRRDBFiles( &pfd, fileData, 1 ) ) return -1;
+  return pfd;
+}
+
+/************************************************************************************
+ * Function: readRRDBFiles
+ *
+ * Purpose: Read the contents of a number of RRDB files into memory. The sections are
+ * read in three batches across all of the files: headers, then times, sets and the
+ * xform header (whose sizes we now know), then the xforms themselves. A file which
+ * fails to read has its pfds entry set to -1 and its memory released.
+ *
+ * @returns { int } the number of files read successfully
+ ************************************************************************************/
+int readRRDBFiles(int *pfds, rrdbFile *fileData, unsigned int count) {
+
+  long long totalSizeRequired;
+  long long setCountSize;
+  unsigned int i, f;
+  int goodcount = 0;
+
+  struct iovec *iov = malloc( sizeof( struct iovec ) * RRDBMAXIOV * count );
+  rrdbIoRequest *reqs = malloc( sizeof( rrdbIoRequest ) * count );
+  unsigned int *pending = malloc( sizeof( unsigned int ) * count );
+  unsigned int pendingcount;
+
+  if ( NULL == iov || NULL == reqs || NULL == pending ) {
+    free( iov );
+    free( reqs );
+    free( pending );
+    return 0;
+  }
+
+  /* headers */
+  pendingcount = 0;
+  for ( f = 0; f < count; f++ ) {
+    if ( -1 == pfds[ f ] ) continue;
+    iov[ f * RRDBMAXIOV ] = ( struct iovec ) { &fileData[ f ].header, sizeof( rrdbHeader ) };
+    reqs[ pendingcount ] = ( rrdbIoRequest ) { .fd = pfds[ f ], .iov = &iov[ f * RRDBMAXIOV ], .iovcnt = 1, .offset = 0 };
+    pending[ pendingcount++ ] = f;
+  }
+  rrdbiosubmit( reqs, pendingcount );
+
+  for ( i = 0; i < pendingcount; i++ ) {
+    f = pending[ i ];
+    /* a V1 header is shorter, so a file with little else has less to read than we asked for */
+    if ( reqs[ i ].result < ( ssize_t ) sizeof( rrdbHeaderV1 ) ||
+         reqs[ i ].result < ( ssize_t ) seriesheadersize( fileData[ f ].header.fileVersion ) ) {
+      rrdbprintf("ERROR: failed to read a RRDB header - there must be one??\n");
+      pfds[ f ] = -1;
+      continue;
+    }
+
+    seriesheaderread( &fileData[ f ].header );
+    if( fileData[ f ].header.setCount > MAXNUMSETS ) {
+      rrdbprintf("ERROR: RRDB header data corrupt\n");
+      fileData[ f ].header.setCount = 0;
+      pfds[ f ] = -1;
+    }
+  }
+
+  /* time data, data sets and the xform header */
+  pendingcount = 0;
+  for ( f = 0; f < count; f++ ) {
+    if ( -1 == pfds[ f ] ) continue;
+
+    rrdbFile *file = &fileData[ f ];
+    struct iovec *fiov = &iov[ f * RRDBMAXIOV ];
+    int n = 0;
+
+    totalSizeRequired = ( file->header.sampleCount * sizeof (rrdbTimePoint));
+    setCountSize = ( file->header.sampleCount * sizeof (rrdbNumber));
+
+    file->times = malloc(totalSizeRequired);
+    fiov[ n++ ] = ( struct iovec ) { file->times, totalSizeRequired };
+
+    for ( i = 0 ; i < file->header.setCount; i++ ) {
+      file->sets[i] = malloc(setCountSize);
+      fiov[ n++ ] = ( struct iovec ) { file->sets[ i ], setCountSize };
+    }
+
+    fiov[ n++ ] = ( struct iovec ) { &file->xformheader, sizeof( rrdbXformsHeader ) };
+
+    reqs[ pendingcount ] = ( rrdbIoRequest ) { .fd = pfds[ f ], .iov = fiov, .iovcnt = n, .offset = seriesheadersize( file->header.fileVersion ) };
+    pending[ pendingcount++ ] = f;
+  }
+  rrdbiosubmit( reqs, pendingcount );
+
+  for ( i = 0; i < pendingcount; i++ ) {
+    f = pending[ i ];
+    if ( !rrdbiocomplete( &reqs[ i ] ) ) {
+      rrdbprintf("ERROR: failed to read set data from RRDB file\n");
+    } else if ( fileData[ f ].xformheader.xformCount > MAXNUMSETS * MAXNUMXFORMPERSET ) {
+      rrdbprintf("ERROR: RRDB xform header data corrupt\n");
+    } else {
+      continue;
+    }
+
+    fileData[ f ].xformheader.xformCount = 0;
+    freeRRDBFile( &fileData[ f ] );
+    pfds[ f ] = -1;
+  }
+
+  /* we have some xformations */
+  pendingcount = 0;
+  for ( f = 0; f < count; f++ ) {
+    if ( -1 == pfds[ f ] ) continue;
+
+    rrdbFile *file = &fileData[ f ];
+    struct iovec *fiov = &iov[ f * RRDBMAXIOV ];
+    int n = 0;
+
+    if ( 0 == file->xformheader.xformCount ) continue;
+
+    totalSizeRequired = ( file->header.sampleCount * sizeof (rrdbTimePoint));
+    setCountSize = ( file->header.sampleCount * sizeof (rrdbNumber));
+
+    for ( i = 0 ; i < file->xformheader.xformCount; i++ ) {
+      file->xformtimes[i] = malloc(totalSizeRequired);
+      file->xformdata[i] = malloc(setCountSize);
+
+      fiov[ n++ ] = ( struct iovec ) { &file->xforms[ i ], sizeof( rrdbXformHeader ) };
+      fiov[ n++ ] = ( struct iovec ) { file->xformtimes[ i ], totalSizeRequired };
+      fiov[ n++ ] = ( struct iovec ) { file->xformdata[ i ], setCountSize };
+    }
+
+    reqs[ pendingcount ] = ( rrdbIoRequest ) { .fd = pfds[ f ], .iov = fiov, .iovcnt = n,
+                                               .offset = seriesheadersize( file->header.fileVersion ) + totalSizeRequired +
+                                                         ( setCountSize * file->header.setCount ) +
+                                                         sizeof( rrdbXformsHeader ) };
+    pending[ pendingcount++ ] = f;
+  }
+  rrdbiosubmit( reqs, pendingcount );
+
+  for ( i = 0; i < pendingcount; i++ ) {
+    f = pending[ i ];
+    if ( !rrdbiocomplete( &reqs[ i ] ) ) {
+      rrdbprintf("ERROR: failed to read xform data from RRDB file\n");
+      freeRRDBFile( &fileData[ f ] );
+      pfds[ f ] = -1;
+    }
+  }
+
+  for ( f = 0; f < count; f++ ) {
+    if ( -1 != pfds[ f ] ) goodcount++;
+  }
+
+  free( iov );
+  free( reqs );
+  free( pending );
+  return goodcount;
+}
+
+/************************************************************************************
+ * Function: readRRDBFile
+ *
+ * Purpose: Read the contents of an RRDB file into memory.
+ *
+ * Written: 9th March 2013 By: Nick Knight
+ ************************************************************************************/
+int readRRDBFile(int pfd, rrdbFile *fileData) {
+  if ( 1 != readRRDBFiles( &pfd, fileData, 1 ) ) return -1;
+  return pfd;
+}
+
+/************************************************************************************
+ * Function: writeRRDBFile
+ *
+ * Purpose: Print the info about an RRDB file.
+ *
+ * Written: 10th March 2013 By: Nick Knight
+ ************************************************************************************/
+int printRRDBFileInfo(char *filename)
+{
+  rrdbFile fileData;
+  unsigned int i;
+  locked_file_t pfd = snapshotopen( filename );
+
+  if( -1 == pfd.data_fd ) {
+    rrdbprintf("ERROR: failed to open %s\n", filename);
+    return -1;
+  }
+
+  if ( RRDBCONTAINER == getFileVersion( pfd.data_fd ) ) {
+    int retval = printContainerInfo( pfd.data_fd );
+    unlockandclose( pfd );
+    return retval;
+  }
+
+  if ( RRDBTOUCHV4 == getFileVersion( pfd.data_fd ) ) {
+    rrdbTouchHeader *ourtouchheader;
+    rrdbTouchSet *setHeader;
+    struct stat sb;
+    char *addr;
+    unsigned int loopcount;
+
+    if ( fstat( pfd.data_fd, &sb ) == -1 ) { /* To obtain file size */
+      rrdbprintf("ERROR: cannot stat RRDB file\n");
+      unlockandclose( pfd );
+      return -1;
+    }
+
+    addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, pfd.data_fd, 0);
+    if (addr == MAP_FAILED) {
+      rrdbprintf("ERROR: error accessing data file.\n");
+      fprintf(stderr, "error - mmap failed while accessing data file for printing: %s (errno=%d)\n", strerror(errno), errno);
+      unlockandclose( pfd );
+      return -1;
+    }
+
+    ourtouchheader = ( rrdbTouchHeader * ) addr;
+    if ( !touchFileValid( addr, sb.st_size ) ) {
+      rrdbprintf( "ERROR: RRDB header data corrupt\n" );
+      munmap( addr, sb.st_size );
+      unlockandclose( pfd );
+      return -1;
+    }
+
+    rrdbprintf( "2:%i:%i\n", touchSetsInUse( ourtouchheader ), ourtouchheader->samplesPerSet );
+
+    for ( loopcount = 0; loopcount < ourtouchheader->sets; loopcount++ ) {
+      setHeader = touchSetAt( ourtouchheader, loopcount );
+      if ( 0 != setHeader->length ) rrdbprintf("%s:%i\n", touchSetPath( ourtouchheader, setHeader ), getTimePerSample( setHeader->period ) );
+    }
+
+    munmap( ( char * ) addr, sb.st_size );
+
+    unlockandclose( pfd );
+    return 1;
+  }
+
+  memset( &fileData, 0, sizeof( rrdbFile ) );
+  if( -1 == readRRDBFile(pfd.data_fd, &fileData) ) {
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  rrdbprintf("Version is %i\n", fileData.header.fileVersion);
+  rrdbprintf("Number of sets %i\n", fileData.header.setCount);
+  rrdbprintf("Number of samples %i\n", fileData.header.sampleCount);
+  rrdbprintf("Current window position %i\n", fileData.header.windowPosition);
+  rrdbprintf("Contains #%i xformations\n", fileData.xformheader.xformCount);
+
+  for ( i = 0 ; i < fileData.xformheader.xformCount; i++ ) {
+    switch(fileData.xforms[i].calc) {
+      case RRDBMAX:
+        rrdbprintf("RRDBMAX:");
+        break;
+
+      case RRDBMIN:
+        rrdbprintf("RRDBMIN:");
+        break;
+
+      case RRDBCOUNT:
+        rrdbprintf("RRDBCOUNT:");
+        break;
+
+      case RRDBMEAN:
+        rrdbprintf("RRDBMEAN:");
+        break;
+
+      case RRDBSUM:
+        rrdbprintf("RRDBSUM:");
+        break;
+
+      default:
+        break;
+    }
+
+    switch(fileData.xforms[i].period) {
+      case FIVEMINUTE:
+        rrdbprintf("FIVEMINUTE\n");
+        break;
+
+      case QUARTERHOUR:
+        rrdbprintf("QUARTERHOUR\n");
+        break;
+
+      case ONEHOUR:
+        rrdbprintf("ONEHOUR\n");
+        break;
+
+      case SIXHOUR:
+        rrdbprintf("SIXHOUR\n");
+        break;
+
+      case TWELVEHOUR:
+        rrdbprintf("TWELVEHOUR\n");
+        break;
+
+      case ONEDAY:
+        rrdbprintf("ONEDAY\n");
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  rrdbArchiveHeader archive;
+  uint64_t archivebase;
+  if ( 1 == readArchiveHeader( pfd.data_fd, &fileData, &archive, &archivebase ) ) {
+    rrdbprintf("Archived #%" PRIu64 " points in #%u blocks (%" PRIu64 " bytes)\n", archive.points, archive.blockCount,
+               archive.end - archiveStageOffset( archivebase, archive.xformCount ) );
+  }
+
+  if ( 0 != pfd.stored ) rrdbprintf("Stored as version %i\n", pfd.stored);
+
+  freeRRDBFile(&fileData);
+  unlockandclose( pfd );
+
+  return 1;
+}
+
+/************************************************************************************
+ * Function: modifyRRDBFile
+ * Written: 22nd June 2021 By: Nick Knight
+ ************************************************************************************/
+int modifyRRDBFile(char *filename, char* vals, char* xform) {
+
+  rrdbFile fileData;
+  int ixform;
+
+  locked_file_t pfd = readwriteopenandlock( filename );
+  if ( -1 == pfd.data_fd ) {
+    rrdbprintf( "ERROR: failed to open %s\n", filename );
+    return -1;
+  }
+
+  if ( RRDBTOUCHV4 == getFileVersion( pfd.data_fd ) ) {
+    rrdbprintf("Unsupported version V2\n");
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  memset( &fileData, 0, sizeof( rrdbFile ) );
+  if( -1 == readRRDBFile(pfd.data_fd, &fileData) ) {
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  rrdbprintf("Version is %i\n", fileData.header.fileVersion);
+  rrdbprintf("Number of sets %i\n", fileData.header.setCount);
+  rrdbprintf("Number of samples %i\n", fileData.header.sampleCount);
+  rrdbprintf("Current window position %i\n", fileData.header.windowPosition);
+  rrdbprintf("Contains #%i xformations\n", fileData.xformheader.xformCount);
+
+  // vals == "time:val" i.e. "1234:111"
+  // OR
+  // 1234.33:111 - raw data has a usec component also
+  char *token;
+  char *saveptr = NULL;
+  time_t indextime = 0;
+  rrdbTimemSeconds usec = 0;
+
+  if( NULL != strchr( vals, '.' ) ) {
+    token = strtok_r( vals, ".", &saveptr );
+    indextime = atol( token );
+
+    token = strtok_r( NULL, ":", &saveptr );
+    usec = atoi( token );
+  } else {
+    token = strtok_r( vals, ":", &saveptr );
+    indextime = atol( token );
+  }
+  token = strtok_r( NULL, ":", &saveptr );
+  long double newvalue = atof( token );
+
+  if( strlen(xform) > 0 ) {
+    ixform = atoi(xform);
+    rrdbprintf("Modifying xform %i, time %ld, new value %Lf\n", ixform, indextime, newvalue );
+
+    if( ixform > fileData.xformheader.xformCount ) {
+      rrdbprintf("xform out of range\n");
+      freeRRDBFile(&fileData);
+      unlockandclose( pfd );
+      return -1;
+    }
+
+    for ( int i = 0 ; i < fileData.header.sampleCount; i++ ) {
+      if( indextime == fileData.xformtimes[ixform][i].time ) {
+        rrdbprintf("Modifying %ld:%Lf\n", fileData.xformtimes[ixform][i].time, fileData.xformdata[ixform][i] );
+        fileData.xformdata[ixform][i] = newvalue;
+        goto finishmodify;
+      }
+    }
+
+    freeRRDBFile(&fileData);
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  rrdbprintf("Modifying raw data, time %ld.%i, with new value %Lf\n", indextime, usec, newvalue );
+  for ( int i = 0 ; i < fileData.header.sampleCount; i++ ) {
+    if ( 1 == fileData.times[i].valid ) {
+      if( indextime == fileData.times[i].time &&
+          usec == fileData.times[i].uSecs ) {
+        for ( int j = 0 ; j < fileData.header.setCount; j++ ) {
+          rrdbprintf("Modifying raw data time %ld.%i ;old value %Lf; new value %Lf\n", fileData.times[i].time, fileData.times[i].uSecs, fileData.sets[j][i], newvalue );
+          fileData.sets[j][i] = newvalue;
+        }
+        goto finishmodify;
+      }
+    }
+  }
+
+  goto finishnomodify;
+
+finishmodify:
+
+  if ( -1 == writeRRDBFile(pfd.data_fd, &fileData) )
+    fprintf( stderr, "Could not write data to RRDB file\n");
+
+finishnomodify:
+
+  freeRRDBFile(&fileData);
+  unlockandclose( pfd );
+
+  return 1;
+}
+
+
+/**
+ * The start of the period (RRDBTimePeriods) which when falls in - the time an xform
+ * point is kept against.
+ * @return { time_t }
+ */
+static time_t xformStart( unsigned int period, time_t when ) {
+  struct tm *current_tm, current_tm_r;
+
+  current_tm = gmtime_r(&when, &current_tm_r);
+
+  switch (period) {
+    case FIVEMINUTE:
+      current_tm->tm_sec = 0;
+      /* move to the start of the nearest 5 minutes */
+      current_tm->tm_min = ((int)(current_tm->tm_min/5))*5;
+      return mktime(current_tm);
+
+    case QUARTERHOUR:
+      current_tm->tm_sec = 0;
+      current_tm->tm_min = ((int)(current_tm->tm_min/15))*15;
+      return mktime(current_tm);
+
+    case ONEHOUR:
+      current_tm->tm_sec = 0;
+      current_tm->tm_min = 0;
+      return mktime(current_tm);
+
+    case SIXHOUR:
+      current_tm->tm_sec = 0;
+      current_tm->tm_min = 0;
+      current_tm->tm_hour = ((int)(current_tm->tm_hour/6))*6;
+      return mktime(current_tm);
+
+    case TWELVEHOUR:
+      current_tm->tm_sec = 0;
+      current_tm->tm_min = 0;
+      current_tm->tm_hour = ((int)(current_tm->tm_hour/12))*12;
+      return mktime(current_tm);
+
+    case ONEDAY:
+      current_tm->tm_sec = 0;
+      current_tm->tm_min = 0;
+      current_tm->tm_hour = 0;
+      return mktime(current_tm);
+
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+/**
+ * Fold value into xform i (written to outindex) at writeWindowPosition, which is the
+ * next point in the ring if movedon, for the period starting at start.
+ */
+static void xformFold( rrdbFile *fileData, unsigned int i, unsigned int outindex, rrdbNumber value, time_t start,
+                       unsigned int writeWindowPosition, int movedon ) {
+  rrdbNumber xformResult = 0;
+
+  switch (fileData->xforms[i].calc) {
+    case RRDBMAX:
+      if( TRUE == movedon )
+        xformResult = value;
+      else
+        xformResult = MAX( value, fileData->xformdata[i][writeWindowPosition] );
+      break;
+
+    case RRDBMIN:
+      if( TRUE == movedon )
+        xformResult = value;
+      else
+        xformResult = MIN( value, fileData->xformdata[i][writeWindowPosition] );
+      break;
+
+    case RRDBCOUNT:
+      if( TRUE == movedon )
+        xformResult = 1;
+      else
+        xformResult = fileData->xformdata[i][writeWindowPosition] + 1;
+
+      break;
+
+    case RRDBMEAN:
+    {
+      unsigned int countWindowPosition = (writeWindowPosition + 1) % fileData->header.sampleCount;
+      if( TRUE == movedon ) {
+        /* We use the next slot to store our running count so we can add to the average - and hide it */
+        fileData->xformtimes[i][countWindowPosition].valid = FALSE;
+        fileData->xformdata[i][countWindowPosition] = 1;
+        xformResult = value;
+      } else {
+        rrdbNumber countinmean = fileData->xformdata[i][countWindowPosition];
+        if( countinmean <= 0 ) countinmean = 1; /* allow for corruption */
+        rrdbNumber reversemean = fileData->xformdata[i][writeWindowPosition] * countinmean;
+        xformResult = ( reversemean + value ) / ( countinmean + 1 );
+
+        fileData->xformdata[i][countWindowPosition]++;
+      }
+      break;
+    }
+    case RRDBSUM:
+      if( TRUE == movedon )
+        xformResult = value;
+      else
+        xformResult = value + fileData->xformdata[i][writeWindowPosition];
+      break;
+
+    default:
+      break;
+  }
+
+  fileData->xformdata[ outindex ][ writeWindowPosition ] = xformResult;
+  fileData->xformtimes[ outindex ][ writeWindowPosition ].time = start;
+  fileData->xformtimes[ outindex ][ writeWindowPosition ].uSecs = 0;
+  fileData->xformtimes[ outindex ][ writeWindowPosition ].valid = TRUE;
+  fileData->xforms[ outindex ].windowPosition = writeWindowPosition;
+}
+
+/************************************************************************************
+ * Function: updateRRDBFile
+ *
+ * Purpose: Update a file with the supplied values. The vals are a string of seperated
+ * values in the format of num:num:num, 1 for each set we have in the file.
+ *
+ * Written: 9th March 2013 By: Nick Knight
+ ************************************************************************************/
+int updateRRDBFile(char *filename, char* vals) {
+  rrdbNumber values[MAXNUMSETS];
+  unsigned int count = 0;
+  char *result = NULL;
+  char *saveptr = NULL;
+  const char delims[] = ":";
+
+  result = strtok_r( vals, delims, &saveptr );
+  while ( NULL != result && count < MAXNUMSETS ) {
+    values[count++] = atof(result);
+    result = strtok_r( NULL, delims, &saveptr );
+  }
+
+  return updateRRDBFileValues( filename, values, count );
+}
+
+/**
+ * One update of the V1 file pfd, read into fileData: the next row of the ring and every
+ * xform folded on. Points about to fall off the xform rings are archived first if the
+ * file keeps them, the caller writes fileData back.
+ */
+static void applyRRDBUpdate( int pfd, char *filename, rrdbFile *fileData, rrdbNumber *values, unsigned int count ) {
+  struct timeval t1;
+  time_t xformstart;
+  time_t current_time;
+
+  /* points about to fall off the xform rings, if we are keeping them */
+  rrdbArchiveHeader archive;
+  uint64_t archivebase;
+  int archived = 1 == readArchiveHeader( pfd, fileData, &archive, &archivebase );
+  rrdbArchivePoint evicted[ MAXNUMSETS * MAXNUMXFORMPERSET * 2 ];
+  unsigned int evictedxform[ MAXNUMSETS * MAXNUMXFORMPERSET * 2 ];
+  unsigned int evictedcount = 0;
+
+  /*
+    Move round on 1
+    */
+  fileData->header.windowPosition = ( fileData->header.windowPosition + 1 ) % fileData->header.sampleCount;
+
+  /*
+    times
+  */
+
+  fileData->times[fileData->header.windowPosition].valid = 1;
+  gettimeofday(&t1, NULL);
+  fileData->times[fileData->header.windowPosition].time = t1.tv_sec;
+  fileData->times[fileData->header.windowPosition].uSecs = t1.tv_usec;
+
+
+  for ( unsigned int i = 0 ; i < fileData->header.setCount; i++ ) {
+    if ( i < count )
+      fileData->sets[i][fileData->header.windowPosition] = values[i];
+    else
+      fileData->sets[i][fileData->header.windowPosition] = 0;
+  }
+
+  /*
+    * Now we need to update our xformations (xforms) current_tm->tm_hour = 0;
+    */
+  current_time = t1.tv_sec;
+
+  for ( unsigned int i = 0, outindex = 0; i < fileData->xformheader.xformCount; i++) {
+    xformstart = xformStart( fileData->xforms[i].period, current_time );
+
+    /*
+      The value should be placed in the current windowed position, if still valid (i.e. updated)
+      or if it is now outside the time window moved on 1.
+      */
+    unsigned int writeWindowPosition = fileData->xforms[i].windowPosition;
+    int movedon = FALSE;
+    if( fileData->xformtimes[i][fileData->xforms[i].windowPosition].time != xformstart ) {
+      /* we need to move on the window... */
+      writeWindowPosition = (fileData->xforms[i].windowPosition + 1 ) % fileData->header.sampleCount;
+      movedon = TRUE;
+    }
+
+    if( archived && movedon ) {
+      /* the oldest point and, for a mean, the one after which holds the running count */
+      unsigned int slots[ 2 ] = { writeWindowPosition, ( writeWindowPosition + 1 ) % fileData->header.sampleCount };
+      unsigned int slotcount = RRDBMEAN == fileData->xforms[i].calc ? 2 : 1;
+
+      for ( unsigned int s = 0; s < slotcount; s++ ) {
+        if ( !fileData->xformtimes[i][ slots[ s ] ].valid ) continue;
+        evictedxform[ evictedcount ] = i;
+        evicted[ evictedcount++ ] = ( rrdbArchivePoint ) { fileData->xformtimes[i][ slots[ s ] ].time, ( double ) fileData->xformdata[i][ slots[ s ] ] };
+      }
+    }
+
+    unsigned int setindex = fileData->xforms[i].setIndex;
+
+    if( setindex > MAXNUMSETS || NULL == fileData->sets[ setindex ] ) {
+      fprintf( stderr, "Invalid xform - xforms incorrectly setup index at %i  with setcount %i in file %s (ignoring)\n", setindex, fileData->header.setCount, filename );
+    } else {
+      xformFold( fileData, i, outindex, fileData->sets[setindex][fileData->header.windowPosition], xformstart, writeWindowPosition, movedon );
+      outindex++;
+    }
+  }
+
+  if ( evictedcount > 0 ) {
+    rrdbVersionHeader seq;
+    /* writeRRDBFiles ends the write (seqEnd catches up with both begins) */
+    seqwritebegin( pfd, &seq );
+    for ( unsigned int i = 0; i < evictedcount; i++ ) {
+      if ( -1 == archivePoint( pfd, &archive, archivebase, evictedxform[ i ], evicted[ i ].time, evicted[ i ].value ) ) {
+        fprintf( stderr, "failed to archive a point in %s\n", filename );
+      }
+    }
+  }
+}
+
+/************************************************************************************
+ * Function: updateRRDBFileValues
+ *
+ * Purpose: Update a file with the supplied values. At the moment read, modify then
+ * write, so could have performance improved by more clever manipulation of the file.
+ * It will also ripple the data down to depenant files also. Any set we are not given
+ * a value for is set to 0.
+ *
+ * Written: 9th March 2013 By: Nick Knight
+ ************************************************************************************/
+int updateRRDBFileValues(char *filename, rrdbNumber *values, unsigned int count) {
+  int status;
+
+  updateRRDBFilesValues( &filename, &values, &count, 1, &status );
+  return status;
+}
+
+/************************************************************************************
+ * Function: updateRRDBFilesValues
+ *
+ * Purpose: A number of updates (as updateRRDBFileValues), possibly to different files.
+ * They are taken a batch at a time - up to a file the batch already has, so updates to
+ * the same file happen in order - and each batch is read and written through the I/O
+ * layer together, one request a file. A batch is locked in name order so two of us
+ * can't each hold a file the other is waiting for. status[ i ] is 1 or -1 for each.
+ *
+ * @returns { int } the number of updates which failed
+ ************************************************************************************/
+int updateRRDBFilesValues( char **filenames, rrdbNumber **values, unsigned int *counts, unsigned int n, int *status ) {
+  unsigned int order[ RRDBUPDATEBATCH ];
+  locked_file_t pfds[ RRDBUPDATEBATCH ];
+  int fds[ RRDBUPDATEBATCH ], loaded[ RRDBUPDATEBATCH ];
+  unsigned int failed = 0;
+
+  rrdbFile *files = malloc( sizeof( rrdbFile ) * RRDBUPDATEBATCH );
+  if ( NULL == files ) {
+    rrdbprintf( "ERROR: out of memory\n" );
+    for ( unsigned int i = 0; i < n; i++ ) status[ i ] = -1;
+    return n;
+  }
+
+  for ( unsigned int next = 0; next < n; ) {
+    unsigned int batch = 0, k;
+
+    /* kept in name order as we go */
+    for ( ; next < n && batch < RRDBUPDATEBATCH; next++ ) {
+      int cmp = 1;
+      for ( k = 0; k < batch && ( cmp = strcmp( filenames[ order[ k ] ], filenames[ next ] ) ) < 0; k++ );
+      if ( 0 == cmp ) break;
+      memmove( &order[ k + 1 ], &order[ k ], sizeof( unsigned int ) * ( batch - k ) );
+      order[ k ] = next;
+      batch++;
+    }
+
+    memset( files, 0, sizeof( rrdbFile ) * batch );
+    for ( k = 0; k < batch; k++ ) {
+      pfds[ k ] = readwriteopenandlock( filenames[ order[ k ] ] );
+      fds[ k ] = pfds[ k ].data_fd;
+      if ( -1 == fds[ k ] ) {
+        fprintf( stderr, "failed to open %s for O_RDWR\n", filenames[ order[ k ] ] );
+        rrdbprintf( "ERROR: failed to open %s for O_RDWR\n", filenames[ order[ k ] ] );
+      }
+    }
+
+    /*
+      read in the headers to get the window positions and make
+      sure the set counts are correct
+      */
+    readRRDBFiles( fds, files, batch );
+    for ( k = 0; k < batch; k++ ) {
+      unsigned int u = order[ k ];
+
+      loaded[ k ] = -1 != fds[ k ];
+      if ( loaded[ k ] ) applyRRDBUpdate( fds[ k ], filenames[ u ], &files[ k ], values[ u ], counts[ u ] );
+      else if ( -1 != pfds[ k ].data_fd ) fprintf( stderr, "failed to read %s\n", filenames[ u ] );
+    }
+
+    /* Now write them */
+    writeRRDBFiles( fds, files, batch );
+
+    for ( k = 0; k < batch; k++ ) {
+      status[ order[ k ] ] = -1 == fds[ k ] ? -1 : 1;
+      if ( -1 == fds[ k ] ) failed++;
+      if ( loaded[ k ] ) freeRRDBFile( &files[ k ] );
+      unlockandclose( pfds[ k ] );
+    }
+  }
+
+  free( files );
+  return failed;
+}
+
+/**
+ * The valid points of a ring, oldest first (the one after position is the oldest).
+ * @return { unsigned int } how many there are in order
+ */
+static unsigned int ringOrder( const rrdbTimePoint *times, unsigned int count, unsigned int position, unsigned int *order ) {
+  unsigned int n = 0;
+
+  for ( unsigned int p = 1; p <= count; p++ ) {
+    unsigned int index = ( position + p ) % count;
+    if ( times[ index ].valid ) order[ n++ ] = index;
+  }
+  return n;
+}
+
+/**
+ * Lay out the archive of a reshaped file at base: the old archive (old, read from oldbase) with
+ * its stages and blocks moved to the xforms which carry them on (carry) and those of removed
+ * xforms dropped.
+ * @return { int } 1 on success -1 on failure
+ */
+static int reshapeArchive( int pfd, rrdbArchiveHeader *archive, uint64_t base, const char *old, uint64_t oldbase,
+                           const int *carry, unsigned int xformCount ) {
+  const rrdbArchiveHeader *from = ( const rrdbArchiveHeader * ) old;
+  rrdbArchiveStage empty;
+  uint64_t offset = archiveStageOffset( oldbase, from->xformCount ) - oldbase;
+  int *moved = malloc( sizeof( int ) * ( from->xformCount + 1 ) );
+
+  if ( NULL == moved ) return -1;
+  memset( &empty, 0, sizeof( empty ) );
+
+  memset( archive, 0, sizeof( rrdbArchiveHeader ) );
+  archive->magic = RRDBARCHIVEMAGIC;
+  archive->xformCount = xformCount;
+  archive->end = archiveStageOffset( base, xformCount );
+
+  for ( unsigned int j = 0; j < from->xformCount; j++ ) moved[ j ] = -1;
+  for ( unsigned int k = 0; k < xformCount; k++ ) {
+    const void *stage = &empty;
+
+    if ( -1 != carry[ k ] && ( unsigned int ) carry[ k ] < from->xformCount ) {
+      moved[ carry[ k ] ] = k;
+      stage = old + archiveStageOffset( oldbase, carry[ k ] ) - oldbase;
+    }
+    if ( sizeof( rrdbArchiveStage ) != pwrite( pfd, stage, sizeof( rrdbArchiveStage ), archiveStageOffset( base, k ) ) ) goto failed;
+  }
+
+  for ( unsigned int b = 0; b < from->blockCount; b++ ) {
+    rrdbArchiveBlock block;
+
+    memcpy( &block, old + offset, sizeof( block ) );
+    if ( block.xform < from->xformCount && -1 != moved[ block.xform ] ) {
+      size_t length = sizeof( block ) + block.bytes;
+
+      block.xform = moved[ block.xform ];
+      if ( sizeof( block ) != pwrite( pfd, &block, sizeof( block ), archive->end ) ||
+           ( ssize_t ) block.bytes != pwrite( pfd, old + offset + sizeof( block ), block.bytes, archive->end + sizeof( block ) ) ) goto failed;
+
+      archive->end += length;
+      archive->blockCount++;
+      archive->points += block.points;
+    }
+    offset += sizeof( block ) + block.bytes;
+  }
+
+  free( moved );
+  return sizeof( rrdbArchiveHeader ) == pwrite( pfd, archive, sizeof( rrdbArchiveHeader ), base ) ? 1 : -1;
+
+failed:
+  free( moved );
+  return -1;
+}
+
+/************************************************************************************
+ * Function: reshapeRRDBFile
+ *
+ * Purpose: Change the geometry of a V1 file - the samples in its rings, its sets and
+ * its xforms (xformations as create, "" to keep them or NONE for none) - keeping what
+ * it holds, in one pass under its lock. A 0 count keeps the one it has. An xform in
+ * both keeps its points (the newest which fit, those which don't go to the archive if
+ * there is one), a new one is worked out from the raw points we have.
+ ************************************************************************************/
+int reshapeRRDBFile( char *filename, unsigned int setCount, unsigned int sampleCount, char *xformations ) {
+  rrdbFile from, to;
+  rrdbArchiveHeader archive;
+  rrdbVersionHeader seq;
+  uint64_t base = 0, end;
+  char *oldarchive = NULL;
+  unsigned int *order = NULL;
+  rrdbArchivePoint *evicted = NULL;
+  unsigned int *evictedxform = NULL;
+  unsigned int evictedcount = 0;
+  int carry[ MAXNUMSETS * MAXNUMXFORMPERSET ];
+  int used[ MAXNUMSETS * MAXNUMXFORMPERSET ];
+  int archived, retval = -1;
+
+  memset( &from, 0, sizeof( rrdbFile ) );
+  memset( &to, 0, sizeof( rrdbFile ) );
+
+  locked_file_t pfd = readwriteopenandlock( filename );
+  if ( -1 == pfd.data_fd ) {
+    rrdbprintf( "ERROR: failed to open %s\n", filename );
+    return -1;
+  }
+
+  if ( !seriesversion( getFileVersion( pfd.data_fd ) ) ) {
+    rrdbprintf( "ERROR: only V1 files can be reshaped\n" );
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  if ( -1 == readRRDBFile( pfd.data_fd, &from ) ) {
+    rrdbprintf( "ERROR: failed to read %s\n", filename );
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  unsigned int n = from.header.sampleCount;
+
+  to.header = from.header;
+  if ( 0 != sampleCount ) to.header.sampleCount = sampleCount;
+  if ( 0 != setCount ) to.header.setCount = setCount;
+
+  if ( to.header.setCount > MAXNUMSETS ) {
+    rrdbprintf( "ERROR: a file can have at most %i sets\n", MAXNUMSETS );
+    goto done;
+  }
+
+  if ( 0 == strcmp( "NONE", xformations ) ) {
+    to.xformheader.xformCount = 0;
+  } else if ( 0 == xformations[ 0 ] ) {
+    to.xformheader = from.xformheader;
+    memcpy( to.xforms, from.xforms, sizeof( rrdbXformHeader ) * from.xformheader.xformCount );
+  } else if ( -1 == parseXforms( xformations, &to ) ) {
+    goto done;
+  }
+
+  unsigned int m = to.header.sampleCount;
+  if ( 0 == m ) {
+    rrdbprintf( "ERROR: sample count too small, must be more than zero.\n" );
+    goto done;
+  }
+
+  /* the mean keeps its running count in the slot after the newest point */
+  for ( unsigned int k = 0; k < to.xformheader.xformCount; k++ ) {
+    if ( to.xforms[ k ].setIndex >= to.header.setCount && RRDBCOUNT != to.xforms[ k ].calc ) {
+      rrdbprintf( "ERROR: xform %u is of set %u which the file won't have\n", k, to.xforms[ k ].setIndex );
+      goto done;
+    }
+    if ( RRDBMEAN == to.xforms[ k ].calc && m < 2 ) {
+      rrdbprintf( "ERROR: sample count too small for a mean\n" );
+      goto done;
+    }
+  }
+
+  /* which xforms carry on - the same calculation over the same period of the same set */
+  memset( used, 0, sizeof( used ) );
+  for ( unsigned int k = 0; k < to.xformheader.xformCount; k++ ) {
+    carry[ k ] = -1;
+    for ( unsigned int j = 0; j < from.xformheader.xformCount; j++ ) {
+      if ( used[ j ] || from.xforms[ j ].calc != to.xforms[ k ].calc || from.xforms[ j ].period != to.xforms[ k ].period ||
+           from.xforms[ j ].setIndex != to.xforms[ k ].setIndex ) continue;
+      used[ j ] = TRUE;
+      carry[ k ] = j;
+      break;
+    }
+  }
+
+  to.times = calloc( m, sizeof( rrdbTimePoint ) );
+  order = malloc( sizeof( unsigned int ) * n );
+  evicted = malloc( sizeof( rrdbArchivePoint ) * n * MAX( 1, to.xformheader.xformCount ) );
+  evictedxform = malloc( sizeof( unsigned int ) * n * MAX( 1, to.xformheader.xformCount ) );
+  int allocated = NULL != to.times && NULL != order && NULL != evicted && NULL != evictedxform;
+  for ( unsigned int i = 0; i < to.header.setCount; i++ ) {
+    to.sets[ i ] = calloc( m, sizeof( rrdbNumber ) );
+    allocated = allocated && NULL != to.sets[ i ];
+  }
+  for ( unsigned int k = 0; k < to.xformheader.xformCount; k++ ) {
+    to.xformtimes[ k ] = calloc( m, sizeof( rrdbTimePoint ) );
+    to.xformdata[ k ] = calloc( m, sizeof( rrdbNumber ) );
+    allocated = allocated && NULL != to.xformtimes[ k ] && NULL != to.xformdata[ k ];
+  }
+  if ( !allocated ) {
+    rrdbprintf( "ERROR: out of memory\n" );
+    goto done;
+  }
+
+  /* the newest raw points which fit, from the start of the ring */
+  unsigned int count = ringOrder( from.times, n, from.header.windowPosition, order );
+  unsigned int keep = MIN( count, m );
+  for ( unsigned int r = 0; r < keep; r++ ) {
+    unsigned int src = order[ count - keep + r ];
+
+    to.times[ r ] = from.times[ src ];
+    for ( unsigned int i = 0; i < to.header.setCount && i < from.header.setCount; i++ ) to.sets[ i ][ r ] = from.sets[ i ][ src ];
+  }
+  to.header.windowPosition = keep > 0 ? keep - 1 : 0;
+
+  for ( unsigned int k = 0; k < to.xformheader.xformCount; k++ ) {
+    rrdbXformHeader *x = &to.xforms[ k ];
+    x->windowPosition = 0;
+
+    if ( -1 != carry[ k ] ) {
+      unsigned int j = carry[ k ];
+      unsigned int room = RRDBMEAN == x->calc ? m - 1 : m;
+
+      count = ringOrder( from.xformtimes[ j ], n, from.xforms[ j ].windowPosition, order );
+      keep = MIN( count, room );
+
+      for ( unsigned int r = 0; r < count - keep; r++ ) {
+        evictedxform[ evictedcount ] = k;
+        evicted[ evictedcount++ ] = ( rrdbArchivePoint ) { from.xformtimes[ j ][ order[ r ] ].time, ( double ) from.xformdata[ j ][ order[ r ] ] };
+      }
+
+      for ( unsigned int r = 0; r < keep; r++ ) {
+        to.xformtimes[ k ][ r ] = from.xformtimes[ j ][ order[ count - keep + r ] ];
+        to.xformdata[ k ][ r ] = from.xformdata[ j ][ order[ count - keep + r ] ];
+      }
+
+      if ( keep > 0 ) {
+        x->windowPosition = keep - 1;
+        if ( RRDBMEAN == x->calc ) {
+          to.xformdata[ k ][ keep ] = from.xformdata[ j ][ ( from.xforms[ j ].windowPosition + 1 ) % n ];
+          to.xformtimes[ k ][ keep ].valid = FALSE;
+        }
+      }
+    } else if ( x->setIndex < from.header.setCount ) {
+      /* new - as if it had been there for every update we still have */
+      count = ringOrder( from.times, n, from.header.windowPosition, order );
+      for ( unsigned int r = 0; r < count; r++ ) {
+        time_t start = xformStart( x->period, from.times[ order[ r ] ].time );
+        unsigned int write = x->windowPosition;
+        int movedon = FALSE;
+
+        if ( to.xformtimes[ k ][ write ].time != start ) {
+          write = ( write + 1 ) % m;
+          movedon = TRUE;
+        }
+        xformFold( &to, k, k, from.sets[ x->setIndex ][ order[ r ] ], start, write, movedon );
+      }
+    }
+  }
+
+  /* keep the archive, if there is one, which starts wherever the xforms now end */
+  archived = readArchiveHeader( pfd.data_fd, &from, &archive, &base );
+  if ( -1 == archived ) {
+    rrdbprintf( "ERROR: failed to read %s\n", filename );
+    goto done;
+  }
+
+  uint64_t oldbase = base;
+  if ( 1 == archived ) {
+    size_t length = archive.end - oldbase;
+
+    oldarchive = malloc( length );
+    if ( NULL == oldarchive || ( ssize_t ) length != pread( pfd.data_fd, oldarchive, length, oldbase ) ) {
+      rrdbprintf( "ERROR: failed to read the archive of %s\n", filename );
+      goto done;
+    }
+  }
+
+  base = v1FileSize( &to );
+  end = base;
+
+  /* writeRRDBFile ends the write */
+  seqwritebegin( pfd.data_fd, &seq );
+  if ( 1 == archived ) {
+    if ( -1 == reshapeArchive( pfd.data_fd, &archive, base, oldarchive, oldbase, carry, to.xformheader.xformCount ) ) {
+      rrdbprintf( "ERROR: failed to write the archive of %s\n", filename );
+      seqwriteend( pfd.data_fd, &seq );
+      goto done;
+    }
+
+    for ( unsigned int i = 0; i < evictedcount; i++ ) {
+      if ( -1 == archivePoint( pfd.data_fd, &archive, base, evictedxform[ i ], evicted[ i ].time, evicted[ i ].value ) ) {
+        fprintf( stderr, "failed to archive a point in %s\n", filename );
+      }
+    }
+    end = archive.end;
+  }
+
+  if ( -1 == ftruncate( pfd.data_fd, end ) || -1 == writeRRDBFile( pfd.data_fd, &to ) ) {
+    rrdbprintf( "ERROR: failed to write %s\n", filename );
+    goto done;
+  }
+  retval = 1;
+
+done:
+  free( oldarchive );
+  free( order );
+  free( evicted );
+  free( evictedxform );
+  freeRRDBFile( &from );
+  freeRRDBFile( &to );
+  unlockandclose( pfd );
+  return retval;
+}
+
+/************************************************************************************
+ * Function: getFileVersion
+ *
+ * Purpose: Load the first Int in a file which indicates which file type.
+ *
+ * Written: 19th April 2017 By: Nick Knight
+ ************************************************************************************/
+int getFileVersion(int pfd)
+{
+  int version;
+
+  if( sizeof( version ) != pread( pfd, &version, sizeof( version ), 0 ) ) {
+    fprintf( stderr, "Failed to read file in getFileVersion\n");
+    return -1;
+  }
+  return version;
+}
+
+/************************************************************************************
+ * Function: getTimePerSample
+ *
+ * Purpose: Get the number of samples per period.
+ *
+ * Written: 19th April 2017 By: Nick Knight
+ ************************************************************************************/
+unsigned int getTimePerSample(unsigned int period)
+{
+  switch( period )
+  {
+    case FIVEMINUTE:
+      return 60 * 5;
+      break;
+
+    case QUARTERHOUR:
+      return 60 * 15;
+      break;
+
+    case ONEHOUR:
+      return 60 * 60;
+      break;
+
+    case SIXHOUR:
+      return 60 * 60 * 6;
+      break;
+
+    case TWELVEHOUR:
+      return 60 * 60 * 12;
+      break;
+
+    case ONEDAY:
+      return 60 * 60 * 24;
+      break;
+  }
+
+  /* Default */
+  return 60 * 60 * 24;
+}
+
+/**
+ * touchSet for a file which keeps values. The bins are whole rrdbTouchValueBin sparse or
+ * dense, and a dense bin is started again (rather than the ring cleared as it moves on)
+ * when its tick isn't the one being touched.
+ * @return { int } as touchSet
+ */
+static int touchSetValues( rrdbTouchHeader *header, rrdbTouchSet *setHeader, void *ring, rrdbInt count, const rrdbTouchValues *values, time_t when ) {
+  const time_t tps = getTimePerSample( setHeader->period );
+  const time_t now_tick = when / tps;
+  const time_t last_tick = setHeader->lastTouch / tps;
+  const unsigned int N = header->samplesPerSet;
+  rrdbTouchValueBin *bins = ring, *bin;
+
+  if ( NULL == values || last_tick - now_tick >= ( time_t ) N ) return 0;
+
+  if ( TOUCHRINGDENSE != setHeader->bins ) {
+    const time_t first = MAX( now_tick, last_tick ) - ( time_t ) N + 1;
+    unsigned int drop = 0, at;
+
+    while ( drop < setHeader->bins && ( time_t ) bins[ drop ].tick < first ) drop++;
+    if ( drop > 0 ) {
+      memmove( bins, bins + drop, ( setHeader->bins - drop ) * sizeof( rrdbTouchValueBin ) );
+      setHeader->bins -= drop;
+    }
+
+    for ( at = setHeader->bins; at > 0 && ( time_t ) bins[ at - 1 ].tick > now_tick; --at );
+
+    if ( 0 == at || ( time_t ) bins[ at - 1 ].tick != now_tick ) {
+      if ( ( setHeader->bins + 1 ) * sizeof( rrdbTouchValueBin ) > setHeader->room ) return -1;
+      memmove( bins + at + 1, bins + at, ( setHeader->bins - at ) * sizeof( rrdbTouchValueBin ) );
+      memset( &bins[ at ], 0, sizeof( rrdbTouchValueBin ) );
+      bins[ at ].tick = ( uint32_t ) now_tick;
+      setHeader->bins++;
+      at++;
+    }
+    bin = &bins[ at - 1 ];
+  } else {
+    bin = &bins[ now_tick % N ];
+    if ( ( time_t ) bin->tick != now_tick ) {
+      memset( bin, 0, sizeof( rrdbTouchValueBin ) );
+      bin->tick = ( uint32_t ) now_tick;
+    }
+  }
+
+  touchValuesAdd( &bin->values, bin->count, values );
+  bin->count += count;
+  if ( when > setHeader->lastTouch ) __atomic_store_n( &setHeader->lastTouch, when, __ATOMIC_RELAXED );
+  return 1;
+}
+
+/************************************************************************************
+ * Function: touchSet
+ *
+ * Purpose: We have a set to update, clear some variables back to zero, and add count
+ * to the bin for time when. If when is older than the last touch it is added to its
+ * (historical) bin, as long as that bin is still inside the ring.
+ *
+ * A sparse ring drops the bins which have rolled out of the ring and adds when's bin,
+ * in order, if it hasn't got it - if it has no room for it the caller grows it
+ * (growtouchring) and tries again.
+ *
+ * A file which keeps values adds what values came to as well (touchSetValues).
+ *
+ * Written: 8th April 2017 By: Nick Knight
+ * @returns { int } 1, 0 if when is too old to be kept or -1 if a sparse ring is full
+ ************************************************************************************/
+int touchSet(rrdbTouchHeader *header, rrdbTouchSet *setHeader, void *ring, rrdbInt count, const rrdbTouchValues *values, time_t when)
+{
+    const time_t tps       = getTimePerSample(setHeader->period);
+    const time_t now_tick  = when / tps;
+    const time_t last_tick = setHeader->lastTouch / tps;
+
+    const unsigned int N = header->samplesPerSet;
+    rrdbInt *setdata = ring;
+
+    if (header->values) return touchSetValues(header, setHeader, ring, count, values, when);
+
+    if (TOUCHRINGDENSE != setHeader->bins) {
+        rrdbTouchBin *bins = ring;
+        const time_t first = MAX(now_tick, last_tick) - (time_t)N + 1;
+        unsigned int drop = 0, at;
+
+        if (last_tick - now_tick >= (time_t)N) return 0;
+
+        while (drop < setHeader->bins && (time_t)bins[drop].tick < first) drop++;
+        if (drop > 0) {
+            memmove(bins, bins + drop, (setHeader->bins - drop) * sizeof(rrdbTouchBin));
+            setHeader->bins -= drop;
+        }
+
+        // Nearly always the newest bin, so look from the end
+        for (at = setHeader->bins; at > 0 && (time_t)bins[at - 1].tick > now_tick; --at);
+
+        if (0 == at || (time_t)bins[at - 1].tick != now_tick) {
+            if ((setHeader->bins + 1) * sizeof(rrdbTouchBin) > setHeader->room) return -1;
+            memmove(bins + at + 1, bins + at, (setHeader->bins - at) * sizeof(rrdbTouchBin));
+            bins[at].tick = (uint32_t)now_tick;
+            bins[at].count = 0;
+            setHeader->bins++;
+            at++;
+        }
+
+        bins[at - 1].count += count;
+        if (when > setHeader->lastTouch) __atomic_store_n(&setHeader->lastTouch, when, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    // Same bin, older bin or clock went backwards: bump the bin it belongs in
+    if (now_tick <= last_tick) {
+        if (last_tick - now_tick >= (time_t)N) return 0;   // already rolled out of the ring
+
+        unsigned int nowindex = (unsigned int)(now_tick % N);
+        setdata[nowindex] += count;
+        if (when > setHeader->lastTouch) __atomic_store_n(&setHeader->lastTouch, when, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    unsigned int nowindex  = (unsigned int)(now_tick  % N);
+    unsigned int lastindex = (unsigned int)(last_tick % N);
+    time_t diff = now_tick - last_tick;
+
+    if (diff >= (time_t)N) {
+        // advanced by a full ring or more: everything is stale
+        memset(setdata, 0, N * sizeof(rrdbInt));
+    } else if (diff > 1) {
+        // clear bins strictly between last and now
+        if (nowindex > lastindex) {
+            // contiguous region
+            size_t span = (size_t)(diff - 1);
+            memset(setdata + lastindex + 1, 0, span * sizeof(rrdbInt));
+        } else {
+            // wrapped: tail and head
+            size_t tail = N - (lastindex + 1);
+            size_t head = nowindex;
+            if (tail) memset(setdata + lastindex + 1, 0, tail * sizeof(rrdbInt));
+            if (head) memset(setdata, 0, head * sizeof(rrdbInt));
+        }
+    }
+    // Important: we are in a new bin; zero it so we don't carry old value
+    setdata[nowindex] = 0;
+
+    // Now record this touch - the expiry scan in touchExistingSets reads lastTouch without the ring's lock
+    setdata[nowindex] += count;
+    __atomic_store_n(&setHeader->lastTouch, when, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ Heavy hitters. A touch file holds at most maxsets sets - once it is full the touches to
+ paths without a set are counted in a Count-Min sketch after the last set, and a path only
+ takes over the least recently touched set (the top of a min heap on lastTouch) when its
+ count is more than that set's ring holds. What it displaces is counted in the sketch in
+ its place, so it can win the set back.
+ */
+static uint32_t sketchcolumn( const char *path, unsigned int period, unsigned int row ) {
+  /* FNV-1a, a different start for each row */
+  uint32_t hash = 2166136261u ^ ( row * 0x9e3779b9u );
+  for ( const char *c = path; *c; c++ ) hash = ( hash ^ ( unsigned char ) *c ) * 16777619u;
+  hash = ( hash ^ period ) * 16777619u;
+  return hash % TOUCHSKETCHWIDTH;
+}
+
+static uint32_t sketchestimate( rrdbTouchSketch *sketch, const char *path, unsigned int period ) {
+  uint32_t estimate = UINT32_MAX;
+
+  for ( unsigned int row = 0; row < TOUCHSKETCHDEPTH; row++ ) {
+    estimate = MIN( estimate, sketch->counts[ row ][ sketchcolumn( path, period, row ) ] );
+  }
+  return estimate;
+}
+
+/* raise path and period's estimate to at least count (only the counters below it - a conservative update) */
+static void sketchraise( rrdbTouchSketch *sketch, const char *path, unsigned int period, uint32_t count ) {
+  for ( unsigned int row = 0; row < TOUCHSKETCHDEPTH; row++ ) {
+    uint32_t *counter = &sketch->counts[ row ][ sketchcolumn( path, period, row ) ];
+    if ( *counter < count ) *counter = count;
+  }
+}
+
+/**
+ * Count count touches to path and period.
+ * @return { uint32_t } the estimate of its touches, now
+ */
+static uint32_t sketchadd( rrdbTouchSketch *sketch, const char *path, unsigned int period, rrdbInt count ) {
+  uint32_t estimate = sketchestimate( sketch, path, period );
+
+  estimate = count > UINT32_MAX - estimate ? UINT32_MAX : estimate + count;
+  sketchraise( sketch, path, period, estimate );
+
+  /* so that what was busy a long time ago doesn't outweigh what is busy now */
+  sketch->additions += count;
+  if ( sketch->additions >= TOUCHSKETCHRESET ) {
+    for ( unsigned int row = 0; row < TOUCHSKETCHDEPTH; row++ ) {
+      for ( unsigned int c = 0; c < TOUCHSKETCHWIDTH; c++ ) sketch->counts[ row ][ c ] /= 2;
+    }
+    sketch->additions /= 2;
+  }
+
+  return estimate;
+}
+
+static rrdbTimeEpochSeconds touchheapkey( rrdbTouchHeap *h, unsigned int i ) {
+  return h->sets[ h->heap[ i ] ].lastTouch;
+}
+
+static void touchheapswap( rrdbTouchHeap *h, unsigned int i, unsigned int j ) {
+  unsigned int set = h->heap[ i ];
+  h->heap[ i ] = h->heap[ j ];
+  h->heap[ j ] = set;
+  h->at[ h->heap[ i ] ] = i;
+  h->at[ h->heap[ j ] ] = j;
+}
+
+/* lastTouch only goes forward, so a set only ever moves down */
+static void touchheapdown( rrdbTouchHeap *h, unsigned int i ) {
+  for ( ;; ) {
+    unsigned int least = i, left = 2 * i + 1, right = left + 1;
+
+    if ( left < h->count && touchheapkey( h, left ) < touchheapkey( h, least ) ) least = left;
+    if ( right < h->count && touchheapkey( h, right ) < touchheapkey( h, least ) ) least = right;
+    if ( least == i ) return;
+    touchheapswap( h, i, least );
+    i = least;
+  }
+}
+
+static void touchheappush( rrdbTouchHeap *h, unsigned int set ) {
+  unsigned int i = h->count++;
+
+  h->heap[ i ] = set;
+  h->at[ set ] = i;
+  while ( i > 0 && touchheapkey( h, ( i - 1 ) / 2 ) > touchheapkey( h, i ) ) {
+    touchheapswap( h, i, ( i - 1 ) / 2 );
+    i = ( i - 1 ) / 2;
+  }
+}
+
+/**
+ * Make room for more bytes at offset at of the file pfd mapped at *addr (*size bytes),
+ * moving whatever is after it up.
+ * @return { int } 1 on success -1 on failure, when *addr is no longer mapped
+ */
+static int growtouchfile( int pfd, char **addr, size_t *size, size_t at, size_t more ) {
+  munmap( *addr, *size );
+  if ( 0 != posix_fallocate( pfd, *size, more ) ) return -1;
+
+  *addr = mmap( NULL, *size + more, PROT_READ | PROT_WRITE, MAP_SHARED, pfd, 0 );
+  if ( MAP_FAILED == *addr ) return -1;
+
+  memmove( *addr + at + more, *addr + at, *size - at );
+  memset( *addr + at, 0, more );
+  *size += more;
+  return 1;
+}
+
+/**
+ * Free a set - its path is left in the string table, counted as garbage unless another set
+ * (of another period) still has it.
+ */
+static void touchFreeSet( rrdbTouchHeader *header, rrdbTouchSet *setHeader ) {
+  int shared = FALSE;
+
+  for ( unsigned int i = 0; i < header->sets && !shared; i++ ) {
+    rrdbTouchSet *other = touchSetAt( header, i );
+    shared = other != setHeader && 0 != other->length && other->path == setHeader->path;
+  }
+
+  if ( !shared ) header->garbage += touchStringSize( setHeader->length );
+  memset( touchSetRing( header, setHeader ), 0, setHeader->room );
+
+  /* it keeps its room for whichever set reuses it */
+  setHeader->lastTouch = 0;
+  setHeader->hash = 0;
+  setHeader->path = setHeader->length = setHeader->period = 0;
+  setHeader->bins = setHeader->room == touchRingSize( header ) ? TOUCHRINGDENSE : 0;
+}
+
+/**
+ * Give set index's sparse ring twice the room, or make it dense once that is as much room
+ * as a dense ring takes. The rings after it move up (as growtouchfile).
+ * @return { int } 1 on success -1 on failure, when *addr is no longer mapped
+ */
+static int growtouchring( int pfd, char **addr, size_t *size, unsigned int index ) {
+  rrdbTouchHeader *header = ( rrdbTouchHeader * ) *addr;
+  rrdbTouchSet *setHeader = touchSetAt( header, index );
+  size_t room = MIN( ( size_t ) setHeader->room * 2, touchRingSize( header ) );
+  size_t more = room - setHeader->room, after = setHeader->ring + setHeader->room;
+  void *dense;
+
+  if ( more > UINT32_MAX - header->rings ) {
+    munmap( *addr, *size );
+    return -1;
+  }
+
+  if ( more > 0 ) {
+    if ( -1 == growtouchfile( pfd, addr, size, touchRingsAt( header ) + after, more ) ) return -1;
+
+    header = ( rrdbTouchHeader * ) *addr;
+    for ( unsigned int s = 0; s < header->sets; s++ ) {
+      rrdbTouchSet *other = touchSetAt( header, s );
+      if ( other->ring >= after ) other->ring += more;
+    }
+    header->rings += more;
+    setHeader = touchSetAt( header, index );
+    setHeader->room = room;
+  }
+
+  if ( room < touchRingSize( header ) ) return 1;
+
+  dense = malloc( room );
+  if ( NULL == dense ) {
+    munmap( *addr, *size );
+    return -1;
+  }
+  touchSetDense( header, setHeader, dense );
+  memcpy( touchSetRing( header, setHeader ), dense, room );
+  setHeader->bins = TOUCHRINGDENSE;
+  free( dense );
+  return 1;
+}
+
+/**
+ * Where path is in the string table, adding it to the end of the table if no set has it
+ * already. The file may be remapped (as growtouchfile).
+ * @return { int64_t } the offset of its entry or -1 on failure, when *addr is no longer mapped
+ */
+static int64_t touchIntern( int pfd, char **addr, size_t *size, const char *path, size_t length, uint64_t hash ) {
+  rrdbTouchHeader *header = ( rrdbTouchHeader * ) *addr;
+  size_t at, entrysize = touchStringSize( length );
+  uint32_t prefix = length;
+
+  for ( unsigned int i = 0; i < header->sets; i++ ) {
+    rrdbTouchSet *setHeader = touchSetAt( header, i );
+    if ( setHeader->hash == hash && setHeader->length == length &&
+         0 == memcmp( touchSetPath( header, setHeader ), path, length ) ) return setHeader->path;
+  }
+
+  if ( entrysize > UINT32_MAX - header->strings ) {
+    munmap( *addr, *size );
+    return -1;
+  }
+
+  at = touchSetsEnd( header );
+  if ( -1 == growtouchfile( pfd, addr, size, at, entrysize ) ) return -1;
+
+  header = ( rrdbTouchHeader * ) *addr;
+  memcpy( *addr + at, &prefix, sizeof( prefix ) );
+  memcpy( *addr + at + sizeof( prefix ), path, length );
+  header->strings += entrysize;
+  return at - touchStringsAt( header );
+}
+
+static void touched_bin( intmax_t ts, rrdbInt v, void *arg ) {
+  UNUSED( ts );
+  UNUSED( v );
+  ( *( unsigned int * ) arg )++;
+}
+
+/**
+ * Squeeze the free sets and the paths no set has any more out of the touch file pfd, mapped
+ * at addr, keeping the order of the sets - then truncate it. A dense ring which has gone
+ * quiet goes back to being sparse.
+ * @return { int } 1 on success -1 on failure
+ */
+static int compacttouchfile( int pfd, char *addr, size_t size ) {
+  rrdbTouchHeader *header = ( rrdbTouchHeader * ) addr, *compacted;
+  rrdbTouchSketch *sketch = touchSketch( addr, size );
+  uint32_t *moved;
+  void *dense;
+  unsigned int kept = 0;
+  size_t end;
+  char *out, *strings;
+
+  /* never bigger than it is now */
+  out = calloc( 1, size );
+  moved = malloc( sizeof( uint32_t ) * ( header->strings / 4 ) + 1 );
+  dense = malloc( touchRingSize( header ) );
+  if ( NULL == out || NULL == moved || NULL == dense ) {
+    free( out );
+    free( moved );
+    free( dense );
+    return -1;
+  }
+
+  memset( moved, 0xff, sizeof( uint32_t ) * ( header->strings / 4 ) );
+  compacted = ( rrdbTouchHeader * ) out;
+  memcpy( compacted, header, sizeof( rrdbTouchHeader ) );
+  compacted->sets = compacted->capacity = touchSetsInUse( header );
+  compacted->strings = compacted->garbage = compacted->rings = 0;
+
+  /* the rings first, as where the string table goes depends on them */
+  for ( unsigned int s = 0; s < header->sets; s++ ) {
+    rrdbTouchSet *setHeader = touchSetAt( header, s ), *to = touchSetAt( compacted, kept );
+    const time_t tps = getTimePerSample( setHeader->period );
+    const time_t N = header->samplesPerSet;
+    unsigned int touched = 0;
+
+    if ( 0 == setHeader->length ) continue;
+
+    touchSetDense( header, setHeader, dense );
+    walkTouchSet( header, setHeader, touchSetRing( header, setHeader ), touched_bin, &touched );
+
+    *to = *setHeader;
+    to->ring = compacted->rings;
+    to->room = MIN( touchRoomFor( header, touched ), setHeader->room );
+    compacted->rings += to->room;
+
+    if ( to->room == touchRingSize( header ) ) {
+      to->bins = TOUCHRINGDENSE;
+      memcpy( touchSetRing( compacted, to ), dense, to->room );
+    } else if ( header->values ) {
+      rrdbTouchValueBin *bins = touchSetRing( compacted, to ), *from = dense;
+      time_t tick = MAX( setHeader->lastTouch / tps - N + 1, 0 );
+
+      to->bins = 0;
+      for ( ; tick <= setHeader->lastTouch / tps; tick++ ) {
+        if ( ( time_t ) from[ tick % N ].tick != tick || 0 == from[ tick % N ].count ) continue;
+        bins[ to->bins++ ] = from[ tick % N ];
+      }
+    } else {
+      rrdbTouchBin *bins = touchSetRing( compacted, to );
+      rrdbInt *from = dense;
+      time_t tick = MAX( setHeader->lastTouch / tps - N + 1, 0 );
+
+      to->bins = 0;
+      for ( ; tick <= setHeader->lastTouch / tps; tick++ ) {
+        if ( 0 == from[ tick % N ] ) continue;
+        bins[ to->bins ].tick = ( uint32_t ) tick;
+        bins[ to->bins++ ].count = from[ tick % N ];
+      }
+    }
+    kept++;
+  }
+
+  kept = 0;
+  strings = out + touchStringsAt( compacted );
+  for ( unsigned int s = 0; s < header->sets; s++ ) {
+    rrdbTouchSet *setHeader = touchSetAt( header, s ), *to = touchSetAt( compacted, kept );
+
+    if ( 0 == setHeader->length ) continue;
+
+    /* each path once however many sets have it */
+    if ( UINT32_MAX == moved[ setHeader->path / 4 ] ) {
+      moved[ setHeader->path / 4 ] = compacted->strings;
+      memcpy( strings + compacted->strings, addr + touchStringsAt( header ) + setHeader->path, touchStringSize( setHeader->length ) );
+      compacted->strings += touchStringSize( setHeader->length );
+    }
+
+    to->path = moved[ setHeader->path / 4 ];
+    kept++;
+  }
+
+  /* the sketch stays straight after the string table */
+  end = touchSetsEnd( compacted );
+  if ( NULL != sketch ) {
+    memcpy( out + end, sketch, sizeof( rrdbTouchSketch ) );
+    end += sizeof( rrdbTouchSketch );
+  }
+
+  memcpy( addr, out, end );
+  free( out );
+  free( moved );
+  free( dense );
+
+  if ( -1 == ftruncate( pfd, end ) ) {
+    fprintf( stderr, "Failed to truncate file\n" );
+    return -1;
+  }
+  return 1;
+}
+
+/************************************************************************************
+ * Function: findTouchSets
+ *
+ * Purpose: Apply touches to the sets of their path and period, giving any path without
+ * one a free set, a new set up to maxsets - then, if it has been touched often enough,
+ * the set least recently touched (see above). The caller holds the file exclusively.
+ *
+ * A new set goes in the set table, doubling the table if it is full, and its ring after
+ * the last ring. Its path is only added to the string table if no other set has it. Its
+ * ring starts sparse and grows (growtouchring) as more of its bins are touched.
+ *
+ * It is also where sets expire. One pass over the sets frees any not touched for longer
+ * than their ring (a free set has no path) and free sets are the first to be reused. Only
+ * once more than 1 / TOUCHCOMPACTFREE of the sets are free, or of the string table is
+ * paths no set has, are they squeezed out, in one pass keeping their order, and the file
+ * truncated.
+ *
+ * Written: 8th April 2017 By: Nick Knight
+ ************************************************************************************/
+int findTouchSets(int pfd, rrdbTouchDelta *deltas, unsigned int deltacount, unsigned int maxsets)
+{
+  rrdbTouchHeader *header;
+  rrdbTouchSet *setHeader;
+  rrdbTouchSketch *sketch;
+  rrdbTouchHeap heap;
+  struct stat sb;
+  size_t mappedsize;
+  unsigned int *freesets, freecount = 0, nextfree = 0;
+  time_t now = time( NULL );
+  char *addr;
+  int retval = 1;
+
+  if ( fstat( pfd, &sb ) == -1 ) { /* To obtain file size */
+    rrdbprintf("ERROR: failed to stat file\n");
+    return -1;
+  }
+
+  mappedsize = sb.st_size;
+  addr = mmap(NULL, mappedsize, PROT_READ | PROT_WRITE, MAP_SHARED, pfd, 0);
+  if (addr == MAP_FAILED) {
+    rrdbprintf("ERROR: error accessing data file (1).\n");
+    return -1;
+  }
+
+  header = ( rrdbTouchHeader * ) addr;
+  memset( &heap, 0, sizeof( heap ) );
+  if ( !touchFileValid( addr, mappedsize ) ) {
+    rrdbprintf( "ERROR: RRDB header data corrupt\n" );
+    munmap( addr, mappedsize );
+    return -1;
+  }
+
+  heap.sets = touchSetAt( header, 0 );
+  heap.heap = malloc( sizeof( unsigned int ) * ( header->sets + deltacount ) + 1 );
+  heap.at = malloc( sizeof( unsigned int ) * ( header->sets + deltacount ) + 1 );
+  freesets = malloc( sizeof( unsigned int ) * header->sets + 1 );
+  if ( NULL == heap.heap || NULL == heap.at || NULL == freesets ) {
+    rrdbprintf("ERROR: out of memory\n");
+    retval = -1;
+    goto done;
+  }
+
+  header->lastSweep = now;
+  for ( unsigned int s = 0; s < header->sets; s++ ) {
+    setHeader = touchSetAt( header, s );
+    if ( 0 != setHeader->length &&
+         setHeader->lastTouch < ( now - ( getTimePerSample( setHeader->period ) * header->samplesPerSet ) ) ) {
+      touchFreeSet( header, setHeader );
+    }
+
+    if ( 0 == setHeader->length ) freesets[ freecount++ ] = s;
+    else touchheappush( &heap, s );
+  }
+
+  for ( unsigned int i = 0; i < deltacount; i++ ) {
+    rrdbTouchDelta *d = &deltas[ i ];
+    size_t length = strlen( d->path );
+    uint64_t hash = touchPathHash( d->path, length );
+    int64_t path;
+    unsigned int s;
+
+    if ( 0 == length || length > UINT32_MAX / 2 ) {
+      rrdbprintf("ERROR: path should be a string\n");
+      retval = -1;
+      continue;
+    }
+
+    /* a file keeps values from its first touch, or doesn't - said once for all of a touch's items */
+    if ( d->valued != ( int ) header->values ) {
+      if ( -1 != retval ) rrdbprintf( header->values ? "ERROR: touches of this file carry a value\n" : "ERROR: this file doesn't keep values\n" );
+      retval = -1;
+      continue;
+    }
+
+    setHeader = touchFind( header, d->path, length, hash, d->period );
+    if ( NULL != setHeader ) {
+      s = setHeader - heap.sets;
+      if ( -1 == touchSet( header, setHeader, touchSetRing( header, setHeader ), d->count, &d->values, d->when ) ) {
+        if ( -1 == growtouchring( pfd, &addr, &mappedsize, s ) ) {
+          rrdbprintf( "ERROR: error accessing data file (2).\n" );
+          addr = NULL;
+          retval = -1;
+          goto done;
+        }
+        header = ( rrdbTouchHeader * ) addr;
+        heap.sets = touchSetAt( header, 0 );
+        setHeader = touchSetAt( header, s );
+        touchSet( header, setHeader, touchSetRing( header, setHeader ), d->count, &d->values, d->when );
+      }
+      touchheapdown( &heap, heap.at[ s ] );
+      continue;
+    }
+
+    if ( nextfree < freecount ) {
+      /* the first free set, so those in use gather at the start */
+      s = freesets[ nextfree++ ];
+    } else if ( header->sets < maxsets ) {
+      /* a new set at the end of the table, and its ring after the last ring */
+      if ( header->sets == header->capacity ) {
+        unsigned int capacity = MAX( TOUCHMINCAPACITY, header->capacity * 2 );
+        if ( -1 == growtouchfile( pfd, &addr, &mappedsize, touchRingsAt( header ),
+                                  ( size_t ) ( capacity - header->capacity ) * sizeof( rrdbTouchSet ) ) ) {
+          rrdbprintf( "ERROR: error accessing data file (2).\n" );
+          addr = NULL;
+          retval = -1;
+          goto done;
+        }
+        header = ( rrdbTouchHeader * ) addr;
+        header->capacity = capacity;
+      }
+
+      unsigned int room = touchRoomFor( header, 1 );
+      if ( room > UINT32_MAX - header->rings ) {
+        rrdbprintf( "ERROR: touch file is full\n" );
+        retval = -1;
+        goto done;
+      }
+
+      if ( -1 == growtouchfile( pfd, &addr, &mappedsize, touchStringsAt( header ), room ) ) {
+        rrdbprintf( "ERROR: error accessing data file (2).\n" );
+        addr = NULL;
+        retval = -1;
+        goto done;
+      }
+      header = ( rrdbTouchHeader * ) addr;
+      heap.sets = touchSetAt( header, 0 );
+      s = header->sets++;
+      heap.sets[ s ].ring = header->rings;
+      heap.sets[ s ].room = room;
+      header->rings += room;
+    } else {
+      sketch = touchSketch( addr, mappedsize );
+      if ( NULL == sketch ) {
+        if ( -1 == growtouchfile( pfd, &addr, &mappedsize, touchSetsEnd( header ), sizeof( rrdbTouchSketch ) ) ) {
+          rrdbprintf( "ERROR: error accessing data file (3).\n" );
+          addr = NULL;
+          retval = -1;
+          goto done;
+        }
+        header = ( rrdbTouchHeader * ) addr;
+        heap.sets = touchSetAt( header, 0 );
+        sketch = ( rrdbTouchSketch * ) ( addr + touchSetsEnd( header ) );
+        sketch->magic = TOUCHSKETCHMAGIC;
+      }
+
+      /* the least recently touched set and its touches - its ring, or what it had before it got the set */
+      unsigned int victim = heap.heap[ 0 ];
+      uint64_t held;
+      setHeader = touchSetAt( header, victim );
+      held = touchSetTotal( header, setHeader );
+      held = MAX( MIN( held, UINT32_MAX ), sketchestimate( sketch, touchSetPath( header, setHeader ), setHeader->period ) );
+
+      if ( sketchadd( sketch, d->path, d->period, d->count ) <= held ) continue;
+
+      sketchraise( sketch, touchSetPath( header, setHeader ), setHeader->period, held );
+      touchFreeSet( header, setHeader );
+      s = victim;
+    }
+
+    path = touchIntern( pfd, &addr, &mappedsize, d->path, length, hash );
+    if ( -1 == path ) {
+      rrdbprintf( "ERROR: error accessing data file (4).\n" );
+      addr = NULL;
+      retval = -1;
+      goto done;
+    }
+    header = ( rrdbTouchHeader * ) addr;
+    heap.sets = touchSetAt( header, 0 );
+
+    setHeader = touchSetAt( header, s );
+    setHeader->lastTouch = d->when;
+    setHeader->hash = hash;
+    setHeader->path = path;
+    setHeader->length = length;
+    setHeader->period = d->period;
+    /* a free ring is empty, so always has room for one bin */
+    setHeader->bins = setHeader->room == touchRingSize( header ) ? TOUCHRINGDENSE : 0;
+    touchSet( header, setHeader, touchSetRing( header, setHeader ), d->count, &d->values, d->when );
+
+    if ( heap.count < header->sets - ( freecount - nextfree ) ) touchheappush( &heap, s );
+    else touchheapdown( &heap, heap.at[ s ] );
+  }
+
+  if ( ( freecount - nextfree > 0 && ( freecount - nextfree ) * TOUCHCOMPACTFREE > header->sets ) ||
+       header->garbage * TOUCHCOMPACTFREE > header->strings ) {
+    if ( -1 == compacttouchfile( pfd, addr, mappedsize ) ) retval = -1;
+  }
+
+done:
+  free( heap.heap );
+  free( heap.at );
+  free( freesets );
+  if ( NULL != addr ) munmap( addr, mappedsize );
+  return retval;
+}
+
+/*
+ Touch coalescing. In pipe mode a client can ask (coalesce <ms> or --coalesce) for its
+ touches to be gathered in memory, keyed by file, path item, period and bin, and written
+ out as one += n per key every interval rather than one file update per touch. Fetches
+ merge in whatever is still pending so they always see exact counts.
+
+ Lock ordering: the coalescer mutex is always taken before any file lock (flush writes
+ files while holding it, fetch takes it before opening the file) so the two can't deadlock.
+ */
+static unsigned int coalescehash( const char *filename, const char *path, unsigned int period, time_t tick ) {
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  for ( const char *c = filename; *c; c++ ) hash = ( hash ^ ( unsigned char ) *c ) * 16777619u;
+  for ( const char *c = path; *c; c++ ) hash = ( hash ^ ( unsigned char ) *c ) * 16777619u;
+  hash = ( hash ^ period ) * 16777619u;
+  hash = ( hash ^ ( uint32_t ) tick ) * 16777619u;
+  return hash % RRDBCOALESCEBUCKETS;
+}
+
+static int compareentryfilename( const void *a, const void *b ) {
+  return strcmp( ( *( rrdbCoalesceEntry ** ) a )->filename, ( *( rrdbCoalesceEntry ** ) b )->filename );
+}
+
+/**
+ * Write everything pending, the caller holds the lock.
+ * @return { int } 1 on success or -1 if any file failed
+ */
+static int coalescerflushlocked( rrdbCoalescer *c ) {
+  rrdbCoalesceEntry **entries;
+  rrdbTouchDelta *deltas;
+  unsigned int i, n = 0;
+  int retval = 1;
+
+  if ( 0 == c->entries ) return 1;
+
+  entries = malloc( sizeof( rrdbCoalesceEntry * ) * c->entries );
+  deltas = malloc( sizeof( rrdbTouchDelta ) * c->entries );
+  if ( NULL == entries || NULL == deltas ) {
+    free( entries );
+    free( deltas );
+    rrdbprintf( "ERROR: out of memory flushing touches\n" );
+    return -1;
+  }
+
+  for ( i = 0; i < RRDBCOALESCEBUCKETS; i++ ) {
+    for ( rrdbCoalesceEntry *e = c->buckets[ i ]; NULL != e; e = e->next ) entries[ n++ ] = e;
+    c->buckets[ i ] = NULL;
+  }
+
+  /* one open and lock per file */
+  qsort( entries, n, sizeof( rrdbCoalesceEntry * ), compareentryfilename );
+
+  for ( i = 0; i < n; ) {
+    unsigned int first = i, count = 0;
+
+    while ( i < n && 0 == strcmp( entries[ first ]->filename, entries[ i ]->filename ) ) {
+      rrdbCoalesceEntry *e = entries[ i ];
+      deltas[ count ].path = e->path;
+      deltas[ count ].period = e->period;
+      deltas[ count ].count = e->count;
+      deltas[ count ].when = e->tick * getTimePerSample( e->period );
+      deltas[ count ].valued = e->valued;
+      deltas[ count ].values = e->values;
+      count++;
+      i++;
+    }
+
+    /* the most recent touch has the final say on geometry */
+    if ( -1 == touchRRDBFileDeltas( entries[ first ]->filename, deltas, count,
+                                    entries[ i - 1 ]->maxsets, entries[ i - 1 ]->sampleCount ) )
+      retval = -1;
+  }
+
+  for ( i = 0; i < n; i++ ) free( entries[ i ] );
+  free( entries );
+  free( deltas );
+
+  c->entries = 0;
+  return retval;
+}
+
+static void *coalescerflusher( void *arg ) {
+  rrdbCoalescer *c = ( rrdbCoalescer * ) arg;
+  struct timespec until;
+
+  /* nobody to report to from here */
+  rrdbsetoutput( stderr );
+
+  pthread_mutex_lock( &c->lock );
+  while ( !c->stopping ) {
+    if ( 0 == c->interval ) {
+      pthread_cond_wait( &c->wake, &c->lock );
+      continue;
+    }
+
+    clock_gettime( CLOCK_REALTIME, &until );
+    until.tv_sec += c->interval / 1000;
+    until.tv_nsec += ( long ) ( c->interval % 1000 ) * 1000000;
+    if ( until.tv_nsec >= 1000000000 ) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+
+    if ( ETIMEDOUT == pthread_cond_timedwait( &c->wake, &c->lock, &until ) )
+      coalescerflushlocked( c );
+  }
+  pthread_mutex_unlock( &c->lock );
+
+  return NULL;
+}
+
+/**
+ * @return { rrdbCoalescer * } or NULL on failure
+ */
+rrdbCoalescer *coalescercreate( unsigned int interval ) {
+  rrdbCoalescer *c = calloc( 1, sizeof( rrdbCoalescer ) );
+  if ( NULL == c ) return NULL;
+
+  pthread_mutex_init( &c->lock, NULL );
+  pthread_cond_init( &c->wake, NULL );
+  c->interval = interval;
+
+  if ( 0 != pthread_create( &c->flusher, NULL, coalescerflusher, c ) ) {
+    pthread_mutex_destroy( &c->lock );
+    pthread_cond_destroy( &c->wake );
+    free( c );
+    return NULL;
+  }
+
+  return c;
+}
+
+/**
+ * Change the flush interval (ms), 0 switches coalescing off - flushing anything pending.
+ */
+int coalescersetinterval( rrdbCoalescer *c, unsigned int interval ) {
+  int retval = 1;
+
+  pthread_mutex_lock( &c->lock );
+  c->interval = interval;
+  if ( 0 == interval ) retval = coalescerflushlocked( c );
+  pthread_cond_signal( &c->wake );
+  pthread_mutex_unlock( &c->lock );
+
+  return retval;
+}
+
+int coalescerflush( rrdbCoalescer *c ) {
+  pthread_mutex_lock( &c->lock );
+  int retval = coalescerflushlocked( c );
+  pthread_mutex_unlock( &c->lock );
+  return retval;
+}
+
+/**
+ * Stop the flusher and write anything still pending.
+ */
+void coalescerdestroy( rrdbCoalescer *c ) {
+  pthread_mutex_lock( &c->lock );
+  c->stopping = TRUE;
+  pthread_cond_signal( &c->wake );
+  pthread_mutex_unlock( &c->lock );
+  pthread_join( c->flusher, NULL );
+
+  coalescerflushlocked( c );
+
+  pthread_mutex_destroy( &c->lock );
+  pthread_cond_destroy( &c->wake );
+  free( c );
+}
+
+void coalescerlock( rrdbCoalescer *c ) {
+  if ( NULL != c ) pthread_mutex_lock( &c->lock );
+}
+
+void coalescerunlock( rrdbCoalescer *c ) {
+  if ( NULL != c ) pthread_mutex_unlock( &c->lock );
+}
+
+/**
+ * Add touches to the pending buffer.
+ * @return { int } 1 on success -1 on failure
+ */
+int coalesceTouches( rrdbCoalescer *c, char *filename, rrdbTouchDelta *deltas, unsigned int deltacount, unsigned int maxsets, unsigned int sampleCount ) {
+  int retval = 1;
+
+  pthread_mutex_lock( &c->lock );
+
+  for ( unsigned int i = 0; i < deltacount; i++ ) {
+    rrdbTouchDelta *d = &deltas[ i ];
+    time_t tick = d->when / getTimePerSample( d->period );
+    unsigned int bucket = coalescehash( filename, d->path, d->period, tick );
+    rrdbCoalesceEntry *e;
+
+    for ( e = c->buckets[ bucket ]; NULL != e; e = e->next ) {
+      if ( e->tick == tick && e->period == d->period && e->valued == d->valued &&
+           0 == strcmp( e->path, d->path ) && 0 == strcmp( e->filename, filename ) ) break;
+    }
+
+    if ( NULL == e ) {
+      size_t filenamelength = strlen( filename ) + 1;
+      size_t pathlength = strlen( d->path ) + 1;
+
+      e = malloc( sizeof( rrdbCoalesceEntry ) + filenamelength + pathlength );
+      if ( NULL == e ) {
+        rrdbprintf( "ERROR: out of memory coalescing touches\n" );
+        retval = -1;
+        break;
+      }
+
+      e->filename = ( char * ) ( e + 1 );
+      e->path = e->filename + filenamelength;
+      memcpy( e->filename, filename, filenamelength );
+      memcpy( e->path, d->path, pathlength );
+      e->period = d->period;
+      e->tick = tick;
+      e->count = 0;
+      e->valued = d->valued;
+      e->next = c->buckets[ bucket ];
+      c->buckets[ bucket ] = e;
+      c->entries++;
+    }
+
+    if ( d->valued ) touchValuesAdd( &e->values, e->count, &d->values );
+    e->count += d->count;
+    e->maxsets = maxsets;
+    e->sampleCount = sampleCount;
+  }
+
+  if ( c->entries >= RRDBCOALESCEMAXENTRIES && -1 == coalescerflushlocked( c ) ) retval = -1;
+
+  pthread_mutex_unlock( &c->lock );
+  return retval;
+}
+
+/**
+ * Merge any pending touches for a set into a copy of it. The caller must hold the
+ * coalescer lock (coalescerlock) from before it opened the file. setHeader can be
+ * NULL if the set isn't in the file yet.
+ * @return { rrdbTouchSet * } a malloc'd set header followed by its bins, or NULL if
+ * nothing is pending for this set
+ */
+rrdbTouchSet *coalescerMerge( rrdbCoalescer *c, char *filename, rrdbTouchHeader *header, rrdbTouchSet *setHeader, char *path, unsigned int period ) {
+  rrdbTouchSet *merged = NULL;
+  size_t setsize = sizeof( rrdbTouchSet ) + touchRingSize( header );
+
+  if ( NULL == c || 0 == c->entries || NULL == filename ) return NULL;
+
+  if ( NULL != setHeader ) path = ( char * ) touchSetPath( header, setHeader );
+  if ( NULL == path || 0 == path[ 0 ] || 0 == header->samplesPerSet ) return NULL;
+
+  for ( unsigned int i = 0; i < RRDBCOALESCEBUCKETS; i++ ) {
+    for ( rrdbCoalesceEntry *e = c->buckets[ i ]; NULL != e; e = e->next ) {
+      if ( e->period != period || e->valued != ( int ) header->values ||
+           0 != strcmp( e->path, path ) || 0 != strcmp( e->filename, filename ) ) continue;
+
+      if ( NULL == merged ) {
+        merged = calloc( 1, setsize );
+        if ( NULL == merged ) return NULL;
+
+        /* only the bins are walked, so the copy doesn't need its path - its ring is dense */
+        if ( NULL != setHeader ) {
+          memcpy( merged, setHeader, sizeof( rrdbTouchSet ) );
+          touchSetDense( header, setHeader, merged + 1 );
+        } else {
+          merged->period = period;
+        }
+        merged->bins = TOUCHRINGDENSE;
+      }
+
+      touchSet( header, merged, merged + 1, e->count, e->valued ? &e->values : NULL, e->tick * getTimePerSample( period ) );
+    }
+  }
+
+  return merged;
+}
+
+/*
+ Shared memory ingest ring (see rrdbring.h). Producers on the same host claim and fill slots
+ without a syscall; one drainer thread takes what is published in batches, hands the slots
+ straight back and then writes the batch - updates in order, touches one call a file.
+ */
+
+/**
+ * The records' filename under the server's dir. Anyone who can write the ring names the file,
+ * so with a dir it has to stay in it - no absolute path and no .. anywhere in it.
+ * @return { int } 1 on success -1 if it is too long or would leave the dir
+ */
+static int ringfilename( const rrdbRingServer *s, const rrdb_ring_record *r, char *filename, size_t length ) {
+  if ( 0 == s->dir[ 0 ] ) return snprintf( filename, length, "%s", r->filename ) >= ( int ) length ? -1 : 1;
+
+  if ( '/' == r->filename[ 0 ] ) return -1;
+  for ( const char *item = r->filename; NULL != item; item = strchr( item, '/' ) ) {
+    if ( '/' == item[ 0 ] ) item++;
+    if ( 0 == strncmp( item, "..", 2 ) && ( 0 == item[ 2 ] || '/' == item[ 2 ] ) ) return -1;
+  }
+
+  return snprintf( filename, length, "%s/%s", s->dir, r->filename ) >= ( int ) length ? -1 : 1;
+}
+
+/**
+ * Take what has been published, up to a batch, and give the slots back to the producers.
+ * @return { unsigned int } records taken
+ */
+static unsigned int ringtake( rrdbRingServer *s ) {
+  rrdb_ring *ring = s->ring;
+  uint64_t position = ring->tail;
+  unsigned int n = 0;
+
+  for ( ; n < RRDBRINGBATCH; n++, position++ ) {
+    rrdb_ring_slot *slot = &ring->slot[ position & ( ring->slots - 1 ) ];
+    if ( position + 1 != __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE ) ) break;
+
+    s->batch[ n ] = slot->record;
+    __atomic_store_n( &slot->sequence, position + ring->slots, __ATOMIC_RELEASE );
+  }
+
+  if ( 0 == n ) return 0;
+
+  __atomic_store_n( &ring->tail, position, __ATOMIC_RELEASE );
+  __atomic_fetch_add( &ring->received, n, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &ring->batches, 1, __ATOMIC_RELAXED );
+  return n;
+}
+
+/* touches by file, in the order they came within one */
+static int compareringtouch( const void *a, const void *b ) {
+  const rrdb_ring_record *ra = *( const rrdb_ring_record ** ) a, *rb = *( const rrdb_ring_record ** ) b;
+  int c = strcmp( ra->filename, rb->filename );
+  if ( 0 != c ) return c;
+  return ra < rb ? -1 : ra > rb;
+}
+
+/**
+ * Write a batch taken by ringtake. Nothing in it is trusted - the strings are cut to their
+ * fields and a record which makes no sense is counted as failed.
+ */
+static void ringapply( rrdbRingServer *s, unsigned int n ) {
+  rrdb_ring_record **touches = s->touches;
+  unsigned int touchcount = 0, updatecount = 0;
+  uint64_t failed = 0;
+  char filename[ PATH_MAX + NAME_MAX ];
+
+  for ( unsigned int i = 0; i < n; i++ ) {
+    rrdb_ring_record *r = &s->batch[ i ];
+    r->filename[ sizeof( r->filename ) - 1 ] = 0;
+    r->path[ sizeof( r->path ) - 1 ] = 0;
+    r->periods[ sizeof( r->periods ) - 1 ] = 0;
+
+    if ( RRDB_RING_TOUCH == r->type && 0 != r->path[ 0 ] && r->valuecount <= 1 ) {
+      touches[ touchcount++ ] = r;
+    } else if ( RRDB_RING_UPDATE == r->type && r->valuecount <= RRDB_RING_VALUES && -1 != ringfilename( s, r, filename, sizeof( filename ) ) &&
+                NULL != ( s->updatefiles[ updatecount ] = strdup( filename ) ) ) {
+      s->updateinto[ updatecount ] = s->updatevalues[ updatecount ];
+      s->updatecounts[ updatecount ] = r->valuecount;
+      for ( unsigned int v = 0; v < r->valuecount; v++ ) s->updatevalues[ updatecount ][ v ] = r->values[ v ];
+      updatecount++;
+    } else {
+      failed++;
+    }
+  }
+
+  if ( updatecount > 0 ) failed += updateRRDBFilesValues( s->updatefiles, s->updateinto, s->updatecounts, updatecount, s->updatestatus );
+  for ( unsigned int i = 0; i < updatecount; i++ ) free( s->updatefiles[ i ] );
+
+  qsort( touches, touchcount, sizeof( rrdb_ring_record * ), compareringtouch );
+
+  for ( unsigned int i = 0; i < touchcount; ) {
+    unsigned int first = i, deltacount = 0;
+
+    for ( ; i < touchcount && 0 == strcmp( touches[ i ]->filename, touches[ first ]->filename ); i++ ) {
+      rrdb_ring_record *r = touches[ i ];
+
+      /* the most one record can come to is an item every other character of path for a period every other of periods */
+      if ( s->deltaroom - deltacount < RRDBRINGDELTAS ) {
+        rrdbTouchDelta *grown = realloc( s->deltas, sizeof( rrdbTouchDelta ) * ( s->deltaroom * 2 ) );
+        if ( NULL == grown ) break;
+        s->deltas = grown;
+        s->deltaroom *= 2;
+      }
+
+      deltacount += touchDeltas( r->path, r->periods, r->count, r->when, 1 == r->valuecount ? &r->values[ 0 ] : NULL,
+                                 s->deltas + deltacount, s->deltaroom - deltacount );
+    }
+
+    /* out of memory for the rest of this file's touches */
+    if ( i < touchcount && 0 == strcmp( touches[ i ]->filename, touches[ first ]->filename ) ) {
+      rrdbprintf( "ERROR: out of memory\n" );
+      for ( ; i < touchcount && 0 == strcmp( touches[ i ]->filename, touches[ first ]->filename ); i++ ) failed++;
+    }
+
+    /* the most recent touch has the final say on geometry, as the coalescer */
+    int ret;
+    if ( -1 == ringfilename( s, touches[ first ], filename, sizeof( filename ) ) ) ret = -1;
+    else if ( NULL != touchcoalescer && touchcoalescer->interval > 0 )
+      ret = coalesceTouches( touchcoalescer, filename, s->deltas, deltacount, touches[ i - 1 ]->maxsets, touches[ i - 1 ]->samples );
+    else
+      ret = touchRRDBFileDeltas( filename, s->deltas, deltacount, touches[ i - 1 ]->maxsets, touches[ i - 1 ]->samples );
+    if ( -1 == ret ) failed += i - first;
+  }
+
+  if ( failed > 0 ) __atomic_fetch_add( &s->ring->failed, failed, __ATOMIC_RELAXED );
+}
+
+static void *ringdrainer( void *arg ) {
+  rrdbRingServer *s = ( rrdbRingServer * ) arg;
+  unsigned int idle = 0;
+
+  /* nobody to report to from here */
+  rrdbsetoutput( stderr );
+
+  for ( ;; ) {
+    /* read before we look, so whatever was published before we were told to stop is written */
+    int stopping = __atomic_load_n( &s->stopping, __ATOMIC_ACQUIRE );
+    unsigned int n = ringtake( s );
+
+    if ( n > 0 ) {
+      ringapply( s, n );
+      idle = 0;
+      continue;
+    }
+    if ( stopping ) break;
+
+    /* producers don't wake us (that would be a syscall each), so poll - backing off while it is quiet */
+    idle = 0 == idle ? RRDBRINGIDLEMINUSECS : MIN( idle * 2, RRDBRINGIDLEUS );
+    struct timespec pause = { 0, ( long ) idle * 1000 };
+    nanosleep( &pause, NULL );
+  }
+
+  return NULL;
+}
+
+/**
+ * Create the ring name, or take over the one a previous server left (records still in it are
+ * written), and start draining it into files under dir.
+ * @return { rrdbRingServer * } or NULL on failure (error text written with rrdbprintf)
+ */
+rrdbRingServer *ringservercreate( const char *name, const char *dir, unsigned int slots ) {
+  rrdbRingServer *s;
+  struct stat sb;
+  int created = TRUE;
+  int fd;
+
+  if ( 0 != ( slots & ( slots - 1 ) ) ) {
+    rrdbprintf( "ERROR: ring slots should be a power of 2\n" );
+    return NULL;
+  }
+
+  if ( 0 == name[ 0 ] || strlen( dir ) >= sizeof( s->dir ) ) {
+    rrdbprintf( "ERROR: bad ring name or dir\n" );
+    return NULL;
+  }
+
+  s = calloc( 1, sizeof( rrdbRingServer ) );
+  if ( NULL == s ) {
+    rrdbprintf( "ERROR: out of memory\n" );
+    return NULL;
+  }
+  rrdb_ring_shmname( name, s->name, sizeof( s->name ) );
+  strcpy( s->dir, dir );
+
+  fd = shm_open( s->name, O_RDWR | O_CREAT | O_EXCL, 0660 );
+  if ( -1 == fd && EEXIST == errno ) {
+    created = FALSE;
+    fd = shm_open( s->name, O_RDWR, 0 );
+  }
+  if ( -1 == fd ) {
+    rrdbprintf( "ERROR: failed to open ring %s\n", name );
+    free( s );
+    return NULL;
+  }
+
+  if ( created ) {
+    if ( 0 == slots ) slots = RRDBRINGSLOTS;
+    s->size = sizeof( rrdb_ring ) + ( size_t ) slots * sizeof( rrdb_ring_slot );
+    if ( -1 == ftruncate( fd, s->size ) ) goto failed;
+  } else {
+    if ( -1 == fstat( fd, &sb ) || ( size_t ) sb.st_size < sizeof( rrdb_ring ) ) goto notaring;
+    s->size = sb.st_size;
+  }
+
+  s->ring = mmap( NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if ( MAP_FAILED == s->ring ) {
+    s->ring = NULL;
+    goto failed;
+  }
+
+  if ( created ) {
+    s->ring->version = RRDB_RING_VERSION;
+    s->ring->slots = slots;
+    s->ring->slotsize = sizeof( rrdb_ring_slot );
+    for ( uint32_t i = 0; i < slots; i++ ) s->ring->slot[ i ].sequence = i;
+    /* producers look for this last */
+    __atomic_store_n( &s->ring->magic, RRDB_RING_MAGIC, __ATOMIC_RELEASE );
+  } else {
+    if ( RRDB_RING_MAGIC != __atomic_load_n( &s->ring->magic, __ATOMIC_ACQUIRE ) || RRDB_RING_VERSION != s->ring->version ||
+         sizeof( rrdb_ring_slot ) != s->ring->slotsize || 0 == s->ring->slots || 0 != ( s->ring->slots & ( s->ring->slots - 1 ) ) ||
+         s->size != sizeof( rrdb_ring ) + ( size_t ) s->ring->slots * sizeof( rrdb_ring_slot ) ) goto notaring;
+
+    if ( 0 != slots && slots != s->ring->slots ) {
+      rrdbprintf( "ERROR: ring %s has %u slots, not %u\n", name, s->ring->slots, slots );
+      goto cleanup;
+    }
+  }
+
+  /* one server a ring - a server which went away without saying leaves its pid */
+  int32_t server = 0;
+  while ( !__atomic_compare_exchange_n( &s->ring->server, &server, ( int32_t ) getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+    if ( 0 == kill( server, 0 ) || EPERM == errno ) {
+      rrdbprintf( "ERROR: ring %s is already served by %d\n", name, server );
+      goto cleanup;
+    }
+  }
+
+  s->deltaroom = RRDBRINGDELTAS * 2;
+  s->deltas = malloc( sizeof( rrdbTouchDelta ) * s->deltaroom );
+  if ( NULL == s->deltas ) goto release;
+
+  if ( 0 != pthread_create( &s->drainer, NULL, ringdrainer, s ) ) goto release;
+
+  close( fd );
+  return s;
+
+release:
+  __atomic_store_n( &s->ring->server, 0, __ATOMIC_RELEASE );
+failed:
+  rrdbprintf( "ERROR: failed to set up ring %s\n", name );
+  if ( created ) shm_unlink( s->name );
+  goto cleanup;
+notaring:
+  rrdbprintf( "ERROR: %s isn't an rrdb ring\n", name );
+cleanup:
+  if ( NULL != s->ring ) munmap( s->ring, s->size );
+  free( s->deltas );
+  close( fd );
+  free( s );
+  return NULL;
+}
+
+/**
+ * Stop draining once what has been published is written. The ring stays for producers which
+ * have it mapped and the next server.
+ */
+void ringserverdestroy( rrdbRingServer *s ) {
+  __atomic_store_n( &s->stopping, TRUE, __ATOMIC_RELEASE );
+  pthread_join( s->drainer, NULL );
+
+  __atomic_store_n( &s->ring->server, 0, __ATOMIC_RELEASE );
+  munmap( s->ring, s->size );
+  free( s->deltas );
+  free( s );
+}
+
+void printringstats( const rrdbRingServer *s ) {
+  const rrdb_ring *ring = s->ring;
+  uint64_t head = __atomic_load_n( &ring->head, __ATOMIC_RELAXED ), tail = __atomic_load_n( &ring->tail, __ATOMIC_RELAXED );
+
+  rrdbprintf( "ring:%s\n", s->name + 1 );
+  rrdbprintf( "slots:%u\n", ring->slots );
+  rrdbprintf( "queued:%" PRIu64 "\n", head > tail ? head - tail : 0 );
+  rrdbprintf( "received:%" PRIu64 "\n", __atomic_load_n( &ring->received, __ATOMIC_RELAXED ) );
+  rrdbprintf( "batches:%" PRIu64 "\n", __atomic_load_n( &ring->batches, __ATOMIC_RELAXED ) );
+  rrdbprintf( "full:%" PRIu64 "\n", __atomic_load_n( &ring->full, __ATOMIC_RELAXED ) );
+  rrdbprintf( "dropped:%" PRIu64 "\n", __atomic_load_n( &ring->dropped, __ATOMIC_RELAXED ) );
+  rrdbprintf( "failed:%" PRIu64 "\n", __atomic_load_n( &ring->failed, __ATOMIC_RELAXED ) );
+}
+
+/*
+ Rollup. Every coarser period's seconds per sample are a multiple of a finer one's, so the
+ bins of a coarser period are sums of the bins of a finer one - a path touched with only its
+ finest period can be fetched for any coarser one, as far back as that ring goes.
+ */
+typedef struct rrdbTouchRollup {
+  /* dense, of rrdbInt or of a file which keeps values rrdbTouchValueBin */
+  void *ring;
+  unsigned int samples;
+  time_t tps;
+  /* the oldest tick the ring keeps */
+  time_t first;
+} rrdbTouchRollup;
+
+static void rollup_bin( intmax_t ts, rrdbInt v, void *arg ) {
+  rrdbTouchRollup *r = arg;
+  if ( ts / r->tps >= r->first ) ( ( rrdbInt * ) r->ring )[ ( ts / r->tps ) % r->samples ] += v;
+}
+
+static void rollup_value_bin( intmax_t ts, const rrdbTouchValueBin *bin, void *arg ) {
+  rrdbTouchRollup *r = arg;
+  rrdbTouchValueBin *into = ( rrdbTouchValueBin * ) r->ring + ( ts / r->tps ) % r->samples;
+
+  if ( ts / r->tps < r->first ) return;
+  if ( ( time_t ) into->tick != ts / r->tps ) {
+    memset( into, 0, sizeof( rrdbTouchValueBin ) );
+    into->tick = ( uint32_t ) ( ts / r->tps );
+  }
+  touchValuesAdd( &into->values, into->count, &bin->values );
+  into->count += bin->count;
+}
+
+/* add the bins of a set to a rollup */
+static void touchRollupWalk( const rrdbTouchHeader *header, const rrdbTouchSet *setHeader, const void *ring, rrdbTouchRollup *r ) {
+  if ( header->values ) walkTouchValues( header, setHeader, ring, rollup_value_bin, r );
+  else walkTouchSet( header, setHeader, ring, rollup_bin, r );
+}
+
+/**
+ * Make into (a set header followed by a ring) dense, for rollup_bin to add bins to its ring
+ * ending at its lastTouch.
+ * @return { rrdbTouchRollup * } r
+ */
+static rrdbTouchRollup *touchRollupInto( const rrdbTouchHeader *header, rrdbTouchSet *into, rrdbTouchRollup *r ) {
+  r->ring = into + 1;
+  r->samples = header->samplesPerSet;
+  r->tps = getTimePerSample( into->period );
+  r->first = into->lastTouch / r->tps - header->samplesPerSet + 1;
+  into->bins = TOUCHRINGDENSE;
+  return r;
+}
+
+/**
+ * The set of path (or if it has none, of any path) whose period is the coarsest which
+ * divides period - the longest ring to roll up from.
+ * @return { rrdbTouchSet * } or NULL
+ */
+static rrdbTouchSet *findTouchRollupSet( char *addr, size_t size, char *path, unsigned int period ) {
+  rrdbTouchHeader *header = ( rrdbTouchHeader * ) addr;
+  const time_t tps = getTimePerSample( period );
+  rrdbTouchSet *best = NULL;
+  size_t length = NULL == path ? 0 : strlen( path );
+  uint64_t hash = touchPathHash( path, length );
+
+  if ( !touchFileValid( addr, size ) ) return NULL;
+
+  for ( unsigned int i = 0; i < header->sets; i++ ) {
+    rrdbTouchSet *setHeader = touchSetAt( header, i );
+    time_t settps;
+
+    if ( 0 == setHeader->length ) continue;
+    if ( 0 != length && ( setHeader->hash != hash || setHeader->length != length ||
+                          0 != memcmp( touchSetPath( header, setHeader ), path, length ) ) ) continue;
+
+    settps = getTimePerSample( setHeader->period );
+    if ( settps >= tps || 0 != tps % settps ) continue;
+    if ( NULL == best || settps > ( time_t ) getTimePerSample( best->period ) ) best = setHeader;
+  }
+  return best;
+}
+
+/**
+ * The set to fetch for period of every path of the (valid) touch file header starting with
+ * prefix (length bytes), in one pass over the sets - a path's own set of that period, or
+ * the coarsest which divides it to roll up. Paths are interned, so a path is where it is in
+ * the string table.
+ * @return { rrdbTouchSet ** } malloc'd, indexed by path / 4 (header->strings / 4 of them,
+ * NULL for none) - or NULL if out of memory
+ */
+static rrdbTouchSet **findTouchPrefixSets( rrdbTouchHeader *header, const char *prefix, size_t length, unsigned int period ) {
+  const time_t tps = getTimePerSample( period );
+  rrdbTouchSet **found = calloc( header->strings / 4 + 1, sizeof( rrdbTouchSet * ) );
+
+  if ( NULL == found ) return NULL;
+
+  for ( unsigned int i = 0; i < header->sets; i++ ) {
+    rrdbTouchSet *setHeader = touchSetAt( header, i ), **best;
+    time_t settps = getTimePerSample( setHeader->period );
+
+    if ( 0 == setHeader->length || setHeader->length < length ||
+         0 != memcmp( touchSetPath( header, setHeader ), prefix, length ) ) continue;
+    if ( settps > tps || 0 != tps % settps ) continue;
+
+    best = &found[ setHeader->path / 4 ];
+    if ( NULL == *best || ( *best )->period != period ) {
+      if ( NULL == *best || settps == tps || settps > ( time_t ) getTimePerSample( ( *best )->period ) ) *best = setHeader;
+    }
+  }
+  return found;
+}
+
+/**
+ * Roll a set's ring up into a copy of it of a coarser period. A coarser bin holds at least
+ * two finer ones, so the copy's dense ring holds all of them.
+ * @return { rrdbTouchSet * } a malloc'd set header followed by its bins, or NULL
+ */
+static rrdbTouchSet *touchRollup( const rrdbTouchHeader *header, const rrdbTouchSet *setHeader, const void *ring, unsigned int period ) {
+  rrdbTouchSet *rolled = calloc( 1, sizeof( rrdbTouchSet ) + touchRingSize( header ) );
+  rrdbTouchRollup r;
+
+  if ( NULL == rolled ) return NULL;
+
+  *rolled = *setHeader;
+  rolled->period = period;
+  touchRollupWalk( header, setHeader, ring, touchRollupInto( header, rolled, &r ) );
+  return rolled;
+}
+
+/**
+ * What a fetch of period sees of setHeader (NULL if the path has no set yet): the set with
+ * any touches the coalescer holds for it, rolled up if it is of a finer period.
+ * @return { rrdbTouchSet * } as touchFetchSet
+ */
+static rrdbTouchSet *touchView( char *filename, rrdbTouchHeader *header, rrdbTouchSet *setHeader, char *path, unsigned int period,
+                                const void **ring, rrdbTouchSet **owned ) {
+  rrdbTouchSet *merged;
+
+  if ( NULL != setHeader && setHeader->period != period ) {
+    merged = coalescerMerge( touchcoalescer, filename, header, setHeader, path, setHeader->period );
+    if ( NULL != merged ) *owned = touchRollup( header, merged, merged + 1, period );
+    else *owned = touchRollup( header, setHeader, touchSetRing( header, setHeader ), period );
+    free( merged );
+  } else {
+    *owned = coalescerMerge( touchcoalescer, filename, header, setHeader, path, period );
+  }
+
+  if ( NULL != *owned ) {
+    *ring = *owned + 1;
+    return *owned;
+  }
+  if ( NULL != setHeader ) *ring = touchSetRing( header, setHeader );
+  return setHeader;
+}
+
+/**
+ * The bins of every path starting with prefix (length bytes) summed into one set, its ring
+ * ending at the last touch of any of them.
+ * @return { rrdbTouchSet * } a malloc'd set header followed by its bins, or NULL if no path has it
+ */
+static rrdbTouchSet *touchFetchPrefix( char *filename, char *addr, size_t size, char *prefix, size_t length, unsigned int period ) {
+  rrdbTouchHeader *header = ( rrdbTouchHeader * ) addr;
+  rrdbTouchSet **found, *sum = NULL, **views = NULL, **owned = NULL;
+  const void **rings = NULL;
+  unsigned int count = 0;
+  rrdbTouchRollup r;
+
+  if ( !touchFileValid( addr, size ) ) return NULL;
+
+  found = findTouchPrefixSets( header, prefix, length, period );
+  views = malloc( sizeof( rrdbTouchSet * ) * ( header->strings / 4 + 1 ) );
+  owned = malloc( sizeof( rrdbTouchSet * ) * ( header->strings / 4 + 1 ) );
+  rings = malloc( sizeof( void * ) * ( header->strings / 4 + 1 ) );
+  if ( NULL == found || NULL == views || NULL == owned || NULL == rings ) goto done;
+
+  /* the window of the sum ends at the latest of them */
+  for ( unsigned int i = 0; i < header->strings / 4; i++ ) {
+    if ( NULL == found[ i ] ) continue;
+    views[ count ] = touchView( filename, header, found[ i ], ( char * ) touchSetPath( header, found[ i ] ), period, &rings[ count ], &owned[ count ] );
+    if ( NULL == views[ count ] ) continue;
+
+    if ( NULL == sum ) {
+      sum = calloc( 1, sizeof( rrdbTouchSet ) + touchRingSize( header ) );
+      if ( NULL == sum ) {
+        free( owned[ count ] );
+        break;
+      }
+      sum->period = period;
+    }
+    if ( views[ count ]->lastTouch > sum->lastTouch ) sum->lastTouch = views[ count ]->lastTouch;
+    count++;
+  }
+
+  if ( NULL != sum ) touchRollupInto( header, sum, &r );
+  for ( unsigned int i = 0; i < count; i++ ) {
+    if ( NULL != sum ) touchRollupWalk( header, views[ i ], rings[ i ], &r );
+    free( owned[ i ] );
+  }
+
+done:
+  free( found );
+  free( views );
+  free( owned );
+  free( rings );
+  return sum;
+}
+
+/**
+ * The set a fetch of path and period sees in the touch file mapped at addr: the set itself
+ * with any touches the coalescer holds for it (coalescerMerge, filename can be NULL for
+ * none) - or, if there is no set of that period, one rolled up from a finer period's set. A
+ * path ending in * is every path starting with what is before it, summed.
+ * The caller holds the coalescer lock as for coalescerMerge.
+ * @return { rrdbTouchSet * } the set, with its ring at *ring, or NULL if there is nothing
+ * to fetch. If *owned isn't NULL the set is it, malloc'd for the caller to free.
+ */
+rrdbTouchSet *touchFetchSet( char *filename, char *addr, size_t size, char *path, unsigned int period,
+                             const void **ring, rrdbTouchSet **owned ) {
+  rrdbTouchSet *setHeader;
+  size_t length = NULL == path ? 0 : strlen( path );
+
+  *owned = NULL;
+  if ( size < sizeof( rrdbTouchHeader ) ) return NULL;
+
+  if ( 0 != length && '*' == path[ length - 1 ] ) {
+    *owned = touchFetchPrefix( filename, addr, size, path, length - 1, period );
+    if ( NULL != *owned ) *ring = *owned + 1;
+    return *owned;
+  }
+
+  setHeader = findTouchSetByName( addr, size, path, period );
+  if ( NULL == setHeader ) setHeader = findTouchRollupSet( addr, size, path, period );
+  return touchView( filename, ( rrdbTouchHeader * ) addr, setHeader, path, period, ring, owned );
+}
+
+/**
+ * Open a (lock free) copy of a file to fetch from, if it doesn't exist yet but has
+ * touches waiting for it write them out first. Called with the coalescer lock held.
+ */
+locked_file_t openforfetch( char *filename ) {
+  locked_file_t pfd = snapshotopen( filename );
+
+  if( -1 == pfd.data_fd && NULL != touchcoalescer && touchcoalescer->entries > 0 ) {
+    coalescerflushlocked( touchcoalescer );
+    pfd = snapshotopen( filename );
+  }
+
+  return pfd;
+}
+
+/************************************************************************************
+ * Function: touchRRDBFile
+ *
+ * Purpose: This is a slightly different format of file than our initial RRDB file.
+ * This format is to keep count of hits on a certain point. For example, with use in
+ * babblevoice a path is the path through an auto attendant menu. For example,
+ * a user dials 1 then 2 to navigate through a menu. The jumps in the extensions jump
+ * through to extensions mainintro and then sales. The path then becomes mainintro/sales.
+ * So we record a hit on the full path and then each sub path. Because we are slightly
+ * more dynamic, i.e. the paths may vary - we need the ability to remove old paths which
+ * are no longer used (i.e. the oldest one) if we need a new one.
+ *
+ * Each touch adds count at time when (0 for now) - so counts aggregated upstream or
+ * replayed from a log land in the bin they happened in, if it is still in the ring.
+ * With a value (each of the count touches had it, a duration say) the bins of the file
+ * keep the sum, least and most of the values as well - a file keeps values, or doesn't,
+ * from its first touch.
+ *
+ * Written: 7th March 2017 By: Nick Knight
+ ************************************************************************************/
+/**
+ * A delta for each item of path ("/" separated) for each period ("," separated), at most room.
+ * The deltas point into path, which is cut up.
+ * @return { unsigned int } how many
+ */
+unsigned int touchDeltas(char *path, char *period, rrdbInt count, time_t when, const double *value, rrdbTouchDelta *deltas, unsigned int room)
+{
+  unsigned int deltacount = 0;
+  char *pathitem, *perioditem;
+  char *pathitem_save_ptr, *perioditem_save_ptr;
+  char periodcopy[MAXVALUESTRING];
+
+  if ( 0 == when ) when = time( NULL );
+
+  if ( 0 == strlen( period ) ) {
+    period = "d";
+  }
+
+  pathitem_save_ptr = NULL;
+  // We only use path once, so it doesn't matter that strtok_r overwrites it
+  pathitem = strtok_r( path, "/", &pathitem_save_ptr );
+  while( NULL != pathitem ) {
+    perioditem_save_ptr = NULL;
+    strcpy( periodcopy, period );
+    perioditem = strtok_r( periodcopy, ",", &perioditem_save_ptr );
+
+    while( NULL != perioditem && deltacount < room ) {
+      int iperiod = getPeriodFromName( perioditem );
+      if ( -1 == iperiod ) iperiod = ONEHOUR;
+
+      deltas[ deltacount ].path = pathitem;
+      deltas[ deltacount ].period = iperiod;
+      deltas[ deltacount ].count = count;
+      deltas[ deltacount ].when = when;
+      deltas[ deltacount ].valued = NULL != value;
+      if ( NULL != value ) deltas[ deltacount ].values = ( rrdbTouchValues ) { *value * count, *value, *value };
+      deltacount++;
+
+      perioditem = strtok_r( NULL, ",", &perioditem_save_ptr );
+    }
+    pathitem = strtok_r( NULL, "/", &pathitem_save_ptr );
+  }
+
+  return deltacount;
+}
+
+int touchRRDBFile(char *filename, char *path, char * period, unsigned int maxsets, unsigned int sampleCount, rrdbInt count, time_t when, const double *value)
+{
+  rrdbTouchDelta deltas[ MAXVALUESTRING ];
+  unsigned int deltacount = touchDeltas( path, period, count, when, value, deltas, MAXVALUESTRING );
+
+  if ( NULL != touchcoalescer && touchcoalescer->interval > 0 ) {
+    return coalesceTouches( touchcoalescer, filename, deltas, deltacount, maxsets, sampleCount );
+  }
+
+  return touchRRDBFileDeltas( filename, deltas, deltacount, maxsets, sampleCount );
+}
+
+/**
+ * Touch the sets which already exist holding only a shared lock on the header and an
+ * exclusive lock on each set's ring while we change it - so touches to different sets
+ * of a file don't wait for each other. A set's lastTouch is written under its ring's lock
+ * but the expiry scan reads every set's without one, so both go through atomics. Anything
+ * which needs a new set is copied to pending, and needsweep set if a set has expired, for
+ * the caller to do with the header locked exclusively. The sets are looked at for any which
+ * have expired once every TOUCHEXPIRYSECONDS, by whichever touch claims lastSweep - so a
+ * quiet file expires its sets as surely as a busy one.
+ * @return { int } 0 on success, -1 if the caller should do everything (i.e. a new file)
+ */
+static int touchExistingSets( locked_file_t *pfd, const char *filename, rrdbTouchDelta *deltas, unsigned int deltacount,
+                              rrdbTouchDelta *pending, unsigned int *pendingcount, int *needsweep )
+{
+  struct stat sb;
+  char *addr;
+  rrdbTouchHeader *header;
+  rrdbTouchSet *setHeader;
+  off_t ringat;
+  time_t now = time( NULL );
+  int expirycheck = FALSE;
+  int retval = -1;
+
+  if ( -1 == lockrange( pfd, 0, sizeof( rrdbTouchHeader ), F_RDLCK ) ) return -1;
+
+  if ( replacedfile( pfd, filename ) || -1 == fstat( pfd->data_fd, &sb ) || sb.st_size < ( off_t ) sizeof( rrdbTouchHeader ) ||
+       RRDBTOUCHV4 != getFileVersion( pfd->data_fd ) ) goto unlock;
+
+  addr = mmap( NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, pfd->data_fd, 0 );
+  if ( MAP_FAILED == addr ) goto unlock;
+
+  header = ( rrdbTouchHeader * ) addr;
+  if ( !touchFileValid( addr, sb.st_size ) ) {
+    munmap( addr, sb.st_size );
+    goto unlock;
+  }
+
+  *pendingcount = 0;
+  *needsweep = FALSE;
+
+  for ( unsigned int i = 0; i < deltacount; i++ ) {
+    size_t length = strlen( deltas[ i ].path );
+
+    /* path and period only change with the header locked exclusively */
+    setHeader = touchFind( header, deltas[ i ].path, length, touchPathHash( deltas[ i ].path, length ), deltas[ i ].period );
+    /* findTouchSets reports a touch with or without a value the file doesn't take */
+    if ( NULL == setHeader || deltas[ i ].valued != ( int ) header->values ) {
+      pending[ ( *pendingcount )++ ] = deltas[ i ];
+      continue;
+    }
+
+    /* a ring only moves or grows with the header locked exclusively */
+    ringat = ( char * ) touchSetRing( header, setHeader ) - addr;
+    if ( -1 == lockrange( pfd, ringat, setHeader->room, F_WRLCK ) ) {
+      pending[ ( *pendingcount )++ ] = deltas[ i ];
+      continue;
+    }
+    /* other writers may be in other sets, so the seqlock counters are bumped atomically */
+    __atomic_add_fetch( &header->seqBegin, 1, __ATOMIC_SEQ_CST );
+    /* a sparse ring without room for another bin is grown by findTouchSets */
+    if ( -1 == touchSet( header, setHeader, touchSetRing( header, setHeader ), deltas[ i ].count, &deltas[ i ].values, deltas[ i ].when ) )
+      pending[ ( *pendingcount )++ ] = deltas[ i ];
+    __atomic_add_fetch( &header->seqEnd, 1, __ATOMIC_SEQ_CST );
+    lockrange( pfd, ringat, setHeader->room, F_UNLCK );
+  }
+
+  /* one of the touches sharing the header looks, the others carry on */
+  int64_t lastsweep = __atomic_load_n( &header->lastSweep, __ATOMIC_RELAXED );
+  if ( now - lastsweep >= TOUCHEXPIRYSECONDS &&
+       __atomic_compare_exchange_n( &header->lastSweep, &lastsweep, ( int64_t ) now, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    expirycheck = TRUE;
+
+  /* the same test as findTouchSets */
+  for ( unsigned int s = 0; expirycheck && s < header->sets && !*needsweep; s++ ) {
+    setHeader = touchSetAt( header, s );
+    if ( 0 != setHeader->length &&
+         __atomic_load_n( &setHeader->lastTouch, __ATOMIC_RELAXED ) < ( now - ( getTimePerSample( setHeader->period ) * header->samplesPerSet ) ) )
+      *needsweep = TRUE;
+  }
+
+  munmap( addr, sb.st_size );
+  retval = 0;
+
+unlock:
+  lockrange( pfd, 0, sizeof( rrdbTouchHeader ), F_UNLCK );
+  return retval;
+}
+
+/************************************************************************************
+ * Function: touchRRDBFileDeltas
+ *
+ * Purpose: Apply a batch of touches (each a path item, period, time and count) to
+ * a touch file, creating the file if need be. Sets which already exist are touched with
+ * byte range locks (touchExistingSets), only new sets and expiring old ones
+ * (findTouchSets) take the header exclusively.
+ *
+ * Written: 7th March 2017 By: Nick Knight
+ ************************************************************************************/
+int touchRRDBFileDeltas(char *filename, rrdbTouchDelta *deltas, unsigned int deltacount, unsigned int maxsets, unsigned int sampleCount)
+{
+  rrdbTouchHeader *headerData;
+  struct stat sb;
+  rrdbTouchDelta *pending;
+  unsigned int pendingcount = 0;
+  int needsweep = FALSE;
+  unsigned int reopens = 0;
+  rrdbVersionHeader seq;
+  locked_file_t pfd;
+  int retval = 1;
+
+  if ( 0 == maxsets ) {
+    maxsets = TOUCHMAXDEFAULTSETS;
+  }
+
+  if ( 0 == sampleCount ) {
+    sampleCount = TOUCHDEFAULTSAMPLECOUNT;
+  }
+
+reopen:
+  pfd = openforrangelocks( filename );
+  if ( -1 == pfd.data_fd ) {
+    /* failure - should only ouput one error - perhaps need to put this somewhere else?*/
+    rrdbprintf( "ERROR: failed to open %s\n", filename );
+    return -1;
+  }
+
+  pending = malloc( sizeof( rrdbTouchDelta ) * ( deltacount + 1 ) );
+  if ( NULL == pending ) {
+    unlockandclose( pfd );
+    rrdbprintf( "ERROR: out of memory\n" );
+    return -1;
+  }
+
+  /* the common case, all of the sets exist and nothing has expired */
+  if ( -1 == touchExistingSets( &pfd, filename, deltas, deltacount, pending, &pendingcount, &needsweep ) ) {
+    memcpy( pending, deltas, sizeof( rrdbTouchDelta ) * deltacount );
+    pendingcount = deltacount;
+    needsweep = TRUE;
+  }
+
+  if ( 0 == pendingcount && !needsweep ) {
+    free( pending );
+    unlockandclose( pfd );
+    return 1;
+  }
+
+  /* new sets or removing old ones moves things about - we need the file to ourselves */
+  if ( -1 == lockrange( &pfd, 0, sizeof( rrdbTouchHeader ), F_WRLCK ) ) {
+    free( pending );
+    unlockandclose( pfd );
+    rrdbprintf( "ERROR: failed to lock %s\n", filename );
+    return -1;
+  }
+
+  if ( fstat( pfd.data_fd, &sb ) == -1 ) { /* To obtain file size */
+    free( pending );
+    unlockandclose( pfd );
+    rrdbprintf("ERROR: Couldn't stat RRDB file(1)\n");
+    return -1;
+  }
+
+  if ( 0 == sb.st_size ) {
+    posix_fallocate( pfd.data_fd, 0, sizeof(rrdbTouchHeader) );
+
+    if ( fstat( pfd.data_fd, &sb ) == -1 ) { /* To obtain file size */
+      free( pending );
+      unlockandclose( pfd );
+      rrdbprintf("ERROR: Couldn't stat RRDB file(2)\n");
+      return -1;
+    }
+
+    headerData = ( rrdbTouchHeader * ) mmap(NULL, sizeof(rrdbTouchHeader), PROT_WRITE | PROT_READ, MAP_SHARED, pfd.data_fd, 0);
+    if (headerData == MAP_FAILED) {
+      free( pending );
+      unlockandclose( pfd );
+      rrdbprintf("ERROR: Failed to read RRDB file header\n");
+      return -1;
+    }
+
+    /* In this version of RRDB file we create dynamically. */
+    headerData->fileVersion = RRDBTOUCHV4;
+    headerData->sets = 0;
+    headerData->samplesPerSet = sampleCount;
+    headerData->capacity = 0;
+    headerData->strings = 0;
+    headerData->lastSweep = 0;
+    /* whether it keeps values is up to its first touch */
+    headerData->values = 0 != pendingcount && pending[ 0 ].valued;
+
+    munmap( ( char * ) headerData, sizeof(rrdbTouchHeader) );
+  }
+
+  /* converted since we opened it - opening it again finds the new file (and decodes it if V3 or version 2) */
+  if ( storedlayout( getFileVersion( pfd.data_fd ) ) || replacedfile( &pfd, filename ) ) {
+    free( pending );
+    unlockandclose( pfd );
+    if ( ++reopens < RRDBSEQRETRIES ) goto reopen;
+    rrdbprintf( "ERROR: %s keeps changing under us\n", filename );
+    return -1;
+  }
+
+  if ( RRDBTOUCHV4 != getFileVersion( pfd.data_fd ) ) {
+    rrdbprintf("ERROR: Bad format for RRDB touch file\n");
+    free( pending );
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  /* sets move about from here on - keep lock free readers off */
+  seqwritebegin( pfd.data_fd, &seq );
+
+  /* the touches which did go in stay in, the caller hears about the rest */
+  if ( -1 == findTouchSets( pfd.data_fd, pending, pendingcount, maxsets ) ) retval = -1;
+
+  seqwriteend( pfd.data_fd, &seq );
+  free( pending );
+  unlockandclose( pfd );
+  return retval;
+}
+
+/**
+ * @return { int } 1 on success -1 on failure
+*/
+int runfetch( char *filename, char *xformations, char * cperiod ) {
+
+  rrdbFile ourFile;
+  int retval = 1;
+
+  /* before the file lock - see coalesceTouches */
+  coalescerlock( touchcoalescer );
+  locked_file_t pfd = openforfetch( filename );
+
+  if( -1 == pfd.data_fd ) {
+    coalescerunlock( touchcoalescer );
+    rrdbprintf( "ERROR: failed to open rrdb file '%s'\n", filename );
+    return -1;
+  }
+
+  switch( getFileVersion( pfd.data_fd ) ) {
+    case RRDBV1:
+    case RRDBV5:
+      memset( &ourFile, 0, sizeof( rrdbFile ) );
+      if( -1 == readRRDBFile( pfd.data_fd, &ourFile ) ) break;
+
+      if ( 0 != strlen( xformations ) ) {
+        /* anything archived is older than the ring */
+        if ( -1 == printRRDBArchive( pfd.data_fd, &ourFile, atoi( xformations ) ) ||
+             -1 == printRRDBFileXform( &ourFile, atoi( xformations ) ) ) {
+          retval = -1;
+        }
+      } else {
+        if ( -1 == printRRDBFile( &ourFile ) ) {
+          retval = -1;
+        }
+      }
+
+      break;
+    case RRDBTOUCHV4:
+      printRRDBTouchFile( pfd.data_fd, filename, xformations, cperiod );
+      break;
+    default:
+      rrdbprintf("ERROR: Unknown file format\n");
+      retval = -1;
+      break;
+  }
+
+  unlockandclose( pfd );
+  coalescerunlock( touchcoalescer );
+  return retval;
+}
+
+/*
+ The binary results of fetch and info (rrdb_fetch_binary, rrdb_info_binary) - the payloads of the
+ binary protocol, see the README.
+ */
+static void encodeRRDBFile( rrdbBuffer *out, rrdbFile *fileData ) {
+  unsigned int i, j, windowPos, rows = 0;
+  size_t rowsat;
+
+  putu8( out, RRDBRESULTRAW );
+  rowsat = out->length;
+  putu32( out, 0 );
+  putu32( out, fileData->header.setCount );
+
+  for ( i = 0 ; i < fileData->header.sampleCount; i++ ) {
+    windowPos = (i + fileData->header.windowPosition + 1)%fileData->header.sampleCount;
+    if ( 1 != fileData->times[windowPos].valid ) continue;
+
+    puti64( out, fileData->times[windowPos].time );
+    putu32( out, fileData->times[windowPos].uSecs );
+    for ( j = 0 ; j < fileData->header.setCount; j++ ) putf64( out, fileData->sets[j][windowPos] );
+    rows++;
+  }
+
+  patchu32( out, rowsat, rows );
+}
+
+static void encodeRRDBFileXform( rrdbBuffer *out, rrdbFile *fileData, unsigned int index ) {
+  unsigned int i, windowPos, rows = 0;
+  size_t rowsat;
+
+  putu8( out, RRDBRESULTXFORM );
+  rowsat = out->length;
+  putu32( out, 0 );
+
+  for ( i = 0 ; i < fileData->header.sampleCount; i++ ) {
+    windowPos = (i + fileData->xforms[index].windowPosition + 1)%fileData->header.sampleCount;
+    if ( 1 != fileData->xformtimes[index][windowPos].valid ) continue;
+
+    puti64( out, fileData->xformtimes[index][windowPos].time );
+    putf64( out, fileData->xformdata[index][windowPos] );
+    rows++;
+  }
+
+  patchu32( out, rowsat, rows );
+}
+
+static void encode_bin( intmax_t ts, rrdbInt v, void *arg ) {
+  rrdbBuffer *out = ( rrdbBuffer * ) arg;
+  puti64( out, ts );
+  putu32( out, v );
+  out->rows++;
+}
+
+static void encode_value_bin( intmax_t ts, const rrdbTouchValueBin *bin, void *arg ) {
+  rrdbBuffer *out = ( rrdbBuffer * ) arg;
+  puti64( out, ts );
+  putu32( out, bin->count );
+  putf64( out, bin->values.sum );
+  putf64( out, bin->values.min );
+  putf64( out, bin->values.max );
+  out->rows++;
+}
+
+/**
+ * The binary equivalent of runfetch, xform < 0 being the raw data.
+ * @return { int } 1 on success -1 on failure (error text written with rrdbprintf)
+ */
+static int encodefetch( rrdbBuffer *out, char *filename, int xform, char *path, char *period ) {
+  rrdbFile ourFile;
+  int retval = 1;
+
+  coalescerlock( touchcoalescer );
+  locked_file_t pfd = openforfetch( filename );
+  if( -1 == pfd.data_fd ) {
+    coalescerunlock( touchcoalescer );
+    rrdbprintf( "ERROR: failed to open rrdb file '%s'\n", filename );
+    return -1;
+  }
+
+  switch( getFileVersion( pfd.data_fd ) ) {
+    case RRDBV1:
+    case RRDBV5:
+      memset( &ourFile, 0, sizeof( rrdbFile ) );
+      if( -1 == readRRDBFile( pfd.data_fd, &ourFile ) ) {
+        retval = -1;
+        break;
+      }
+
+      if ( xform < 0 ) {
+        encodeRRDBFile( out, &ourFile );
+      } else if ( ( unsigned int ) xform < ourFile.xformheader.xformCount ) {
+        encodeRRDBFileXform( out, &ourFile, xform );
+      } else {
+        rrdbprintf("ERROR: xform index out of bounds\n");
+        retval = -1;
+      }
+
+      freeRRDBFile( &ourFile );
+      break;
+
+    case RRDBTOUCHV4:
+    {
+      struct stat sb;
+      int iperiod = getPeriodFromName( period );
+      if( -1 == iperiod ) iperiod = ONEHOUR;
+
+      if ( -1 == fstat( pfd.data_fd, &sb ) ) {
+        rrdbprintf("ERROR: cannot stat RRDB file\n");
+        retval = -1;
+        break;
+      }
+
+      char *addr = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, pfd.data_fd, 0 );
+      if( MAP_FAILED == addr ) {
+        rrdbprintf("ERROR: error accessing data file.\n");
+        retval = -1;
+        break;
+      }
+
+      rrdbTouchSet *owned;
+      const void *ring;
+      rrdbTouchSet *setHeader = touchFetchSet( filename, addr, sb.st_size, path, iperiod, &ring, &owned );
+      size_t rowsat;
+
+      putu8( out, ( ( rrdbTouchHeader * ) addr )->values ? RRDBRESULTTOUCHVALUES : RRDBRESULTTOUCH );
+      rowsat = out->length;
+      putu32( out, 0 );
+      out->rows = 0;
+      if( NULL != setHeader && ( ( rrdbTouchHeader * ) addr )->values )
+        walkTouchValues( ( rrdbTouchHeader * ) addr, setHeader, ring, encode_value_bin, out );
+      else if( NULL != setHeader )
+        walkTouchSet( ( rrdbTouchHeader * ) addr, setHeader, ring, encode_bin, out );
+      free( owned );
+      patchu32( out, rowsat, out->rows );
+
+      munmap( addr, sb.st_size );
+      break;
+    }
+    default:
+      rrdbprintf("ERROR: Unknown file format\n");
+      retval = -1;
+      break;
+  }
+
+  unlockandclose( pfd );
+  coalescerunlock( touchcoalescer );
+  return retval;
+}
+
+/**
+ * The binary equivalent of printRRDBFileInfo.
+ * @return { int } 1 on success -1 on failure (error text written with rrdbprintf)
+ */
+static int encodeinfo( rrdbBuffer *out, char *filename ) {
+  rrdbFile fileData;
+  unsigned int i;
+
+  locked_file_t pfd = snapshotopen( filename );
+  if( -1 == pfd.data_fd ) {
+    rrdbprintf("ERROR: failed to open %s\n", filename);
+    return -1;
+  }
+
+  if ( RRDBTOUCHV4 == getFileVersion( pfd.data_fd ) ) {
+    struct stat sb;
+
+    if ( -1 == fstat( pfd.data_fd, &sb ) ) {
+      rrdbprintf("ERROR: cannot stat RRDB file\n");
+      unlockandclose( pfd );
+      return -1;
+    }
+
+    char *addr = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, pfd.data_fd, 0 );
+    if( MAP_FAILED == addr ) {
+      rrdbprintf("ERROR: error accessing data file.\n");
+      unlockandclose( pfd );
+      return -1;
+    }
+
+    rrdbTouchHeader *header = ( rrdbTouchHeader * ) addr;
+
+    if ( !touchFileValid( addr, sb.st_size ) ) {
+      rrdbprintf("ERROR: RRDB header data corrupt\n");
+      munmap( addr, sb.st_size );
+      unlockandclose( pfd );
+      return -1;
+    }
+
+    putu8( out, RRDBRESULTINFOTOUCH );
+    putu32( out, touchSetsInUse( header ) );
+    putu32( out, header->samplesPerSet );
+    for ( i = 0; i < header->sets; i++ ) {
+      rrdbTouchSet *setHeader = touchSetAt( header, i );
+      /* free */
+      if ( 0 == setHeader->length ) continue;
+      putstring( out, touchSetPath( header, setHeader ) );
+      putu32( out, getTimePerSample( setHeader->period ) );
+    }
+
+    munmap( addr, sb.st_size );
+    unlockandclose( pfd );
+    return 1;
+  }
+
+  memset( &fileData, 0, sizeof( rrdbFile ) );
+  if( -1 == readRRDBFile( pfd.data_fd, &fileData ) ) {
+    unlockandclose( pfd );
+    return -1;
+  }
+
+  putu8( out, RRDBRESULTINFOV1 );
+  putu32( out, fileData.header.setCount );
+  putu32( out, fileData.header.sampleCount );
+  putu32( out, fileData.header.windowPosition );
+  putu32( out, fileData.xformheader.xformCount );
+  for ( i = 0 ; i < fileData.xformheader.xformCount; i++ ) {
+    putu8( out, fileData.xforms[i].calc );
+    putu8( out, fileData.xforms[i].period );
+    putu32( out, fileData.xforms[i].setIndex );
+  }
+
+  freeRRDBFile( &fileData );
+  unlockandclose( pfd );
+  return 1;
+}
+
+/*
+ The busiest paths under a prefix (topRRDBTouchFile). The n largest totals are kept in a
+ min heap, the least of them at the top to be replaced, and sorted once they are all in.
+ */
+typedef struct rrdbTopPath {
+  const char *path;
+  uint64_t total;
+} rrdbTopPath;
+
+typedef struct rrdbTouchTotal {
+  time_t tps;
+  /* the oldest tick counted */
+  time_t first;
+  uint64_t total;
+} rrdbTouchTotal;
+
+static void total_bin( intmax_t ts, rrdbInt v, void *arg ) {
+  rrdbTouchTotal *t = arg;
+  if ( ts / t->tps >= t->first ) t->total += v;
+}
+
+/* more first: the larger total, or for the same total the path which sorts first */
+static int comparetop( const void *a, const void *b ) {
+  const rrdbTopPath *x = a, *y = b;
+  if ( x->total != y->total ) return x->total > y->total ? -1 : 1;
+  return strcmp( x->path, y->path );
+}
+
+static void topsiftdown( rrdbTopPath *heap, unsigned int count, unsigned int i ) {
+  for ( ;; ) {
+    unsigned int least = i, l = 2 * i + 1, r = 2 * i + 2;
+    rrdbTopPath t;
+
+    if ( l < count && comparetop( &heap[ l ], &heap[ least ] ) > 0 ) least = l;
+    if ( r < count && comparetop( &heap[ r ], &heap[ least ] ) > 0 ) least = r;
+    if ( least == i ) return;
+
+    t = heap[ i ];
+    heap[ i ] = heap[ least ];
+    heap[ least ] = t;
+    i = least;
+  }
+}
+
+/**
+ * Print the n (0 for all) paths starting with prefix (less any * on the end) with the most touches in the last bins
+ * (0 for the whole ring) bins of period, as path:total, the most first.
+ * @return { int } 1 on success -1 on failure
+ */
+int topRRDBTouchFile( char *filename, char *prefix, char *period, unsigned int n, unsigned int bins ) {
+  struct stat sb;
+  char *addr;
+  rrdbTouchHeader *header;
+  rrdbTouchSet **found = NULL;
+  rrdbTopPath *heap = NULL;
+  unsigned int count = 0;
+  size_t length;
+  int retval = 1;
+  int iperiod = getPeriodFromName( period );
+
+  if ( -1 == iperiod ) iperiod = ONEHOUR;
+
+  /* before the file lock - see coalesceTouches */
+  coalescerlock( touchcoalescer );
+  locked_file_t pfd = openforfetch( filename );
+
+  if ( -1 == pfd.data_fd ) {
+    coalescerunlock( touchcoalescer );
+    rrdbprintf( "ERROR: failed to open rrdb file '%s'\n", filename );
+    return -1;
+  }
+
+  if ( RRDBTOUCHV4 != getFileVersion( pfd.data_fd ) || -1 == fstat( pfd.data_fd, &sb ) ||
+       MAP_FAILED == ( addr = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, pfd.data_fd, 0 ) ) ) {
+    unlockandclose( pfd );
+    coalescerunlock( touchcoalescer );
+    rrdbprintf( "ERROR: '%s' is not a touch file\n", filename );
+    return -1;
+  }
+
+  header = ( rrdbTouchHeader * ) addr;
+  if ( !touchFileValid( addr, sb.st_size ) ) goto done;
+
+  /* a * on the end as for fetch */
+  length = strlen( prefix );
+  if ( 0 != length && '*' == prefix[ length - 1 ] ) length--;
+
+  found = findTouchPrefixSets( header, prefix, length, iperiod );
+  heap = malloc( sizeof( rrdbTopPath ) * ( header->strings / 4 + 1 ) );
+  if ( NULL == found || NULL == heap ) {
+    rrdbprintf( "ERROR: out of memory\n" );
+    retval = -1;
+    goto done;
+  }
+
+  for ( unsigned int i = 0; i < header->strings / 4; i++ ) {
+    rrdbTouchSet *view, *owned;
+    const void *ring;
+    rrdbTouchTotal t = { .tps = getTimePerSample( iperiod ) };
+    rrdbTopPath top;
+
+    if ( NULL == found[ i ] ) continue;
+    top.path = touchSetPath( header, found[ i ] );
+    view = touchView( filename, header, found[ i ], ( char * ) top.path, iperiod, &ring, &owned );
+    if ( NULL == view ) continue;
+
+    if ( 0 != bins ) t.first = time( NULL ) / t.tps - bins + 1;
+    walkTouchSet( header, view, ring, total_bin, &t );
+    free( owned );
+    top.total = t.total;
+
+    /* the least of the n at heap[ 0 ] */
+    if ( 0 == n || count < n ) {
+      heap[ count++ ] = top;
+      if ( 0 != n && count == n ) {
+        for ( unsigned int j = n / 2; j-- > 0; ) topsiftdown( heap, count, j );
+      }
+    } else if ( comparetop( &top, &heap[ 0 ] ) < 0 ) {
+      heap[ 0 ] = top;
+      topsiftdown( heap, count, 0 );
+    }
+  }
+
+  qsort( heap, count, sizeof( rrdbTopPath ), comparetop );
+  for ( unsigned int i = 0; i < count; i++ ) rrdbprintf( "%s:%" PRIu64 "\n", heap[ i ].path, heap[ i ].total );
+
+done:
+  free( found );
+  free( heap );
+  munmap( addr, sb.st_size );
+  unlockandclose( pfd );
+  coalescerunlock( touchcoalescer );
+  return retval;
+}
+
+/**
+ * @return { int } 1 on success -1 on failure.
+*/
+/*
+ Fetching across files (aggregateRRDBFiles). Workers take the files one at a time, read
+ the points of each holding its shared lock and merge them into buckets of their own,
+ which are merged when they have all finished.
+ */
+typedef struct rrdbPointList {
+  rrdbArchivePoint *points;
+  size_t count;
+  size_t size;
+  int failed;
+} rrdbPointList;
+
+static void listpoint( int64_t time, double value, void *arg ) {
+  rrdbPointList *list = ( rrdbPointList * ) arg;
+
+  if ( list->count == list->size ) {
+    size_t size = MAX( 64, list->size * 2 );
+    rrdbArchivePoint *points = realloc( list->points, sizeof( rrdbArchivePoint ) * size );
+    if ( NULL == points ) {
+      list->failed = TRUE;
+      return;
+    }
+    list->points = points;
+    list->size = size;
+  }
+
+  list->points[ list->count++ ] = ( rrdbArchivePoint ) { time, value };
+}
+
+static void listbin( intmax_t ts, rrdbInt v, void *arg ) {
+  listpoint( ts, v, arg );
+}
+
+static int comparepoints( const void *a, const void *b ) {
+  int64_t x = ( ( const rrdbArchivePoint * ) a )->time, y = ( ( const rrdbArchivePoint * ) b )->time;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * The points of xform selector (V1, archive first) or touch path selector and period in filename.
+ * @return { int } 1 on success -1 on failure
+ */
+static int aggregatepoints( char *filename, const char *selector, const char *period, rrdbPointList *list ) {
+  rrdbFile fileData;
+  struct stat sb;
+  int retval = -1;
+
+  locked_file_t pfd = readopenandlock( filename );
+  if ( -1 == pfd.data_fd ) return -1;
+
+  switch ( getFileVersion( pfd.data_fd ) ) {
+    case RRDBV1:
+    case RRDBV5:
+    {
+      unsigned int index = atoi( selector );
+
+      memset( &fileData, 0, sizeof( rrdbFile ) );
+      if ( -1 == readRRDBFile( pfd.data_fd, &fileData ) ) break;
+
+      if ( index < fileData.xformheader.xformCount && 1 == visitRRDBArchive( pfd.data_fd, &fileData, index, listpoint, list ) ) {
+        unsigned int n = fileData.header.sampleCount;
+
+        for ( unsigned int p = 1; p <= n; p++ ) {
+          unsigned int i = ( fileData.xforms[ index ].windowPosition + p ) % n;
+          if ( 1 == fileData.xformtimes[ index ][ i ].valid ) listpoint( fileData.xformtimes[ index ][ i ].time, fileData.xformdata[ index ][ i ], list );
+        }
+        retval = 1;
+      }
+
+      freeRRDBFile( &fileData );
+      break;
+    }
+
+    case RRDBTOUCHV4:
+    {
+      int iperiod = getPeriodFromName( period );
+      if ( -1 == iperiod ) iperiod = ONEHOUR;
+
+      if ( -1 == fstat( pfd.data_fd, &sb ) || sb.st_size < ( off_t ) sizeof( rrdbTouchHeader ) ) break;
+
+      char *addr = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, pfd.data_fd, 0 );
+      if ( MAP_FAILED == addr ) break;
+
+      /* a file which hasn't seen the path has nothing to add */
+      rrdbTouchSet *owned;
+      const void *ring;
+      rrdbTouchSet *setHeader = touchFetchSet( NULL, addr, sb.st_size, ( char * ) selector, iperiod, &ring, &owned );
+      if ( NULL != setHeader ) walkTouchSet( ( rrdbTouchHeader * ) addr, setHeader, ring, listbin, list );
+      free( owned );
+
+      munmap( addr, sb.st_size );
+      retval = 1;
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  unlockandclose( pfd );
+  return list->failed ? -1 : retval;
+}
+
+/**
+ * Merge two runs of buckets sorted by time.
+ * @return { rrdbAggregateBucket * } count of them (to free) or NULL if we ran out of memory
+ */
+static rrdbAggregateBucket *mergebuckets( const rrdbAggregateBucket *a, size_t na, const rrdbAggregateBucket *b, size_t nb, size_t *count ) {
+  rrdbAggregateBucket *merged = malloc( sizeof( rrdbAggregateBucket ) * ( na + nb + 1 ) );
+  size_t i = 0, j = 0, n = 0;
+
+  if ( NULL == merged ) return NULL;
+
+  while ( i < na || j < nb ) {
+    if ( j == nb || ( i < na && a[ i ].time < b[ j ].time ) ) {
+      merged[ n++ ] = a[ i++ ];
+    } else if ( i == na || b[ j ].time < a[ i ].time ) {
+      merged[ n++ ] = b[ j++ ];
+    } else {
+      merged[ n ] = a[ i++ ];
+      merged[ n ].sum += b[ j ].sum;
+      merged[ n ].min = MIN( merged[ n ].min, b[ j ].min );
+      merged[ n ].max = MAX( merged[ n ].max, b[ j ].max );
+      merged[ n++ ].count += b[ j++ ].count;
+    }
+  }
+
+  *count = n;
+  return merged;
+}
+
+static void aggregatefailed( rrdbAggregateRun *run, size_t file ) {
+  ssize_t none = -1;
+  __atomic_compare_exchange_n( &run->failed, &none, ( ssize_t ) file, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+}
+
+static void aggregatejob( void *arg ) {
+  rrdbAggregatePartial *partial = ( rrdbAggregatePartial * ) arg;
+  rrdbAggregateRun *run = partial->run;
+  rrdbPointList list = { NULL, 0, 0, FALSE };
+  /* anything said on the way is for stderr, aggregateRRDBFiles reports which file failed */
+  FILE *previous = rrdbsetoutput( stderr );
+
+  while ( TRUE ) {
+    size_t f = __atomic_fetch_add( &run->next, 1, __ATOMIC_SEQ_CST );
+    rrdbAggregateBucket *buckets, *merged;
+    size_t count = 0;
+
+    if ( f >= run->filecount ) break;
+
+    list.count = 0;
+    list.failed = FALSE;
+    if ( -1 == aggregatepoints( run->files[ f ], run->selector, run->period, &list ) ) {
+      aggregatefailed( run, f );
+      continue;
+    }
+
+    /* the file's own points as buckets, in order */
+    qsort( list.points, list.count, sizeof( rrdbArchivePoint ), comparepoints );
+    buckets = malloc( sizeof( rrdbAggregateBucket ) * ( list.count + 1 ) );
+    if ( NULL == buckets ) {
+      aggregatefailed( run, f );
+      continue;
+    }
+
+    for ( size_t i = 0; i < list.count; i++ ) {
+      double v = list.points[ i ].value;
+      if ( count > 0 && buckets[ count - 1 ].time == list.points[ i ].time ) {
+        buckets[ count - 1 ].sum += v;
+        buckets[ count - 1 ].min = MIN( buckets[ count - 1 ].min, v );
+        buckets[ count - 1 ].max = MAX( buckets[ count - 1 ].max, v );
+      } else {
+        buckets[ count++ ] = ( rrdbAggregateBucket ) { list.points[ i ].time, v, v, v, 1 };
+      }
+    }
+
+    merged = mergebuckets( partial->buckets, partial->count, buckets, count, &count );
+    free( buckets );
+    if ( NULL == merged ) {
+      aggregatefailed( run, f );
+      continue;
+    }
+
+    free( partial->buckets );
+    partial->buckets = merged;
+    partial->count = count;
+  }
+
+  free( list.points );
+  rrdbsetoutput( previous );
+}
+
+/**
+ * RRDBCalculation of a reduction, SUM or RRDBSUM and so on.
+ * @return { int } -1 if we don't know it
+ */
+static int aggregateCalculation( const char *name ) {
+  /* in RRDBCalculation order */
+  static const char *names[] = { "MAX", "MIN", "COUNT", "MEAN", "SUM" };
+
+  if ( 0 == strncmp( name, "RRDB", 4 ) ) name += 4;
+  for ( unsigned int i = 0; i < sizeof( names ) / sizeof( names[ 0 ] ); i++ ) {
+    if ( 0 == strcasecmp( name, names[ i ] ) ) return i;
+  }
+  return -1;
+}
+
+/************************************************************************************
+ * Function: aggregateRRDBFiles
+ *
+ * Purpose: Fetch an xform (selector an index) or a touch path and period from every
+ * file pattern matches (a glob, {a,b} for a list) and combine them into one series,
+ * a point for each time any of them has: reduce is SUM, MIN, MAX, MEAN or COUNT (the
+ * number of files with a point then). The files are read on threads workers (0 for
+ * one a cpu) holding their shared locks.
+ ************************************************************************************/
+int aggregateRRDBFiles( char *pattern, char *selector, char *period, char *reduce, unsigned int threads ) {
+  glob_t g;
+  int calc = aggregateCalculation( reduce );
+  rrdbAggregateRun run;
+  rrdbAggregatePartial *partials;
+  rrdbAggregateBucket *buckets = NULL;
+  size_t count = 0;
+  int retval = -1;
+
+  if ( -1 == calc ) {
+    rrdbprintf( "ERROR: unknown reduction '%s' - SUM, MIN, MAX, MEAN or COUNT\n", reduce );
+    return -1;
+  }
+
+  if ( 0 == selector[ 0 ] ) {
+    rrdbprintf( "ERROR: aggregate needs an xform index or a touch path\n" );
+    return -1;
+  }
+
+  switch ( glob( pattern, GLOB_BRACE, NULL, &g ) ) {
+    case 0:
+      break;
+    case GLOB_NOMATCH:
+      rrdbprintf( "ERROR: no files match %s\n", pattern );
+      return -1;
+    default:
+      rrdbprintf( "ERROR: failed to read %s\n", pattern );
+      return -1;
+  }
+
+  /* touches waiting to be written count too */
+  if ( NULL != touchcoalescer ) coalescerflush( touchcoalescer );
+
+  if ( 0 == threads ) threads = MAX( 1, sysconf( _SC_NPROCESSORS_ONLN ) );
+  threads = MIN( threads, g.gl_pathc );
+
+  run = ( rrdbAggregateRun ) { g.gl_pathv, g.gl_pathc, 0, selector, period, -1 };
+  partials = calloc( threads, sizeof( rrdbAggregatePartial ) );
+  if ( NULL == partials ) {
+    rrdbprintf( "ERROR: out of memory\n" );
+    globfree( &g );
+    return -1;
+  }
+
+  rrdbPool *pool = threads > 1 ? rrdbpoolcreate( threads ) : NULL;
+  for ( unsigned int w = 0; w < threads; w++ ) {
+    partials[ w ].run = &run;
+    if ( NULL == pool || -1 == rrdbpoolsubmit( pool, aggregatejob, &partials[ w ] ) ) aggregatejob( &partials[ w ] );
+  }
+  if ( NULL != pool ) rrdbpooldestroy( pool );
+
+  if ( -1 != run.failed ) {
+    rrdbprintf( "ERROR: failed to read %s\n", run.files[ run.failed ] );
+    goto done;
+  }
+
+  for ( unsigned int w = 0; w < threads; w++ ) {
+    rrdbAggregateBucket *merged = mergebuckets( buckets, count, partials[ w ].buckets, partials[ w ].count, &count );
+    if ( NULL == merged ) {
+      rrdbprintf( "ERROR: out of memory\n" );
+      goto done;
+    }
+    free( buckets );
+    buckets = merged;
+  }
+
+  for ( size_t i = 0; i < count; i++ ) {
+    double value;
+
+    switch ( calc ) {
+      case RRDBMAX:
+        value = buckets[ i ].max;
+        break;
+      case RRDBMIN:
+        value = buckets[ i ].min;
+        break;
+      case RRDBCOUNT:
+        value = buckets[ i ].count;
+        break;
+      case RRDBMEAN:
+        value = buckets[ i ].sum / buckets[ i ].count;
+        break;
+      default:
+        value = buckets[ i ].sum;
+        break;
+    }
+    rrdbprintf( "%" PRId64 ":%f\n", buckets[ i ].time, value );
+  }
+  retval = 1;
+
+done:
+  for ( unsigned int w = 0; w < threads; w++ ) free( partials[ w ].buckets );
+  free( partials );
+  free( buckets );
+  globfree( &g );
+  return retval;
+}
+
+int runcreate( char *filename, unsigned int sampleCount, unsigned int setCount, char *xformations ) {
+  rrdbFile check;
+  char xformscopy[ MAXVALUESTRING ];
+
+  if ( 0 >= sampleCount ) {
+    rrdbprintf("ERROR: sample count too small, must be more than zero.\n");
+    return -1;
+  }
+
+  /* a bad xform is reported before there is a file (parseXforms splits its copy in place) */
+  if ( strlen( xformations ) >= sizeof( xformscopy ) ) {
+    rrdbprintf("ERROR: Length of xformation string too long\n");
+    return -1;
+  }
+  strcpy( xformscopy, xformations );
+  if ( -1 == parseXforms( xformscopy, &check ) ) return -1;
+
+  locked_file_t pfd = initRRDBFile( filename, setCount, sampleCount, xformations);
+  if ( -1 == pfd.data_fd  ) {
+    rrdbprintf( "ERROR: writing db file error" );
+    return -1;
+  }
+
+  unlockandclose( pfd );
+  return 1;
+}
+
+/*
+ The public interface (librrdb.h). Everything underneath writes through rrdbprintf, so
+ we point that at a memstream for the duration of a call and hand the text back in the
+ caller's buffer.
+ */
+typedef struct rrdbCapture {
+  FILE *stream;
+  FILE *previous;
+  char *data;
+  size_t length;
+} rrdbCapture;
+
+static pthread_mutex_t coalescerlockcreate = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ringlockcreate = PTHREAD_MUTEX_INITIALIZER;
+
+static int capturebegin( rrdbCapture *c ) {
+  c->data = NULL;
+  c->length = 0;
+  c->stream = open_memstream( &c->data, &c->length );
+  if ( NULL == c->stream ) return -1;
+  c->previous = rrdbsetoutput( c->stream );
+  return 0;
+}
+
+static int captureend( rrdbCapture *c, int ret, rrdb_buffer *out ) {
+  int retval = ret < 0 ? RRDB_ERROR : RRDB_OK;
+
+  rrdbsetoutput( c->previous );
+  fclose( c->stream );
+
+  if ( NULL != out ) {
+    out->length = c->length;
+    if ( NULL != out->data && out->size > 0 ) {
+      size_t copy = MIN( c->length, out->size - 1 );
+      memcpy( out->data, c->data, copy );
+      out->data[ copy ] = 0;
+    }
+    if ( RRDB_OK == retval && c->length > 0 && c->length >= out->size ) retval = RRDB_TRUNCATED;
+  }
+
+  free( c->data );
+  return retval;
+}
+
+static int capturefailed( rrdb_buffer *out ) {
+  if ( NULL != out && NULL != out->data && out->size > 0 ) {
+    snprintf( out->data, out->size, "ERROR: out of memory\n" );
+    out->length = strlen( out->data );
+  }
+  return RRDB_ERROR;
+}
+
+/**
+ * As captureend for a call which built a binary result - on success out gets result rather
+ * than the text, which can't have anything but warnings in it.
+ */
+static int capturebinary( rrdbCapture *c, int ret, rrdbBuffer *result, rrdb_buffer *out ) {
+  if ( 1 == ret && result->overrun ) {
+    rrdbprintf( "ERROR: out of memory\n" );
+    ret = -1;
+  }
+
+  if ( -1 == ret ) {
+    free( result->data );
+    return captureend( c, ret, out );
+  }
+
+  rrdbsetoutput( c->previous );
+  fclose( c->stream );
+  free( c->data );
+
+  int retval = RRDB_OK;
+  if ( NULL != out ) {
+    out->length = result->length;
+    if ( NULL != out->data && out->size > 0 ) {
+      size_t copy = MIN( result->length, out->size - 1 );
+      if ( copy > 0 ) memcpy( out->data, result->data, copy );
+      out->data[ copy ] = 0;
+    }
+    if ( result->length > 0 && result->length >= out->size ) retval = RRDB_TRUNCATED;
+  }
+
+  free( result->data );
+  return retval;
+}
+
+int rrdb_create( const char *filename, unsigned int sets, unsigned int samples, const char *xforms, rrdb_buffer *out ) {
+  char xformscopy[ MAXVALUESTRING ];
+  rrdbCapture c;
+
+  if ( strlen( xforms ) >= sizeof( xformscopy ) ) return capturefailed( out );
+  strcpy( xformscopy, xforms );
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, runcreate( ( char * ) filename, samples, sets, xformscopy ), out );
+}
+
+int rrdb_update( const char *filename, const double *values, unsigned int count, rrdb_buffer *out ) {
+  rrdbNumber numbers[ MAXNUMSETS ];
+  rrdbCapture c;
+
+  if ( count > MAXNUMSETS ) count = MAXNUMSETS;
+  for ( unsigned int i = 0; i < count; i++ ) numbers[ i ] = values[ i ];
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, updateRRDBFileValues( ( char * ) filename, numbers, count ), out );
+}
+
+int rrdb_update_many( const char *const *filenames, const double *const *values, const unsigned int *counts, unsigned int n,
+                      int *status, rrdb_buffer *out ) {
+  size_t total = 0;
+  rrdbCapture c;
+  int ret;
+
+  for ( unsigned int i = 0; i < n; i++ ) total += MIN( counts[ i ], MAXNUMSETS );
+
+  rrdbNumber *numbers = malloc( sizeof( rrdbNumber ) * total + 1 );
+  rrdbNumber **into = malloc( sizeof( rrdbNumber * ) * n + 1 );
+  unsigned int *clamped = malloc( sizeof( unsigned int ) * n + 1 );
+  int *done = malloc( sizeof( int ) * n + 1 );
+  if ( NULL == numbers || NULL == into || NULL == clamped || NULL == done || -1 == capturebegin( &c ) ) {
+    free( numbers );
+    free( into );
+    free( clamped );
+    free( done );
+    for ( unsigned int i = 0; i < n; i++ ) status[ i ] = RRDB_ERROR;
+    return capturefailed( out );
+  }
+
+  total = 0;
+  for ( unsigned int i = 0; i < n; i++ ) {
+    clamped[ i ] = MIN( counts[ i ], MAXNUMSETS );
+    into[ i ] = numbers + total;
+    for ( unsigned int j = 0; j < clamped[ i ]; j++ ) into[ i ][ j ] = values[ i ][ j ];
+    total += clamped[ i ];
+  }
+
+  ret = 0 == updateRRDBFilesValues( ( char ** ) filenames, into, clamped, n, done ) ? 1 : -1;
+  for ( unsigned int i = 0; i < n; i++ ) status[ i ] = 1 == done[ i ] ? RRDB_OK : RRDB_ERROR;
+
+  free( numbers );
+  free( into );
+  free( clamped );
+  free( done );
+  return captureend( &c, ret, out );
+}
+
+int rrdb_touch( const char *filename, const char *path, const char *periods, unsigned int maxsets, unsigned int samples,
+                unsigned int count, time_t when, rrdb_buffer *out ) {
+  char pathcopy[ MAXVALUESTRING ];
+  char periodcopy[ MAXVALUESTRING ];
+  rrdbCapture c;
+
+  if ( strlen( path ) >= sizeof( pathcopy ) || strlen( periods ) >= sizeof( periodcopy ) ) return capturefailed( out );
+  /* touchRRDBFile splits these in place */
+  strcpy( pathcopy, path );
+  strcpy( periodcopy, periods );
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, touchRRDBFile( ( char * ) filename, pathcopy, periodcopy, maxsets, samples, count, when, NULL ), out );
+}
+
+int rrdb_touch_value( const char *filename, const char *path, const char *periods, unsigned int maxsets, unsigned int samples,
+                      unsigned int count, double value, time_t when, rrdb_buffer *out ) {
+  char pathcopy[ MAXVALUESTRING ];
+  char periodcopy[ MAXVALUESTRING ];
+  rrdbCapture c;
+
+  if ( strlen( path ) >= sizeof( pathcopy ) || strlen( periods ) >= sizeof( periodcopy ) ) return capturefailed( out );
+  strcpy( pathcopy, path );
+  strcpy( periodcopy, periods );
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, touchRRDBFile( ( char * ) filename, pathcopy, periodcopy, maxsets, samples, count, when, &value ), out );
+}
+
+int rrdb_fetch( const char *filename, const char *selector, const char *period, rrdb_buffer *out ) {
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, runfetch( ( char * ) filename, ( char * ) selector, ( char * ) period ), out );
+}
+
+int rrdb_fetch_binary( const char *filename, int xform, const char *path, const char *period, rrdb_buffer *out ) {
+  rrdbBuffer result = { 0 };
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return capturebinary( &c, encodefetch( &result, ( char * ) filename, xform, ( char * ) path, ( char * ) period ), &result, out );
+}
+
+int rrdb_aggregate( const char *pattern, const char *selector, const char *period, const char *reduce, unsigned int threads, rrdb_buffer *out ) {
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, aggregateRRDBFiles( ( char * ) pattern, ( char * ) selector, ( char * ) period, ( char * ) reduce, threads ), out );
+}
+
+int rrdb_top( const char *filename, const char *prefix, const char *period, unsigned int n, unsigned int bins, rrdb_buffer *out ) {
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, topRRDBTouchFile( ( char * ) filename, ( char * ) prefix, ( char * ) period, n, bins ), out );
+}
+
+int rrdb_info( const char *filename, rrdb_buffer *out ) {
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, printRRDBFileInfo( ( char * ) filename ), out );
+}
+
+int rrdb_info_binary( const char *filename, rrdb_buffer *out ) {
+  rrdbBuffer result = { 0 };
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return capturebinary( &c, encodeinfo( &result, ( char * ) filename ), &result, out );
+}
+
+int rrdb_modify( const char *filename, const char *values, const char *xforms, rrdb_buffer *out ) {
+  char valuescopy[ MAXVALUESTRING ];
+  char xformscopy[ MAXVALUESTRING ];
+  rrdbCapture c;
+
+  if ( strlen( values ) >= sizeof( valuescopy ) || strlen( xforms ) >= sizeof( xformscopy ) ) return capturefailed( out );
+  /* modifyRRDBFile splits these in place */
+  strcpy( valuescopy, values );
+  strcpy( xformscopy, xforms );
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, modifyRRDBFile( ( char * ) filename, valuescopy, xformscopy ), out );
+}
+
+int rrdb_scan( const char *dir, const char *emit, const char *selector, const char *period, unsigned int threads, FILE *stream ) {
+  char emitcopy[ MAXVALUESTRING ];
+
+  if ( strlen( emit ) >= sizeof( emitcopy ) ) return RRDB_ERROR;
+  strcpy( emitcopy, emit );
+
+  /* too much to hand back in a buffer, so it writes as it goes */
+  FILE *previous = rrdbsetoutput( stream );
+  int ret = scanRRDBTree( ( char * ) dir, emitcopy, ( char * ) selector, ( char * ) period, threads );
+  rrdbsetoutput( previous );
+
+  return -1 == ret ? RRDB_ERROR : RRDB_OK;
+}
+
+int rrdb_archive( const char *filename, rrdb_buffer *out ) {
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, archiveRRDBFile( ( char * ) filename ), out );
+}
+
+int rrdb_convert( const char *filename, int version, rrdb_buffer *out ) {
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, convertRRDBFile( ( char * ) filename, version ), out );
+}
+
+int rrdb_convert_tree( const char *dir, int version, unsigned int threads, rrdb_buffer *out ) {
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, convertRRDBTree( ( char * ) dir, version, threads ), out );
+}
+
+int rrdb_reshape( const char *filename, unsigned int sets, unsigned int samples, const char *xforms, rrdb_buffer *out ) {
+  char xformscopy[ MAXVALUESTRING ];
+  rrdbCapture c;
+
+  if ( strlen( xforms ) >= sizeof( xformscopy ) ) return capturefailed( out );
+  strcpy( xformscopy, xforms );
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  return captureend( &c, reshapeRRDBFile( ( char * ) filename, sets, samples, xformscopy ), out );
+}
+
+int rrdb_set_lock_mode( const char *mode ) {
+  return -1 == rrdbsetlockmode( mode ) ? RRDB_ERROR : RRDB_OK;
+}
+
+int rrdb_lock_stats( rrdb_buffer *out ) {
+  rrdbCapture c;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+  printlockstats();
+  return captureend( &c, 1, out );
+}
+
+int rrdb_coalesce( unsigned int ms ) {
+  int retval = RRDB_OK;
+
+  pthread_mutex_lock( &coalescerlockcreate );
+  if ( NULL == touchcoalescer ) {
+    if ( 0 != ms ) {
+      rrdbCoalescer *c = coalescercreate( ms );
+      if ( NULL == c ) retval = RRDB_ERROR;
+      /* touchRRDBFile looks without the lock */
+      __atomic_store_n( &touchcoalescer, c, __ATOMIC_RELEASE );
+    }
+  } else if ( -1 == coalescersetinterval( touchcoalescer, ms ) ) {
+    retval = RRDB_ERROR;
+  }
+  pthread_mutex_unlock( &coalescerlockcreate );
+
+  return retval;
+}
+
+int rrdb_flush( void ) {
+  int retval = RRDB_OK;
+
+  pthread_mutex_lock( &coalescerlockcreate );
+  if ( NULL != touchcoalescer && -1 == coalescerflush( touchcoalescer ) ) retval = RRDB_ERROR;
+  pthread_mutex_unlock( &coalescerlockcreate );
+
+  return retval;
+}
+
+int rrdb_ring_serve( const char *name, const char *dir, unsigned int slots, rrdb_buffer *out ) {
+  rrdbCapture c;
+  int ret = 1;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+
+  pthread_mutex_lock( &ringlockcreate );
+  if ( NULL != ringserver ) {
+    rrdbprintf( "ERROR: already serving ring %s\n", ringserver->name + 1 );
+    ret = -1;
+  } else {
+    ringserver = ringservercreate( name, NULL == dir ? "" : dir, slots );
+    if ( NULL == ringserver ) ret = -1;
+  }
+  pthread_mutex_unlock( &ringlockcreate );
+
+  return captureend( &c, ret, out );
+}
+
+int rrdb_ring_stats( rrdb_buffer *out ) {
+  rrdbCapture c;
+  int ret = 1;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+
+  pthread_mutex_lock( &ringlockcreate );
+  if ( NULL == ringserver ) {
+    rrdbprintf( "ERROR: no ring is being served\n" );
+    ret = -1;
+  } else {
+    printringstats( ringserver );
+  }
+  pthread_mutex_unlock( &ringlockcreate );
+
+  return captureend( &c, ret, out );
+}
+
+void rrdb_shutdown( void ) {
+  /* first, as what it drains may go to the coalescer */
+  pthread_mutex_lock( &ringlockcreate );
+  if ( NULL != ringserver ) {
+    ringserverdestroy( ringserver );
+    ringserver = NULL;
+  }
+  pthread_mutex_unlock( &ringlockcreate );
+
+  pthread_mutex_lock( &coalescerlockcreate );
+  if ( NULL != touchcoalescer ) {
+    coalescerdestroy( touchcoalescer );
+    touchcoalescer = NULL;
+  }
+  pthread_mutex_unlock( &coalescerlockcreate );
+}
+
+/*
+ Cursors. The layout of a V1 file is the header, the times, each set, the xform header then
+ for each xform its header, times and data - each ring sampleCount long. A touch file is its
+ header then each set header followed by its bins.
+ */
+_Static_assert( sizeof( rrdb_time_point ) == sizeof( rrdbTimePoint ) &&
+                offsetof( rrdb_time_point, valid ) == offsetof( rrdbTimePoint, valid ), "rrdb_time_point must match rrdbTimePoint" );
+_Static_assert( sizeof( long double ) == sizeof( rrdbNumber ) && sizeof( unsigned int ) == sizeof( rrdbInt ), "span value types must match the file" );
+
+/**
+ * Take a private copy of the file: the lock free snapshot is mapped as is, if we had to
+ * fall back to a read lock we copy it out so the lock can go.
+ * @return { rrdb_cursor * } or NULL on failure (having said why)
+ */
+static rrdb_cursor *cursoropen( const char *filename ) {
+  rrdb_cursor *cursor;
+  struct stat sb;
+
+  locked_file_t pfd = snapshotopen( ( char * ) filename );
+  if ( -1 == pfd.data_fd ) {
+    rrdbprintf( "ERROR: failed to open rrdb file '%s'\n", filename );
+    return NULL;
+  }
+
+  cursor = calloc( 1, sizeof( rrdb_cursor ) );
+  if ( NULL == cursor || -1 == fstat( pfd.data_fd, &sb ) || sb.st_size < ( off_t ) sizeof( rrdbVersionHeader ) ) {
+    rrdbprintf( "ERROR: failed to read rrdb file '%s'\n", filename );
+    free( cursor );
+    unlockandclose( pfd );
+    return NULL;
+  }
+  cursor->size = sb.st_size;
+
+  /* a snapshot is ours alone (lockedat is only set when we hold a lock) */
+  if ( 0 == pfd.lockedat ) {
+    cursor->base = mmap( NULL, cursor->size, PROT_READ, MAP_SHARED, pfd.data_fd, 0 );
+    cursor->mapped = TRUE;
+    if ( MAP_FAILED == cursor->base ) cursor->base = NULL;
+  } else {
+    cursor->base = malloc( cursor->size );
+    if ( NULL != cursor->base && ( ssize_t ) cursor->size != pread( pfd.data_fd, cursor->base, cursor->size, 0 ) ) {
+      free( cursor->base );
+      cursor->base = NULL;
+    }
+  }
+
+  unlockandclose( pfd );
+
+  if ( NULL == cursor->base ) {
+    rrdbprintf( "ERROR: failed to read rrdb file '%s'\n", filename );
+    free( cursor );
+    return NULL;
+  }
+
+  return cursor;
+}
+
+void rrdb_cursor_close( rrdb_cursor *cursor ) {
+  if ( NULL == cursor ) return;
+
+  if ( cursor->mapped ) munmap( cursor->base, cursor->size );
+  else free( cursor->base );
+  free( cursor->owned );
+  free( cursor );
+}
+
+/**
+ * Point the cursor at a V1 ring of times and values.
+ */
+static void cursorv1runs( rrdb_cursor *cursor, size_t timesoffset, size_t valuesoffset, unsigned int windowPosition, unsigned int sampleCount ) {
+  unsigned int runs[ 2 ][ 2 ];
+  const rrdb_time_point *times = ( const rrdb_time_point * ) ( cursor->base + timesoffset );
+  const long double *values = ( const long double * ) ( cursor->base + valuesoffset );
+
+  if ( 0 == sampleCount ) return;
+
+  /* the oldest is just after the newest */
+  cursor->spancount = ringRuns( ( windowPosition + 1 ) % sampleCount, sampleCount, runs );
+  for ( int r = 0; r < cursor->spancount; r++ ) {
+    cursor->spans[ r ] = ( rrdb_span ) { .times = times + runs[ r ][ 0 ], .values = values + runs[ r ][ 0 ], .length = runs[ r ][ 1 ] };
+  }
+}
+
+/**
+ * The header of the V1 or V5 file the cursor holds, as rrdbHeader.
+ * @return { size_t } its size in the file or 0 if the cursor doesn't hold a sound one
+ */
+static size_t cursorv1header( rrdb_cursor *cursor, rrdbHeader *header ) {
+  int version = ( ( rrdbVersionHeader * ) cursor->base )->fileVersion;
+  size_t size = seriesheadersize( version );
+
+  if ( !seriesversion( version ) ) {
+    rrdbprintf( "ERROR: not a V1 rrdb file\n" );
+    return 0;
+  }
+
+  if ( cursor->size >= size ) {
+    memcpy( header, cursor->base, size );
+    seriesheaderread( header );
+  }
+
+  if ( cursor->size < size || header->setCount > MAXNUMSETS ||
+       cursor->size < size + ( size_t ) header->sampleCount * ( sizeof( rrdbTimePoint ) + header->setCount * sizeof( rrdbNumber ) ) + sizeof( rrdbXformsHeader ) ) {
+    rrdbprintf( "ERROR: RRDB header data corrupt\n" );
+    return 0;
+  }
+
+  return size;
+}
+
+static int cursorset( rrdb_cursor *cursor, unsigned int set ) {
+  rrdbHeader h, *header = &h;
+  size_t timesoffset = cursorv1header( cursor, header );
+  if ( 0 == timesoffset ) return -1;
+
+  if ( set >= header->setCount ) {
+    rrdbprintf( "ERROR: set index out of bounds\n" );
+    return -1;
+  }
+
+  size_t valuesoffset = timesoffset + header->sampleCount * sizeof( rrdbTimePoint ) + ( size_t ) set * header->sampleCount * sizeof( rrdbNumber );
+  cursorv1runs( cursor, timesoffset, valuesoffset, header->windowPosition, header->sampleCount );
+  return 1;
+}
+
+static int cursorxform( rrdb_cursor *cursor, unsigned int index ) {
+  rrdbHeader h, *header = &h;
+  size_t headersize = cursorv1header( cursor, header );
+  if ( 0 == headersize ) return -1;
+
+  size_t ringsize = header->sampleCount * ( sizeof( rrdbTimePoint ) + sizeof( rrdbNumber ) );
+  size_t offset = headersize + header->sampleCount * sizeof( rrdbTimePoint ) + ( size_t ) header->setCount * header->sampleCount * sizeof( rrdbNumber );
+  rrdbXformsHeader *xforms = ( rrdbXformsHeader * ) ( cursor->base + offset );
+
+  if ( index >= xforms->xformCount ) {
+    rrdbprintf( "ERROR: xform index out of bounds\n" );
+    return -1;
+  }
+
+  offset += sizeof( rrdbXformsHeader ) + index * ( sizeof( rrdbXformHeader ) + ringsize );
+  if ( offset + sizeof( rrdbXformHeader ) + ringsize > cursor->size ) {
+    rrdbprintf( "ERROR: RRDB xform header data corrupt\n" );
+    return -1;
+  }
+
+  /* xforms sit off natural alignment - fine on x86 */
+  rrdbXformHeader *xform = ( rrdbXformHeader * ) ( cursor->base + offset );
+  offset += sizeof( rrdbXformHeader );
+  cursorv1runs( cursor, offset, offset + header->sampleCount * sizeof( rrdbTimePoint ), xform->windowPosition, header->sampleCount );
+  return 1;
+}
+
+typedef struct {
+  rrdbInt *counts;
+  time_t tps;
+  unsigned int N;
+} rrdbCursorCounts;
+
+static void cursor_count_bin( intmax_t ts, rrdbInt v, void *arg ) {
+  rrdbCursorCounts *c = arg;
+  c->counts[ ( ts / c->tps ) % c->N ] = v;
+}
+
+/**
+ * The same window walkTouchSet prints, oldest bin first.
+ */
+static int cursortouch( rrdb_cursor *cursor, const char *path, const char *period ) {
+  rrdbTouchHeader *header = ( rrdbTouchHeader * ) cursor->base;
+  unsigned int runs[ 2 ][ 2 ];
+
+  if ( RRDBTOUCHV4 != ( ( rrdbVersionHeader * ) cursor->base )->fileVersion ) {
+    rrdbprintf( "ERROR: not a touch rrdb file\n" );
+    return -1;
+  }
+
+  if ( !touchFileValid( cursor->base, cursor->size ) ) {
+    rrdbprintf( "ERROR: RRDB header data corrupt\n" );
+    return -1;
+  }
+
+  int iperiod = getPeriodFromName( NULL == period ? "" : period );
+  if( -1 == iperiod ) iperiod = ONEHOUR;
+
+  /* the coalescer's touches aren't included, so no filename */
+  rrdbTouchSet *owned;
+  const void *ring;
+  rrdbTouchSet *setHeader = touchFetchSet( NULL, cursor->base, cursor->size, ( char * ) path, iperiod, &ring, &owned );
+  if ( NULL == setHeader ) return 1;
+  cursor->owned = owned;
+
+  const unsigned int N = header->samplesPerSet;
+  const time_t tps = ( time_t ) getTimePerSample( setHeader->period );
+  const time_t end_tick = setHeader->lastTouch / tps;
+  time_t start_tick = end_tick - ( time_t ) ( N - 1 );
+  if ( start_tick < 0 ) start_tick = 0;
+
+  const rrdbInt *values = ring;
+  time_t first = start_tick * tps;
+
+  /* spans are of counts, so a file which keeps values has just its counts copied out */
+  if ( header->values ) {
+    rrdbCursorCounts c = { .counts = calloc( N, sizeof( rrdbInt ) ), .tps = tps, .N = N };
+    if ( NULL == c.counts ) {
+      rrdbprintf( "ERROR: out of memory\n" );
+      return -1;
+    }
+    walkTouchSet( header, setHeader, ring, cursor_count_bin, &c );
+    free( owned );
+    cursor->owned = c.counts;
+    values = c.counts;
+  /* spans are of a dense ring, so a sparse one is copied out as one (a rolled up set is already) */
+  } else if ( TOUCHRINGDENSE != setHeader->bins ) {
+    cursor->owned = malloc( N * sizeof( rrdbInt ) );
+    if ( NULL == cursor->owned ) {
+      rrdbprintf( "ERROR: out of memory\n" );
+      return -1;
+    }
+    touchSetDense( header, setHeader, cursor->owned );
+    values = cursor->owned;
+  }
+
+  /* a window clipped at the epoch starts at bin 0 so never wraps */
+  cursor->spancount = ringRuns( ( unsigned int ) ( start_tick % N ), ( unsigned int ) ( end_tick - start_tick + 1 ), runs );
+
+  for ( int r = 0; r < cursor->spancount; r++ ) {
+    cursor->spans[ r ] = ( rrdb_span ) { .counts = values + runs[ r ][ 0 ], .first = first, .step = tps, .length = runs[ r ][ 1 ] };
+    first += runs[ r ][ 1 ] * tps;
+  }
+
+  return 1;
+}
+
+int rrdb_cursor_set( const char *filename, unsigned int set, rrdb_cursor **cursor, rrdb_buffer *out ) {
+  rrdbCapture c;
+  int ret = -1;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+
+  *cursor = cursoropen( filename );
+  if ( NULL != *cursor && -1 == ( ret = cursorset( *cursor, set ) ) ) {
+    rrdb_cursor_close( *cursor );
+    *cursor = NULL;
+  }
+
+  return captureend( &c, ret, out );
+}
+
+int rrdb_cursor_xform( const char *filename, unsigned int xform, rrdb_cursor **cursor, rrdb_buffer *out ) {
+  rrdbCapture c;
+  int ret = -1;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+
+  *cursor = cursoropen( filename );
+  if ( NULL != *cursor && -1 == ( ret = cursorxform( *cursor, xform ) ) ) {
+    rrdb_cursor_close( *cursor );
+    *cursor = NULL;
+  }
+
+  return captureend( &c, ret, out );
+}
+
+int rrdb_cursor_touch( const char *filename, const char *path, const char *period, rrdb_cursor **cursor, rrdb_buffer *out ) {
+  rrdbCapture c;
+  int ret = -1;
+
+  if ( -1 == capturebegin( &c ) ) return capturefailed( out );
+
+  if ( NULL == path ) {
+    *cursor = NULL;
+    rrdbprintf( "ERROR: path should be a string\n" );
+    return captureend( &c, -1, out );
+  }
+
+  *cursor = cursoropen( filename );
+  if ( NULL != *cursor && -1 == ( ret = cursortouch( *cursor, path, period ) ) ) {
+    rrdb_cursor_close( *cursor );
+    *cursor = NULL;
+  }
+
+  return captureend( &c, ret, out );
+}
+
+int rrdb_cursor_spans( const rrdb_cursor *cursor, rrdb_span spans[ 2 ] ) {
+  for ( int r = 0; r < cursor->spancount; r++ ) spans[ r ] = cursor->spans[ r ];
+  return cursor->spancount;
+}
@@ -0,0 +1,137 @@
+
+
+#ifndef LIBRRDB_H
+#define LIBRRDB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ librrdb - the public interface for embedding rrdb rather than running the binary.
+
+ Every call which produces output (results, or the error text on failure) writes it
+ into a buffer supplied by the caller, NUL terminated. The output is the same text the
+ rrdb command prints, one line per row. If it doesn't fit the call returns
+ RRDB_TRUNCATED with length set to what it needed (not including the terminator), so
+ fetch and info can be called again with a bigger buffer. out can be NULL if the
+ caller isn't interested.
+
+ The calls are thread safe and file locking keeps them safe against other processes (and
+ rrdb binaries) using the same files, as long as they all lock the same way - the default
+ lock mode is the one every rrdb takes unless told otherwise, see rrdb_set_lock_mode.
+ */
+
+#if defined( __GNUC__ )
+#define RRDB_API __attribute__ (( visibility( "default" ) ))
+#else
+#define RRDB_API
+#endif
+
+#define RRDB_OK 0
+#define RRDB_ERROR -1
+#define RRDB_TRUNCATED -2
+
+typedef struct rrdb_buffer {
+  char *data;
+  /* of data */
+  size_t size;
+  /* written, or needed on RRDB_TRUNCATED */
+  size_t length;
+} rrdb_buffer;
+
+/* xforms as the create command, i.e. "RRDBSUM:ONEDAY:0:RRDBMAX:ONEHOUR:1" - an unknown xform or period is an error */
+RRDB_API int rrdb_create( const char *filename, unsigned int sets, unsigned int samples, const char *xforms, rrdb_buffer *out );
+/* a value for each set */
+RRDB_API int rrdb_update( const char *filename, const double *values, unsigned int count, rrdb_buffer *out );
+/* n updates as rrdb_update, possibly to different files, which are read and written in batches - status[ i ] is
+   RRDB_OK or RRDB_ERROR for each, the call fails if any of them did */
+RRDB_API int rrdb_update_many( const char *const *filenames, const double *const *values, const unsigned int *counts, unsigned int n,
+                               int *status, rrdb_buffer *out );
+/* add count at when (0 for now) to each item of path ("/" separated) for each period ("," separated) */
+RRDB_API int rrdb_touch( const char *filename, const char *path, const char *periods, unsigned int maxsets, unsigned int samples,
+                         unsigned int count, time_t when, rrdb_buffer *out );
+/* as rrdb_touch, each of the count touches with value - the bins keep the sum, least and most of the values, which
+   fetch gives as time:count:sum:min:max:mean. A file keeps values, or doesn't, from its first touch */
+RRDB_API int rrdb_touch_value( const char *filename, const char *path, const char *periods, unsigned int maxsets, unsigned int samples,
+                               unsigned int count, double value, time_t when, rrdb_buffer *out );
+/* selector is an xform index ("" for the raw data) for a V1 file or the path for a touch file */
+RRDB_API int rrdb_fetch( const char *filename, const char *selector, const char *period, rrdb_buffer *out );
+/* an xform or touch path of every file pattern (a glob) matches combined by time - reduce is SUM, MIN, MAX, MEAN or
+   COUNT - on threads workers (0 for one a cpu) */
+RRDB_API int rrdb_aggregate( const char *pattern, const char *selector, const char *period, const char *reduce, unsigned int threads, rrdb_buffer *out );
+/* the n (0 for all) paths starting with prefix with the most touches in the last bins (0 for all) of period, as
+   path:total lines, the most first */
+RRDB_API int rrdb_top( const char *filename, const char *prefix, const char *period, unsigned int n, unsigned int bins, rrdb_buffer *out );
+RRDB_API int rrdb_info( const char *filename, rrdb_buffer *out );
+/* as rrdb_fetch and rrdb_info but out gets the result in the binary protocol's layout (see the README) rather than
+   text, length being its size - xform is the index for a series, < 0 for the raw data. A failure is still text */
+RRDB_API int rrdb_fetch_binary( const char *filename, int xform, const char *path, const char *period, rrdb_buffer *out );
+RRDB_API int rrdb_info_binary( const char *filename, rrdb_buffer *out );
+/* set the point of a series at a time to a new value in place - values is time[.usecs]:value and xforms the xform
+   index ("" for the raw data) */
+RRDB_API int rrdb_modify( const char *filename, const char *values, const char *xforms, rrdb_buffer *out );
+/* info and/or fetch every file under dir on threads workers as the scan command, emit being what it prints. The
+   output is written to stream (NULL for stdout) as the files finish rather than into a buffer */
+RRDB_API int rrdb_scan( const char *dir, const char *emit, const char *selector, const char *period, unsigned int threads, FILE *stream );
+/* keep the xform points which fall off the end of the rings, compressed, from now on */
+RRDB_API int rrdb_archive( const char *filename, rrdb_buffer *out );
+/* rewrite the file in the aligned interchange layout (3, decoded by every call which opens it) or back to one it holds
+   (5 or 1 for a series, 4 or 2 for a touch file) */
+RRDB_API int rrdb_convert( const char *filename, int version, rrdb_buffer *out );
+RRDB_API int rrdb_convert_tree( const char *dir, int version, unsigned int threads, rrdb_buffer *out );
+/* new sets, samples or xforms (0, 0 or "" keep what there is, xforms NONE removes them all) keeping the data */
+RRDB_API int rrdb_reshape( const char *filename, unsigned int sets, unsigned int samples, const char *xforms, rrdb_buffer *out );
+
+/* "debug" (the default) or "fast" - every process using a file has to use the same, see the README */
+RRDB_API int rrdb_set_lock_mode( const char *mode );
+RRDB_API int rrdb_lock_stats( rrdb_buffer *out );
+
+/* hold touches in memory and write them every ms, 0 writes anything pending and stops */
+RRDB_API int rrdb_coalesce( unsigned int ms );
+RRDB_API int rrdb_flush( void );
+/* drain the shared memory ring name (see rrdbring.h, created with slots records - 0 for 4096 - if there isn't one)
+   into files under dir ("" or NULL if records have full paths) on a thread of its own until rrdb_shutdown */
+RRDB_API int rrdb_ring_serve( const char *name, const char *dir, unsigned int slots, rrdb_buffer *out );
+/* ring:name, slots, queued, received, batches, full, dropped and failed lines */
+RRDB_API int rrdb_ring_stats( rrdb_buffer *out );
+
+/* write anything pending and stop any background threads */
+RRDB_API void rrdb_shutdown( void );
+
+/*
+ Cursors give direct access to the rows of a set, xform or touch set, oldest first, as at
+ most two runs (the ring is split where it wraps) so they can be copied or looped over
+ without reformatting. The rows point into a private copy of the file which stays valid
+ until rrdb_cursor_close. Touches still held by rrdb_coalesce are not included, call
+ rrdb_flush first if they matter.
+ */
+typedef struct rrdb_time_point {
+  time_t time;
+  unsigned short usecs;
+  /* 0 for a row which hasn't been written yet */
+  char valid;
+} rrdb_time_point;
+
+typedef struct rrdb_span {
+  /* sets and xforms */
+  const rrdb_time_point *times;
+  const long double *values;
+  /* touch sets, counts[ i ] is the bin starting at first + i * step */
+  const unsigned int *counts;
+  time_t first;
+  time_t step;
+  size_t length;
+} rrdb_span;
+
+typedef struct rrdb_cursor rrdb_cursor;
+
+RRDB_API int rrdb_cursor_set( const char *filename, unsigned int set, rrdb_cursor **cursor, rrdb_buffer *out );
+RRDB_API int rrdb_cursor_xform( const char *filename, unsigned int xform, rrdb_cursor **cursor, rrdb_buffer *out );
+/* path and period as rrdb_fetch, no matching set gives a cursor with no spans */
+RRDB_API int rrdb_cursor_touch( const char *filename, const char *path, const char *period, rrdb_cursor **cursor, rrdb_buffer *out );
+/* @return the number of spans filled, 0 to 2 */
+RRDB_API int rrdb_cursor_spans( const rrdb_cursor *cursor, rrdb_span spans[ 2 ] );
+RRDB_API void rrdb_cursor_close( rrdb_cursor *cursor );
+
+#endif /* LIBRRDB_H */
@@ -1,8 +1,11 @@
 
+/* F_OFD_SETLK and friends */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 
 #include <sys/types.h>
 #include <time.h>
@@ -19,8 +22,13 @@
 #include <sys/mman.h>
 
 #include <inttypes.h>
+#include <limits.h>
 
 #include <sys/file.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <math.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -30,7 +38,6 @@
 #endif
 
 #include "rrdb.h"
-
 /*
  Data manipulation - store and retreive round robin data. Maintain xformations
  i.e. average, sum, count etc.
@@ -97,1602 +104,660 @@
  The first will return all of the raw data in columns.
  The second with the param --xform=0 will return xform data set 0 (each set may have different times against rows).
 
- V2 Touch
- Records a count against a path. The path is comma delimitered, so that
- it will record a touch against the whole touchpath and also each item
- which is comma delimitered.
-
- truncate: the number of sets after which it will start to re-use older non used sets
- touchpath: the string we are counting against.
-
- rrdb --command=touch --dir=data/rrd --filename=nick.rrdb --touchpath=test
- rrdb --command=touch --dir=data/rrd --filename=nick.rrdb --touchpath=tech,support --samplecount=2000 --period=ONEHOUR,ONEDAY --setcount=50
+ archive
+ rrdb --command=archive --dir=data/rrd --filename=nick.rrdb
 
- In pipe mode, these are the equivalent commands
- touch test.rrdb 50 2000 tech,support ONEHOUR,ONEDAY
- touch <filename> <setcount> <samplecount> <path> <period>
+ Keep (compressed) the xform points which fall off the end of the rings rather than losing them,
+ fetch --xform returns them ahead of the ring.
 
- (setcount could also be described as max setcount)
- */
+ convert
+ rrdb --command=convert --dir=data/rrd --filename=nick.rrdb --format=3
 
+ Rewrite a file in the aligned V3 interchange layout (which every command decodes to a working
+ copy first), or back (--format=5 for a V1 file, 1 for one without the
+ seqlock lock free readers need, 4 for a touch file or 2 for the touch files before it, whose paths
+ were at most 99 characters).
+ Everything else works on a file whichever layout it is in.
 
-/*
- Some notes on file locking.
+ rrdb --command=convert --dir=data/rrd --format=3 --threads=8
 
- Only two functions can open a file: initRRDBFile and readRRDBFile. Both of which apply a lock
- at the beggining of the file. Which must be released when the file is closed. Nothing clever
- at the moment, a lock we use as an advisor for the whole file.
- */
+ Without a filename (or with a directory) every file under the directory is converted, on
+ --threads workers. A run which is stopped carries on where it left off the next time.
 
+ reshape
+ rrdb --command=reshape --dir=data/rrd --filename=nick.rrdb --samplecount=200 --setcount=3 --xform=RRDBSUM:ONEDAY:0:RRDBMAX:ONEHOUR:2
 
- static int buildlockpath( const char *path, char *out, size_t outlen ) {
-    size_t len = strlen(path);
+ Change the samples, sets or xforms of a V1 file keeping its data. Anything not given stays as
+ it is (--xform=NONE removes them all). New xforms are filled in from the raw points the file has.
 
-    if (len + 5 >= outlen)  /* ".lock" + NUL */
-        return -1;
+ aggregate
+ rrdb --command=aggregate --dir=data/rrd --filename='queue*.rrdb' --xform=0 --reduce=SUM --threads=8
+ rrdb --command=aggregate --dir=data/rrd --filename='{a,b,c}.rrdb' --touchpath=sales --period=ONEHOUR --reduce=MAX
 
-    memcpy(out, path, len);
-    memcpy(out + len, ".lock", 6); /* includes NUL */
-    return 0;
-}
+ Fetch an xform or touch path from every file the glob matches combined into one series by time,
+ --reduce is SUM, MIN, MAX, MEAN or COUNT (how many files have a point then).
 
-static int lockacquire( const char *path, int lock_mode ) {
-  char lockpath[PATH_MAX];
+ top
+ rrdb --command=top --dir=data/rrd --filename=nick.rrdb --touchpath='tech*' --period=ONEDAY --values=10:7
 
-  if (buildlockpath(path, lockpath, sizeof(lockpath)) < 0)
-    return -1;
+ The paths of a touch file starting with --touchpath (less the *, so * is all of them) with the
+ most touches, as path:total, the most first. --values is how many (0 for all) then, optionally, how many bins of
+ --period back from now to count (the whole ring if not given). Periods a path wasn't touched with
+ are rolled up as fetch does. In pipe mode: top <filename> <prefix> <period> <n[:bins]>
+ A fetch --touchpath ending in * is every path starting with what comes before it, summed.
 
-  int fd = open(lockpath, O_CREAT | O_RDWR, 0644);
-  if (fd < 0)
-    return -1;
+ scan
+ rrdb --command=scan --dir=data/rrd --emit=info --threads=8
+ rrdb --command=scan --dir=data/rrd --filename=queues --emit=fetch,ordered --xform=0
 
-  if( flock(fd, lock_mode) < 0 ) {
-      close(fd);
-      return -1;
-  }
+ Info and/or fetch (with --xform or --touchpath and --period) every file under the directory
+ (or --filename within it) on --threads workers. Each file's lines come tagged @<path> and end
+ with @<path> END, as they finish or in path order with ordered. Then files:, failed: and filespersec:.
 
-  /* Optional debug info */
-  if (ftruncate(fd, 0) == 0) {
-      dprintf(fd, "pid=%ld time=%ld\n",
-              (long)getpid(), (long)time(NULL));
-      fsync(fd);
-  }
+ V2 Touch
+ Records a count against a path. The path is comma delimitered, so that
+ it will record a touch against the whole touchpath and also each item
+ which is comma delimitered.
 
-  return fd;
-}
+ truncate: the number of sets after which it will start to re-use older non used sets
+ touchpath: the string we are counting against.
 
-static int lockrelease( int lockfd ) {
-  if( lockfd < 0 )
-    return -1;
+ rrdb --command=touch --dir=data/rrd --filename=nick.rrdb --touchpath=test
+ rrdb --command=touch --dir=data/rrd --filename=nick.rrdb --touchpath=tech,support --samplecount=2000 --period=ONEHOUR,ONEDAY --setcount=50
+ rrdb --command=touch --dir=data/rrd --filename=latency.rrdb --touchpath=api/orders --values=1::182.5
 
-  /* flock unlock is optional; close() releases it anyway */
-  if ( flock( lockfd, LOCK_UN ) < 0 ) {
-    close( lockfd );
-    return -1;
-  }
+ --values=count[:timestamp[:value]] - with a value each bin keeps the sum, min and max of the values too
+ and fetch gives time:count:sum:min:max:mean. A file keeps values, or doesn't, from its first touch.
 
+ In pipe mode, these are the equivalent commands
+ touch test.rrdb 50 2000 tech,support ONEHOUR,ONEDAY
+ touch <filename> <setcount> <samplecount> <path> <period>
 
-  return close( lockfd );
-}
+ (setcount could also be described as max setcount)
 
+ Shared memory ring
+ rrdb --command=- --dir=data/rrd --ring=pbx --ringslots=4096
 
+ In pipe mode, also drain the ring pbx (/dev/shm/pbx, created if it isn't there) which local
+ producers queue updates and touches into with rrdbring.h, no syscall each. ringstats in pipe
+ mode gives its counts, including what producers dropped when it was full.
+ */
 
-/**
- * @return { int } open file id or -1 on failure.
-*/
-locked_file_t createopenandlock( char *filename ) {
 
-  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
+/* has the pipe client asked for the binary protocol */
+static int binarymode = FALSE;
 
-  lf.lock_fd = lockacquire( filename, LOCK_EX );
+/* workers for tagged pipe requests (--threads), NULL to run everything inline */
+static rrdbPool *requestpool = NULL;
 
-  if( -1 == lf.lock_fd ) {
-    fprintf( stderr, "failed to lock file '%s'\n", filename );
-    return lf;
-  }
+/*
+ Everything we send back goes through outprintf. Normally that is stdout, but a request can
+ point it somewhere else (i.e. a memstream) so that its output can be captured and framed or
+ tagged.
+ */
+static __thread FILE *outputstream = NULL;
 
-  lf.data_fd = open( filename, O_CREAT | O_RDWR , S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH );
-  if ( -1 == lf.data_fd ) {
-    lockrelease( lf.lock_fd );
-    lf.lock_fd = -1;
+static int outprintf( const char *format, ... ) __attribute__ (( format( printf, 1, 2 ) ));
+static int outprintf( const char *format, ... ) {
+  va_list ap;
+  int ret;
 
-    fprintf( stderr, "failed to open file '%s' for writing\n", filename );
-  }
+  va_start( ap, format );
+  ret = vfprintf( NULL == outputstream ? stdout : outputstream, format, ap );
+  va_end( ap );
 
-  return lf;
+  return ret;
 }
 
 /**
- * We have to be writable to gain a lock.
- * @return { locked_file_t } .data_fd -1 on failure
-*/
-locked_file_t readwriteopenandlock( char *  filename ) {
-
-  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
-  lf.lock_fd = lockacquire( filename, LOCK_EX );
-
-  if( -1 == lf.lock_fd ) {
-    fprintf( stderr, "failed to lock read write rrdb file '%s'\n", filename );
-    return lf;
-  }
-
-  lf.data_fd = open( filename, O_RDWR );
-
-  if( -1 == lf.data_fd ) {
-    lockrelease( lf.lock_fd );
-    lf.lock_fd = -1;
-    fprintf( stderr, "failed to read rrdb file '%s'\n", filename );
-  }
-
-  return lf;
+ * @return { FILE * } the previous output (NULL being stdout)
+ */
+static FILE *setoutput( FILE *out ) {
+  FILE *previous = outputstream;
+  outputstream = out;
+  return previous;
 }
 
-/**
- * Open for read and get a read lock.
- * @return { locked_file_t } .data_fd -1 on failure
+/*
+ The commands go through the public interface (librrdb.h), which hands back the text
+ to print in a buffer. One per thread, grown whenever a fetch or info doesn't fit.
  */
-locked_file_t readopenandlock( char *  filename ) {
-
-  locked_file_t lf = { .data_fd = -1, .lock_fd = -1 };
-  lf.lock_fd = lockacquire( filename, LOCK_SH );
-
-  if( -1 == lf.lock_fd ) {
-    fprintf( stderr, "failed to lock read rrdb file '%s'\n", filename );
-    return lf;
-  }
-
-  lf.data_fd = open( filename, O_RDONLY );
-
-  if( -1 == lf.data_fd ) {
-    lockrelease( lf.lock_fd );
-    lf.lock_fd = -1;
-    fprintf( stderr, "failed to read rrdb file '%s'\n", filename );
-  }
-
-  return lf;
-}
+static __thread rrdb_buffer commandresult = { NULL, 0, 0 };
 
 /**
- * If unlocking fails we still try to close the file.
- * @return { locked_file_t } .data_fd -1 on failure
-*/
-locked_file_t unlockandclose( locked_file_t lf ) {
-
-  close( lf.data_fd );
-  lockrelease( lf.lock_fd );
-
-  lf.data_fd = -1;
-  lf.lock_fd = -1;
-  return lf;
-}
-
-/************************************************************************************
- * Function: freeRRDBFile
- *
- * Purpose: free any memory allocations within the RRDB file structure - clean up.
- *
- * Written: 9th March 2013 By: Nick Knight
- ************************************************************************************/
-int freeRRDBFile(rrdbFile *fileData) {
-    unsigned int i;
-
-    if ( fileData->times ) {
-        free(fileData->times);
-        fileData->times = NULL;
-    }
-
-    unsigned int it = fileData->header.setCount;
-    if( it > MAXNUMSETS ) it = MAXNUMSETS;
-
-    for ( i = 0 ; i < it; i++ ) {
-         free(fileData->sets[i]);
-         fileData->sets[i] = NULL;
-    }
-
-    for ( i = 0 ; i < fileData->xformheader.xformCount; i++ ) {
-        free(fileData->xformdata[i]);
-        free(fileData->xformtimes[i]);
-
-        fileData->xformdata[i] = NULL;
-        fileData->xformtimes[i] = NULL;
-    }
-
-    fileData->header.setCount = 0;
-    fileData->xformheader.xformCount = 0;
-
-    return 1;
-}
-
-/************************************************************************************
- * Function: printRRDBFile
- *
- * Purpose: output to stdout the data form the sets.
- *
- * Written: 9th March 2013 By: Nick Knight
- ************************************************************************************/
-int printRRDBFile(rrdbFile *fileData)
-{
-  unsigned int i,j;
-  unsigned int windowPos = 0;
+ * @return { int } 1 if the buffer is now big enough for needed, 0 if not
+ */
+static int growresult( size_t needed ) {
+  if ( needed < commandresult.size ) return 1;
 
-  for ( i = 0 ; i < fileData->header.sampleCount; i++ )
-  {
-    /* + 1 so that we loop back round to the start and print them in time order */
-    windowPos = (i + fileData->header.windowPosition + 1)%fileData->header.sampleCount;
-
-    if ( 1 == fileData->times[windowPos].valid )
-    {
-      printf("%ld.%i", fileData->times[windowPos].time, fileData->times[windowPos].uSecs);
-      for ( j = 0 ; j < fileData->header.setCount; j++ )
-      {
-        printf(":%Lf", fileData->sets[j][windowPos]);
-      }
-      printf("\n");
-    }
-  }
+  size_t size = MAX( needed + 1, 4096 );
+  char *data = realloc( commandresult.data, size );
+  if ( NULL == data ) return 0;
 
+  commandresult.data = data;
+  commandresult.size = size;
   return 1;
 }
 
-static void print_set(const rrdbTouchHeader *header,
-                      const rrdbTouchSet *setHeader,
-                      const rrdbInt *values)
-{
-  const unsigned int N = header->samplesPerSet;
-  const time_t tps = (time_t)getTimePerSample(setHeader->period);
-
-  // Anchor window to the last write
-  const time_t last_tick = setHeader->lastTouch / tps;  // tick we last touched
-  time_t end_tick  = last_tick;                         // print up to here
-  time_t start_tick = end_tick - (time_t)(N - 1);
-  if (start_tick < 0) start_tick = 0;
-
-  for (time_t tick = end_tick; ; --tick) {
-    unsigned int idx = (unsigned int)(tick % N);
-    rrdbInt v = values[idx];
-    // label with START of bin
-    intmax_t ts = (intmax_t)(tick * tps);
-    if (v != 0) printf("%" PRIdMAX ":%d\n", ts, (int)v);
-    if (tick == start_tick) break;
-  }
-}
-
-int printRRDBTouchFile(int pfd, char *path, char *period)
-{
-  struct stat sb;
-  if (fstat(pfd, &sb) == -1) return -1;
-
-  unsigned int iperiod;
-  if( strcmp( period, "FIVEMINUTE")  == 0 ) iperiod = FIVEMINUTE;
-  else if( strcmp( period, "QUARTERHOUR" ) == 0 ) iperiod = QUARTERHOUR;
-  else if( strcmp( period, "ONEHOUR" ) == 0 ) iperiod = ONEHOUR;
-  else if( strcmp( period, "SIXHOUR" ) == 0 ) iperiod = SIXHOUR;
-  else if( strcmp( period, "TWELVEHOUR" ) == 0 ) iperiod = TWELVEHOUR;
-  else if( strcmp( period, "ONEDAY" ) == 0 ) iperiod = ONEDAY;
-  else iperiod = ONEHOUR;
-
-  char *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, pfd, 0);
-  if( addr == MAP_FAILED ) return -1;
-
-  rrdbTouchHeader *header = (rrdbTouchHeader *)addr;
-  char *ptr = addr + sizeof(rrdbTouchHeader);
-
-  for( unsigned int i = 0; i < header->sets; i++ ) {
-    rrdbTouchSet *setHeader = (rrdbTouchSet *)ptr;
-
-    // optional path filter
-    if( path && path[0] != '\0' && strcmp( setHeader->path, path ) != 0 ) {
-      ptr += sizeof(rrdbTouchSet) + header->samplesPerSet * sizeof( rrdbInt );
-      continue;
-    }
-
-    // period filter
-    if (setHeader->period != iperiod) {
-      ptr += sizeof(rrdbTouchSet) + header->samplesPerSet * sizeof(rrdbInt);
-      continue;
-    }
-
-    rrdbInt *values = (rrdbInt *)(ptr + sizeof(rrdbTouchSet));
-    print_set(header, setHeader, values);
-    break; // print only first matching set
-  }
-
-  munmap( addr, sb.st_size );
-  return 0;
-}
-
-/************************************************************************************
- * Function: printRRDBFileXform
- *
- * Purpose: output to stdout the xfomr data form the sets.
- *
- * Written: 12th March 2013 By: Nick Knight
- ************************************************************************************/
-int printRRDBFileXform(rrdbFile *fileData, unsigned int index)
-{
-    unsigned int i;
-    unsigned int windowPos = 0;
-
-    if ( index >= fileData->xformheader.xformCount ) {
-        printf("ERROR: xform index out of bounds\n");
-        return -1;
-    }
-
-    for ( i = 0 ; i < fileData->header.sampleCount; i++ ) {
-
-        /* + 1 so that we loop back round to the start and print them in time order */
-        windowPos = (i + fileData->xforms[index].windowPosition + 1)%fileData->header.sampleCount;
-
-        if ( 1 == fileData->xformtimes[index][windowPos].valid ) {
-            printf("%ld:%Lf\n", fileData->xformtimes[index][windowPos].time, fileData->xformdata[index][windowPos]);
-        }
-    }
-
-    return 1;
-}
-
 /**
- * Initialize a file with zeroed out data. Locks the file. This function
- * must not output error as this is the job of the caller.
- * Written: 9th March 2013 By: Nick Knight
- * @returns { int } - an open file or -1 on failure.
+ * @return { int } 1 on success -1 on failure (as the other run functions)
  */
-locked_file_t initRRDBFile(char *filename, unsigned int setCount, unsigned int sampleCount , char *xformations) {
-
-  locked_file_t pfd;
-  rrdbFile fileData;
-  long long totalSizeRequired;
-  unsigned int setCountSize;
-
-  pfd = createopenandlock( filename );
-  if( -1 == pfd.data_fd ) return pfd;
-
-  char *result = NULL;
-  const char delims[] = ":";
-
-  unsigned int i;
-  unsigned int setIndexRequired;
-
-  fileData.header.fileVersion = RRDBV1;
-  fileData.header.windowPosition = 0;
-  fileData.header.setCount = setCount;
-  fileData.header.sampleCount = sampleCount;
-  fileData.xformheader.xformCount = 0;
-
-  /* read time data */
-  totalSizeRequired = (fileData.header.sampleCount * sizeof (rrdbTimePoint));
-
-  fileData.times = malloc(totalSizeRequired);
-  memset(fileData.times, 0, totalSizeRequired);
-
-
-  /* data sets */
-  setCountSize = ( fileData.header.sampleCount * sizeof (rrdbNumber));
-  for ( i = 0 ; i < fileData.header.setCount; i++ ) {
-    fileData.sets[i] = malloc(setCountSize);
-    memset(fileData.sets[i], 0, setCountSize);
-  }
-
-  /* now xform data */
-  /* xformations takes the format of RRDBCOUNT:ONEHOUR:RRDBCOUNT:ONEDAY:RRDBMEAN:ONEDAY:0
-   for all other items it also takes another param which is the index into the set */
-  i = 0;
-  result = strtok( xformations, delims );
-  while ( result ) {
-    setIndexRequired = FALSE;
-
-    if ( 0 == strcmp("RRDBMAX", result)) {
-      fileData.xforms[i].calc = RRDBMAX;
-      setIndexRequired = TRUE;
-    } else if ( 0 == strcmp("RRDBMIN", result)) {
-      fileData.xforms[i].calc = RRDBMIN;
-      setIndexRequired = TRUE;
-    } else if ( 0 == strcmp("RRDBCOUNT", result)) {
-      fileData.xforms[i].calc = RRDBCOUNT;
-    } else if ( 0 == strcmp("RRDBMEAN", result)) {
-      fileData.xforms[i].calc = RRDBMEAN;
-      setIndexRequired = TRUE;
-    } else if ( 0 == strcmp("RRDBSUM", result)) {
-      fileData.xforms[i].calc = RRDBSUM;
-      setIndexRequired = TRUE;
-    }
-
-    /* then get the time span */
-    result = strtok( NULL, delims );
-    if ( NULL == result ) {
-      fprintf( stderr, "Failed to get timespan\n" );
-      pfd = unlockandclose( pfd );
-      freeRRDBFile(&fileData);
-      return pfd;
-    }
-
-    if ( 0 == strcmp("FIVEMINUTE", result)) {
-      fileData.xforms[i].period = FIVEMINUTE;
-    } else if ( 0 == strcmp("QUARTERHOUR", result)) {
-      fileData.xforms[i].period = QUARTERHOUR;
-    } else if ( 0 == strcmp("ONEHOUR", result)) {
-      fileData.xforms[i].period = ONEHOUR;
-    } else if ( 0 == strcmp("SIXHOUR", result)) {
-      fileData.xforms[i].period = SIXHOUR;
-    } else if ( 0 == strcmp("TWELVEHOUR", result)) {
-      fileData.xforms[i].period = TWELVEHOUR;
-    } else if ( 0 == strcmp("ONEDAY", result)) {
-      fileData.xforms[i].period = ONEDAY;
-    }
-
-    fileData.xforms[i].setIndex = 0;
-    fileData.xforms[i].windowPosition = 0;
-
-    if ( TRUE == setIndexRequired ) {
-      result = strtok( NULL, delims );
-      if ( NULL == result ) {
-        fprintf( stderr, "We really need an index for the xform\n" );
-        pfd = unlockandclose( pfd );
-        freeRRDBFile(&fileData);
-        return pfd;
-      }
-      fileData.xforms[i].setIndex = atoi(result);
-    }
-
-    fileData.xformdata[i] = malloc(setCountSize);
-    memset(fileData.xformdata[i], 0, setCountSize);
-
-    fileData.xformtimes[i] = malloc(totalSizeRequired);
-    memset(fileData.xformtimes[i], 0, totalSizeRequired);
-
-    i++;
-    fileData.xformheader.xformCount = i;
-    /* we can repeat until we get all of xforms required */
-
-    result = strtok( NULL, delims );
-  }
-
-  if ( -1 == writeRRDBFile( pfd.data_fd, &fileData ) ) {
-    pfd = unlockandclose( pfd );
-  }
-  freeRRDBFile(&fileData);
-
-  return pfd;
+static int printresult( int ret ) {
+  if ( NULL != commandresult.data ) outprintf( "%s", commandresult.data );
+  return RRDB_ERROR == ret ? -1 : 1;
 }
 
 
-/************************************************************************************
- * Function: writeRRDBFile
- *
- * Purpose: Write the contents of an RRDB strcture to a file.
- *
- * Written: 9th March 2013 By: Nick Knight
- ************************************************************************************/
-int writeRRDBFile(int pfd, rrdbFile *fileData)
-{
-  long long totalSizeRequired;
-  long long setCountSize;
-  unsigned int i;
-
-  lseek(pfd, 0, SEEK_SET);
-
-  if ( sizeof(rrdbHeader) != write(pfd, &fileData->header, sizeof(rrdbHeader)) )
-  {
-    printf("ERROR: failed to write header to file\n");
-    return -1;
-  }
-
-  /* write time points ( and valid flags etc ) */
-  totalSizeRequired = ( fileData->header.sampleCount * sizeof (rrdbTimePoint));
-
-  if ( totalSizeRequired != write(pfd, fileData->times, totalSizeRequired) )
-  {
-    printf("ERROR: failed to write time data to file\n");
-    return -1;
-  }
-
-  /* now write data */
-  setCountSize = ( fileData->header.sampleCount * sizeof (rrdbNumber));
-
-  for ( i = 0 ; i < fileData->header.setCount; i++ )
-  {
-      if ( setCountSize != write(pfd, fileData->sets[i], setCountSize) )
-      {
-          printf("ERROR: failed to write time data to file\n");
-          return -1;
-      }
-  }
-
-  /* now write our xform data */
-  if ( sizeof(rrdbXformsHeader) != write(pfd, &fileData->xformheader, sizeof(rrdbXformsHeader)) )
-  {
-      printf("ERROR: failed to write xform master header to file\n");
-      return -1;
-  }
-
-  for ( i = 0 ; i < fileData->xformheader.xformCount; i++ )
-  {
-    if ( sizeof(rrdbXformHeader) != write(pfd, &fileData->xforms[i], sizeof(rrdbXformHeader)) )
-    {
-      printf("ERROR: failed to write xform header to file\n");
-      return -1;
-    }
-
-    if ( totalSizeRequired != write(pfd, fileData->xformtimes[i], totalSizeRequired) )
-    {
-      printf("ERROR: failed to write xform time data to file\n");
-      return -1;
-    }
-
-    if ( setCountSize != write(pfd, fileData->xformdata[i], setCountSize) )
-    {
-      printf("ERROR: failed to write xform data to file\n");
-      return -1;
-    }
-  }
-
-  return pfd;
-}
-
-
-/************************************************************************************
- * Function: readRRDBFile
- *
- * Purpose: Read the contents of an RRDB file into memory.
- *
- * Written: 9th March 2013 By: Nick Knight
- ************************************************************************************/
-int readRRDBFile(int pfd, rrdbFile *fileData) {
-
-  ssize_t amount_read = 0;
-  long long totalSizeRequired;
-  long long setCountSize;
-  unsigned int i;
-
-  amount_read = read(pfd, &fileData->header, sizeof(rrdbHeader));
-
-  if ( sizeof(rrdbHeader) != amount_read ) {
-    printf("ERROR: failed to read a RRDB header - there must be one??\n");
-    return -1;
-  }
-
-  if( fileData->header.setCount > MAXNUMSETS ) {
-    printf("ERROR: RRDB header data corrupt\n");
-    return -1;
-  }
-
-  /* read time data */
-  totalSizeRequired = ( fileData->header.sampleCount * sizeof (rrdbTimePoint));
-
-  fileData->times = malloc(totalSizeRequired);
-  if ( totalSizeRequired != read(pfd, fileData->times, totalSizeRequired) ) {
-    printf("ERROR: failed to read time data from RRDB file\n");
-    freeRRDBFile(fileData);
-    return -1;
-  }
-
-
-  /* data sets */
-  setCountSize = ( fileData->header.sampleCount * sizeof (rrdbNumber));
-  for ( i = 0 ; i < fileData->header.setCount; i++ ) {
-    fileData->sets[i] = malloc(setCountSize);
-    if ( setCountSize != read(pfd, fileData->sets[i], setCountSize) ) {
-      printf("ERROR: failed to read set data from RRDB file\n");
-      freeRRDBFile(fileData);
-      return -1;
-    }
-  }
-
-  /* now look for xform data
-  fileData->xformheader.xformCount = 0;*/
-  if ( sizeof(rrdbXformsHeader) != read(pfd, &fileData->xformheader, sizeof(rrdbXformsHeader)) ) {
-    printf("ERROR: failed to read xform header from RRDB file\n");
-    freeRRDBFile(fileData);
-    return -1;
-  }
-
-  /* we have some xformations */
-  for ( i = 0 ; i < fileData->xformheader.xformCount; i++ ) {
-    if ( sizeof(rrdbXformHeader) != read(pfd, &fileData->xforms[i], sizeof(rrdbXformHeader))) {
-      printf("ERROR: failed to read xform header data from RRDB file\n");
-      freeRRDBFile(fileData);
-      return -1;
-    }
-
-    fileData->xformtimes[i] = malloc(totalSizeRequired);
-    if ( totalSizeRequired != read(pfd, fileData->xformtimes[i], totalSizeRequired) ) {
-      printf("ERROR: failed to read xform time data from RRDB file\n");
-      freeRRDBFile(fileData);
-      return -1;
-    }
-
+/**
+ * Parse the values of a touch, "count[:timestamp[:value]]" - an empty timestamp is now. An
+ * empty string is a single touch now. valued is set if it has a value.
+ * @return { int } 1 on success -1 on failure
+ */
+static int parseTouchValues( const char *values, unsigned int *count, time_t *when, double *value, int *valued ) {
+  char *end;
 
-    fileData->xformdata[i] = malloc(setCountSize);
-    if ( setCountSize != read(pfd, fileData->xformdata[i], setCountSize) ) {
-      printf("ERROR: failed to read xform data from RRDB file\n");
-      freeRRDBFile(fileData);
-      return -1;
-    }
-  }
+  *count = 1;
+  *when = 0;
+  *valued = FALSE;
 
-  return pfd;
-}
+  if ( NULL == values || 0 == values[ 0 ] ) return 1;
 
-/************************************************************************************
- * Function: writeRRDBFile
- *
- * Purpose: Print the info about an RRDB file.
- *
- * Written: 10th March 2013 By: Nick Knight
- ************************************************************************************/
-int printRRDBFileInfo(char *filename)
-{
-  rrdbFile fileData;
-  unsigned int i;
-  locked_file_t pfd = readopenandlock( filename );
-
-  if( -1 == pfd.data_fd ) {
-    printf("ERROR: failed to open %s\n", filename);
+  errno = 0;
+  unsigned long c = strtoul( values, &end, 10 );
+  if ( 0 != errno || end == values || '-' == values[ 0 ] || c > UINT_MAX || ( ':' != *end && 0 != *end ) ) {
+    outprintf("ERROR: bad touch count '%s'\n", values);
     return -1;
   }
+  *count = ( unsigned int ) c;
 
-  if ( RRDBTOUCHV2 == getFileVersion( pfd.data_fd ) ) {
-    rrdbTouchHeader *ourtouchheader;
-    rrdbTouchSet *setHeader;
-    struct stat sb;
-    char *addr, *ptr;
-    unsigned int loopcount;
-
-    if ( fstat( pfd.data_fd, &sb ) == -1 ) { /* To obtain file size */
-      printf("ERROR: cannot stat RRDB file\n");
-      unlockandclose( pfd );
-      return -1;
-    }
-
-    addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, pfd.data_fd, 0);
-    if (addr == MAP_FAILED) {
-      printf("ERROR: error accessing data file.\n");
-      fprintf(stderr, "error - mmap failed while accessing data file for printing: %s (errno=%d)\n", strerror(errno), errno);
-      unlockandclose( pfd );
+  if ( ':' == *end && ':' != end[ 1 ] ) {
+    const char *ts = end + 1;
+    long long t = strtoll( ts, &end, 10 );
+    if ( 0 != errno || end == ts || ( ':' != *end && 0 != *end ) || t <= 0 ) {
+      outprintf("ERROR: bad touch timestamp '%s'\n", ts);
       return -1;
     }
-
-    ourtouchheader = ( rrdbTouchHeader * ) addr;
-    setHeader = ( rrdbTouchSet * )( addr + sizeof(rrdbTouchHeader) );
-
-    printf( "2:%i:%i\n", ourtouchheader->sets, ourtouchheader->samplesPerSet );
-
-    for ( loopcount = 0; loopcount < ourtouchheader->sets; loopcount++ ) {
-      printf("%s:%i\n", setHeader->path, getTimePerSample( setHeader->period ) );
-      ptr = (char *)setHeader;
-      ptr += sizeof( rrdbTouchSet ) + ( ourtouchheader->samplesPerSet * sizeof( rrdbInt ) );
-      setHeader = ( rrdbTouchSet * ) ptr;
-    }
-
-    munmap( ( char * ) addr, sb.st_size );
-
-    unlockandclose( pfd );
-    return 1;
-  }
-
-  memset( &fileData, 0, sizeof( rrdbFile ) );
-  if( -1 == readRRDBFile(pfd.data_fd, &fileData) ) {
-    unlockandclose( pfd );
-    return -1;
+    *when = ( time_t ) t;
+  } else if ( ':' == *end ) {
+    end++;
   }
 
-  printf("Version is %i\n", fileData.header.fileVersion);
-  printf("Number of sets %i\n", fileData.header.setCount);
-  printf("Number of samples %i\n", fileData.header.sampleCount);
-  printf("Current window position %i\n", fileData.header.windowPosition);
-  printf("Contains #%i xformations\n", fileData.xformheader.xformCount);
-
-  for ( i = 0 ; i < fileData.xformheader.xformCount; i++ ) {
-    switch(fileData.xforms[i].calc) {
-      case RRDBMAX:
-        printf("RRDBMAX:");
-        break;
-
-      case RRDBMIN:
-        printf("RRDBMIN:");
-        break;
-
-      case RRDBCOUNT:
-        printf("RRDBCOUNT:");
-        break;
-
-      case RRDBMEAN:
-        printf("RRDBMEAN:");
-        break;
-
-      case RRDBSUM:
-        printf("RRDBSUM:");
-        break;
-
-      default:
-        break;
-    }
-
-    switch(fileData.xforms[i].period) {
-      case FIVEMINUTE:
-        printf("FIVEMINUTE\n");
-        break;
-
-      case QUARTERHOUR:
-        printf("QUARTERHOUR\n");
-        break;
-
-      case ONEHOUR:
-        printf("ONEHOUR\n");
-        break;
-
-      case SIXHOUR:
-        printf("SIXHOUR\n");
-        break;
-
-      case TWELVEHOUR:
-        printf("TWELVEHOUR\n");
-        break;
-
-      case ONEDAY:
-        printf("ONEDAY\n");
-        break;
-
-      default:
-        break;
-    }
-  }
-
-  freeRRDBFile(&fileData);
-  unlockandclose( pfd );
-
-  return 1;
-}
-
-/************************************************************************************
- * Function: modifyRRDBFile
- * Written: 22nd June 2021 By: Nick Knight
- ************************************************************************************/
-int modifyRRDBFile(char *filename, char* vals, char* xform) {
-
-  rrdbFile fileData;
-  int ixform;
-
-  locked_file_t pfd = readwriteopenandlock( filename );
-  if ( -1 == pfd.data_fd ) {
-    printf( "ERROR: failed to open %s\n", filename );
-    return -1;
-  }
-
-  if ( RRDBTOUCHV2 == getFileVersion( pfd.data_fd ) ) {
-    printf("Unsupported version V2\n");
-    unlockandclose( pfd );
-    return -1;
-  }
-
-  memset( &fileData, 0, sizeof( rrdbFile ) );
-  if( -1 == readRRDBFile(pfd.data_fd, &fileData) ) {
-    unlockandclose( pfd );
-    return -1;
-  }
-
-  printf("Version is %i\n", fileData.header.fileVersion);
-  printf("Number of sets %i\n", fileData.header.setCount);
-  printf("Number of samples %i\n", fileData.header.sampleCount);
-  printf("Current window position %i\n", fileData.header.windowPosition);
-  printf("Contains #%i xformations\n", fileData.xformheader.xformCount);
-
-  // vals == "time:val" i.e. "1234:111"
-  // OR
-  // 1234.33:111 - raw data has a usec component also
-  char *token;
-  time_t indextime = 0;
-  rrdbTimemSeconds usec = 0;
-
-  if( NULL != strchr( vals, '.' ) ) {
-    token = strtok( vals, "." );
-    indextime = atol( token );
-
-    token = strtok( NULL, ":" );
-    usec = atoi( token );
-  } else {
-    token = strtok( vals, ":" );
-    indextime = atol( token );
-  }
-  token = strtok( NULL, ":" );
-  long double newvalue = atof( token );
-
-  if( strlen(xform) > 0 ) {
-    ixform = atoi(xform);
-    printf("Modifying xform %i, time %ld, new value %Lf\n", ixform, indextime, newvalue );
-
-    if( ixform > fileData.xformheader.xformCount ) {
-      printf("xform out of range\n");
-      freeRRDBFile(&fileData);
-      unlockandclose( pfd );
+  if ( ':' == *end ) {
+    const char *v = end + 1;
+    *value = strtod( v, &end );
+    if ( 0 != errno || end == v || 0 != *end || !isfinite( *value ) ) {
+      outprintf("ERROR: bad touch value '%s'\n", v);
       return -1;
     }
-
-    for ( int i = 0 ; i < fileData.header.sampleCount; i++ ) {
-      if( indextime == fileData.xformtimes[ixform][i].time ) {
-        printf("Modifying %ld:%Lf\n", fileData.xformtimes[ixform][i].time, fileData.xformdata[ixform][i] );
-        fileData.xformdata[ixform][i] = newvalue;
-        goto finishmodify;
-      }
-    }
-
-    freeRRDBFile(&fileData);
-    unlockandclose( pfd );
-    return -1;
-  }
-
-  printf("Modifying raw data, time %ld.%i, with new value %Lf\n", indextime, usec, newvalue );
-  for ( int i = 0 ; i < fileData.header.sampleCount; i++ ) {
-    if ( 1 == fileData.times[i].valid ) {
-      if( indextime == fileData.times[i].time &&
-          usec == fileData.times[i].uSecs ) {
-        for ( int j = 0 ; j < fileData.header.setCount; j++ ) {
-          printf("Modifying raw data time %ld.%i ;old value %Lf; new value %Lf\n", fileData.times[i].time, fileData.times[i].uSecs, fileData.sets[j][i], newvalue );
-          fileData.sets[j][i] = newvalue;
-        }
-        goto finishmodify;
-      }
-    }
+    *valued = TRUE;
   }
 
-  goto finishnomodify;
-
-finishmodify:
-
-  if ( -1 == writeRRDBFile(pfd.data_fd, &fileData) )
-    fprintf( stderr, "Could not write data to RRDB file\n");
-
-finishnomodify:
-
-  freeRRDBFile(&fileData);
-  unlockandclose( pfd );
-
   return 1;
 }
 
+/**
+ * runs the command
+ * Written: 10th March 2013 By: Nick Knight
+ */
+int runCommand(char *filename, RRDBCommand ourCommand, unsigned int sampleCount, unsigned int setCount, char *values, char *xformations, char * cperiod) {
+  int ret = RRDB_ERROR;
 
-/************************************************************************************
- * Function: updateRRDBFile
- *
- * Purpose: Update a file with the supplied values. At the moment read, modify then
- * write, so could have performance improved by more clever manipulation of the file.
- * It will also ripple the data down to depenant files also.
- *
- * Written: 9th March 2013 By: Nick Knight
- ************************************************************************************/
-int updateRRDBFile(char *filename, char* vals) {
-  rrdbFile fileData;
-  char *result = NULL;
-  const char delims[] = ":";
-  struct timeval t1;
-
-  memset( &fileData, 0, sizeof( rrdbFile ) );
-
-  struct timeval xformstart;
-  rrdbNumber xformResult;
-
-  struct tm *current_tm;
-  time_t current_time;
-
-  xformstart = (struct timeval){0};
-
-  locked_file_t pfd = readwriteopenandlock( filename );
-
-  if( -1 == pfd.data_fd ) {
-    fprintf( stderr, "failed to open %s for O_RDWR\n", filename );
-    printf( "ERROR: failed to open %s for O_RDWR\n", filename );
-    return -1;
-  }
-
-  /*
-    read in the header to get the window position and make
-    sure the set count is correct
-    */
-  if( -1 == readRRDBFile(pfd.data_fd, &fileData) ) {
-    fprintf( stderr, "failed to read %s\n", filename );
-    unlockandclose( pfd );
-    return -1;
-  }
-
-  /*
-    Move round on 1
-    */
-  fileData.header.windowPosition = ( fileData.header.windowPosition + 1 ) % fileData.header.sampleCount;
-
-  /*
-    times
-  */
-
-  fileData.times[fileData.header.windowPosition].valid = 1;
-  gettimeofday(&t1, NULL);
-  fileData.times[fileData.header.windowPosition].time = t1.tv_sec;
-  fileData.times[fileData.header.windowPosition].uSecs = t1.tv_usec;
-
-
-  /*
-    The vals are a string of seperated vales in the format of num:num:num
-    1 for each set we have in the file.
-    */
-
-  result = strtok( vals, delims );
-  for ( unsigned int i = 0 ; i < fileData.header.setCount; i++ ) {
-    if ( NULL != result )
-      fileData.sets[i][fileData.header.windowPosition] = atof(result);
-    else
-      fileData.sets[i][fileData.header.windowPosition] = 0;
-
-    result = strtok( NULL, delims );
-  }
-
-  /*
-    * Now we need to update our xformations (xforms) current_tm->tm_hour = 0;
-    */
-  current_time = t1.tv_sec;
-
-  for ( unsigned int i = 0, outindex = 0; i < fileData.xformheader.xformCount; i++) {
-    current_tm = gmtime(&current_time);
-
-    switch (fileData.xforms[i].period) {
-      case FIVEMINUTE:
-        current_tm->tm_sec = 0;
-        /* move to the start of the nearest 5 minutes */
-        current_tm->tm_min = ((int)(current_tm->tm_min/5))*5;
-
-
-        xformstart.tv_sec = mktime(current_tm);
-        xformstart.tv_usec = 0;
-        break;
-
-      case QUARTERHOUR:
-        current_tm->tm_sec = 0;
-        current_tm->tm_min = ((int)(current_tm->tm_min/15))*15;;
-
-        xformstart.tv_sec = mktime(current_tm);
-        xformstart.tv_usec = 0;
-        break;
-
-      case ONEHOUR:
-        current_tm->tm_sec = 0;
-        current_tm->tm_min = 0;
-
-        xformstart.tv_sec = mktime(current_tm);
-        xformstart.tv_usec = 0;
-        break;
-
-      case SIXHOUR:
-        current_tm->tm_sec = 0;
-        current_tm->tm_min = 0;
-        current_tm->tm_hour = ((int)(current_tm->tm_hour/6))*6;
-
-        xformstart.tv_sec = mktime(current_tm);
-        xformstart.tv_usec = 0;
-        break;
-
-      case TWELVEHOUR:
-        current_tm->tm_sec = 0;
-        current_tm->tm_min = 0;
-        current_tm->tm_hour = ((int)(current_tm->tm_hour/12))*12;
-
-        xformstart.tv_sec = mktime(current_tm);
-        xformstart.tv_usec = 0;
-        break;
-
-      case ONEDAY:
-        current_tm->tm_sec = 0;
-        current_tm->tm_min = 0;
-        current_tm->tm_hour = 0;
-
-        xformstart.tv_sec = mktime(current_tm);
-        xformstart.tv_usec = 0;
-        break;
-
-      default:
-        break;
-    }
-
-    xformResult = 0;
-
-    /*
-      The value should be placed in the current windowed position, if still valid (i.e. updated)
-      or if it is now outside the time window moved on 1.
-      */
-    unsigned int writeWindowPosition = fileData.xforms[i].windowPosition;
-    int movedon = FALSE;
-    if( fileData.xformtimes[i][fileData.xforms[i].windowPosition].time != xformstart.tv_sec ) {
-      /* we need to move on the window... */
-      writeWindowPosition = (fileData.xforms[i].windowPosition + 1 ) % fileData.header.sampleCount;
-      movedon = TRUE;
-    }
-
-    unsigned int setindex = fileData.xforms[i].setIndex;
-
-    if( setindex > MAXNUMSETS || NULL == fileData.sets[ setindex ] ) {
-      fprintf( stderr, "Invalid xform - xforms incorrectly setup index at %i  with setcount %i in file %s (ignoring)\n", setindex, fileData.header.setCount, filename );
-    } else {
-
-      switch (fileData.xforms[i].calc) {
-        case RRDBMAX:
-          if( TRUE == movedon )
-            xformResult = fileData.sets[setindex][fileData.header.windowPosition];
-          else
-            xformResult = MAX( fileData.sets[setindex][fileData.header.windowPosition],
-                                fileData.xformdata[i][writeWindowPosition] );
-          break;
-
-        case RRDBMIN:
-          if( TRUE == movedon )
-            xformResult = fileData.sets[setindex][fileData.header.windowPosition];
-          else
-            xformResult = MIN( fileData.sets[setindex][fileData.header.windowPosition],
-                                fileData.xformdata[i][writeWindowPosition] );
-          break;
-
-        case RRDBCOUNT:
-          if( TRUE == movedon )
-            xformResult = 1;
-          else
-            xformResult = fileData.xformdata[i][writeWindowPosition] + 1;
-
-          break;
-
-        case RRDBMEAN:
-        {
-          unsigned int countWindowPosition = (writeWindowPosition + 1) % fileData.header.sampleCount;
-          if( TRUE == movedon ) {
-            /* We use the next slot to store our running count so we can add to the average - and hide it */
-            fileData.xformtimes[i][countWindowPosition].valid = FALSE;
-            fileData.xformdata[i][countWindowPosition] = 1;
-            xformResult = fileData.sets[setindex][fileData.header.windowPosition];
-          } else {
-            rrdbNumber countinmean = fileData.xformdata[i][countWindowPosition];
-            if( countinmean <= 0 ) countinmean = 1; /* allow for corruption */
-            rrdbNumber reversemean = fileData.xformdata[i][writeWindowPosition] * countinmean;
-            rrdbNumber newval = fileData.sets[setindex][fileData.header.windowPosition];
-            xformResult = ( reversemean + newval ) /
-                          ( countinmean + 1 );
-
-            fileData.xformdata[i][countWindowPosition]++;
-          }
-          break;
-        }
-        case RRDBSUM:
-          if( TRUE == movedon )
-            xformResult = fileData.sets[setindex][fileData.header.windowPosition];
-          else
-            xformResult = fileData.sets[setindex][fileData.header.windowPosition] +
-                                fileData.xformdata[i][writeWindowPosition];
-          break;
-
-        default:
-            break;
-      }
-
-      fileData.xformdata[ outindex ][ writeWindowPosition ] = xformResult;
-      fileData.xformtimes[ outindex ][ writeWindowPosition ].time = xformstart.tv_sec;
-      fileData.xformtimes[ outindex ][ writeWindowPosition ].uSecs = 0;
-      fileData.xformtimes[ outindex ][ writeWindowPosition ].valid = TRUE;
-      fileData.xforms[ outindex ].windowPosition = writeWindowPosition;
-
-      outindex++;
-    }
-  }
-
-  /* Now write it */
-  int retval = 1;
-  if ( -1 == writeRRDBFile(pfd.data_fd, &fileData) ) retval = -1;
-  freeRRDBFile(&fileData);
-  unlockandclose( pfd );
-  return retval;
-}
-
-/************************************************************************************
- * Function: getFileVersion
- *
- * Purpose: Load the first Int in a file which indicates which file type.
- *
- * Written: 19th April 2017 By: Nick Knight
- ************************************************************************************/
-int getFileVersion(int pfd)
-{
-  int version;
-
-  off_t curpos = lseek( pfd, 0, SEEK_CUR );
-
-  lseek( pfd, 0, SEEK_SET );
-  if( -1 == read( pfd, &version, sizeof(version) ) ) {
-    fprintf( stderr, "Failed to read file in getFileVersion\n");
-    return -1;
-  }
-  lseek( pfd, curpos, SEEK_SET );
-  return version;
-}
-
-/************************************************************************************
- * Function: getTimePerSample
- *
- * Purpose: Get the number of samples per period.
- *
- * Written: 19th April 2017 By: Nick Knight
- ************************************************************************************/
-unsigned int getTimePerSample(unsigned int period)
-{
-  switch( period )
-  {
-    case FIVEMINUTE:
-      return 60 * 5;
-      break;
-
-    case QUARTERHOUR:
-      return 60 * 15;
-      break;
-
-    case ONEHOUR:
-      return 60 * 60;
-      break;
-
-    case SIXHOUR:
-      return 60 * 60 * 6;
-      break;
-
-    case TWELVEHOUR:
-      return 60 * 60 * 12;
-      break;
-
-    case ONEDAY:
-      return 60 * 60 * 24;
-      break;
-  }
-
-  /* Default */
-  return 60 * 60 * 24;
-}
-
-/************************************************************************************
- * Function: touchSet
- *
- * Purpose: We have a set to update, clear some variables back to zero, and the
- * latest increment. The file pointer is expected to be at the start of the
- * setdata.
- *
- * Written: 8th April 2017 By: Nick Knight
- ************************************************************************************/
-int touchSet(rrdbTouchHeader *header, rrdbTouchSet *setHeader, rrdbInt *setdata)
-{
-    const time_t tps       = getTimePerSample(setHeader->period);
-    const time_t now       = time(NULL);
-    const time_t now_tick  = now / tps;
-    const time_t last_tick = setHeader->lastTouch / tps;
-
-    const unsigned int N = header->samplesPerSet;
-
-    // Same or clock went backwards: just bump current computed index
-    if (now_tick <= last_tick) {
-        unsigned int nowindex = (unsigned int)(now_tick % N);
-        setdata[nowindex]++;
-        setHeader->lastTouch = now;
-        return 1;
-    }
-
-    unsigned int nowindex  = (unsigned int)(now_tick  % N);
-    unsigned int lastindex = (unsigned int)(last_tick % N);
-    time_t diff = now_tick - last_tick;
-
-    if (diff >= (time_t)N) {
-        // advanced by a full ring or more: everything is stale
-        memset(setdata, 0, N * sizeof(rrdbInt));
-    } else if (diff > 1) {
-        // clear bins strictly between last and now
-        if (nowindex > lastindex) {
-            // contiguous region
-            size_t span = (size_t)(diff - 1);
-            memset(setdata + lastindex + 1, 0, span * sizeof(rrdbInt));
-        } else {
-            // wrapped: tail and head
-            size_t tail = N - (lastindex + 1);
-            size_t head = nowindex;
-            if (tail) memset(setdata + lastindex + 1, 0, tail * sizeof(rrdbInt));
-            if (head) memset(setdata, 0, head * sizeof(rrdbInt));
-        }
-    }
-    // Important: we are in a new bin; zero it so we don't carry old value
-    setdata[nowindex] = 0;
-
-    // Now record this touch
-    setdata[nowindex]++;           // or += count if you have a batch value
-    setHeader->lastTouch = now;
-    return 1;
-}
-
-/************************************************************************************
- * Function: findTouchSet
- *
- * Purpose: Search through exsisting sets to find the one of interest - or if not
- * found either create a new one up to our max or overwrite the oldest one untouched.
- *
- * Written: 8th April 2017 By: Nick Knight
- ************************************************************************************/
-int findTouchSet(int pfd, char *path, unsigned int period, unsigned int maxsets)
-{
-  rrdbTouchHeader *header;
-  unsigned int samplesPerSet;
-  rrdbTouchSet *setHeader, *oldestHeader = NULL;
-  unsigned int loopcount;
-  rrdbInt *setdata;
-  struct stat sb;
-  char *addr, *ptr;
-  int retval = -1;
-
-  if ( fstat( pfd, &sb ) == -1 ) { /* To obtain file size */
-    printf("ERROR: failed to stat file\n");
-    return -1;
-  }
-
-  if ( 0 == strlen( path ) ) {
-    printf("ERROR: path should be a string\n");
-    return -1;
-  }
-
-  size_t mappedsize = sb.st_size;
-  addr = mmap(NULL, mappedsize, PROT_READ | PROT_WRITE, MAP_SHARED, pfd, 0);
-  if (addr == MAP_FAILED) {
-    printf("ERROR: error accessing data file (1).\n");
+  if ( !growresult( 0 ) ) {
+    outprintf( "ERROR: out of memory\n" );
     return -1;
   }
 
-  rrdbTimeEpochSeconds oldestlasttouch = 0;
-
-  /* Header */
-  header = ( rrdbTouchHeader * ) addr;
-  samplesPerSet = header->samplesPerSet;
-  /* Make sure we are at the beggining of the sets */
-  setHeader = ( rrdbTouchSet * )( addr + sizeof(rrdbTouchHeader) );
+  switch( ourCommand ) {
+    case CREATE:
+      return printresult( rrdb_create( filename, setCount, sampleCount, xformations, &commandresult ) );
 
-  for ( loopcount = 0; loopcount < header->sets; loopcount++ )
-  {
+    case FETCH:
+      /* only reads, so it is safe to ask again with a bigger buffer */
+      while( RRDB_TRUNCATED == ( ret = rrdb_fetch( filename, xformations, cperiod, &commandresult ) ) && growresult( commandresult.length ) );
+      return printresult( ret );
 
-    if ( 0 == oldestlasttouch && setHeader->lastTouch < oldestlasttouch )
+    case UPDATE:
     {
-      oldestlasttouch = setHeader->lastTouch;
-      oldestHeader = setHeader;
-    }
+      /* we should be given a value for each set we have - num:num:num */
+      double numbers[ MAXNUMSETS ];
+      unsigned int count = 0;
+      char *saveptr = NULL;
 
-    if ( 0 != strcmp(setHeader->path, path) )
-    {
-      goto continueloop;
+      for ( char *v = strtok_r( values, ":", &saveptr ); NULL != v && count < MAXNUMSETS; v = strtok_r( NULL, ":", &saveptr ) ) {
+        numbers[ count++ ] = atof( v );
+      }
+      /* update can fail - but just indicate it needs creating - output will have been sent though */
+      return printresult( rrdb_update( filename, numbers, count, &commandresult ) );
     }
 
-    if ( setHeader->period != period )
+    case MODIFY:
+      return printresult( rrdb_modify( filename, values, xformations, &commandresult ) );
+
+    case INFO:
+      while( RRDB_TRUNCATED == ( ret = rrdb_info( filename, &commandresult ) ) && growresult( commandresult.length ) );
+      return printresult( ret );
+
+    case TOUCH:
     {
-      goto continueloop;
+      unsigned int count;
+      time_t when;
+      double value;
+      int valued;
+      /* values is count[:timestamp[:value]] */
+      if ( -1 == parseTouchValues( values, &count, &when, &value, &valued ) ) return -1;
+      if ( valued ) return printresult( rrdb_touch_value( filename, xformations, cperiod, setCount, sampleCount, count, value, when, &commandresult ) );
+      return printresult( rrdb_touch( filename, xformations, cperiod, setCount, sampleCount, count, when, &commandresult ) );
     }
 
-    retval = touchSet( header, setHeader, ( rrdbInt * ) ( setHeader + 1 ) );
-    munmap( ( char * ) addr, mappedsize );
-    return retval;
+    case COALESCE:
+      /* setCount is the interval in ms */
+      return RRDB_OK == rrdb_coalesce( setCount ) ? 1 : -1;
 
-    continueloop:
+    case FLUSH:
+      return RRDB_OK == rrdb_flush() ? 1 : -1;
 
-    ptr = (char *)setHeader;
-    ptr += sizeof( rrdbTouchSet ) + ( header->samplesPerSet * sizeof( rrdbInt ) );
-    setHeader = ( rrdbTouchSet * ) ptr;
-  }
+    case ARCHIVE:
+      return printresult( rrdb_archive( filename, &commandresult ) );
 
-  /* If we get here, then we have not found one */
-  if ( header->sets >= maxsets && NULL != oldestHeader )
-  {
-    /* in this condition we overwrite the oldest */
-    setHeader = oldestHeader;
-    setdata = ( rrdbInt * ) ( setHeader + 1 );
-    memset( (void *) setdata, 0, samplesPerSet * sizeof(rrdbInt) );
-  }
-  else
-  {
-    /* Add a new one(s) */
-    header->sets++;
-
-    if ( fstat( pfd, &sb ) == -1 ) {/* To obtain file size */
-      printf( "ERROR: failed to stat file \n" );
-      munmap( ( char * ) addr, mappedsize );
-      return -1;
-    }
+    case RESHAPE:
+      return printresult( rrdb_reshape( filename, setCount, sampleCount, xformations, &commandresult ) );
 
-    munmap( ( char * ) addr, mappedsize );
-    posix_fallocate( pfd, sb.st_size, sizeof( rrdbTouchSet ) + ( sizeof( rrdbInt ) * samplesPerSet ) );
+    case AGGREGATE:
+      /* filename is a glob, values the reduction and sampleCount the threads to read the files on */
+      while( RRDB_TRUNCATED == ( ret = rrdb_aggregate( filename, xformations, cperiod, values, sampleCount, &commandresult ) ) && growresult( commandresult.length ) );
+      return printresult( ret );
 
-    if ( fstat( pfd, &sb ) == -1 ) { /* To obtain file size */
-      printf( "ERROR: failed to stat file\n" );
-      return -1;
+    case TOP:
+    {
+      /* xformations is the prefix, values n[:bins] */
+      char *bins = strchr( values, ':' );
+      while( RRDB_TRUNCATED == ( ret = rrdb_top( filename, xformations, cperiod, atoi( values ), NULL == bins ? 0 : atoi( bins + 1 ),
+                                                 &commandresult ) ) && growresult( commandresult.length ) );
+      return printresult( ret );
     }
 
-    addr = mmap(NULL, sb.st_size, PROT_WRITE | PROT_READ, MAP_SHARED, pfd, 0);
-    if (addr == MAP_FAILED) {
-      printf("ERROR: error accessing data file (2).\n");
-      return -1;
-    }
+    case SCAN:
+      /* its output streams rather than coming back in the buffer. values is what to emit, sampleCount the threads */
+      return RRDB_OK == rrdb_scan( filename, values, xformations, cperiod, sampleCount, outputstream ) ? 1 : -1;
 
-    setHeader = ( rrdbTouchSet * ) ( addr + sb.st_size - ( sizeof( rrdbTouchSet ) + ( sizeof( rrdbInt ) * samplesPerSet ) ) );
-    setdata = ( rrdbInt * ) ( setHeader + 1 );
-  }
+    case CONVERT: {
+      /* values is the version to convert to, a directory converts everything under it on sampleCount threads */
+      struct stat sb;
+      if ( 0 == stat( filename, &sb ) && S_ISDIR( sb.st_mode ) ) {
+        return printresult( rrdb_convert_tree( filename, atoi( values ), sampleCount, &commandresult ) );
+      }
+      return printresult( rrdb_convert( filename, atoi( values ), &commandresult ) );
+    }
 
-  setHeader->lastTouch = time( NULL );
-  setHeader->period = period;
-  memset( setHeader->path, 0, sizeof( setHeader->path ) );
-  strcpy( setHeader->path, path );
+    case LOCKSTATS:
+      while( RRDB_TRUNCATED == ( ret = rrdb_lock_stats( &commandresult ) ) && growresult( commandresult.length ) );
+      return printresult( ret );
 
-  int nowindex = ( setHeader->lastTouch / getTimePerSample( period ) ) % samplesPerSet;
-  setdata[ nowindex ] = 1;
+    case RINGSTATS:
+      while( RRDB_TRUNCATED == ( ret = rrdb_ring_stats( &commandresult ) ) && growresult( commandresult.length ) );
+      return printresult( ret );
 
-  munmap( ( char * ) addr, sb.st_size );
+    case PIPE:
+      break;
+  }
 
-  return 1;
+  return -1;
 }
 
-/************************************************************************************
- * Function: touchRRDBFile
- *
- * Purpose: This is a slightly different format of file than our initial RRDB file.
- * This format is to keep count of hits on a certain point. For example, with use in
- * babblevoice a path is the path through an auto attendant menu. For example,
- * a user dials 1 then 2 to navigate through a menu. The jumps in the extensions jump
- * through to extensions mainintro and then sales. The path then becomes mainintro/sales.
- * So we record a hit on the full path and then each sub path. Because we are slightly
- * more dynamic, i.e. the paths may vary - we need the ability to remove old paths which
- * are no longer used (i.e. the oldest one) if we need a new one.
- *
- * Written: 7th March 2017 By: Nick Knight
- ************************************************************************************/
-int touchRRDBFile(char *filename, char *path, char * period, unsigned int maxsets, unsigned int sampleCount)
-{
-  unsigned int iperiod = 0;
-  char *pathitem, *perioditem;
-  char *pathitem_save_ptr, *perioditem_save_ptr;
-  char *addr, *ptr;
-  char periodcopy[MAXVALUESTRING];
-  unsigned int i;
-  unsigned int setsize = 0;
-  off_t truncateby = 0;
-  time_t now;
-  rrdbTouchHeader *headerData;
-  rrdbTouchSet *touchSet, *src;
-  struct stat sb;
-
-  if ( 0 == maxsets ) {
-    maxsets = TOUCHMAXDEFAULTSETS;
-  }
-
-  if ( 0 == sampleCount ) {
-    sampleCount = TOUCHDEFAULTSAMPLECOUNT;
-  }
+/*
+ Binary protocol. A pipe client which sends "binary" as a command switches the connection
+ to length prefixed frames. All integers are little endian, numbers are IEEE 754 doubles
+ and strings are a u16 length followed by the bytes (no terminator).
 
-  locked_file_t pfd = createopenandlock( filename );
-  if ( -1 == pfd.data_fd ) {
-    /* failure - should only ouput one error - perhaps need to put this somewhere else?*/
-    printf( "ERROR: failed to open %s\n", filename );
-    return -1;
-  }
+ request:  u32 length (of what follows), u8 opcode, payload
+ response: u32 length (of what follows), u8 status, payload
 
-  if ( fstat( pfd.data_fd, &sb ) == -1 ) { /* To obtain file size */
-    unlockandclose( pfd );
-    printf("ERROR: Couldn't stat RRDB file(1)\n");
-    return -1;
-  }
+ A failed request has status RRDBSTATUSERROR and the error text as its payload. See the
+ README for the payload of each opcode.
+ */
+/**
+ * A filename in a frame is relative to our dir, the same as the text protocol.
+ */
+static void getfilename( rrdbBuffer *buf, char *dir, char *fulldirname, size_t outlen ) {
+  char filename[ NAME_MAX ];
+  getstring( buf, filename, sizeof( filename ) );
 
-  if ( 0 == sb.st_size ) {
-    posix_fallocate( pfd.data_fd, 0, sizeof(rrdbTouchHeader) );
+  if ( !buf->overrun && snprintf( fulldirname, outlen, "%s/%s", dir, filename ) >= ( int ) outlen )
+    buf->overrun = TRUE;
+}
 
-    if ( fstat( pfd.data_fd, &sb ) == -1 ) { /* To obtain file size */
-      unlockandclose( pfd );
-      printf("ERROR: Couldn't stat RRDB file(2)\n");
-      return -1;
-    }
+static void writeframe( uint8_t status, rrdbBuffer *payload ) {
+  unsigned char head[ 5 ];
+  uint32_t length = payload->length + 1;
 
-    headerData = ( rrdbTouchHeader * ) mmap(NULL, sizeof(rrdbTouchHeader), PROT_WRITE | PROT_READ, MAP_SHARED, pfd.data_fd, 0);
-    if (headerData == MAP_FAILED) {
-      unlockandclose( pfd );
-      printf("ERROR: Failed to read RRDB file header\n");
-      return -1;
-    }
+  for ( int i = 0; i < 4; i++ ) head[ i ] = ( length >> ( 8 * i ) ) & 0xff;
+  head[ 4 ] = status;
 
-    /* In this version of RRDB file we create dynamically. */
-    headerData->fileVersion = RRDBTOUCHV2;
-    headerData->sets = 0;
-    headerData->samplesPerSet = sampleCount;
+  fwrite( head, 1, sizeof( head ), stdout );
+  if ( payload->length ) fwrite( payload->data, 1, payload->length, stdout );
+  fflush( stdout );
+}
 
-    munmap( ( char * ) headerData, sizeof(rrdbTouchHeader) );
-  }
+static void writeerrorframe( const char *message, size_t len ) {
+  rrdbBuffer payload = { 0 };
 
-  if ( RRDBTOUCHV2 != getFileVersion( pfd.data_fd ) ) {
-    printf("ERROR: Bad format for RRDB touch file\n");
-    unlockandclose( pfd );
-    return -1;
+  /* drop the trailing new line the text messages carry */
+  while ( len > 0 && ( '\n' == message[ len - 1 ] || '\r' == message[ len - 1 ] ) ) len--;
+  if ( 0 == len ) {
+    message = "ERROR: request failed";
+    len = strlen( message );
   }
 
-  if ( 0 == strlen( period ) ) {
-    period = "d";
-  }
+  putbytes( &payload, message, len );
+  writeframe( RRDBSTATUSERROR, &payload );
+  free( payload.data );
+}
 
-  pathitem_save_ptr = NULL;
-  // We only use path once, so it doesn't matter that strtok_r overwrites it
-  pathitem = strtok_r( path, "/", &pathitem_save_ptr );
-  while( NULL != pathitem ) {
-    perioditem_save_ptr = NULL;
-    strcpy( periodcopy, period );
-    perioditem = strtok_r( periodcopy, ",", &perioditem_save_ptr );
-
-    while( NULL != perioditem ) {
-      if ( 0 == strcmp( perioditem, "FIVEMINUTE" ) ) {
-        iperiod = FIVEMINUTE;
-      } else if ( 0 == strcmp( perioditem, "QUARTERHOUR" ) ) {
-        iperiod = QUARTERHOUR;
-      } else if ( 0 == strcmp( perioditem, "ONEHOUR" ) ) {
-        iperiod = ONEHOUR;
-      } else if ( 0 == strcmp( perioditem, "SIXHOUR" ) ) {
-        iperiod = SIXHOUR;
-      } else if ( 0 == strcmp( perioditem, "TWELVEHOUR" ) ) {
-        iperiod = TWELVEHOUR;
-      } else if ( 0 == strcmp( perioditem, "ONEDAY" ) ) {
-        iperiod = ONEDAY;
-      } else {
-        iperiod = ONEHOUR;
-      }
+/**
+ * Decode a set of update values (u8 count then count doubles).
+ */
+static unsigned int getvalues( rrdbBuffer *buf, double *values ) {
+  unsigned int count = getu8( buf );
 
-      findTouchSet(pfd.data_fd, pathitem, iperiod, maxsets);
-      perioditem = strtok_r( NULL, ",", &perioditem_save_ptr );
-    }
-    pathitem = strtok_r( NULL, "/", &pathitem_save_ptr );
+  if ( count > MAXNUMSETS ) {
+    buf->overrun = TRUE;
+    return 0;
   }
 
-  /* Remove any sets which haven't been touched for longer than the set size */
-  if ( fstat( pfd.data_fd, &sb ) == -1 ) { /* To obtain file size */
-    unlockandclose( pfd );
-    printf("ERROR: Failed to stat RRDB file (3)\n");
-    return -1;
-  }
+  for ( unsigned int i = 0; i < count; i++ ) values[ i ] = getf64( buf );
+  return count;
+}
 
-  addr = mmap(NULL, sb.st_size, PROT_WRITE | PROT_READ, MAP_SHARED, pfd.data_fd, 0);
-  if (addr == MAP_FAILED) {
-    unlockandclose( pfd );
-    printf("ERROR: Failed to mmap RRDB file data\n");
+/**
+ * Run one decoded request through the library. Anything it would normally print is
+ * written with outprintf so that it can be returned as the text of an error frame.
+ * @return { int } 1 on success -1 on failure
+ */
+static int runframe( char *dir, rrdbBuffer *in, rrdbBuffer *out ) {
+  char filename[ PATH_MAX + NAME_MAX ];
+  char xformations[ MAXVALUESTRING ];
+  char period[ MAXVALUESTRING ];
+  double values[ MAXNUMSETS ];
+  unsigned int count, setCount, sampleCount;
+  int ret = RRDB_ERROR;
+  /* fetch and info hand back the payload itself */
+  int payload = FALSE;
+
+  if ( !growresult( 0 ) ) {
+    outprintf( "ERROR: out of memory\n" );
     return -1;
   }
+  /* nothing left from the last request if we fail before the library is called */
+  commandresult.data[ 0 ] = 0;
 
-  headerData = ( rrdbTouchHeader * ) addr;
-  ptr = addr + sizeof( rrdbTouchHeader );
-  now = time( NULL );
-  setsize = sizeof( rrdbTouchSet ) + ( headerData->samplesPerSet * sizeof( rrdbInt ) );
+  uint8_t opcode = getu8( in );
 
-  for( i = 0; i < headerData->sets; i++ ) {
-    touchSet = ( rrdbTouchSet * ) ( ptr + ( setsize * i ) );
-    if ( touchSet->lastTouch < ( now - ( getTimePerSample( touchSet->period ) * headerData->samplesPerSet ) ) ) {
-      /* We need to remove */
-      truncateby++;
-      headerData->sets--;
+  switch( opcode ) {
+    case RRDBOPCREATE:
+      getfilename( in, dir, filename, sizeof( filename ) );
+      setCount = getu32( in );
+      sampleCount = getu32( in );
+      getstring( in, xformations, sizeof( xformations ) );
+      if ( in->overrun ) break;
+      ret = rrdb_create( filename, setCount, sampleCount, xformations, &commandresult );
+      break;
 
-      /* Copy the last one to this one (if not the last one) */
-      if ( i == headerData->sets ) break;
+    case RRDBOPUPDATE:
+      getfilename( in, dir, filename, sizeof( filename ) );
+      count = getvalues( in, values );
+      if ( in->overrun ) break;
+      ret = rrdb_update( filename, values, count, &commandresult );
+      break;
 
-      src = ( rrdbTouchSet * )
-            ( addr + sizeof( rrdbTouchHeader ) +
-            ( headerData->sets * setsize ) );
+    case RRDBOPMUPDATE:
+    {
+      /* every update is attempted, we return a status byte for each - the files are read and written in batches */
+      unsigned int updates = getu16( in );
+      size_t namesroom = in->length + ( size_t ) updates * ( strlen( dir ) + 2 ), namesused = 0;
+      char *names = malloc( namesroom + 1 );
+      const char **filenames = malloc( sizeof( char * ) * updates + 1 );
+      /* a value takes 8 bytes of the frame, so it can't have more than this (and a malformed last update) */
+      double *numbers = malloc( sizeof( double ) * ( in->length / 8 + MAXNUMSETS ) );
+      const double **into = malloc( sizeof( double * ) * updates + 1 );
+      unsigned int *counts = malloc( sizeof( unsigned int ) * updates + 1 ), numbersused = 0;
+      int *status = malloc( sizeof( int ) * updates + 1 );
+
+      if ( NULL == names || NULL == filenames || NULL == numbers || NULL == into || NULL == counts || NULL == status ) {
+        outprintf( "ERROR: out of memory\n" );
+      } else {
+        unsigned int i;
+        for ( i = 0; i < updates; i++ ) {
+          getfilename( in, dir, filename, sizeof( filename ) );
+          into[ i ] = numbers + numbersused;
+          counts[ i ] = getvalues( in, numbers + numbersused );
+          if ( in->overrun ) break;
+          numbersused += counts[ i ];
+          filenames[ i ] = strcpy( names + namesused, filename );
+          namesused += strlen( filename ) + 1;
+        }
 
-      memcpy( touchSet, src, setsize );
+        if ( i == updates ) {
+          /* fails if any of them did, which the status bytes say */
+          rrdb_update_many( filenames, into, counts, updates, status, &commandresult );
+          ret = RRDB_OK;
+          putu16( out, updates );
+          for ( i = 0; i < updates; i++ ) putu8( out, RRDB_OK == status[ i ] ? RRDBSTATUSOK : RRDBSTATUSERROR );
+        }
+      }
 
-      /* Start again */
-      i = 0;
+      free( names );
+      free( filenames );
+      free( numbers );
+      free( into );
+      free( counts );
+      free( status );
+      break;
     }
-  }
-
-  if ( truncateby > 0 && -1 == ftruncate( pfd.data_fd, sb.st_size - ( setsize * truncateby ) ) ) {
-    fprintf( stderr, "Failed to truncate file\n" );
-  }
 
-  munmap( addr, sb.st_size );
-  unlockandclose( pfd );
-  return 1;
-}
+    case RRDBOPTOUCH:
+      getfilename( in, dir, filename, sizeof( filename ) );
+      setCount = getu32( in );
+      sampleCount = getu32( in );
+      getstring( in, xformations, sizeof( xformations ) );
+      getstring( in, period, sizeof( period ) );
+      /* optional u32 count and i64 time (0 for now), then an optional f64 value */
+      count = 1;
+      time_t when = 0;
+      double value = 0;
+      int valued = FALSE;
+      if ( in->offset < in->length ) {
+        count = getu32( in );
+        when = ( time_t ) ( int64_t ) getle( in, 8 );
+      }
+      if ( in->offset < in->length ) {
+        value = getf64( in );
+        valued = TRUE;
+      }
+      if ( in->overrun ) break;
+      if ( valued ) ret = rrdb_touch_value( filename, xformations, period, setCount, sampleCount, count, value, when, &commandresult );
+      else ret = rrdb_touch( filename, xformations, period, setCount, sampleCount, count, when, &commandresult );
+      break;
 
-/**
- * @return { int } 1 on success -1 on failure
-*/
-int runfetch( char *filename, char *xformations, char * cperiod ) {
+    case RRDBOPFETCH:
+    {
+      getfilename( in, dir, filename, sizeof( filename ) );
+      int32_t xform = ( int32_t ) getu32( in );
+      getstring( in, xformations, sizeof( xformations ) );
+      getstring( in, period, sizeof( period ) );
+      if ( in->overrun ) break;
+      /* only reads, so it is safe to ask again with a bigger buffer */
+      while( RRDB_TRUNCATED == ( ret = rrdb_fetch_binary( filename, xform, xformations, period, &commandresult ) ) && growresult( commandresult.length ) );
+      payload = TRUE;
+      break;
+    }
 
-  rrdbFile ourFile;
-  int retval = 1;
+    case RRDBOPINFO:
+      getfilename( in, dir, filename, sizeof( filename ) );
+      if ( in->overrun ) break;
+      while( RRDB_TRUNCATED == ( ret = rrdb_info_binary( filename, &commandresult ) ) && growresult( commandresult.length ) );
+      payload = TRUE;
+      break;
 
-  locked_file_t pfd = readopenandlock( filename );
+    default:
+      outprintf( "ERROR: unknown opcode %u\n", opcode );
+      return -1;
+  }
 
-  if( -1 == pfd.data_fd ) {
-    printf( "ERROR: failed to open rrdb file '%s'\n", filename );
+  if ( in->overrun ) {
+    outprintf( "ERROR: malformed request\n" );
     return -1;
   }
 
-  switch( getFileVersion( pfd.data_fd ) ) {
-    case RRDBV1:
-      memset( &ourFile, 0, sizeof( rrdbFile ) );
-      if( -1 == readRRDBFile( pfd.data_fd, &ourFile ) ) break;
-
-      if ( 0 != strlen( xformations ) ) {
-        if ( -1 == printRRDBFileXform( &ourFile, atoi( xformations ) ) ) {
-          retval = -1;
-        }
-      } else {
-        if ( -1 == printRRDBFile( &ourFile ) ) {
-          retval = -1;
-        }
-      }
+  /* a payload which still doesn't fit is one we couldn't grow the buffer for */
+  if ( payload && RRDB_TRUNCATED == ret ) {
+    outprintf( "ERROR: out of memory\n" );
+    return -1;
+  }
 
-      break;
-    case RRDBTOUCHV2:
-      printRRDBTouchFile( pfd.data_fd, xformations, cperiod );
-      break;
-    default:
-      printf("ERROR: Unknown file format\n");
-      retval = -1;
-      break;
+  if ( RRDB_ERROR == ret ) {
+    outprintf( "%s", commandresult.data );
+    return -1;
   }
 
-  unlockandclose( pfd );
-  return retval;
+  if ( payload ) putbytes( out, commandresult.data, commandresult.length );
+  return 1;
 }
 
-/**
- * @return { int } 1 on success -1 on failure.
-*/
-int runcreate( char *filename, unsigned int sampleCount, unsigned int setCount, char *xformations ) {
-
-  if ( 0 >= sampleCount ) {
-    printf("ERROR: sample count too small, must be more than zero.\n");
+/************************************************************************************
+ * Function: waitForFrame
+ *
+ * Purpose: The binary version of waitForInput. Read a request frame from stdin, run
+ * it and write the response frame.
+ *
+ * @returns { int } -1 when we should stop
+ ************************************************************************************/
+int waitForFrame(char *dir) {
+  unsigned char head[ 4 ];
+  rrdbBuffer in = { 0 }, out = { 0 };
+  char *captured = NULL;
+  size_t capturedlength = 0;
+  uint32_t length;
+
+  if ( sizeof( head ) != fread( head, 1, sizeof( head ), stdin ) ) return -1;
+  length = head[ 0 ] | ( head[ 1 ] << 8 ) | ( head[ 2 ] << 16 ) | ( ( uint32_t ) head[ 3 ] << 24 );
+
+  if ( 0 == length || length > RRDBMAXFRAME ) {
+    /* we can't find the next frame so there is no way to carry on */
+    writeerrorframe( "ERROR: bad frame length", strlen( "ERROR: bad frame length" ) );
     return -1;
   }
 
-  locked_file_t pfd = initRRDBFile( filename, setCount, sampleCount, xformations);
-  if ( -1 == pfd.data_fd  ) {
-    printf( "ERROR: writing db file error" );
+  if ( -1 == bufferreserve( &in, length ) ) {
+    writeerrorframe( "ERROR: out of memory", strlen( "ERROR: out of memory" ) );
+    free( in.data );
+    return -1;
+  }
+  if ( length != fread( in.data, 1, length, stdin ) ) {
+    free( in.data );
     return -1;
   }
+  in.length = length;
+
+  FILE *capture = open_memstream( &captured, &capturedlength );
+  if ( NULL == capture ) {
+    writeerrorframe( "ERROR: out of memory", strlen( "ERROR: out of memory" ) );
+    free( in.data );
+    return 1;
+  }
+
+  FILE *previous = setoutput( capture );
+  int retval = runframe( dir, &in, &out );
+  setoutput( previous );
+  fclose( capture );
+
+  if ( -1 == retval ) {
+    writeerrorframe( NULL == captured ? "" : captured, capturedlength );
+  } else if ( out.overrun ) {
+    writeerrorframe( "ERROR: out of memory", strlen( "ERROR: out of memory" ) );
+  } else {
+    writeframe( RRDBSTATUSOK, &out );
+  }
 
-  unlockandclose( pfd );
+  free( captured );
+  free( in.data );
+  free( out.data );
   return 1;
 }
 
-/**
- * runs the command
- * Written: 10th March 2013 By: Nick Knight
- */
-int runCommand(char *filename, RRDBCommand ourCommand, unsigned int sampleCount, unsigned int setCount, char *values, char *xformations, char * cperiod) {
+/************************************************************************************
+ * Function: runrequest
+ *
+ * Purpose: Run a request parsed by waitForInput. An untagged request writes straight
+ * to stdout as it always has. A tagged request's output is captured and then written
+ * in one go with every line prefixed by its tag and followed by an END line - so
+ * tagged requests can complete in any order.
+ ************************************************************************************/
+static void runrequest( void *arg ) {
+  rrdbRequest *req = ( rrdbRequest * ) arg;
+  char *captured = NULL;
+  size_t capturedlength = 0;
+  FILE *capture = NULL, *previous = NULL;
+
+  if ( 0 != req->tag[ 0 ] ) {
+    capture = open_memstream( &captured, &capturedlength );
+    if ( NULL == capture ) {
+      flockfile( stdout );
+      fprintf( stdout, "@%s ERROR: out of memory\n@%s END\n", req->tag, req->tag );
+      funlockfile( stdout );
+      free( req );
+      return;
+    }
+    previous = setoutput( capture );
+  }
 
-  switch( ourCommand ) {
-    case CREATE:
-      return runcreate( filename, sampleCount, setCount, xformations );
+  int ret = runCommand( req->filename, req->command, req->sampleCount, req->setCount, req->values, req->xformations, req->period );
+  switch( ret ) {
+    case -1:
       break;
-
-    case FETCH:
-      return runfetch( filename, xformations, cperiod );
+    case 0:
       break;
+    default:
+      outprintf( "OK\n" );
+  }
 
-    case UPDATE:
-      /* we should be given a value for each set we have */
-      return updateRRDBFile( filename, &values[ 0 ] );
-      /* update can fail - but just indicate it needs creating - output will havebeen sent though */
-      break;
+  if ( NULL != capture ) {
+    setoutput( previous );
+    fclose( capture );
 
-    case MODIFY:
-      return  modifyRRDBFile( filename, values, xformations );
-      break;
+    /* hold stdout so no other request's lines end up in the middle of ours */
+    flockfile( stdout );
+    char *line = captured, *end = captured + capturedlength;
+    while ( line < end ) {
+      char *nl = memchr( line, '\n', end - line );
+      size_t linelength = NULL == nl ? ( size_t ) ( end - line ) : ( size_t ) ( nl - line );
+      fprintf( stdout, "@%s %.*s\n", req->tag, ( int ) linelength, line );
+      line += linelength + 1;
+    }
+    fprintf( stdout, "@%s END\n", req->tag );
+    fflush( stdout );
+    funlockfile( stdout );
+    free( captured );
+  }
 
-    case INFO:
-      return printRRDBFileInfo(filename);
-      break;
+  free( req );
+}
 
-    case TOUCH:
-      return touchRRDBFile(filename, xformations, cperiod, setCount, sampleCount);
-      break;
+/**
+ * Run a parsed request, on the pool if it is tagged and we have one.
+ */
+static int dispatchrequest( rrdbRequest *req ) {
+  if ( NULL != requestpool ) {
+    if ( 0 != req->tag[ 0 ] ) {
+      rrdbpoolsubmit( requestpool, runrequest, req );
+      return 1;
+    }
 
-    case PIPE:
-      break;
+    /* keep the old ordering for untagged requests */
+    rrdbpoolwait( requestpool );
   }
 
-  return -1;
+  runrequest( req );
+  return 1;
 }
 
 /************************************************************************************
@@ -1705,6 +770,11 @@ int runCommand(char *filename, RRDBCommand ourCommand, unsigned int sampleCount,
  * for update a string of values in the format val:val:val for the string of values
  * for create setCount sampleCount
  *
+ * The command can be prefixed with a tag, i.e. "@12 fetch test.rrdb", in which case the
+ * response is framed with the tag (see runrequest) and, when we have a pool of
+ * workers, the request runs in the background while we read the next one. An untagged
+ * request waits for any tagged requests in flight to finish first.
+ *
  * Written: 10th March 2013 By: Nick Knight
  ************************************************************************************/
 int waitForInput(char *dir) {
@@ -1712,21 +782,13 @@ int waitForInput(char *dir) {
   char c;
   int ic;
   char command[MAXCOMMANDLENGTH];
-  RRDBCommand ourCommand;
+  char *commandstart = command;
   const char delims[] = " ";
   unsigned int i = 0;
   int pathlength = 0;
-  unsigned int sampleCount = 0;
-  unsigned int setCount = 0;
-  char values[MAXVALUESTRING];
-  values[0] = 0;
   char *result = NULL;
-  char xformations[MAXVALUESTRING];
-  xformations[0] = 0;
-
-  char period[MAXCOMMANDLENGTH];
-
-  char fulldirname[PATH_MAX + NAME_MAX];
+  char *saveptr = NULL;
+  rrdbRequest *req;
 
   command[0] = 0;
   while( TRUE ) {
@@ -1740,7 +802,7 @@ int waitForInput(char *dir) {
     command[i+1] = 0;
 
     if( i > ( MAXCOMMANDLENGTH - 5 ) ) {
-      printf("ERROR: command too long\n");
+      outprintf("ERROR: command too long\n");
       return -1;
     }
 
@@ -1749,93 +811,210 @@ int waitForInput(char *dir) {
 
   if ( 0 == strlen(command)) return -1;
 
+  /* switch this connection to the binary protocol */
+  if ( 0 == strcmp("binary", command) ) {
+    if ( NULL != requestpool ) rrdbpoolwait( requestpool );
+    binarymode = TRUE;
+    outprintf( "OK\n" );
+    return 1;
+  }
+
+  req = calloc( 1, sizeof( rrdbRequest ) );
+  if ( NULL == req ) {
+    outprintf("ERROR: out of memory\n");
+    return -1;
+  }
+
+  /* tag */
+  if ( '@' == command[ 0 ] ) {
+    result = strtok_r( command + 1, delims, &saveptr );
+    if ( NULL == result || strlen( result ) >= RRDBMAXTAG ) {
+      outprintf("ERROR: bad request tag\n");
+      free( req );
+      return -1;
+    }
+    strcpy( req->tag, result );
+    commandstart = NULL;
+  }
+
   /* command */
-  result = strtok( command, delims );
+  result = strtok_r( commandstart, delims, &saveptr );
+  if ( NULL == result ) {
+    result = "";
+  }
+
   if ( 0 == strcmp("create", result) ) {
-      ourCommand = CREATE;
+      req->command = CREATE;
   } else if ( 0 == strcmp("update", result) ) {
-      ourCommand = UPDATE;
+      req->command = UPDATE;
   } else if ( 0 == strcmp("fetch", result) ) {
-      ourCommand = FETCH;
+      req->command = FETCH;
   } else if ( 0 == strcmp("info", result) ) {
-      ourCommand = INFO;
+      req->command = INFO;
   } else if ( 0 == strcmp("touch", result) ) {
-    ourCommand = TOUCH;
+    req->command = TOUCH;
+  } else if ( 0 == strcmp("coalesce", result) ) {
+    req->command = COALESCE;
+  } else if ( 0 == strcmp("flush", result) ) {
+    req->command = FLUSH;
+  } else if ( 0 == strcmp("lockstats", result) ) {
+    req->command = LOCKSTATS;
+  } else if ( 0 == strcmp("ringstats", result) ) {
+    req->command = RINGSTATS;
+  } else if ( 0 == strcmp("archive", result) ) {
+    req->command = ARCHIVE;
+  } else if ( 0 == strcmp("convert", result) ) {
+    req->command = CONVERT;
+  } else if ( 0 == strcmp("reshape", result) ) {
+    req->command = RESHAPE;
+  } else if ( 0 == strcmp("aggregate", result) ) {
+    req->command = AGGREGATE;
+  } else if ( 0 == strcmp("scan", result) ) {
+    req->command = SCAN;
+  } else if ( 0 == strcmp("top", result) ) {
+    req->command = TOP;
   } else {
     /* we must have a command */
-    printf("ERROR: no valid command so quiting\n");
+    outprintf("ERROR: no valid command so quiting\n");
+    free( req );
     return -1;
   }
 
+  /* these are for the connection not a file, coalesce takes the interval in ms */
+  if ( COALESCE == req->command || FLUSH == req->command || LOCKSTATS == req->command || RINGSTATS == req->command ) {
+    result = strtok_r( NULL, delims, &saveptr );
+    if ( NULL != result ) req->setCount = atoi( result );
+    return dispatchrequest( req );
+  }
+
   /* filename */
-  strcpy(&fulldirname[0], &dir[0]);
+  result = strtok_r( NULL, delims, &saveptr );
+  if ( NULL == result || strlen( dir ) + strlen( result ) + 2 > sizeof( req->filename ) ) {
+    outprintf("ERROR: bad filename\n");
+    free( req );
+    return -1;
+  }
+
+  strcpy(&req->filename[0], &dir[0]);
   pathlength = strlen(dir);
-  fulldirname[pathlength] = '/';
+  req->filename[pathlength] = '/';
   pathlength++;
-  fulldirname[pathlength] = 0;
+  req->filename[pathlength] = 0;
+  strcpy(&req->filename[pathlength], result);
+
+  /* the filename is a glob, then the reduction, xform or touch path, period and threads */
+  if ( AGGREGATE == req->command ) {
+    char *into[] = { req->values, req->xformations, req->period };
+
+    for ( unsigned int i = 0; i < 3 && NULL != ( result = strtok_r( NULL, delims, &saveptr ) ); i++ ) {
+      if ( strlen(result) >= MAXVALUESTRING ) {
+        outprintf("ERROR: Length of aggregate string too long\n");
+        free( req );
+        return -1;
+      }
+      strcpy( into[ i ], result );
+    }
+
+    result = strtok_r( NULL, delims, &saveptr );
+    if ( NULL != result ) req->sampleCount = atoi(result);
+    return dispatchrequest( req );
+  }
+
+  /* the prefix, period then n[:bins] */
+  if ( TOP == req->command ) {
+    char *into[] = { req->xformations, req->period, req->values };
+
+    for ( unsigned int i = 0; i < 3 && NULL != ( result = strtok_r( NULL, delims, &saveptr ) ); i++ ) {
+      if ( strlen(result) >= MAXVALUESTRING ) {
+        outprintf("ERROR: Length of top string too long\n");
+        free( req );
+        return -1;
+      }
+      strcpy( into[ i ], result );
+    }
+    return dispatchrequest( req );
+  }
 
-  result = strtok( NULL, delims );
-  strcpy(&fulldirname[pathlength], result);
+  /* the directory (. for all of it), what to emit, threads then xform or touch path and period */
+  if ( SCAN == req->command ) {
+    char *into[] = { req->values, NULL, req->xformations, req->period };
 
+    for ( unsigned int i = 0; i < 4 && NULL != ( result = strtok_r( NULL, delims, &saveptr ) ); i++ ) {
+      if ( NULL == into[ i ] ) {
+        req->sampleCount = atoi(result);
+        continue;
+      }
+      if ( strlen(result) >= MAXVALUESTRING ) {
+        outprintf("ERROR: Length of scan string too long\n");
+        free( req );
+        return -1;
+      }
+      strcpy( into[ i ], result );
+    }
+    return dispatchrequest( req );
+  }
 
   /* setcount or values */
-  result = strtok( NULL, delims );
+  result = strtok_r( NULL, delims, &saveptr );
   if ( NULL != result ) {
-    if ( CREATE == ourCommand || TOUCH == ourCommand ) {
-      setCount = atoi(result);
-    } else if ( FETCH == ourCommand ) {
-      if ( strlen(result) > MAXVALUESTRING ) {
-        printf("ERROR: Length of xformations string too long\n");
+    if ( CREATE == req->command || TOUCH == req->command || RESHAPE == req->command ) {
+      req->setCount = atoi(result);
+    } else if ( FETCH == req->command ) {
+      if ( strlen(result) >= MAXVALUESTRING ) {
+        outprintf("ERROR: Length of xformations string too long\n");
+        free( req );
         return -1;
       }
-      strcpy( &xformations[0], result );
+      strcpy( &req->xformations[0], result );
     } else {
-      if ( strlen(result) > MAXVALUESTRING ) {
-        printf("ERROR: Length of value string too long\n");
+      if ( strlen(result) >= MAXVALUESTRING ) {
+        outprintf("ERROR: Length of value string too long\n");
+        free( req );
         return -1;
       }
-      strcpy( &values[0], result );
+      strcpy( &req->values[0], result );
     }
   }
 
   /* samplecount */
-  result = strtok( NULL, delims );
+  result = strtok_r( NULL, delims, &saveptr );
   if ( NULL != result ) {
     /* Just in case this is a v2 touch. */
-    strcpy( &period[0], result );
+    strcpy( &req->period[0], result );
 
     /* or not */
-    sampleCount = atoi(result);
+    req->sampleCount = atoi(result);
   }
 
-  if ( CREATE == ourCommand || TOUCH == ourCommand ) {
-    result = strtok( NULL, delims );
+  if ( CREATE == req->command || TOUCH == req->command || RESHAPE == req->command ) {
+    result = strtok_r( NULL, delims, &saveptr );
     if ( NULL != result ) {
-      if (strlen(result) > MAXVALUESTRING) {
-        printf("ERROR: Length of xformation string too long\n");
+      if (strlen(result) >= MAXVALUESTRING) {
+        outprintf("ERROR: Length of xformation string too long\n");
         exit(1);
 
       }
-      strcpy( &xformations[0], result );
+      strcpy( &req->xformations[0], result );
     }
   }
 
-  if ( TOUCH == ourCommand ) {
-    result = strtok( NULL, delims );
-    strcpy( &period[0], result );
-  }
+  if ( TOUCH == req->command ) {
+    result = strtok_r( NULL, delims, &saveptr );
+    if ( NULL != result ) strcpy( &req->period[0], result );
 
-  int ret = runCommand(fulldirname, ourCommand, sampleCount, setCount, values, xformations, period);
-  switch( ret ) {
-    case -1:
-      break;
-    case 0:
-      break;
-    default:
-      printf( "OK\n" );
+    /* count[:timestamp[:value]] */
+    result = strtok_r( NULL, delims, &saveptr );
+    if ( NULL != result ) {
+      if ( strlen(result) >= MAXVALUESTRING ) {
+        outprintf("ERROR: Length of value string too long\n");
+        free( req );
+        return -1;
+      }
+      strcpy( &req->values[0], result );
+    }
   }
 
-  return 1;
+  return dispatchrequest( req );
 }
 
 /************************************************************************************
@@ -1867,6 +1046,11 @@ int main(int argc, char **argv) {
 
   unsigned int setCount = 0;
   unsigned int sampleCount = 0;
+  int threads = 1;
+  unsigned int coalesce = 0;
+  int showlockstats = FALSE;
+  char ring[NAME_MAX];
+  unsigned int ringslots = 0;
 
   char dir[PATH_MAX];
   char fulldirname[PATH_MAX + NAME_MAX];
@@ -1889,6 +1073,15 @@ int main(int argc, char **argv) {
       {"xform",       1, 0, 6 },
       {"touchpath",   1, 0, 7 },
       {"period",      1, 0, 8 },
+      {"threads",     1, 0, 9 },
+      {"coalesce",    1, 0, 10 },
+      {"lockmode",    1, 0, 11 },
+      {"lockstats",   0, 0, 12 },
+      {"format",      1, 0, 13 },
+      {"reduce",      1, 0, 14 },
+      {"emit",        1, 0, 15 },
+      {"ring",        1, 0, 16 },
+      {"ringslots",   1, 0, 17 },
       {0,             0, 0, 0 }
   };
 
@@ -1900,9 +1093,10 @@ int main(int argc, char **argv) {
   memset(&dir[0], 0, PATH_MAX);
   memset(&filename[0], 0, NAME_MAX);
   memset(&values[0], 0, MAXVALUESTRING);
+  memset(&ring[0], 0, NAME_MAX);
 
   if (signal(SIGINT, sigHandler) == SIG_ERR) {
-      printf("ERROR: can't catch SIGINT\n");
+      outprintf("ERROR: can't catch SIGINT\n");
       exit(1);
   }
 
@@ -1927,6 +1121,18 @@ int main(int argc, char **argv) {
           ourCommand = TOUCH;
         } else if ( 0 == strcmp("modify", optarg) ) {
           ourCommand = MODIFY;
+        } else if ( 0 == strcmp("archive", optarg) ) {
+          ourCommand = ARCHIVE;
+        } else if ( 0 == strcmp("convert", optarg) ) {
+          ourCommand = CONVERT;
+        } else if ( 0 == strcmp("reshape", optarg) ) {
+          ourCommand = RESHAPE;
+        } else if ( 0 == strcmp("aggregate", optarg) ) {
+          ourCommand = AGGREGATE;
+        } else if ( 0 == strcmp("scan", optarg) ) {
+          ourCommand = SCAN;
+        } else if ( 0 == strcmp("top", optarg) ) {
+          ourCommand = TOP;
         }
 
         break;
@@ -1941,7 +1147,7 @@ int main(int argc, char **argv) {
       case 3:
         /* directory */
         if ( strlen(optarg) > PATH_MAX ) {
-          printf("ERROR: Length of path too long\n");
+          outprintf("ERROR: Length of path too long\n");
           exit(1);
         }
         strcpy( &dir[0], optarg );
@@ -1951,7 +1157,7 @@ int main(int argc, char **argv) {
       case 4:
         /* filename */
         if ( strlen(optarg) > NAME_MAX ) {
-          printf("ERROR: Length of filename too long\n");
+          outprintf("ERROR: Length of filename too long\n");
           exit(1);
         }
         strcpy( &filename[0], optarg );
@@ -1960,7 +1166,7 @@ int main(int argc, char **argv) {
       case 5:
         /* values */
         if ( strlen(optarg) > MAXVALUESTRING ) {
-          printf("ERROR: Length of value string too long\n");
+          outprintf("ERROR: Length of value string too long\n");
           exit(1);
         }
 
@@ -1970,7 +1176,7 @@ int main(int argc, char **argv) {
       case 6:
         /* xformations */
         if ( strlen(optarg) > MAXVALUESTRING ) {
-          printf("ERROR: Length of xform string too long\n");
+          outprintf("ERROR: Length of xform string too long\n");
           exit(1);
         }
         strcpy( &xformations[0], optarg );
@@ -1979,7 +1185,7 @@ int main(int argc, char **argv) {
       case 7:
         /* touchpath */
         if ( strlen(optarg) > MAXVALUESTRING ) {
-          printf("ERROR: Length of touchpath string too long\n");
+          outprintf("ERROR: Length of touchpath string too long\n");
           exit(1);
         }
         strcpy( &xformations[0], optarg );
@@ -1989,6 +1195,70 @@ int main(int argc, char **argv) {
         strcpy( &period[0], optarg );
         break;
 
+      case 9:
+        /* worker threads for tagged requests in pipe mode or convert */
+        threads = atoi(optarg);
+        break;
+
+      case 10:
+        /* ms to hold touches in memory for in pipe mode */
+        coalesce = atoi(optarg);
+        break;
+
+      case 11:
+        /* debug (the default) or fast */
+        if ( RRDB_OK != rrdb_set_lock_mode( optarg ) ) {
+          fprintf( stderr, "ERROR: unknown lock mode '%s'\n", optarg );
+          exit(1);
+        }
+        break;
+
+      case 12:
+        /* print lock timings to stderr on the way out */
+        showlockstats = TRUE;
+        break;
+
+      case 13:
+        /* the version convert writes */
+        if ( strlen(optarg) >= MAXVALUESTRING ) {
+          outprintf("ERROR: Length of format string too long\n");
+          exit(1);
+        }
+        strcpy( &values[0], optarg );
+        break;
+
+      case 14:
+        /* how aggregate combines the files */
+        if ( strlen(optarg) >= MAXVALUESTRING ) {
+          outprintf("ERROR: Length of reduce string too long\n");
+          exit(1);
+        }
+        strcpy( &values[0], optarg );
+        break;
+
+      case 15:
+        /* what scan prints for each file */
+        if ( strlen(optarg) >= MAXVALUESTRING ) {
+          outprintf("ERROR: Length of emit string too long\n");
+          exit(1);
+        }
+        strcpy( &values[0], optarg );
+        break;
+
+      case 16:
+        /* shared memory ring local producers queue into (pipe mode) */
+        if ( strlen(optarg) >= NAME_MAX ) {
+          outprintf("ERROR: Length of ring name too long\n");
+          exit(1);
+        }
+        strcpy( &ring[0], optarg );
+        break;
+
+      case 17:
+        /* records a new ring has room for */
+        ringslots = atoi(optarg);
+        break;
+
       default:
         /* Unknown option */
         exit(1);
@@ -1996,7 +1266,31 @@ int main(int argc, char **argv) {
   }
 
   if ( PIPE == ourCommand ) {
-      while(-1 != waitForInput(dir));
+      if ( threads > 1 ) {
+        requestpool = rrdbpoolcreate( threads );
+        if ( NULL == requestpool ) fprintf( stderr, "Failed to start worker threads, running requests inline\n" );
+      }
+
+      if ( coalesce > 0 && RRDB_OK != rrdb_coalesce( coalesce ) ) {
+        fprintf( stderr, "Failed to start touch coalescing, writing touches straight through\n" );
+      }
+
+      /* producers have nowhere else to go, so no ring is no server */
+      if ( 0 != ring[0] && ( !growresult( 0 ) || RRDB_OK != rrdb_ring_serve( ring, dir, ringslots, &commandresult ) ) ) {
+        fprintf( stderr, "%s", NULL == commandresult.data ? "ERROR: out of memory\n" : commandresult.data );
+        rrdb_shutdown();
+        exit(1);
+      }
+
+      while(-1 != ( binarymode ? waitForFrame(dir) : waitForInput(dir) ));
+
+      if ( NULL != requestpool ) {
+        rrdbpooldestroy( requestpool );
+        requestpool = NULL;
+      }
+
+      /* write out anything still pending */
+      rrdb_shutdown();
   } else {
     strcpy(&fulldirname[0], &dir[0]);
     pathlength = strlen(dir);
@@ -2006,10 +1300,19 @@ int main(int argc, char **argv) {
 
     strcpy(&fulldirname[pathlength], &filename[0]);
 
+    /* converting or scanning a directory or aggregating files, the threads to do it on */
+    if ( CONVERT == ourCommand || AGGREGATE == ourCommand || SCAN == ourCommand ) sampleCount = threads;
+
     runCommand(fulldirname, ourCommand, sampleCount, setCount, values, xformations, period);
 
   }
 
+  if ( showlockstats ) {
+    int ret;
+    while( RRDB_TRUNCATED == ( ret = rrdb_lock_stats( &commandresult ) ) && growresult( commandresult.length ) );
+    if ( RRDB_OK == ret ) fprintf( stderr, "%s", commandresult.data );
+  }
+
   /* mainly to keep users of valgrind happy as to while 3 file descriptors are still open */
   close(STDIN_FILENO);
   close(STDOUT_FILENO);
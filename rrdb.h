@@ -4,13 +4,74 @@
 #ifndef RRDB_H
 #define RRDB_H
 
+#include "librrdb.h"
+#include "rrdbring.h"
+
 #define MAXNUMSETS 20
 #define MAXNUMXFORMPERSET 5
 #define MAXVALUESTRING 600
 #define MAXCOMMANDLENGTH 600
 #define TOUCHDEFAULTSAMPLECOUNT 2000
 #define TOUCHMAXDEFAULTSETS 50
+/* paths a version 2 touch file has room for (including the NUL), later versions take any length */
 #define TOUCHMAXPATHLENGTH 100
+/* the smallest set table a touch file grows to, it doubles from there */
+#define TOUCHMINCAPACITY 4
+/* bins a sparse touch ring starts with room for, it doubles until it would be as big as a dense one */
+#define TOUCHSPARSEMIN 4
+/* rrdbTouchSet.bins of a dense ring */
+#define TOUCHRINGDENSE 0xffffffffu
+/* the Count-Min sketch a full touch file keeps of paths without a set, and halved after this many touches */
+#define TOUCHSKETCHMAGIC 0x54534b52
+#define TOUCHSKETCHDEPTH 4
+#define TOUCHSKETCHWIDTH 256
+#define TOUCHSKETCHRESET ( 16 * TOUCHSKETCHWIDTH )
+/* a touch file's free sets (or unused paths) are squeezed out once more than 1 / this of them are free */
+#define TOUCHCOMPACTFREE 2
+/* seconds between looks at a touch file's sets for any which have expired (rrdbTouchHeader.lastSweep) */
+#define TOUCHEXPIRYSECONDS 60
+/* io_uring submission queue depth, bigger batches are submitted in chunks */
+#define RRDBURINGDEPTH 64
+/* most files the updates of a binary mupdate (or drained from a ring) are read and written in one batch */
+#define RRDBUPDATEBATCH RRDBURINGDEPTH
+/* longest tag on a pipelined request */
+#define RRDBMAXTAG 64
+/* jobs we let queue up per worker thread before the producer waits */
+#define RRDBPOOLQUEUEPERTHREAD 16
+/* largest request frame we will accept in binary mode */
+#define RRDBMAXFRAME ( 1024 * 1024 )
+/* hash buckets and the most distinct keys we hold before flushing early when coalescing touches */
+#define RRDBCOALESCEBUCKETS 4096
+#define RRDBCOALESCEMAXENTRIES 65536
+/* slots a new shared memory ring has unless told, records the server takes from it at a time, deltas one
+   record can come to and the shortest and longest it sleeps (us) when the ring is empty */
+#define RRDBRINGSLOTS 4096
+#define RRDBRINGBATCH 256
+#define RRDBRINGDELTAS ( ( RRDB_RING_PATH / 2 ) * ( RRDB_RING_PERIODS / 2 ) )
+#define RRDBRINGIDLEMINUSECS 50
+#define RRDBRINGIDLEUS 1000
+/* times a lock free read is retried while writers get in the way before taking a read lock */
+#define RRDBSEQRETRIES 8
+/* most vectors a single file needs: header, times, sets, xform header then 3 per xform */
+#define RRDBMAXIOV ( 3 + MAXNUMSETS + ( 3 * MAXNUMSETS * MAXNUMXFORMPERSET ) )
+/* longest series name in a container, directory slots a new container starts with and the
+   granularity its regions are allocated in */
+#define RRDBCONTAINERNAME 64
+#define RRDBCONTAINERSLOTS 64
+#define RRDBCONTAINERALIGN 64
+#define RRDBCONTAINERSUFFIX ".rrdbc"
+/* points an xform collects as they fall off its ring before they are compressed into a block */
+#define RRDBARCHIVEPOINTS 128
+/* "RRDA" */
+#define RRDBARCHIVEMAGIC 0x41445252
+/* worst case for a compressed block: 68 bits a time and 77 a value */
+#define RRDBARCHIVEBLOCKBYTES ( ( RRDBARCHIVEPOINTS * ( 68 + 77 ) + 7 ) / 8 )
+/* "RRD3", and what every V3 section starts on */
+#define RRDBV3MAGIC 0x33445252
+#define RRDBV3ALIGN 64
+/* what convert leaves in a directory as it goes and writes a file to before renaming it */
+#define RRDBCONVERTJOURNAL ".rrdbconvert"
+#define RRDBCONVERTTEMP ".rrdbconvert.tmp"
 
 
 #define TRUE 1
@@ -34,22 +95,56 @@ typedef unsigned short rrdbTimemSeconds;
 	TOUCH: touch the path - i.e. count it
 	MODIFY: index by data or xform and timestamp
   HI: add count to count set (for a count (v2) file)
+  ARCHIVE: keep what falls off the xform rings of a standard (v1) file
+  CONVERT: change the layout of a file (to or from v3)
+  RESHAPE: change the samples, sets or xforms of a standard (v1) file keeping its data
+  AGGREGATE: fetch an xform or touch path from many files combined into one series
+  SCAN: info and/or fetch every file in a directory tree
+  TOP: the paths under a prefix of a touch file with the most touches
+  RINGSTATS: the counts of the shared memory ring being drained
 */
-typedef enum {PIPE, CREATE, UPDATE, FETCH, INFO, TOUCH, MODIFY} RRDBCommand;
+typedef enum {PIPE, CREATE, UPDATE, FETCH, INFO, TOUCH, MODIFY, COALESCE, FLUSH, LOCKSTATS, ARCHIVE, CONVERT, RESHAPE, AGGREGATE, SCAN, TOP, RINGSTATS} RRDBCommand;
+
+/*
+ Binary protocol opcodes (request) and status (response). MUPDATE carries a number of
+ updates, possibly to different files, in one request.
+ */
+typedef enum {RRDBOPCREATE = 1, RRDBOPUPDATE = 2, RRDBOPMUPDATE = 3, RRDBOPTOUCH = 4, RRDBOPFETCH = 5, RRDBOPINFO = 6} RRDBOpcode;
+typedef enum {RRDBSTATUSOK = 0, RRDBSTATUSERROR = 1} RRDBStatus;
+
+/*
+ The first byte of a successful fetch or info response says what follows.
+ */
+typedef enum {RRDBRESULTRAW = 1, RRDBRESULTXFORM = 2, RRDBRESULTTOUCH = 3, RRDBRESULTINFOV1 = 4, RRDBRESULTINFOTOUCH = 5,
+              RRDBRESULTTOUCHVALUES = 6} RRDBResultType;
 
 /*
- * Versions of files, including format.
+ * Versions of files, including format. RRDBV5 is the V1 layout with a seqlock after the version.
  */
-typedef enum {RRDBV1 = 1, RRDBTOUCHV2} RRDBVersions;
+typedef enum {RRDBV1 = 1, RRDBTOUCHV2, RRDBV3, RRDBTOUCHV4, RRDBV5, RRDBCONTAINER = 64} RRDBVersions;
 
 /*
  * File structure for our db file
  */
+/*
+ Every file starts with its version as an int. V3, V5, version 4 touch files and containers
+ follow it with a seqlock so readers can copy the file without a lock (see snapshotopen). A
+ writer bumps seqBegin before it changes anything and seqEnd once it is done, so a copy is good
+ if the two were equal before it started and seqBegin hasn't moved by the time it finished.
+ V1 and version 2 touch files have no seqlock and are read under a lock, convert moves them on.
+ */
+#define RRDBVERSIONFIELDS int fileVersion; unsigned int seqBegin; unsigned int seqEnd;
+
+typedef struct rrdbVersionHeader {
+  RRDBVERSIONFIELDS
+} rrdbVersionHeader;
+
 typedef struct rrdbHeader {
   /*
-   File version and check the file looks sensible.
+   File version and check the file looks sensible. A V1 file has no seqlock (rrdbHeaderV1),
+   it is read into and written from this all the same.
    */
-	int fileVersion;
+  RRDBVERSIONFIELDS
   /*
    Where abouts in our RRD circle are we?
    */
@@ -65,6 +160,14 @@ typedef struct rrdbHeader {
   unsigned int sampleCount;
 } rrdbHeader;
 
+/* the header of a V1 file */
+typedef struct rrdbHeaderV1 {
+  int fileVersion;
+  unsigned int windowPosition;
+  unsigned int setCount;
+  unsigned int sampleCount;
+} rrdbHeaderV1;
+
 
 typedef struct rrdbTimePoint {
     /* UNIX Time (EPOCH) */
@@ -79,28 +182,117 @@ typedef struct rrdbTimePoint {
 typedef enum {FIVEMINUTE = 0, ONEHOUR = 1, SIXHOUR = 2, TWELVEHOUR = 3, ONEDAY = 4, QUARTERHOUR = 5} RRDBTimePeriods;
 typedef enum {RRDBMAX = 0, RRDBMIN = 1, RRDBCOUNT = 2, RRDBMEAN = 3, RRDBSUM = 4} RRDBCalculation;
 
+/*
+ A touch file (RRDBTOUCHV4): the header, a table of capacity sets, the rings, the string
+ table then the sketch if it has one (rrdbTouchSketch). Each path is in the string table
+ once (interned) however many periods it has a set for - a uint32 length, the path and a
+ NUL, padded to 4 bytes. A set with no path is free.
+
+ Each set has room for its ring somewhere in the rings. A ring starts sparse, only the bins
+ which have been touched as rrdbTouchBin in order, and becomes dense - samplesPerSet
+ rrdbInt, bin tick % samplesPerSet - once that would take no more room.
+
+ A file whose touches carry a value (values) has rrdbTouchValueBin for both, a dense ring's
+ bins only holding what they say if their tick is the tick they are at.
+ */
 typedef struct rrdbTouchHeader {
   /*
    Just check the file looks sensible.
    */
-	int fileVersion;
+  RRDBVERSIONFIELDS
 
   unsigned int sets;
   unsigned int samplesPerSet;
+  /* sets the table has room for */
+  unsigned int capacity;
+  /* bytes of the string table, and of those bytes no set refers to any more */
+  unsigned int strings;
+  unsigned int garbage;
+  /* bytes of the rings */
+  unsigned int rings;
+  /* TRUE if every touch carries a value, and the bins keep what they came to */
+  unsigned int values;
+  /* when the sets were last looked at for any which have expired - claimed atomically under the shared lock */
+  int64_t lastSweep;
 } rrdbTouchHeader;
 
 typedef struct rrdbTouchSet {
   /* UNIX Time (EPOCH) */
   rrdbTimeEpochSeconds lastTouch;
 
-  /* The name of the header which will be passed to us. */
-  char path[TOUCHMAXPATHLENGTH];
+  /* of the path (touchPathHash), compared before the path itself */
+  uint64_t hash;
+
+  /* where the path is in the string table and its length, 0 if the set is free */
+  unsigned int path;
+  unsigned int length;
 
-  /* RRDBTimePeriods For now we will probably only support 1 hour and 1 day */
+  /* RRDBTimePeriods */
   unsigned int period;
 
+  /* where its ring is in the rings and the bytes it has there, free sets keep theirs */
+  unsigned int ring;
+  unsigned int room;
+  /* in a sparse ring, or TOUCHRINGDENSE */
+  unsigned int bins;
 } rrdbTouchSet;
 
+/* a bin of a sparse ring, tick is the time / seconds per sample */
+typedef struct rrdbTouchBin {
+  uint32_t tick;
+  rrdbInt count;
+} rrdbTouchBin;
+
+/* what the values of some touches came to */
+typedef struct rrdbTouchValues {
+  double sum;
+  double min;
+  double max;
+} rrdbTouchValues;
+
+/* a bin of a ring of a touch file which keeps values, sparse or dense */
+typedef struct rrdbTouchValueBin {
+  uint32_t tick;
+  rrdbInt count;
+  rrdbTouchValues values;
+} rrdbTouchValueBin;
+
+/* version 2 touch files, a header then each set followed by its ring - see touchV2Decode */
+typedef struct rrdbTouchHeaderV2 {
+  int fileVersion;
+
+  unsigned int sets;
+  unsigned int samplesPerSet;
+} rrdbTouchHeaderV2;
+
+typedef struct rrdbTouchSetV2 {
+  rrdbTimeEpochSeconds lastTouch;
+  char path[TOUCHMAXPATHLENGTH];
+  unsigned int period;
+} rrdbTouchSetV2;
+
+/*
+ Once a touch file has maxsets sets it gets one of these after its paths: approximate
+ counts of the touches to paths which didn't have a set. A path takes over the least
+ recently touched set only once it has had more touches than that set's ring holds.
+ */
+typedef struct rrdbTouchSketch {
+  uint32_t magic;
+  /* touches counted since the counters were last halved */
+  uint32_t additions;
+  uint32_t counts[TOUCHSKETCHDEPTH][TOUCHSKETCHWIDTH];
+} rrdbTouchSketch;
+
+/* the sets of a touch file as a min heap on lastTouch, to find the one to give up */
+typedef struct rrdbTouchHeap {
+  rrdbTouchSet *sets;
+  /* set indexes, the least recently touched first */
+  unsigned int *heap;
+  /* where each set is in heap */
+  unsigned int *at;
+  unsigned int count;
+} rrdbTouchHeap;
+
 typedef struct rrdbXformsHeader {
   unsigned int xformCount;
 
@@ -133,38 +325,641 @@ typedef struct rrdbFile {
 
 } rrdbFile;
 
+struct rrdbStaged;
+
 typedef struct {
     int data_fd;
+    /* the .lock side file in debug lock mode, otherwise -1 */
     int lock_fd;
+    /* monotonic ns when we got the lock */
+    uint64_t lockedat;
+    /* a series copied out of a container (or a V3 file decoded) to be written back when we close, otherwise NULL */
+    struct rrdbStaged *staged;
+    /* the version on disk when data_fd holds it decoded (RRDBV3 or RRDBTOUCHV2), otherwise 0 */
+    int stored;
 } locked_file_t;
 
+/*
+ Containers hold many series (V1 or touch files) in one file, addressed as name.rrdbc:series.
+ The header is followed by regions, one of which is the directory - an open addressed hash
+ table of entries by name. Free regions are kept in a list ordered by offset, each starting
+ with an rrdbContainerFree.
+ */
+typedef struct rrdbContainerHeader {
+  RRDBVERSIONFIELDS
+  unsigned int dirCapacity;
+  unsigned int dirCount;
+  unsigned int unused;
+  uint64_t dirOffset;
+  /* first free region, 0 for none */
+  uint64_t freeHead;
+  /* end of the allocated space */
+  uint64_t end;
+} rrdbContainerHeader;
+
+typedef struct rrdbContainerEntry {
+  /* empty slots have no name */
+  char name[RRDBCONTAINERNAME];
+  uint64_t offset;
+  /* of the series and of the region it is in */
+  uint64_t length;
+  uint64_t capacity;
+} rrdbContainerEntry;
+
+typedef struct rrdbContainerFree {
+  uint64_t size;
+  uint64_t next;
+} rrdbContainerFree;
+
+/*
+ An operation on a container series works on a copy in a memfd, holding the container
+ lock until it is written back (see containeropen). V3 and version 2 touch files are worked
+ on the same way, decoded (see storedstage).
+ */
+typedef struct rrdbStaged {
+  /* RRDBCONTAINER, RRDBV3 or RRDBTOUCHV2 - how the copy is written back */
+  int version;
+  /* the container or file we hold locked */
+  locked_file_t file;
+  char series[RRDBCONTAINERNAME];
+} rrdbStaged;
+
+/*
+ Version 3 - an aligned, little endian layout of a V1 or touch file. The header is followed
+ by a table of sections, each section starts on an RRDBV3ALIGN boundary. Rings are split
+ into arrays of one type each: times (int64 seconds and uint16 usecs), a bitmap of which
+ are valid and the values as doubles. It starts as rrdbVersionHeader so the seqlock works
+ the same. It is for interchange (other programs mapping the rings) - we never work on it in
+ place, every open decodes it into a staged copy.
+ */
+typedef struct rrdbV3Header {
+  uint32_t fileVersion;
+  uint32_t seqBegin;
+  uint32_t seqEnd;
+  uint32_t magic;
+  /* RRDBV1, RRDBV5 or RRDBTOUCHV4 (RRDBTOUCHV2 in older files), what we hold */
+  uint32_t kind;
+  uint32_t sectionCount;
+  /* V1 as rrdbHeader, touch has sets in setCount, samplesPerSet in sampleCount and values in xformCount */
+  uint32_t windowPosition;
+  uint32_t setCount;
+  uint32_t sampleCount;
+  uint32_t xformCount;
+  uint64_t sectionOffset;
+  uint64_t unused[ 2 ];
+} rrdbV3Header;
+
+/* index is the set, xform or touch set the section belongs to */
+typedef enum {RRDBV3TIMES = 1, RRDBV3USECS, RRDBV3VALID, RRDBV3SET, RRDBV3XFORMS, RRDBV3XFORMTIMES, RRDBV3XFORMUSECS,
+              RRDBV3XFORMVALID, RRDBV3XFORMDATA, RRDBV3ARCHIVE, RRDBV3TOUCHSETS, RRDBV3TOUCHRING, RRDBV3TOUCHSKETCH,
+              RRDBV3TOUCHTABLE, RRDBV3TOUCHSTRINGS, RRDBV3TOUCHBINS, RRDBV3TOUCHVALUERING, RRDBV3TOUCHVALUEBINS} RRDBV3Sections;
+
+typedef struct rrdbV3Section {
+  uint32_t type;
+  uint32_t index;
+  /* bytes in each of count elements */
+  uint32_t width;
+  uint32_t count;
+  uint64_t offset;
+  uint64_t length;
+} rrdbV3Section;
+
+/* an element of RRDBV3TOUCHSETS (a version 2 touch file), the rings are RRDBV3TOUCHRING of uint32 */
+typedef struct rrdbV3TouchSet {
+  int64_t lastTouch;
+  uint32_t period;
+  char path[TOUCHMAXPATHLENGTH];
+} rrdbV3TouchSet;
+
+/*
+ An element of RRDBV3TOUCHTABLE, as rrdbTouchSet - path is into RRDBV3TOUCHSTRINGS, the
+ string table as it is. Each set has an RRDBV3TOUCHRING of uint32 if its ring is dense or
+ RRDBV3TOUCHBINS of rrdbTouchBin (little endian) if it is sparse - or in a file which keeps
+ values RRDBV3TOUCHVALUERING or RRDBV3TOUCHVALUEBINS of rrdbTouchValueBin.
+ */
+typedef struct rrdbV3TouchEntry {
+  int64_t lastTouch;
+  uint64_t hash;
+  uint32_t path;
+  uint32_t length;
+  uint32_t period;
+  uint32_t unused;
+} rrdbV3TouchEntry;
+
+/* lock timings, ns, how lock free reads went and how big the I/O batches were */
+typedef struct rrdbLockStats {
+  uint64_t acquired;
+  /* had to wait for someone else */
+  uint64_t contended;
+  uint64_t waitns;
+  uint64_t maxwaitns;
+  uint64_t holdns;
+  uint64_t maxholdns;
+  /* lock free copies made, retried because of a writer and given up on for a read lock */
+  uint64_t snapshots;
+  uint64_t snapshotretries;
+  uint64_t snapshotfallbacks;
+  /* rrdbiosubmit calls, the requests (one a file) they carried and the most in one */
+  uint64_t iosubmits;
+  uint64_t iorequests;
+  uint64_t iomaxbatch;
+} rrdbLockStats;
+
+/*
+ One positional, vectored read or write - the unit we batch up for the io layer.
+ */
+typedef struct rrdbIoRequest {
+  int fd;
+  struct iovec *iov;
+  int iovcnt;
+  off_t offset;
+  int write;
+  /* bytes transferred or -1 */
+  ssize_t result;
+} rrdbIoRequest;
+
+/*
+ A growable byte buffer we build (or decode) binary frames in.
+ */
+typedef struct rrdbBuffer {
+  unsigned char *data;
+  size_t length;
+  size_t size;
+  /* read position when decoding */
+  size_t offset;
+  /* set if a read ran off the end of the data, or a write couldn't get the memory */
+  int overrun;
+  /* rows written by a visitor */
+  unsigned int rows;
+} rrdbBuffer;
+
+/*
+ Building and decoding frames, shared by the library (which encodes binary results) and the
+ binary protocol in rrdb - little endian throughout. A write which can't grow the buffer is
+ dropped and sets overrun, so a caller checks once at the end.
+ */
+static inline int bufferreserve( rrdbBuffer *buf, size_t more ) {
+  if ( buf->overrun ) return -1;
+  if ( buf->length + more <= buf->size ) return 0;
+
+  size_t newsize = buf->size ? buf->size : 256;
+  while ( newsize < buf->length + more ) newsize *= 2;
+
+  unsigned char *data = realloc( buf->data, newsize );
+  if ( NULL == data ) {
+    buf->overrun = TRUE;
+    return -1;
+  }
+  buf->data = data;
+  buf->size = newsize;
+  return 0;
+}
+
+static inline void putbytes( rrdbBuffer *buf, const void *bytes, size_t len ) {
+  if ( -1 == bufferreserve( buf, len ) ) return;
+  memcpy( buf->data + buf->length, bytes, len );
+  buf->length += len;
+}
+
+static inline void putle( rrdbBuffer *buf, uint64_t v, int bytes ) {
+  if ( -1 == bufferreserve( buf, bytes ) ) return;
+  for ( int i = 0; i < bytes; i++ ) buf->data[ buf->length++ ] = ( v >> ( 8 * i ) ) & 0xff;
+}
+
+static inline void putu8( rrdbBuffer *buf, uint8_t v ) { putle( buf, v, 1 ); }
+static inline void putu16( rrdbBuffer *buf, uint16_t v ) { putle( buf, v, 2 ); }
+static inline void putu32( rrdbBuffer *buf, uint32_t v ) { putle( buf, v, 4 ); }
+static inline void puti64( rrdbBuffer *buf, int64_t v ) { putle( buf, ( uint64_t ) v, 8 ); }
+
+static inline void putf64( rrdbBuffer *buf, double v ) {
+  uint64_t bits;
+  memcpy( &bits, &v, sizeof( bits ) );
+  putle( buf, bits, 8 );
+}
+
+static inline void putstring( rrdbBuffer *buf, const char *str ) {
+  size_t len = strlen( str );
+  if ( len > UINT16_MAX ) len = UINT16_MAX;
+  putu16( buf, len );
+  putbytes( buf, str, len );
+}
+
+/* fill in a u32 written earlier (i.e. a row count) */
+static inline void patchu32( rrdbBuffer *buf, size_t at, uint32_t v ) {
+  if ( buf->overrun ) return;
+  for ( int i = 0; i < 4; i++ ) buf->data[ at + i ] = ( v >> ( 8 * i ) ) & 0xff;
+}
+
+static inline uint64_t getle( rrdbBuffer *buf, int bytes ) {
+  uint64_t v = 0;
+
+  if ( buf->offset + bytes > buf->length ) {
+    buf->overrun = TRUE;
+    return 0;
+  }
+
+  for ( int i = 0; i < bytes; i++ ) v |= ( uint64_t ) buf->data[ buf->offset++ ] << ( 8 * i );
+  return v;
+}
+
+static inline uint8_t getu8( rrdbBuffer *buf ) { return getle( buf, 1 ); }
+static inline uint16_t getu16( rrdbBuffer *buf ) { return getle( buf, 2 ); }
+static inline uint32_t getu32( rrdbBuffer *buf ) { return getle( buf, 4 ); }
+
+static inline double getf64( rrdbBuffer *buf ) {
+  uint64_t bits = getle( buf, 8 );
+  double v;
+  memcpy( &v, &bits, sizeof( v ) );
+  return v;
+}
+
+/**
+ * Copy a string out of the frame - it must fit (with terminator) in outlen.
+ */
+static inline void getstring( rrdbBuffer *buf, char *out, size_t outlen ) {
+  uint16_t len = getu16( buf );
+
+  out[ 0 ] = 0;
+  if ( buf->overrun || len >= outlen || buf->offset + len > buf->length ) {
+    buf->overrun = TRUE;
+    return;
+  }
+
+  memcpy( out, buf->data + buf->offset, len );
+  out[ len ] = 0;
+  buf->offset += len;
+}
+
+/*
+ A request read in pipe mode. If it carries a tag the response is framed with it.
+ */
+typedef struct rrdbRequest {
+  char tag[RRDBMAXTAG];
+  RRDBCommand command;
+  char filename[PATH_MAX + NAME_MAX];
+  unsigned int sampleCount;
+  unsigned int setCount;
+  char values[MAXVALUESTRING];
+  char xformations[MAXVALUESTRING];
+  char period[MAXCOMMANDLENGTH];
+} rrdbRequest;
+
+/*
+ Worker thread pool.
+ */
+typedef void (*rrdbJobFunction)( void *arg );
+
+typedef struct rrdbJob {
+  rrdbJobFunction fn;
+  void *arg;
+  struct rrdbJob *next;
+} rrdbJob;
+
+typedef struct rrdbPool {
+  pthread_mutex_t lock;
+  /* signalled when a job is queued or we are stopping */
+  pthread_cond_t work;
+  /* signalled when a job is taken off the queue */
+  pthread_cond_t space;
+  /* signalled when the last job finishes */
+  pthread_cond_t idle;
+
+  rrdbJob *head;
+  rrdbJob *tail;
+  /* jobs waiting for a worker */
+  unsigned int queued;
+  unsigned int maxqueued;
+  /* jobs queued or running */
+  unsigned int pending;
+
+  pthread_t *threads;
+  unsigned int threadcount;
+  int stopping;
+} rrdbPool;
+
+/*
+ The archive of a V1 file follows its last xform: this header, a stage for each xform which
+ collects points as they fall off the ring, then the sealed blocks - an rrdbArchiveBlock
+ followed by the compressed points (delta of delta times and XOR'd values, as Gorilla).
+ */
+typedef struct rrdbArchiveHeader {
+  uint32_t magic;
+  uint32_t xformCount;
+  uint32_t blockCount;
+  uint32_t unused;
+  /* points in sealed blocks */
+  uint64_t points;
+  /* where the next block goes */
+  uint64_t end;
+} rrdbArchiveHeader;
+
+typedef struct rrdbArchivePoint {
+  int64_t time;
+  double value;
+} rrdbArchivePoint;
+
+typedef struct rrdbArchiveStage {
+  uint32_t count;
+  uint32_t unused;
+  rrdbArchivePoint points[RRDBARCHIVEPOINTS];
+} rrdbArchiveStage;
+
+typedef struct rrdbArchiveBlock {
+  uint32_t xform;
+  uint32_t points;
+  uint32_t bytes;
+  uint32_t unused;
+  int64_t first;
+  int64_t last;
+} rrdbArchiveBlock;
+
+typedef void (*archivePointVisitor)( int64_t time, double value, void *arg );
+
+/*
+ A tree being converted (see convertRRDBTree).
+ */
+typedef struct rrdbConvertRun {
+  pthread_mutex_t lock;
+  rrdbPool *pool;
+  int version;
+  /* of the top directory, without a trailing / */
+  size_t dirlength;
+  FILE *journal;
+  /* paths (relative to the top) the journal says are done, sorted */
+  char **done;
+  unsigned int donecount;
+  uint64_t converted;
+  /* already the version asked for */
+  uint64_t unchanged;
+  /* in the journal */
+  uint64_t resumed;
+  /* not ours to convert */
+  uint64_t skipped;
+  uint64_t failed;
+  /* of the files we looked at */
+  uint64_t bytes;
+} rrdbConvertRun;
+
+typedef struct rrdbConvertJob {
+  rrdbConvertRun *run;
+  char path[];
+} rrdbConvertJob;
+
+/*
+ A tree being scanned (see scanRRDBTree), a job for each file.
+ */
+struct rrdbScanRun;
+
+typedef struct rrdbScanJob {
+  struct rrdbScanRun *run;
+  char *path;
+  /* what info and fetch had to say */
+  char *record;
+  size_t length;
+  int done;
+} rrdbScanJob;
+
+typedef struct rrdbScanRun {
+  pthread_mutex_t lock;
+  int info;
+  int fetch;
+  /* records in path order rather than as they finish */
+  int ordered;
+  char *selector;
+  char *period;
+  FILE *out;
+  size_t dirlength;
+  rrdbScanJob *jobs;
+  size_t count;
+  size_t size;
+  /* when ordered, the jobs whose records are out */
+  size_t printed;
+  uint64_t failed;
+} rrdbScanRun;
+
+/*
+ A fetch across files (see aggregateRRDBFiles). The points of the files are combined by
+ time into buckets, sorted by time - each worker builds its own from the files it takes
+ and they are merged at the end.
+ */
+typedef struct rrdbAggregateBucket {
+  int64_t time;
+  double sum;
+  double min;
+  double max;
+  /* files with a point at time */
+  uint64_t count;
+} rrdbAggregateBucket;
+
+typedef struct rrdbAggregateRun {
+  char **files;
+  size_t filecount;
+  /* the next file a worker takes */
+  size_t next;
+  /* an xform index or a touch path, and its period */
+  const char *selector;
+  const char *period;
+  /* the first file which failed, or -1 */
+  ssize_t failed;
+} rrdbAggregateRun;
+
+typedef struct rrdbAggregatePartial {
+  rrdbAggregateRun *run;
+  rrdbAggregateBucket *buckets;
+  size_t count;
+} rrdbAggregatePartial;
+
+/*
+ A private copy of a file and the runs of one series within it (see rrdb_cursor_set).
+ */
+struct rrdb_cursor {
+  char *base;
+  size_t size;
+  /* base is a mapping rather than malloc'd */
+  int mapped;
+  rrdb_span spans[ 2 ];
+  int spancount;
+  /* what the spans point into if not the file - a rolled up touch set or a sparse ring made dense - or NULL */
+  void *owned;
+};
+
+/*
+ Touch coalescing.
+ */
+typedef struct rrdbTouchDelta {
+  char *path;
+  unsigned int period;
+  rrdbInt count;
+  time_t when;
+  /* what the values of the count touches came to, if valued */
+  int valued;
+  rrdbTouchValues values;
+} rrdbTouchDelta;
+
+typedef struct rrdbCoalesceEntry {
+  char *filename;
+  char *path;
+  unsigned int period;
+  /* bin - when / secondsPerSample */
+  time_t tick;
+  rrdbInt count;
+  /* as rrdbTouchDelta, touches with and without values are kept apart */
+  int valued;
+  rrdbTouchValues values;
+  unsigned int maxsets;
+  unsigned int sampleCount;
+  struct rrdbCoalesceEntry *next;
+} rrdbCoalesceEntry;
+
+typedef struct rrdbCoalescer {
+  pthread_mutex_t lock;
+  /* signalled when the interval changes or we are stopping */
+  pthread_cond_t wake;
+  pthread_t flusher;
+
+  rrdbCoalesceEntry *buckets[ RRDBCOALESCEBUCKETS ];
+  unsigned int entries;
+  /* ms between flushes, 0 is off */
+  unsigned int interval;
+  int stopping;
+} rrdbCoalescer;
+
+/*
+ The server side of a shared memory ring (rrdbring.h).
+ */
+typedef struct rrdbRingServer {
+  /* as shm_open has it, with the / */
+  char name[ 256 ];
+  /* record filenames are relative to, "" if they are full paths */
+  char dir[ PATH_MAX ];
+  rrdb_ring *ring;
+  size_t size;
+  pthread_t drainer;
+  int stopping;
+
+  /* what the drainer took from the ring and is writing */
+  rrdb_ring_record batch[ RRDBRINGBATCH ];
+  rrdb_ring_record *touches[ RRDBRINGBATCH ];
+  /* its updates, written together (updateRRDBFilesValues) */
+  char *updatefiles[ RRDBRINGBATCH ];
+  rrdbNumber updatevalues[ RRDBRINGBATCH ][ RRDB_RING_VALUES ];
+  rrdbNumber *updateinto[ RRDBRINGBATCH ];
+  unsigned int updatecounts[ RRDBRINGBATCH ];
+  int updatestatus[ RRDBRINGBATCH ];
+  rrdbTouchDelta *deltas;
+  unsigned int deltaroom;
+} rrdbRingServer;
+
+rrdbPool *rrdbpoolcreate( unsigned int threads );
+int rrdbpoolsubmit( rrdbPool *pool, rrdbJobFunction fn, void *arg );
+void rrdbpoolwait( rrdbPool *pool );
+void rrdbpooldestroy( rrdbPool *pool );
+
+rrdbCoalescer *coalescercreate( unsigned int interval );
+int coalescersetinterval( rrdbCoalescer *c, unsigned int interval );
+int coalescerflush( rrdbCoalescer *c );
+void coalescerdestroy( rrdbCoalescer *c );
+void coalescerlock( rrdbCoalescer *c );
+void coalescerunlock( rrdbCoalescer *c );
+rrdbRingServer *ringservercreate( const char *name, const char *dir, unsigned int slots );
+void ringserverdestroy( rrdbRingServer *s );
+void printringstats( const rrdbRingServer *s );
+int coalesceTouches( rrdbCoalescer *c, char *filename, rrdbTouchDelta *deltas, unsigned int deltacount, unsigned int maxsets, unsigned int sampleCount );
+rrdbTouchSet *coalescerMerge( rrdbCoalescer *c, char *filename, rrdbTouchHeader *header, rrdbTouchSet *setHeader, char *path, unsigned int period );
+rrdbTouchSet *touchFetchSet( char *filename, char *addr, size_t size, char *path, unsigned int period, const void **ring, rrdbTouchSet **owned );
+
+/* see rrdb_coalesce */
+extern rrdbCoalescer *touchcoalescer;
+
+/* output */
+int rrdbprintf( const char *format, ... ) __attribute__ (( format( printf, 1, 2 ) ));
+FILE *rrdbsetoutput( FILE *out );
+
+/* io */
+int rrdbiosubmit( rrdbIoRequest *reqs, unsigned int count );
+
 /* file helpers */
+int rrdbsetlockmode( const char *name );
+void rrdbgetlockstats( rrdbLockStats *stats );
+void printlockstats( void );
 locked_file_t createopenandlock( char *filename );
 locked_file_t readwriteopenandlock( char *filename );
 locked_file_t readopenandlock( char *  filename );
+locked_file_t openforrangelocks( char *filename );
+locked_file_t snapshotopen( char *filename );
+locked_file_t openforfetch( char *filename );
+int containeraddress( const char *filename, char *container, size_t containerlen, char *series );
+locked_file_t containeropen( const char *filename, int flags, int exclusive );
+int printContainerInfo( int pfd );
+int lockrange( locked_file_t *lf, off_t start, off_t length, int type );
 locked_file_t unlockandclose( locked_file_t pfd );
+locked_file_t storedstage( locked_file_t file, int exclusive );
 
 locked_file_t initRRDBFile(char *filename, unsigned int setCount, unsigned int sampleCount , char *xformations);
 int readRRDBFile(int pfd, rrdbFile *fileData); /* RRDB V1 */
 int writeRRDBFile(int pfd, rrdbFile *fileData);
+int readRRDBFiles(int *pfds, rrdbFile *fileData, unsigned int count);
+int writeRRDBFiles(int *pfds, rrdbFile *fileData, unsigned int count);
 int updateRRDBFile(char *filename, char* vals);
+int updateRRDBFileValues(char *filename, rrdbNumber *values, unsigned int count);
+int updateRRDBFilesValues( char **filenames, rrdbNumber **values, unsigned int *counts, unsigned int n, int *status );
 int modifyRRDBFile(char *filename, char* vals, char* xform);
 int freeRRDBFile(rrdbFile *fileData);
 int printRRDBFile(rrdbFile *fileData);
 int printRRDBFileInfo(char *filename);
 int printRRDBFileXform(rrdbFile *fileData, unsigned int index);
 int waitForInput(char *dir);
+int waitForFrame(char *dir);
 
 int runfetch( char *filename, char *xformations, char * cperiod );
 int runcreate( char *filename, unsigned int sampleCount, unsigned int setCount, char *xformations );
 int runCommand(char *filename, RRDBCommand ourCommand, unsigned int sampleCount, unsigned int setCount, char *values, char *xformations, char * period);
 
-int touchRRDBFile(char *filename, char *path, char * period, unsigned int maxsets, unsigned int sampleCount);
-int findTouchSet(int pfd, char *path, unsigned int period, unsigned int maxsets);
-int touchSet(rrdbTouchHeader *header, rrdbTouchSet *setHeader, rrdbInt *setdata);
+int touchRRDBFile(char *filename, char *path, char * period, unsigned int maxsets, unsigned int sampleCount, rrdbInt count, time_t when, const double *value);
+unsigned int touchDeltas(char *path, char *period, rrdbInt count, time_t when, const double *value, rrdbTouchDelta *deltas, unsigned int room);
+int touchRRDBFileDeltas(char *filename, rrdbTouchDelta *deltas, unsigned int deltacount, unsigned int maxsets, unsigned int sampleCount);
+int findTouchSets(int pfd, rrdbTouchDelta *deltas, unsigned int deltacount, unsigned int maxsets);
+unsigned int touchSetsInUse(const rrdbTouchHeader *header);
+int touchFileValid(const char *addr, size_t size);
+rrdbTouchSet *touchSetAt(const rrdbTouchHeader *header, unsigned int index);
+void *touchSetRing(const rrdbTouchHeader *header, const rrdbTouchSet *setHeader);
+void touchSetDense(const rrdbTouchHeader *header, const rrdbTouchSet *setHeader, void *dense);
+const char *touchSetPath(const rrdbTouchHeader *header, const rrdbTouchSet *setHeader);
+uint64_t touchPathHash(const char *path, size_t length);
+int touchV2Decode(const char *data, size_t size, int pfd);
+int touchV2Encode(int pfd, char **data, size_t *size);
+int touchSet(rrdbTouchHeader *header, rrdbTouchSet *setHeader, void *ring, rrdbInt count, const rrdbTouchValues *values, time_t when);
 unsigned int getTimePerSample(unsigned int period);
 int getFileVersion(int pfd);
-int printRRDBTouchFile(int pfd, char * path, char * period);
+int printRRDBTouchFile(int pfd, char *filename, char * path, char * period);
+int topRRDBTouchFile( char *filename, char *prefix, char *period, unsigned int n, unsigned int bins );
+int getPeriodFromName(const char *name);
+rrdbTouchSet *findTouchSetByName(char *addr, size_t size, char *path, unsigned int iperiod);
+
+typedef void (*touchBinVisitor)( intmax_t ts, rrdbInt v, void *arg );
+void walkTouchSet(const rrdbTouchHeader *header, const rrdbTouchSet *setHeader, const void *ring, touchBinVisitor visit, void *arg);
+typedef void (*touchValueVisitor)( intmax_t ts, const rrdbTouchValueBin *bin, void *arg );
+void walkTouchValues(const rrdbTouchHeader *header, const rrdbTouchSet *setHeader, const void *ring, touchValueVisitor visit, void *arg);
+void touchValuesAdd(rrdbTouchValues *into, rrdbInt had, const rrdbTouchValues *values);
+unsigned int ringRuns( unsigned int first, unsigned int count, unsigned int runs[ 2 ][ 2 ] );
+
+/* archives */
+int archiveRRDBFile( char *filename );
+int reshapeRRDBFile( char *filename, unsigned int setCount, unsigned int sampleCount, char *xformations );
+int aggregateRRDBFiles( char *pattern, char *selector, char *period, char *reduce, unsigned int threads );
+int readArchiveHeader( int pfd, const rrdbFile *fileData, rrdbArchiveHeader *archive, uint64_t *base );
+int archivePoint( int pfd, rrdbArchiveHeader *archive, uint64_t base, unsigned int xform, int64_t time, double value );
+size_t rrdbArchiveEncode( const rrdbArchivePoint *points, unsigned int count, unsigned char *out, size_t size );
+int rrdbArchiveDecode( const unsigned char *in, size_t bytes, unsigned int count, archivePointVisitor visit, void *arg );
+int visitRRDBArchive( int pfd, const rrdbFile *fileData, unsigned int index, archivePointVisitor visit, void *arg );
+int printRRDBArchive( int pfd, const rrdbFile *fileData, unsigned int index );
+
+/* V3 */
+int rrdbV3Encode( int pfd, char **data, size_t *size );
+int rrdbV3Decode( const char *data, size_t size, int pfd );
+int convertRRDBFile( char *filename, int version );
+int convertRRDBTree( char *dir, int version, unsigned int threads );
+int scanRRDBTree( char *dir, char *what, char *selector, char *period, unsigned int threads );
 
 /* xformations */
 rrdbNumber calcRRDBCount(struct timeval* start, struct timeval *end, rrdbFile *fileData, unsigned int setIndex);
@@ -0,0 +1,145 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+#ifndef NAME_MAX
+#define NAME_MAX 4096
+#endif
+
+#include "rrdb.h"
+
+/*
+ A simple pool of worker threads fed from a FIFO of jobs. rrdbpoolsubmit blocks when
+ too much work is already queued so a fast producer can't run us out of memory.
+
+ Not part of the library interface - the library and rrdb (for tagged pipe requests)
+ each link their own copy.
+ */
+static void *rrdbpoolworker( void *arg ) {
+  rrdbPool *pool = ( rrdbPool * ) arg;
+
+  pthread_mutex_lock( &pool->lock );
+  while ( TRUE ) {
+    while ( NULL == pool->head && !pool->stopping )
+      pthread_cond_wait( &pool->work, &pool->lock );
+
+    if ( NULL == pool->head ) break; /* stopping and nothing left to do */
+
+    rrdbJob *job = pool->head;
+    pool->head = job->next;
+    if ( NULL == pool->head ) pool->tail = NULL;
+    pool->queued--;
+    pthread_cond_signal( &pool->space );
+    pthread_mutex_unlock( &pool->lock );
+
+    job->fn( job->arg );
+    free( job );
+
+    pthread_mutex_lock( &pool->lock );
+    pool->pending--;
+    if ( 0 == pool->pending ) pthread_cond_broadcast( &pool->idle );
+  }
+  pthread_mutex_unlock( &pool->lock );
+
+  return NULL;
+}
+
+/**
+ * @return { rrdbPool * } or NULL on failure
+ */
+rrdbPool *rrdbpoolcreate( unsigned int threads ) {
+  rrdbPool *pool = calloc( 1, sizeof( rrdbPool ) );
+  if ( NULL == pool ) return NULL;
+
+  pool->threads = calloc( threads, sizeof( pthread_t ) );
+  if ( NULL == pool->threads ) {
+    free( pool );
+    return NULL;
+  }
+
+  pthread_mutex_init( &pool->lock, NULL );
+  pthread_cond_init( &pool->work, NULL );
+  pthread_cond_init( &pool->space, NULL );
+  pthread_cond_init( &pool->idle, NULL );
+  pool->maxqueued = threads * RRDBPOOLQUEUEPERTHREAD;
+
+  for ( pool->threadcount = 0; pool->threadcount < threads; pool->threadcount++ ) {
+    if ( 0 != pthread_create( &pool->threads[ pool->threadcount ], NULL, rrdbpoolworker, pool ) ) break;
+  }
+
+  if ( 0 == pool->threadcount ) {
+    rrdbpooldestroy( pool );
+    return NULL;
+  }
+
+  return pool;
+}
+
+/**
+ * Queue a job, waits if the queue is full.
+ * @return { int } 0 or -1 on failure
+ */
+int rrdbpoolsubmit( rrdbPool *pool, rrdbJobFunction fn, void *arg ) {
+  rrdbJob *job = malloc( sizeof( rrdbJob ) );
+  if ( NULL == job ) return -1;
+
+  job->fn = fn;
+  job->arg = arg;
+  job->next = NULL;
+
+  pthread_mutex_lock( &pool->lock );
+  while ( pool->queued >= pool->maxqueued )
+    pthread_cond_wait( &pool->space, &pool->lock );
+
+  if ( NULL == pool->tail ) pool->head = job;
+  else pool->tail->next = job;
+  pool->tail = job;
+  pool->queued++;
+  pool->pending++;
+
+  pthread_cond_signal( &pool->work );
+  pthread_mutex_unlock( &pool->lock );
+  return 0;
+}
+
+/**
+ * Wait until every job submitted so far has finished.
+ */
+void rrdbpoolwait( rrdbPool *pool ) {
+  pthread_mutex_lock( &pool->lock );
+  while ( pool->pending > 0 )
+    pthread_cond_wait( &pool->idle, &pool->lock );
+  pthread_mutex_unlock( &pool->lock );
+}
+
+/**
+ * Finish off any queued jobs then stop the workers.
+ */
+void rrdbpooldestroy( rrdbPool *pool ) {
+  pthread_mutex_lock( &pool->lock );
+  pool->stopping = TRUE;
+  pthread_cond_broadcast( &pool->work );
+  pthread_mutex_unlock( &pool->lock );
+
+  for ( unsigned int i = 0; i < pool->threadcount; i++ )
+    pthread_join( pool->threads[ i ], NULL );
+
+  pthread_mutex_destroy( &pool->lock );
+  pthread_cond_destroy( &pool->work );
+  pthread_cond_destroy( &pool->space );
+  pthread_cond_destroy( &pool->idle );
+  free( pool->threads );
+  free( pool );
+}
+
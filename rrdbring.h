@@ -0,0 +1,236 @@
+
+
+#ifndef RRDBRING_H
+#define RRDBRING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ rrdbring - queue updates and touches for an rrdb server on the same host without a syscall
+ or a copy through the kernel each. The server (rrdb --command=- --ring=name, or rrdb_ring_serve)
+ creates a named shared memory ring of fixed size records; producers map it with rrdb_ring_open
+ then each record is claimed with a compare and swap, filled in and published by a store. Any
+ number of producers, one server, which drains it in batches into the files.
+
+ Nothing here needs the library - include this on its own and link nothing (-lrt with glibc
+ before 2.34). A full ring isn't waited on in the kernel: rrdb_ring_push tries spins times, then
+ gives up on the record and counts it as dropped, so a producer decides how much back pressure
+ it will take. full and dropped are kept in the ring where everyone, the server included, sees them.
+
+ A producer which dies between claiming a slot and publishing it stops the server at that slot
+ until the ring is recreated (stop the server and remove /dev/shm/name).
+
+ rrdb_ring *ring = rrdb_ring_open( "pbx" );
+ rrdb_ring_touch( ring, "calls.rrdb", "queue1/sales", "ONEHOUR", 50, 2000, 1, 0, 1000 );
+ */
+
+#define RRDB_RING_MAGIC 0x474e495242445252ull
+#define RRDB_RING_VERSION 1
+
+#define RRDB_RING_UPDATE 1
+#define RRDB_RING_TOUCH 2
+
+/* the most values an update carries (a file's sets) and the longest strings, including the NUL */
+#define RRDB_RING_VALUES 20
+#define RRDB_RING_FILENAME 128
+#define RRDB_RING_PATH 128
+#define RRDB_RING_PERIODS 32
+
+typedef struct rrdb_ring_record {
+  uint16_t type;
+  /* an update's values, 1 for a touch with a value (values[ 0 ]) */
+  uint16_t valuecount;
+  /* touch count, the most sets and the samples of a new file */
+  uint32_t count;
+  uint32_t maxsets;
+  uint32_t samples;
+  /* of a touch, 0 for when the server gets to it */
+  int64_t when;
+  double values[ RRDB_RING_VALUES ];
+  /* relative to the server's --dir */
+  char filename[ RRDB_RING_FILENAME ];
+  /* "/" separated items as the touch command */
+  char path[ RRDB_RING_PATH ];
+  /* "," separated, "" for the default */
+  char periods[ RRDB_RING_PERIODS ];
+} rrdb_ring_record;
+
+/* a slot is free for the producer of position p when sequence is p and holds a record for the server when p + 1 */
+typedef struct rrdb_ring_slot {
+  uint64_t sequence;
+  rrdb_ring_record record;
+} __attribute__ (( aligned( 64 ) )) rrdb_ring_slot;
+
+typedef struct rrdb_ring {
+  uint64_t magic;
+  uint32_t version;
+  /* a power of 2 */
+  uint32_t slots;
+  /* sizeof( rrdb_ring_slot ), so a producer built against another layout doesn't open it */
+  uint32_t slotsize;
+  /* pid of the server draining it, 0 if none is */
+  int32_t server;
+
+  /* the next position a producer claims - producers share this line */
+  uint64_t head __attribute__ (( aligned( 64 ) ));
+  /* times a producer found it full and records it gave up on */
+  uint64_t full;
+  uint64_t dropped;
+
+  /* the next position the server takes and its counts - only the server writes these */
+  uint64_t tail __attribute__ (( aligned( 64 ) ));
+  uint64_t received;
+  uint64_t batches;
+  uint64_t failed;
+
+  rrdb_ring_slot slot[] __attribute__ (( aligned( 64 ) ));
+} rrdb_ring;
+
+/* shm_open wants a leading / */
+static inline void rrdb_ring_shmname( const char *name, char *shmname, size_t length ) {
+  shmname[ 0 ] = '/';
+  strncpy( shmname + 1, '/' == name[ 0 ] ? name + 1 : name, length - 2 );
+  shmname[ length - 1 ] = 0;
+}
+
+/**
+ * Map a ring the server has created.
+ * @return { rrdb_ring * } or NULL if there isn't one (yet) or it isn't the layout we know
+ */
+static inline rrdb_ring *rrdb_ring_open( const char *name ) {
+  char shmname[ 256 ];
+  struct stat sb;
+  rrdb_ring *ring;
+
+  rrdb_ring_shmname( name, shmname, sizeof( shmname ) );
+  int fd = shm_open( shmname, O_RDWR, 0 );
+  if ( -1 == fd ) return NULL;
+
+  if ( -1 == fstat( fd, &sb ) || ( size_t ) sb.st_size < sizeof( rrdb_ring ) ) {
+    close( fd );
+    return NULL;
+  }
+
+  ring = mmap( NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( MAP_FAILED == ring ) return NULL;
+
+  /* the server writes magic last */
+  if ( RRDB_RING_MAGIC != __atomic_load_n( &ring->magic, __ATOMIC_ACQUIRE ) || RRDB_RING_VERSION != ring->version ||
+       sizeof( rrdb_ring_slot ) != ring->slotsize ||
+       ( size_t ) sb.st_size < sizeof( rrdb_ring ) + ( size_t ) ring->slots * sizeof( rrdb_ring_slot ) ) {
+    munmap( ring, sb.st_size );
+    return NULL;
+  }
+
+  return ring;
+}
+
+static inline void rrdb_ring_close( rrdb_ring *ring ) {
+  munmap( ring, sizeof( rrdb_ring ) + ( size_t ) ring->slots * sizeof( rrdb_ring_slot ) );
+}
+
+/**
+ * @return { uint32_t } about how many records could be pushed now
+ */
+static inline uint32_t rrdb_ring_room( const rrdb_ring *ring ) {
+  uint64_t used = __atomic_load_n( &ring->head, __ATOMIC_RELAXED ) - __atomic_load_n( &ring->tail, __ATOMIC_RELAXED );
+  return used >= ring->slots ? 0 : ring->slots - ( uint32_t ) used;
+}
+
+/**
+ * One go at queueing record.
+ * @return { int } 0 if it is queued, -1 if the ring is full
+ */
+static inline int rrdb_ring_try_push( rrdb_ring *ring, const rrdb_ring_record *record ) {
+  uint64_t position = __atomic_load_n( &ring->head, __ATOMIC_RELAXED );
+  rrdb_ring_slot *slot;
+
+  for ( ;; ) {
+    slot = &ring->slot[ position & ( ring->slots - 1 ) ];
+    int64_t ahead = ( int64_t ) ( __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE ) - position );
+
+    if ( 0 == ahead ) {
+      if ( __atomic_compare_exchange_n( &ring->head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) break;
+    } else if ( ahead < 0 ) {
+      /* still holds the record of a lap ago */
+      __atomic_fetch_add( &ring->full, 1, __ATOMIC_RELAXED );
+      return -1;
+    } else {
+      /* another producer took it */
+      position = __atomic_load_n( &ring->head, __ATOMIC_RELAXED );
+    }
+  }
+
+  slot->record = *record;
+  __atomic_store_n( &slot->sequence, position + 1, __ATOMIC_RELEASE );
+  return 0;
+}
+
+/**
+ * Queue record, trying up to spins times (at least once) while the ring is full.
+ * @return { int } 0 if it is queued, -1 if it was dropped
+ */
+static inline int rrdb_ring_push( rrdb_ring *ring, const rrdb_ring_record *record, unsigned int spins ) {
+  for ( unsigned int i = 0; ; i++ ) {
+    if ( 0 == rrdb_ring_try_push( ring, record ) ) return 0;
+    if ( i + 1 >= spins ) break;
+#if defined( __x86_64__ ) || defined( __i386__ )
+    __builtin_ia32_pause();
+#endif
+  }
+
+  __atomic_fetch_add( &ring->dropped, 1, __ATOMIC_RELAXED );
+  return -1;
+}
+
+/**
+ * Queue an update of a V1 file, a value for each set.
+ * @return { int } 0 if it is queued, -1 if it was dropped or doesn't fit a record
+ */
+static inline int rrdb_ring_update( rrdb_ring *ring, const char *filename, const double *values, unsigned int count, unsigned int spins ) {
+  rrdb_ring_record r = { .type = RRDB_RING_UPDATE, .valuecount = ( uint16_t ) count };
+
+  if ( count > RRDB_RING_VALUES || strlen( filename ) >= sizeof( r.filename ) ) return -1;
+  memcpy( r.values, values, count * sizeof( double ) );
+  strcpy( r.filename, filename );
+  return rrdb_ring_push( ring, &r, spins );
+}
+
+/**
+ * Queue a touch, as rrdb_touch - when 0 is when the server writes it.
+ * @return { int } 0 if it is queued, -1 if it was dropped or doesn't fit a record
+ */
+static inline int rrdb_ring_touch( rrdb_ring *ring, const char *filename, const char *path, const char *periods,
+                                   unsigned int maxsets, unsigned int samples, unsigned int count, time_t when, unsigned int spins ) {
+  rrdb_ring_record r = { .type = RRDB_RING_TOUCH, .count = count, .maxsets = maxsets, .samples = samples, .when = when };
+
+  if ( strlen( filename ) >= sizeof( r.filename ) || strlen( path ) >= sizeof( r.path ) || strlen( periods ) >= sizeof( r.periods ) ) return -1;
+  strcpy( r.filename, filename );
+  strcpy( r.path, path );
+  strcpy( r.periods, periods );
+  return rrdb_ring_push( ring, &r, spins );
+}
+
+/**
+ * As rrdb_ring_touch, each of the count touches with value (see rrdb_touch_value).
+ */
+static inline int rrdb_ring_touch_value( rrdb_ring *ring, const char *filename, const char *path, const char *periods,
+                                         unsigned int maxsets, unsigned int samples, unsigned int count, double value, time_t when, unsigned int spins ) {
+  rrdb_ring_record r = { .type = RRDB_RING_TOUCH, .valuecount = 1, .count = count, .maxsets = maxsets, .samples = samples, .when = when };
+
+  if ( strlen( filename ) >= sizeof( r.filename ) || strlen( path ) >= sizeof( r.path ) || strlen( periods ) >= sizeof( r.periods ) ) return -1;
+  r.values[ 0 ] = value;
+  strcpy( r.filename, filename );
+  strcpy( r.path, path );
+  strcpy( r.periods, periods );
+  return rrdb_ring_push( ring, &r, spins );
+}
+
+#endif /* RRDBRING_H */
@@ -0,0 +1,61 @@
+
+import { execFile } from "node:child_process"
+import { promisify } from "node:util"
+import { randomUUID } from "node:crypto"
+import { mkdir } from "node:fs/promises"
+import { expect } from "chai"
+
+const execFileAsync = promisify( execFile )
+const rrbdbin = "/usr/bin/rrdb"
+
+async function rrdb( args, env = process.env ) {
+  const { stdout } = await execFileAsync( rrbdbin, [ "--dir=/tmp", ...args ], { env } )
+  return stdout
+}
+
+function at( seconds ) {
+  const when = new Date( seconds * 1000 ).toISOString().replace( "T", " " ).slice( 0, 19 )
+  return { ...process.env, TZ: "UTC", FAKETIME: `@${when}`, LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1" }
+}
+
+describe( "rrdb aggregate", function () {
+  this.timeout( 60000 )
+
+  it( "combines an xform of many files by time", async function () {
+    const dir = randomUUID()
+    const start = Date.parse( "2025-10-31T10:00:00Z" ) / 1000
+    /* file: the hours (from start) and values of its updates */
+    const files = { a: [ [ 0, 1 ], [ 1, 2 ] ], b: [ [ 1, 10 ], [ 2, 20 ], [ 2, 5 ] ], c: [ [ 2, 100 ] ] }
+
+    await mkdir( `/tmp/${dir}` )
+    for( const [ name, updates ] of Object.entries( files ) ) {
+      await rrdb( [ "--command=create", `--filename=${dir}/${name}.rrdb`, "--setcount=1", "--samplecount=10", "--xform=RRDBSUM:ONEHOUR:0" ] )
+      for( const [ hour, value ] of updates ) {
+        await rrdb( [ "--command=update", `--filename=${dir}/${name}.rrdb`, `--values=${value}` ], at( start + hour * 3600 + 60 ) )
+      }
+    }
+
+    const aggregate = async ( reduce, pattern = "*.rrdb" ) => ( await rrdb( [ "--command=aggregate", `--filename=${dir}/${pattern}`, "--xform=0", `--reduce=${reduce}`, "--threads=3" ] ) )
+      .trim().split( "\n" ).map( ( l ) => l.split( ":" ).map( Number ) )
+
+    expect( await aggregate( "SUM" ) ).to.eql( [ [ start, 1 ], [ start + 3600, 12 ], [ start + 7200, 125 ] ] )
+    expect( await aggregate( "MAX" ) ).to.eql( [ [ start, 1 ], [ start + 3600, 10 ], [ start + 7200, 100 ] ] )
+    expect( await aggregate( "MEAN" ) ).to.eql( [ [ start, 1 ], [ start + 3600, 6 ], [ start + 7200, 62.5 ] ] )
+    expect( await aggregate( "COUNT" ) ).to.eql( [ [ start, 1 ], [ start + 3600, 2 ], [ start + 7200, 2 ] ] )
+    expect( await aggregate( "SUM", "{a,c}.rrdb" ) ).to.eql( [ [ start, 1 ], [ start + 3600, 2 ], [ start + 7200, 100 ] ] )
+
+    expect( await rrdb( [ "--command=aggregate", `--filename=${dir}/*.rrdb`, "--xform=1", "--reduce=SUM" ] ) ).to.match( /^ERROR: failed to read / )
+  } )
+
+  it( "combines a touch path of many files", async function () {
+    const dir = randomUUID()
+
+    await mkdir( `/tmp/${dir}` )
+    for( let i = 1; i <= 6; i++ ) {
+      await rrdb( [ "--command=touch", `--filename=${dir}/t${i}.rrdb`, "--touchpath=main/sales", "--period=ONEHOUR", `--values=${i}` ] )
+    }
+
+    const sum = await rrdb( [ "--command=aggregate", `--filename=${dir}/t*.rrdb`, "--touchpath=sales", "--period=ONEHOUR", "--reduce=SUM", "--threads=4" ] )
+    expect( sum ).to.match( /^\d+:21\.000000\n$/ )
+  } )
+} )
@@ -0,0 +1,48 @@
+
+import { execFile } from "node:child_process"
+import { promisify } from "node:util"
+import { randomUUID } from "node:crypto"
+import { expect } from "chai"
+
+const execFileAsync = promisify( execFile )
+const rrbdbin = "/usr/bin/rrdb"
+
+function genfilename() {
+  return `${randomUUID()}.rrdb`
+}
+
+async function rrdb( args, env = process.env ) {
+  const { stdout } = await execFileAsync( rrbdbin, [ "--dir=/tmp", ...args ], { env } )
+  return stdout
+}
+
+describe( "rrdb archive", function () {
+  this.timeout( 120000 )
+
+  it( "keeps the xform points which fall off the ring", async function () {
+    const fn = genfilename()
+    const start = Date.parse( "2025-10-31T12:00:00Z" ) / 1000
+    const updates = 132
+
+    await rrdb( [ "--command=create", `--filename=${fn}`, "--setcount=1", "--samplecount=2", "--xform=RRDBSUM:FIVEMINUTE:0" ] )
+    await rrdb( [ "--command=archive", `--filename=${fn}` ] )
+
+    /* one update every five minutes - all but the last 2 end up archived, 128 of them compressed */
+    for( let i = 0; i < updates; i++ ) {
+      const when = new Date( ( start + i * 300 ) * 1000 ).toISOString().replace( "T", " " ).slice( 0, 19 )
+      await rrdb( [ "--command=update", `--filename=${fn}`, `--values=${ i % 7 }.25` ], {
+        ...process.env,
+        TZ: "UTC",
+        FAKETIME: `@${when}`,
+        LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+      } )
+    }
+
+    const rows = ( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=0" ] ) ).trim().split( "\n" )
+    expect( rows.length ).to.equal( updates )
+    rows.forEach( ( row, i ) => expect( row ).to.equal( `${ start + i * 300 }:${ i % 7 }.250000` ) )
+
+    const info = await rrdb( [ "--command=info", `--filename=${fn}` ] )
+    expect( info ).to.match( /\nArchived #128 points in #1 blocks \(\d+ bytes\)\n/ )
+  } )
+} )
@@ -0,0 +1,248 @@
+
+import { spawn } from "node:child_process"
+import { expect } from "chai"
+import { randomUUID } from "node:crypto"
+
+const rrbdbin = "/usr/bin/rrdb"
+
+const OP = { create: 1, update: 2, mupdate: 3, touch: 4, fetch: 5, info: 6 }
+
+function genfilename() {
+  return `${randomUUID()}.rrdb`
+}
+
+/*
+ Minimal client for the binary protocol - little endian throughout.
+ */
+class binaryclient {
+  constructor( flags = [] ) {
+    this.proc = spawn( rrbdbin, [ "--command=-", "--dir=/tmp", ...flags ] )
+    this.buffer = Buffer.alloc( 0 )
+    this.waiting = []
+    this.stderr = ""
+    this.proc.stderr.on( "data", ( d ) => this.stderr += d )
+    this.exited = new Promise( ( resolve ) => this.proc.on( "close", resolve ) )
+    this.proc.stdout.on( "data", ( d ) => {
+      this.buffer = Buffer.concat( [ this.buffer, d ] )
+      this.drain()
+    } )
+  }
+
+  drain() {
+    while( this.waiting.length > 0 ) {
+      const w = this.waiting[ 0 ]
+      const got = w.take( this.buffer )
+      if( !got ) return
+      this.buffer = this.buffer.subarray( got.used )
+      this.waiting.shift()
+      w.resolve( got.value )
+    }
+  }
+
+  expect( take ) {
+    return new Promise( ( resolve ) => {
+      this.waiting.push( { take, resolve } )
+      this.drain()
+    } )
+  }
+
+  async negotiate() {
+    this.proc.stdin.write( "binary\n" )
+    return this.expect( ( b ) => {
+      const nl = b.indexOf( "\n" )
+      if( -1 === nl ) return
+      return { used: nl + 1, value: b.subarray( 0, nl ).toString() }
+    } )
+  }
+
+  request( opcode, payload ) {
+    const head = Buffer.alloc( 5 )
+    head.writeUInt32LE( payload.length + 1, 0 )
+    head.writeUInt8( opcode, 4 )
+    this.proc.stdin.write( Buffer.concat( [ head, payload ] ) )
+
+    return this.expect( ( b ) => {
+      if( b.length < 4 ) return
+      const length = b.readUInt32LE( 0 )
+      if( b.length < 4 + length ) return
+      return { used: 4 + length, value: { status: b.readUInt8( 4 ), payload: b.subarray( 5, 4 + length ) } }
+    } )
+  }
+
+  close() {
+    this.proc.stdin.end()
+  }
+
+  /**
+   * Close and wait for it to exit.
+   * @returns { Promise< string > } what it wrote to stderr
+   */
+  async finish() {
+    this.close()
+    await this.exited
+    return this.stderr
+  }
+}
+
+function str( s ) {
+  const b = Buffer.alloc( 2 )
+  b.writeUInt16LE( Buffer.byteLength( s ), 0 )
+  return Buffer.concat( [ b, Buffer.from( s ) ] )
+}
+
+function u32( v ) {
+  const b = Buffer.alloc( 4 )
+  b.writeUInt32LE( v >>> 0, 0 )
+  return b
+}
+
+function values( vals ) {
+  const b = Buffer.alloc( 1 + vals.length * 8 )
+  b.writeUInt8( vals.length, 0 )
+  vals.forEach( ( v, i ) => b.writeDoubleLE( v, 1 + i * 8 ) )
+  return b
+}
+
+describe( "rrdb binary protocol", function () {
+
+  it( "create, update, mupdate and fetch", async function () {
+    const fn = genfilename()
+    const client = new binaryclient()
+
+    expect( await client.negotiate() ).to.equal( "OK" )
+
+    let r = await client.request( OP.create, Buffer.concat( [ str( fn ), u32( 2 ), u32( 10 ), str( "RRDBSUM:ONEDAY:1" ) ] ) )
+    expect( r.status ).to.equal( 0 )
+
+    r = await client.request( OP.update, Buffer.concat( [ str( fn ), values( [ 1.5, 2 ] ) ] ) )
+    expect( r.status ).to.equal( 0 )
+
+    const mupdate = Buffer.alloc( 2 )
+    mupdate.writeUInt16LE( 2, 0 )
+    r = await client.request( OP.mupdate, Buffer.concat( [ mupdate,
+      str( fn ), values( [ 3, 4 ] ),
+      str( "doesnotexist.rrdb" ), values( [ 1 ] ) ] ) )
+    expect( r.status ).to.equal( 0 )
+    expect( r.payload.readUInt16LE( 0 ) ).to.equal( 2 )
+    expect( r.payload.readUInt8( 2 ) ).to.equal( 0 )
+    expect( r.payload.readUInt8( 3 ) ).to.equal( 1 )
+
+    /* raw rows: type, rows, columns then time, usecs, values */
+    r = await client.request( OP.fetch, Buffer.concat( [ str( fn ), u32( -1 ), str( "" ), str( "" ) ] ) )
+    expect( r.status ).to.equal( 0 )
+    expect( r.payload.readUInt8( 0 ) ).to.equal( 1 )
+    expect( r.payload.readUInt32LE( 1 ) ).to.equal( 2 )
+    expect( r.payload.readUInt32LE( 5 ) ).to.equal( 2 )
+    expect( r.payload.readDoubleLE( 9 + 12 ) ).to.equal( 1.5 )
+    expect( r.payload.readDoubleLE( 9 + 12 + 8 ) ).to.equal( 2 )
+    expect( r.payload.readDoubleLE( 9 + 28 + 12 + 8 ) ).to.equal( 4 )
+
+    /* xform 0 - the sum of set 1 */
+    r = await client.request( OP.fetch, Buffer.concat( [ str( fn ), u32( 0 ), str( "" ), str( "" ) ] ) )
+    expect( r.status ).to.equal( 0 )
+    expect( r.payload.readUInt8( 0 ) ).to.equal( 2 )
+    expect( r.payload.readUInt32LE( 1 ) ).to.equal( 1 )
+    expect( r.payload.readDoubleLE( 5 + 8 ) ).to.equal( 6 )
+
+    r = await client.request( OP.info, str( fn ) )
+    expect( r.status ).to.equal( 0 )
+    expect( r.payload.readUInt8( 0 ) ).to.equal( 4 )
+    expect( r.payload.readUInt32LE( 1 ) ).to.equal( 2 )
+    expect( r.payload.readUInt32LE( 5 ) ).to.equal( 10 )
+    expect( r.payload.readUInt32LE( 13 ) ).to.equal( 1 )
+
+    client.close()
+  } )
+
+  it( "mupdate reads and writes its files in one batch", async function () {
+    const files = [ genfilename(), genfilename(), genfilename() ]
+    const client = new binaryclient( [ "--lockstats" ] )
+
+    await client.negotiate()
+
+    for( const fn of files ) {
+      expect( ( await client.request( OP.create, Buffer.concat( [ str( fn ), u32( 1 ), u32( 10 ), str( "" ) ] ) ) ).status ).to.equal( 0 )
+    }
+
+    const mupdate = Buffer.alloc( 2 )
+    mupdate.writeUInt16LE( files.length, 0 )
+    let r = await client.request( OP.mupdate, Buffer.concat( [ mupdate, ...files.map( ( fn, i ) => Buffer.concat( [ str( fn ), values( [ i + 1 ] ) ] ) ) ] ) )
+    expect( r.status ).to.equal( 0 )
+    expect( [ ...r.payload.subarray( 2 ) ] ).to.eql( [ 0, 0, 0 ] )
+
+    for( const [ i, fn ] of files.entries() ) {
+      r = await client.request( OP.fetch, Buffer.concat( [ str( fn ), u32( -1 ), str( "" ), str( "" ) ] ) )
+      expect( r.payload.readUInt32LE( 1 ) ).to.equal( 1 )
+      expect( r.payload.readDoubleLE( 9 + 12 ) ).to.equal( i + 1 )
+    }
+
+    /* everything else here is a file at a time, so only the mupdate can have put all three in one submit */
+    const stats = await client.finish()
+    expect( stats ).to.match( /\niomaxbatch:3\n/ )
+  } )
+
+  it( "touch and fetch", async function () {
+    const fn = genfilename()
+    const client = new binaryclient()
+
+    await client.negotiate()
+
+    const touch = Buffer.concat( [ str( fn ), u32( 10 ), u32( 10 ), str( "main/sales" ), str( "ONEHOUR" ) ] )
+    let r = await client.request( OP.touch, touch )
+    expect( r.status ).to.equal( 0 )
+    r = await client.request( OP.touch, touch )
+    expect( r.status ).to.equal( 0 )
+
+    r = await client.request( OP.fetch, Buffer.concat( [ str( fn ), u32( -1 ), str( "sales" ), str( "ONEHOUR" ) ] ) )
+    expect( r.status ).to.equal( 0 )
+    expect( r.payload.readUInt8( 0 ) ).to.equal( 3 )
+    expect( r.payload.readUInt32LE( 1 ) ).to.equal( 1 )
+    expect( r.payload.readUInt32LE( 5 + 8 ) ).to.equal( 2 )
+
+    client.close()
+  } )
+
+  it( "touch with a value and fetch", async function () {
+    const fn = genfilename()
+    const client = new binaryclient()
+
+    await client.negotiate()
+
+    const touch = ( count, value ) => {
+      const rest = Buffer.alloc( 4 + 8 + 8 )
+      rest.writeUInt32LE( count, 0 )
+      rest.writeDoubleLE( value, 12 )
+      return client.request( OP.touch, Buffer.concat( [ str( fn ), u32( 10 ), u32( 10 ), str( "sales" ), str( "ONEHOUR" ), rest ] ) )
+    }
+    expect( ( await touch( 1, 4 ) ).status ).to.equal( 0 )
+    expect( ( await touch( 3, 8 ) ).status ).to.equal( 0 )
+
+    /* type 6: time, count, sum, min, max */
+    const r = await client.request( OP.fetch, Buffer.concat( [ str( fn ), u32( -1 ), str( "sales" ), str( "ONEHOUR" ) ] ) )
+    expect( r.status ).to.equal( 0 )
+    expect( r.payload.readUInt8( 0 ) ).to.equal( 6 )
+    expect( r.payload.readUInt32LE( 1 ) ).to.equal( 1 )
+    expect( r.payload.readUInt32LE( 5 + 8 ) ).to.equal( 4 )
+    expect( r.payload.readDoubleLE( 5 + 12 ) ).to.equal( 28 )
+    expect( r.payload.readDoubleLE( 5 + 20 ) ).to.equal( 4 )
+    expect( r.payload.readDoubleLE( 5 + 28 ) ).to.equal( 8 )
+
+    client.close()
+  } )
+
+  it( "errors are returned as text", async function () {
+    const client = new binaryclient()
+
+    await client.negotiate()
+
+    let r = await client.request( OP.info, str( genfilename() ) )
+    expect( r.status ).to.equal( 1 )
+    expect( r.payload.toString() ).to.match( /^ERROR: failed to open/ )
+
+    r = await client.request( 99, Buffer.alloc( 0 ) )
+    expect( r.status ).to.equal( 1 )
+    expect( r.payload.toString() ).to.equal( "ERROR: unknown opcode 99" )
+
+    client.close()
+  } )
+} )
@@ -0,0 +1,202 @@
+
+import { execFile } from "node:child_process"
+import { promisify } from "node:util"
+import { randomUUID } from "node:crypto"
+import { readFile, mkdir, writeFile, access } from "node:fs/promises"
+import { expect } from "chai"
+
+const execFileAsync = promisify( execFile )
+const rrbdbin = "/usr/bin/rrdb"
+
+function genfilename() {
+  return `${randomUUID()}.rrdb`
+}
+
+async function rrdb( args ) {
+  const { stdout } = await execFileAsync( rrbdbin, [ "--dir=/tmp", ...args ] )
+  return stdout
+}
+
+async function storedversion( fn ) {
+  return ( await readFile( `/tmp/${fn}` ) ).readInt32LE( 0 )
+}
+
+describe( "rrdb convert", function () {
+  this.timeout( 20000 )
+
+  it( "a V1 file reads and updates the same in V3 and converts back", async function () {
+    const fn = genfilename()
+
+    await rrdb( [ "--command=create", `--filename=${fn}`, "--setcount=2", "--samplecount=10", "--xform=RRDBSUM:ONEDAY:0:RRDBMAX:ONEHOUR:1" ] )
+    for( let i = 1; i <= 4; i++ ) await rrdb( [ "--command=update", `--filename=${fn}`, `--values=${i}.5:${i * 3}` ] )
+
+    const raw = await rrdb( [ "--command=fetch", `--filename=${fn}` ] )
+    const xform = await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=1" ] )
+
+    /* every value is a double as it is */
+    expect( await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=3" ] ) ).to.equal( "" )
+    expect( await storedversion( fn ) ).to.equal( 3 )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}` ] ) ).to.equal( raw )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=1" ] ) ).to.equal( xform )
+
+    const info = await rrdb( [ "--command=info", `--filename=${fn}` ] )
+    expect( info ).to.match( /^Version is 1\n/ )
+    expect( info ).to.match( /\nStored as version 3\n/ )
+
+    /* still V3 after an update */
+    await rrdb( [ "--command=update", `--filename=${fn}`, "--values=7:20" ] )
+    expect( await storedversion( fn ) ).to.equal( 3 )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=0" ] ) ).to.match( /:19\.000000\n$/ )
+
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=5" ] )
+    expect( await storedversion( fn ) ).to.equal( 5 )
+    expect( ( await rrdb( [ "--command=fetch", `--filename=${fn}` ] ) ).trim().split( "\n" ).length ).to.equal( 5 )
+  } )
+
+  it( "converting to V3 says when values lose precision", async function () {
+    const fn = genfilename()
+
+    await rrdb( [ "--command=create", `--filename=${fn}`, "--setcount=1", "--samplecount=10", "--xform=RRDBSUM:ONEDAY:0" ] )
+    for( const v of [ "0.1", "0.2" ] ) await rrdb( [ "--command=update", `--filename=${fn}`, `--values=${v}` ] )
+
+    /* 0.1 + 0.2 in a long double isn't a double */
+    expect( await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=3" ] ) ).to.equal( `WARNING: /tmp/${fn} has values version 3 keeps less precisely\n` )
+    expect( await storedversion( fn ) ).to.equal( 3 )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=0" ] ) ).to.match( /:0\.300000\n$/ )
+  } )
+
+  it( "a V5 file converts to V1, without the seqlock, and back keeping its archive", async function () {
+    const fn = genfilename()
+    const start = Date.parse( "2025-10-31T12:00:00Z" ) / 1000
+    const rrdbstats = async ( args ) => ( await execFileAsync( rrbdbin, [ "--dir=/tmp", "--lockstats", ...args ] ) ).stderr
+    let updates = 0
+
+    /* an update every five minutes so points fall off the xform ring into the archive */
+    const update = async () => {
+      const when = new Date( ( start + updates * 300 ) * 1000 ).toISOString().replace( "T", " " ).slice( 0, 19 )
+      await execFileAsync( rrbdbin, [ "--dir=/tmp", "--command=update", `--filename=${fn}`, `--values=${ updates + 1 }:2` ], {
+        env: { ...process.env, TZ: "UTC", FAKETIME: `@${when}`, LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1" }
+      } )
+      updates++
+    }
+
+    /* created as V1, which every build reads, and moved on */
+    await rrdb( [ "--command=create", `--filename=${fn}`, "--setcount=2", "--samplecount=2", "--xform=RRDBSUM:FIVEMINUTE:0" ] )
+    expect( await storedversion( fn ) ).to.equal( 1 )
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=5" ] )
+    expect( await storedversion( fn ) ).to.equal( 5 )
+    await rrdb( [ "--command=archive", `--filename=${fn}` ] )
+    for( let i = 0; i < 4; i++ ) await update()
+
+    const raw = await rrdb( [ "--command=fetch", `--filename=${fn}` ] )
+    const xform = await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=0" ] )
+    expect( xform.trim().split( "\n" ).length ).to.equal( 4 )
+    expect( await rrdbstats( [ "--command=fetch", `--filename=${fn}` ] ) ).to.match( /\nsnapshotfallbacks:0\n/ )
+
+    /* the header as builds before version 5 wrote it: version, window position, sets, samples */
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=1" ] )
+    const data = await readFile( `/tmp/${fn}` )
+    expect( data.readInt32LE( 0 ) ).to.equal( 1 )
+    expect( data.readUInt32LE( 8 ) ).to.equal( 2 )
+    expect( data.readUInt32LE( 12 ) ).to.equal( 2 )
+    expect( await rrdb( [ "--command=info", `--filename=${fn}` ] ) ).to.match( /^Version is 1\n/ )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}` ] ) ).to.equal( raw )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=0" ] ) ).to.equal( xform )
+
+    /* no seqlock, so read under a lock */
+    expect( await rrdbstats( [ "--command=fetch", `--filename=${fn}` ] ) ).to.match( /\nsnapshotfallbacks:1\n/ )
+
+    for( let i = 0; i < 2; i++ ) await update()
+    expect( await storedversion( fn ) ).to.equal( 1 )
+
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=5" ] )
+    expect( await storedversion( fn ) ).to.equal( 5 )
+    for( let i = 0; i < 2; i++ ) await update()
+
+    const rows = ( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=0" ] ) ).trim().split( "\n" )
+    expect( rows.length ).to.equal( updates )
+    rows.forEach( ( row, i ) => expect( row ).to.equal( `${ start + i * 300 }:${ i + 1 }.000000` ) )
+  } )
+
+  it( "a touch file keeps touching in V3", async function () {
+    const fn = genfilename()
+    const touch = [ "--command=touch", `--filename=${fn}`, "--touchpath=main/sales", "--period=ONEHOUR" ]
+
+    await rrdb( touch )
+    await rrdb( touch )
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=3" ] )
+    expect( await storedversion( fn ) ).to.equal( 3 )
+
+    await rrdb( touch )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--touchpath=sales", "--period=ONEHOUR" ] ) ).to.match( /^\d+:3\n$/ )
+
+    /* a touch file only goes back to 2 */
+    expect( await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=1" ] ) ).to.match( /^ERROR: a touch file converts to version 2, 3 or 4/ )
+    expect( await storedversion( fn ) ).to.equal( 3 )
+
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=2" ] )
+    expect( await storedversion( fn ) ).to.equal( 2 )
+    expect( await rrdb( [ "--command=info", `--filename=${fn}` ] ) ).to.equal( "2:2:2000\nmain:3600\nsales:3600\n" )
+  } )
+
+  it( "a version 2 touch file is written back as 2 until it has a path too long for it", async function () {
+    const fn = genfilename()
+    const touch = ( path ) => rrdb( [ "--command=touch", `--filename=${fn}`, `--touchpath=${path}`, "--period=ONEHOUR" ] )
+    const fetch = () => rrdb( [ "--command=fetch", `--filename=${fn}`, "--touchpath=sales", "--period=ONEHOUR" ] )
+    const long = "y".repeat( 120 )
+
+    await touch( "main/sales" )
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=2" ] )
+    expect( await storedversion( fn ) ).to.equal( 2 )
+
+    /* older builds keep reading it - moving it on is up to convert */
+    await touch( "main/sales" )
+    expect( await storedversion( fn ) ).to.equal( 2 )
+    expect( await fetch() ).to.match( /^\d+:2\n$/ )
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=4" ] )
+    expect( await storedversion( fn ) ).to.equal( 4 )
+    await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=2" ] )
+    expect( await storedversion( fn ) ).to.equal( 2 )
+
+    await touch( long )
+    expect( await storedversion( fn ) ).to.equal( 4 )
+    expect( await fetch() ).to.match( /^\d+:2\n$/ )
+
+    expect( await rrdb( [ "--command=convert", `--filename=${fn}`, "--format=2" ] ) ).to.match( /has a path too long for version 2\n$/ )
+    expect( await storedversion( fn ) ).to.equal( 4 )
+  } )
+
+  it( "a directory tree converts on several threads and resumes", async function () {
+    const dir = randomUUID()
+    const files = [ `${dir}/a.rrdb`, `${dir}/b.rrdb`, `${dir}/x/c.rrdb`, `${dir}/x/y/d.rrdb` ]
+    const touched = `${dir}/x/t.rrdb`
+
+    await mkdir( `/tmp/${dir}/x/y`, { recursive: true } )
+    for( const fn of files ) {
+      await rrdb( [ "--command=create", `--filename=${fn}`, "--setcount=1", "--samplecount=10", "--xform=RRDBSUM:ONEDAY:0" ] )
+      await rrdb( [ "--command=update", `--filename=${fn}`, "--values=4" ] )
+    }
+    await rrdb( [ "--command=touch", `--filename=${touched}`, "--touchpath=main/sales", "--period=ONEHOUR" ] )
+    await writeFile( `/tmp/${dir}/notes.txt`, "not an rrdb file" )
+
+    let out = await rrdb( [ "--command=convert", `--filename=${dir}`, "--format=3", "--threads=4" ] )
+    expect( out ).to.match( /^converted:5\nunchanged:0\nresumed:0\nskipped:1\nfailed:0\n/ )
+    expect( out ).to.match( /\nfilespersec:[\d.]+\nmbpersec:[\d.]+\n$/ )
+    for( const fn of [ ...files, touched ] ) expect( await storedversion( fn ) ).to.equal( 3 )
+    expect( await rrdb( [ "--command=fetch", `--filename=${files[ 3 ]}`, "--xform=0" ] ) ).to.match( /:4\.000000\n$/ )
+
+    /* finished, so no journal */
+    await access( `/tmp/${dir}/.rrdbconvert` ).then( () => expect.fail( "journal left behind" ), () => {} )
+
+    out = await rrdb( [ "--command=convert", `--filename=${dir}`, "--format=3" ] )
+    expect( out ).to.match( /^converted:0\nunchanged:5\n/ )
+
+    /* a run which stopped after a.rrdb */
+    await writeFile( `/tmp/${dir}/.rrdbconvert`, "format:1\na.rrdb\n" )
+    out = await rrdb( [ "--command=convert", `--filename=${dir}`, "--format=1", "--threads=2" ] )
+    expect( out ).to.match( /^converted:3\nunchanged:0\nresumed:1\nskipped:1\nfailed:1\n/ )
+    expect( await storedversion( files[ 0 ] ) ).to.equal( 3 )
+    expect( await storedversion( files[ 1 ] ) ).to.equal( 1 )
+    expect( await storedversion( touched ) ).to.equal( 3 )
+  } )
+} )
@@ -0,0 +1,276 @@
+/*
+ Tests of the library interface (librrdb.h) on its own - the specs only reach it through the
+ command line, and the cursors not at all. It works on files in the directory it is given,
+ prints a line for each check which fails and exits 1 if any did. Run by library.spec.js.
+
+ make test/library && test/library /tmp
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "librrdb.h"
+
+static unsigned int failed = 0;
+static const char *dir;
+
+#define CHECK( x ) do { if ( !( x ) ) { printf( "FAIL %s:%d %s\n", __func__, __LINE__, #x ); failed++; } } while ( 0 )
+
+/* a file of our own in dir, name being what tells them apart */
+static const char *filename( const char *name ) {
+  static char names[ 8 ][ 256 ];
+  static unsigned int next = 0;
+  char *f = names[ next++ % 8 ];
+
+  snprintf( f, sizeof( names[ 0 ] ), "%s/library-%d-%s.rrdb", dir, ( int ) getpid(), name );
+  unlink( f );
+  return f;
+}
+
+/* results which don't fit say how much they need and fit once given that */
+static void truncated( void ) {
+  const char *fn = filename( "truncated" );
+  double values[ 2 ] = { 1.5, 2 };
+  char small[ 8 ], *big;
+  rrdb_buffer out = { small, sizeof( small ), 0 };
+
+  CHECK( RRDB_OK == rrdb_create( fn, 2, 10, "RRDBSUM:ONEDAY:0", NULL ) );
+  CHECK( RRDB_OK == rrdb_update( fn, values, 2, NULL ) );
+
+  CHECK( RRDB_TRUNCATED == rrdb_info( fn, &out ) );
+  CHECK( out.length > sizeof( small ) );
+  CHECK( strlen( small ) == sizeof( small ) - 1 );
+  CHECK( 0 == strncmp( small, "Version", sizeof( small ) - 1 ) );
+
+  /* room for the text but not its terminator is still too small */
+  big = malloc( out.length + 1 );
+  out = ( rrdb_buffer ) { big, out.length, 0 };
+  CHECK( RRDB_TRUNCATED == rrdb_info( fn, &out ) );
+
+  out.size = out.length + 1;
+  CHECK( RRDB_OK == rrdb_info( fn, &out ) );
+  CHECK( strlen( big ) == out.length );
+  CHECK( 0 == strncmp( big, "Version is 1\nNumber of sets 2\n", 30 ) );
+
+  /* the binary layout says how much it needs the same way */
+  out = ( rrdb_buffer ) { small, sizeof( small ), 0 };
+  CHECK( RRDB_TRUNCATED == rrdb_fetch_binary( fn, -1, "", "", &out ) );
+  CHECK( out.length > sizeof( small ) );
+
+  free( big );
+}
+
+/* every update is tried, status says which went in */
+static void updatemany( void ) {
+  const char *fns[ 3 ] = { filename( "many0" ), filename( "missing" ), filename( "many2" ) };
+  double a[ 1 ] = { 3 }, b[ 1 ] = { 4 }, c[ 1 ] = { 5 };
+  const double *values[ 3 ] = { a, b, c };
+  unsigned int counts[ 3 ] = { 1, 1, 1 };
+  int status[ 3 ] = { -99, -99, -99 };
+  char text[ 1024 ];
+  rrdb_buffer out = { text, sizeof( text ), 0 };
+
+  CHECK( RRDB_OK == rrdb_create( fns[ 0 ], 1, 10, "", NULL ) );
+  CHECK( RRDB_OK == rrdb_create( fns[ 2 ], 1, 10, "", NULL ) );
+
+  CHECK( RRDB_ERROR == rrdb_update_many( fns, values, counts, 3, status, &out ) );
+  CHECK( RRDB_OK == status[ 0 ] );
+  CHECK( RRDB_ERROR == status[ 1 ] );
+  CHECK( RRDB_OK == status[ 2 ] );
+
+  CHECK( RRDB_OK == rrdb_fetch( fns[ 2 ], "", "", &out ) );
+  CHECK( NULL != strstr( text, ":5.000000\n" ) );
+
+  /* all of them going in is a success */
+  const char *good[ 2 ] = { fns[ 0 ], fns[ 2 ] };
+  CHECK( RRDB_OK == rrdb_update_many( good, values, counts, 2, status, NULL ) );
+  CHECK( RRDB_OK == status[ 0 ] && RRDB_OK == status[ 1 ] );
+}
+
+/* a failure is RRDB_ERROR with the error text, even when the text doesn't fit */
+static void errors( void ) {
+  const char *fn = filename( "errors" );
+  char text[ 1024 ], small[ 8 ];
+  rrdb_buffer out = { text, sizeof( text ), 0 };
+
+  CHECK( RRDB_ERROR == rrdb_fetch( filename( "nothere" ), "", "", &out ) );
+  CHECK( 0 == strncmp( text, "ERROR: failed to open", 21 ) );
+  CHECK( strlen( text ) == out.length );
+
+  CHECK( RRDB_ERROR == rrdb_create( fn, 1, 10, "RRDBSUM:FORTNIGHT:0", &out ) );
+  CHECK( 0 == strcmp( text, "ERROR: unknown period 'FORTNIGHT'\n" ) );
+  CHECK( -1 == access( fn, F_OK ) );
+
+  CHECK( RRDB_OK == rrdb_touch_value( fn, "main/sales", "ONEHOUR", 10, 10, 1, 2.5, 0, &out ) );
+  CHECK( RRDB_ERROR == rrdb_touch( fn, "main/sales", "ONEHOUR", 10, 10, 1, 0, &out ) );
+  CHECK( 0 == strcmp( text, "ERROR: touches of this file carry a value\n" ) );
+
+  out = ( rrdb_buffer ) { small, sizeof( small ), 0 };
+  CHECK( RRDB_ERROR == rrdb_info( filename( "nothere" ), &out ) );
+  CHECK( out.length > sizeof( small ) );
+  CHECK( 0 == strcmp( small, "ERROR: " ) );
+
+  CHECK( RRDB_ERROR == rrdb_set_lock_mode( "nonsense" ) );
+  CHECK( RRDB_ERROR == rrdb_update( filename( "nothere" ), ( double[] ) { 1 }, 1, NULL ) );
+}
+
+/* the rows of the spans in order, n at most */
+static size_t flatten( const rrdb_span *spans, int count, rrdb_time_point *times, long double *values, size_t n ) {
+  size_t rows = 0;
+
+  for ( int s = 0; s < count; s++ ) {
+    for ( size_t i = 0; i < spans[ s ].length && rows < n; i++, rows++ ) {
+      times[ rows ] = spans[ s ].times[ i ];
+      values[ rows ] = spans[ s ].values[ i ];
+    }
+  }
+  return rows;
+}
+
+/* the count of the touch bin when falls in, -1 if the spans don't reach it */
+static long countat( const rrdb_span *spans, int count, time_t when ) {
+  for ( int s = 0; s < count; s++ ) {
+    if ( when >= spans[ s ].first && when < spans[ s ].first + ( time_t ) spans[ s ].length * spans[ s ].step )
+      return spans[ s ].counts[ ( when - spans[ s ].first ) / spans[ s ].step ];
+  }
+  return -1;
+}
+
+/* the spans follow on from each other */
+static int contiguous( const rrdb_span *spans, int count ) {
+  return count < 2 || spans[ 1 ].first == spans[ 0 ].first + ( time_t ) spans[ 0 ].length * spans[ 0 ].step;
+}
+
+/* a ring which has wrapped is two spans, oldest first, as is its xform */
+static void cursorseries( void ) {
+  const char *fn = filename( "cursor" );
+  rrdb_cursor *cursor;
+  rrdb_span spans[ 2 ];
+  rrdb_time_point times[ 8 ];
+  long double values[ 8 ];
+  int count;
+
+  CHECK( RRDB_OK == rrdb_create( fn, 2, 4, "RRDBSUM:ONEDAY:1", NULL ) );
+  for ( int i = 1; i <= 6; i++ ) CHECK( RRDB_OK == rrdb_update( fn, ( double[] ) { i, i * 10 }, 2, NULL ) );
+
+  CHECK( RRDB_OK == rrdb_cursor_set( fn, 0, &cursor, NULL ) );
+  count = rrdb_cursor_spans( cursor, spans );
+  CHECK( 2 == count );
+  CHECK( 4 == flatten( spans, count, times, values, 8 ) );
+  for ( int i = 0; i < 4; i++ ) CHECK( times[ i ].valid && values[ i ] == i + 3 );
+  for ( int i = 1; i < 4; i++ ) CHECK( times[ i ].time >= times[ i - 1 ].time );
+  rrdb_cursor_close( cursor );
+
+  CHECK( RRDB_OK == rrdb_cursor_set( fn, 1, &cursor, NULL ) );
+  count = rrdb_cursor_spans( cursor, spans );
+  CHECK( 4 == flatten( spans, count, times, values, 8 ) );
+  CHECK( 60 == values[ 3 ] );
+  rrdb_cursor_close( cursor );
+
+  /* a day's sum of set 1 in one row, the rows not written yet aren't valid */
+  CHECK( RRDB_OK == rrdb_cursor_xform( fn, 0, &cursor, NULL ) );
+  count = rrdb_cursor_spans( cursor, spans );
+  CHECK( 4 == flatten( spans, count, times, values, 8 ) );
+  CHECK( times[ 3 ].valid && 210 == values[ 3 ] );
+  CHECK( 0 == times[ 3 ].time % 86400 );
+  for ( int i = 0; i < 3; i++ ) CHECK( !times[ i ].valid );
+  rrdb_cursor_close( cursor );
+}
+
+/* touch sets as they are kept - sparse, keeping values and rolled up from a finer period */
+static void cursortouches( void ) {
+  const char *fn = filename( "cursortouch" ), *valued = filename( "cursorvalued" );
+  time_t hour = time( NULL ) / 3600 * 3600;
+  rrdb_cursor *cursor;
+  rrdb_span spans[ 2 ];
+  size_t rows;
+  int count;
+
+  /* a new set's ring is sparse until enough of its bins are touched */
+  CHECK( RRDB_OK == rrdb_touch( fn, "main/sales", "ONEHOUR", 10, 10, 2, hour - 7200, NULL ) );
+  CHECK( RRDB_OK == rrdb_touch( fn, "main/sales", "ONEHOUR", 10, 10, 3, hour, NULL ) );
+
+  CHECK( RRDB_OK == rrdb_cursor_touch( fn, "sales", "ONEHOUR", &cursor, NULL ) );
+  count = rrdb_cursor_spans( cursor, spans );
+  CHECK( count >= 1 && contiguous( spans, count ) );
+  rows = 0;
+  for ( int s = 0; s < count; s++ ) rows += spans[ s ].length;
+  CHECK( 10 == rows );
+  CHECK( hour - 9 * 3600 == spans[ 0 ].first && 3600 == spans[ 0 ].step );
+  CHECK( 2 == countat( spans, count, hour - 7200 ) );
+  CHECK( 0 == countat( spans, count, hour - 3600 ) );
+  CHECK( 3 == countat( spans, count, hour ) );
+  rrdb_cursor_close( cursor );
+
+  /* only hours are kept, so days are summed from them */
+  CHECK( RRDB_OK == rrdb_cursor_touch( fn, "main", "ONEDAY", &cursor, NULL ) );
+  count = rrdb_cursor_spans( cursor, spans );
+  CHECK( count >= 1 && 86400 == spans[ 0 ].step );
+  if ( ( hour - 7200 ) / 86400 == hour / 86400 ) CHECK( 5 == countat( spans, count, hour ) );
+  else CHECK( 2 == countat( spans, count, hour - 7200 ) && 3 == countat( spans, count, hour ) );
+  rrdb_cursor_close( cursor );
+
+  /* the counts of a file which keeps values */
+  CHECK( RRDB_OK == rrdb_touch_value( valued, "queue", "ONEHOUR", 10, 10, 4, 1.5, hour - 3600, NULL ) );
+  CHECK( RRDB_OK == rrdb_touch_value( valued, "queue", "ONEHOUR", 10, 10, 1, 8, hour, NULL ) );
+  CHECK( RRDB_OK == rrdb_cursor_touch( valued, "queue", "ONEHOUR", &cursor, NULL ) );
+  count = rrdb_cursor_spans( cursor, spans );
+  CHECK( 4 == countat( spans, count, hour - 3600 ) );
+  CHECK( 1 == countat( spans, count, hour ) );
+  CHECK( 0 == countat( spans, count, hour - 7200 ) );
+  rrdb_cursor_close( cursor );
+
+  /* no such path is no spans rather than an error */
+  CHECK( RRDB_OK == rrdb_cursor_touch( fn, "support", "ONEHOUR", &cursor, NULL ) );
+  CHECK( 0 == rrdb_cursor_spans( cursor, spans ) );
+  rrdb_cursor_close( cursor );
+}
+
+/* what a cursor can't be opened on */
+static void cursorerrors( void ) {
+  const char *fn = filename( "cursorerrors" ), *touches = filename( "cursorerrortouch" );
+  rrdb_cursor *cursor = ( rrdb_cursor * ) &cursor;
+  char text[ 1024 ];
+  rrdb_buffer out = { text, sizeof( text ), 0 };
+
+  CHECK( RRDB_OK == rrdb_create( fn, 2, 4, "RRDBSUM:ONEDAY:0", NULL ) );
+  CHECK( RRDB_OK == rrdb_touch( touches, "main", "ONEHOUR", 10, 10, 1, 0, NULL ) );
+
+  CHECK( RRDB_ERROR == rrdb_cursor_set( fn, 2, &cursor, &out ) );
+  CHECK( NULL == cursor );
+  CHECK( 0 == strcmp( text, "ERROR: set index out of bounds\n" ) );
+
+  CHECK( RRDB_ERROR == rrdb_cursor_xform( fn, 1, &cursor, &out ) );
+  CHECK( NULL == cursor );
+  CHECK( 0 == strcmp( text, "ERROR: xform index out of bounds\n" ) );
+
+  CHECK( RRDB_ERROR == rrdb_cursor_touch( fn, "main", "ONEHOUR", &cursor, &out ) );
+  CHECK( 0 == strcmp( text, "ERROR: not a touch rrdb file\n" ) );
+  CHECK( RRDB_ERROR == rrdb_cursor_set( touches, 0, &cursor, &out ) );
+  CHECK( 0 == strcmp( text, "ERROR: not a V1 rrdb file\n" ) );
+
+  CHECK( RRDB_ERROR == rrdb_cursor_touch( touches, NULL, "ONEHOUR", &cursor, &out ) );
+  CHECK( NULL == cursor );
+  CHECK( 0 == strcmp( text, "ERROR: path should be a string\n" ) );
+
+  CHECK( RRDB_ERROR == rrdb_cursor_set( filename( "nothere" ), 0, &cursor, &out ) );
+  CHECK( NULL == cursor );
+  CHECK( 0 == strncmp( text, "ERROR: failed to open", 21 ) );
+}
+
+int main( int argc, char **argv ) {
+  dir = argc > 1 ? argv[ 1 ] : "/tmp";
+
+  truncated();
+  updatemany();
+  errors();
+  cursorseries();
+  cursortouches();
+  cursorerrors();
+
+  rrdb_shutdown();
+  return 0 == failed ? 0 : 1;
+}
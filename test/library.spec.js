@@ -0,0 +1,22 @@
+
+import { execFile } from "node:child_process"
+import { promisify } from "node:util"
+import { fileURLToPath } from "node:url"
+import { expect } from "chai"
+
+const execFileAsync = promisify( execFile )
+const repo = fileURLToPath( new URL( "..", import.meta.url ) )
+
+/* the C tests of librrdb.h, linked against librrdb.a - a failed check is a line of stdout and exit 1 */
+describe( "rrdb library", function () {
+  this.timeout( 60000 )
+
+  before( async function () {
+    await execFileAsync( "make", [ "-s", "-C", repo, "test/library" ] )
+  } )
+
+  it( "truncated results, update_many statuses, errors and cursors", async function () {
+    const { stdout } = await execFileAsync( `${repo}/test/library`, [ "/tmp" ] )
+    expect( stdout ).to.equal( "" )
+  } )
+} )
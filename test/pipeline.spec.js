@@ -0,0 +1,258 @@
+
+import { spawn, execFile } from "node:child_process"
+import { promisify } from "node:util"
+import { access, mkdir, unlink } from "node:fs/promises"
+import { fileURLToPath } from "node:url"
+import { expect } from "chai"
+import { randomUUID } from "node:crypto"
+
+const execFileAsync = promisify( execFile )
+const rrbdbin = "/usr/bin/rrdb"
+const repo = fileURLToPath( new URL( "..", import.meta.url ) )
+
+function genfilename() {
+  return `${randomUUID()}.rrdb`
+}
+
+/**
+ * Run a pipe session, returning stdout once the input is exhausted.
+ * @returns { Promise< string > }
+ */
+function pipe( lines, flags = [] ) {
+  return new Promise( ( resolve, reject ) => {
+    const proc = spawn( rrbdbin, [ "--command=-", "--dir=/tmp", ...flags ] )
+    let out = ""
+    proc.stdout.on( "data", ( d ) => out += d )
+    proc.on( "error", reject )
+    proc.on( "close", () => resolve( out ) )
+    proc.stdin.end( lines.join( "\n" ) + "\n" )
+  } )
+}
+
+/**
+ * Group tagged response lines by tag.
+ * @returns { Object } tag -> lines (without the END marker)
+ */
+function bytag( out ) {
+  const responses = {}
+  for( const line of out.trim().split( "\n" ) ) {
+    const m = line.match( /^@(\S+) (.*)$/ )
+    if( !m ) continue
+    if( !responses[ m[ 1 ] ] ) responses[ m[ 1 ] ] = { lines: [], ended: false }
+    expect( responses[ m[ 1 ] ].ended ).to.equal( false )
+    if( "END" === m[ 2 ] ) responses[ m[ 1 ] ].ended = true
+    else responses[ m[ 1 ] ].lines.push( m[ 2 ] )
+  }
+  return responses
+}
+
+describe( "rrdb pipelined requests", function () {
+
+  it( "tagged responses are framed with the tag and an END marker", async function () {
+    const fn = genfilename()
+    const out = await pipe( [
+      `create ${fn} 1 10 RRDBCOUNT:ONEDAY`,
+      `@u1 update ${fn} 5`,
+      `@missing fetch ${genfilename()}`,
+      `info ${fn}`
+    ] )
+
+    const responses = bytag( out )
+    expect( responses.u1.lines ).to.eql( [ "OK" ] )
+    expect( responses.u1.ended ).to.equal( true )
+    expect( responses.missing.lines[ 0 ] ).to.match( /^ERROR: failed to open/ )
+    expect( responses.missing.ended ).to.equal( true )
+
+    /* untagged requests are still plain text, in order */
+    expect( out.split( "\n" )[ 0 ] ).to.equal( "OK" )
+    expect( out ).to.match( /\nVersion is 1\n/ )
+  } )
+
+  it( "many tagged requests on worker threads all complete", async function () {
+    const files = [ genfilename(), genfilename(), genfilename(), genfilename() ]
+    const lines = files.map( ( fn ) => `create ${fn} 1 10 RRDBSUM:ONEDAY:0` )
+
+    for( let i = 0; i < 40; i++ ) {
+      lines.push( `@${i} update ${files[ i % files.length ]} ${i}` )
+    }
+
+    /* untagged - waits for the tagged updates before it runs */
+    lines.push( `info ${files[ 0 ]}` )
+    files.forEach( ( fn, i ) => lines.push( `@f${i} fetch ${fn} 0` ) )
+
+    const out = await pipe( lines, [ "--threads=4" ] )
+    const responses = bytag( out )
+
+    for( let i = 0; i < 40; i++ ) {
+      expect( responses[ i ].lines ).to.eql( [ "OK" ] )
+      expect( responses[ i ].ended ).to.equal( true )
+    }
+
+    /* each file got 10 updates: i, i + 4, ... i + 36 */
+    files.forEach( ( fn, i ) => {
+      const sum = Number( responses[ `f${i}` ].lines[ 0 ].split( ":" )[ 1 ] )
+      expect( sum ).to.equal( 10 * i + 180 )
+    } )
+  } )
+
+  it( "coalesced touches are merged into fetches and flushed on exit", async function () {
+    const fn = genfilename()
+    const touch = `touch ${fn} 2 10 main/sales ONEHOUR`
+    const fetch = `fetch ${fn} sales ONEHOUR`
+
+    let out = await pipe( [ touch, touch, touch, fetch, touch, touch, fetch ], [ "--coalesce=60000" ] )
+    let counts = out.trim().split( "\n" ).filter( ( l ) => l.includes( ":" ) ).map( ( l ) => Number( l.split( ":" )[ 1 ] ) )
+    expect( counts ).to.eql( [ 3, 5 ] )
+
+    out = await pipe( [ fetch ] )
+    expect( out ).to.match( /^\d+:5\n/ )
+  } )
+
+  it( "coalesce 0 and flush write pending touches", async function () {
+    const fn = genfilename()
+    const touch = `touch ${fn} 2 10 main/sales ONEHOUR`
+
+    const out = await pipe( [ "coalesce 60000", touch, touch, "flush", touch, "coalesce 0", touch ] )
+    expect( out.trim().split( "\n" ) ).to.eql( [ "OK", "OK", "OK", "OK", "OK", "OK", "OK" ] )
+
+    const fetched = await pipe( [ `fetch ${fn} sales ONEHOUR` ] )
+    expect( fetched ).to.match( /^\d+:4\n/ )
+  } )
+
+  it( "lock timings are reported in either lock mode", async function () {
+    const fn = genfilename()
+
+    for( const mode of [ "fast", "debug" ] ) {
+      const out = await pipe( [ `create ${fn} 1 10 RRDBSUM:ONEDAY:0`, `update ${fn} 1`, "lockstats" ], [ `--lockmode=${mode}` ] )
+      expect( out ).to.include( `lockmode:${mode}\n` )
+      expect( out ).to.match( /\nacquired:2\n/ )
+      expect( out ).to.match( /\nmaxholdus:\d+\n/ )
+    }
+
+    /* the side file lock every earlier rrdb takes, unless told otherwise */
+    expect( await pipe( [ "lockstats" ] ) ).to.include( "lockmode:debug\n" )
+  } )
+
+  it( "concurrent touches of one file with byte range locks all count", async function () {
+    this.timeout( 60000 )
+
+    const fn = genfilename()
+    const procs = 8
+    const touches = 500
+    /* every process touches the shared path and its own, both with each touch */
+    const session = ( p ) => Array.from( { length: touches }, () => `touch ${fn} 20 10 shared/p${p} ONEHOUR` )
+    /* an hour may turn while we run, so add up the bins */
+    const total = ( out ) => out.trim().split( "\n" ).filter( ( l ) => /^\d+:\d+$/.test( l ) ).reduce( ( sum, l ) => sum + Number( l.split( ":" )[ 1 ] ), 0 )
+
+    const outs = await Promise.all( Array.from( { length: procs }, ( _, p ) => pipe( session( p ), [ "--lockmode=fast" ] ) ) )
+    outs.forEach( ( out ) => expect( out ).to.equal( "OK\n".repeat( touches ) ) )
+
+    expect( total( await pipe( [ `fetch ${fn} shared ONEHOUR` ] ) ) ).to.equal( procs * touches )
+    for( let p = 0; p < procs; p++ ) {
+      expect( total( await pipe( [ `fetch ${fn} p${p} ONEHOUR` ] ) ) ).to.equal( touches )
+    }
+  } )
+
+  it( "fetch and info read without a lock", async function () {
+    const fn = genfilename()
+    await pipe( [ `create ${fn} 1 10 RRDBSUM:ONEDAY:0` ] )
+    /* created as V1, which has no seqlock to read by */
+    await execFileAsync( rrbdbin, [ "--command=convert", "--dir=/tmp", `--filename=${fn}`, "--format=5" ] )
+    const out = await pipe( [ `update ${fn} 1`, `fetch ${fn}`, `info ${fn}`, "lockstats" ] )
+
+    /* only the update locks */
+    expect( out ).to.match( /\nacquired:1\n/ )
+    expect( out ).to.match( /\nsnapshots:2\n/ )
+    expect( out ).to.match( /\nsnapshotfallbacks:0\n/ )
+  } )
+
+  it( "series in a container work as files of their own", async function () {
+    const container = genfilename().replace( ".rrdb", ".rrdbc" )
+    const lines = []
+
+    /* enough series to grow the directory */
+    for( let i = 0; i < 60; i++ ) {
+      lines.push( `create ${container}:s${i} 1 10 RRDBSUM:ONEDAY:0`, `update ${container}:s${i} ${i}` )
+    }
+    lines.push( `touch ${container}:touches 10 10 main/sales ONEHOUR`, `touch ${container}:touches 10 10 main/sales ONEHOUR` )
+    lines.push( `fetch ${container}:s42 0`, `fetch ${container}:touches sales ONEHOUR`, `info ${container}`, `fetch ${container}:missing` )
+
+    const out = ( await pipe( lines ) ).trim().split( "\n" )
+    const results = out.slice( 122 )
+
+    expect( out.slice( 0, 122 ).every( ( l ) => "OK" === l ) ).to.equal( true )
+    expect( results[ 0 ] ).to.match( /^\d+:42\.000000$/ )
+    expect( results[ 2 ] ).to.match( /^\d+:2$/ )
+    expect( results ).to.include( "64:61" )
+    expect( results ).to.include( "s42:1:676" )
+    expect( results[ results.length - 1 ] ).to.match( /^ERROR: failed to open/ )
+  } )
+
+  it( "local producers queue touches through a shared memory ring", async function () {
+    this.timeout( 60000 )
+
+    const ring = randomUUID()
+    const fn = genfilename()
+    const producer = `${repo}/bench/ring`
+    const fetch = [ `fetch ${fn} p0 ONEHOUR`, `fetch ${fn} p3 ONEHOUR` ]
+    const counts = ( out ) => out.trim().split( "\n" ).filter( ( l ) => /^\d+:\d+$/.test( l ) ).map( ( l ) => Number( l.split( ":" )[ 1 ] ) )
+
+    await execFileAsync( "make", [ "-s", "-C", repo, "bench/ring" ] )
+
+    /* a server which stays up until we close its input */
+    const server = spawn( rrbdbin, [ "--command=-", "--dir=/tmp", `--ring=${ring}`, "--ringslots=256" ] )
+    const closed = new Promise( ( resolve ) => server.on( "close", resolve ) )
+    for( let i = 0; i < 100; i++ ) {
+      try { await access( `/dev/shm/${ring}` ); break } catch( e ) { await new Promise( ( r ) => setTimeout( r, 50 ) ) }
+    }
+
+    /* 4 producers, willing to wait as long as it takes */
+    let out = ( await execFileAsync( producer, [ ring, fn, "4", "2000", "100000000" ] ) ).stdout
+    expect( out ).to.match( /^pushed:8000\ndropped:0\n/ )
+    server.stdin.end()
+    await closed
+
+    expect( counts( await pipe( fetch ) ) ).to.eql( [ 2000, 2000 ] )
+
+    /* nobody draining - what doesn't fit is dropped and the rest waits for the next server */
+    out = ( await execFileAsync( producer, [ ring, fn, "1", "300", "1" ] ) ).stdout
+    expect( out ).to.match( /^pushed:256\ndropped:44\n/ )
+
+    out = await pipe( [ "ringstats" ], [ `--ring=${ring}` ] )
+    expect( out ).to.match( /^ring:\S+\nslots:256\n/ )
+    expect( out ).to.match( /\ndropped:44\nfailed:0\n/ )
+    expect( await pipe( [ "coalesce 0" ], [ `--ring=${ring}`, "--ringslots=64" ] ) ).to.equal( "" )
+
+    expect( counts( await pipe( fetch ) ) ).to.eql( [ 2256, 2000 ] )
+    await unlink( `/dev/shm/${ring}` )
+  } )
+
+  it( "a ring's records can't name a file outside the server's dir", async function () {
+    this.timeout( 60000 )
+
+    const ring = randomUUID()
+    const dir = `/tmp/${randomUUID()}`
+    const fn = genfilename()
+    const producer = `${repo}/bench/ring`
+    const server = [ `--ring=${ring}`, `--dir=${dir}` ]
+
+    await mkdir( dir )
+    await execFileAsync( "make", [ "-s", "-C", repo, "bench/ring" ] )
+    await pipe( [], server )
+
+    for( const escape of [ `../${fn}`, `/tmp/${fn}`, `sub/../../${fn}` ] ) {
+      expect( ( await execFileAsync( producer, [ ring, escape, "1", "5", "1" ] ) ).stdout ).to.match( /^pushed:5\n/ )
+    }
+    expect( ( await execFileAsync( producer, [ ring, fn, "1", "5", "1" ] ) ).stdout ).to.match( /^pushed:5\n/ )
+
+    /* the server drains what is queued before it stops */
+    await pipe( [], server )
+    expect( await pipe( [ "ringstats" ], server ) ).to.match( /\nreceived:20\n(.*\n)*failed:15\n/ )
+    await access( `${dir}/${fn}` )
+    let escaped = true
+    try { await access( `/tmp/${fn}` ) } catch( e ) { escaped = false }
+    expect( escaped ).to.equal( false )
+
+    await unlink( `/dev/shm/${ring}` )
+  } )
+} )
@@ -0,0 +1,72 @@
+
+import { execFile } from "node:child_process"
+import { promisify } from "node:util"
+import { randomUUID } from "node:crypto"
+import { expect } from "chai"
+
+const execFileAsync = promisify( execFile )
+const rrbdbin = "/usr/bin/rrdb"
+
+function genfilename() {
+  return `${randomUUID()}.rrdb`
+}
+
+async function rrdb( args, env = process.env ) {
+  const { stdout } = await execFileAsync( rrbdbin, [ "--dir=/tmp", ...args ], { env } )
+  return stdout
+}
+
+function at( seconds ) {
+  const when = new Date( seconds * 1000 ).toISOString().replace( "T", " " ).slice( 0, 19 )
+  return { ...process.env, TZ: "UTC", FAKETIME: `@${when}`, LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1" }
+}
+
+describe( "rrdb reshape", function () {
+  this.timeout( 120000 )
+
+  it( "keeps the data of a file given new samples, sets and xforms", async function () {
+    const fn = genfilename()
+
+    await rrdb( [ "--command=create", `--filename=${fn}`, "--setcount=2", "--samplecount=6", "--xform=RRDBSUM:ONEDAY:0:RRDBMEAN:ONEHOUR:1" ] )
+    for( let i = 1; i <= 8; i++ ) await rrdb( [ "--command=update", `--filename=${fn}`, `--values=${i}:${i * 2}` ] )
+
+    await rrdb( [ "--command=reshape", `--filename=${fn}`, "--samplecount=4", "--setcount=3", "--xform=RRDBMEAN:ONEHOUR:1:RRDBMAX:ONEDAY:0:RRDBCOUNT:ONEDAY" ] )
+
+    const raw = ( await rrdb( [ "--command=fetch", `--filename=${fn}` ] ) ).trim().split( "\n" ).map( ( r ) => r.split( ":" ).slice( 1 ).join( ":" ) )
+    expect( raw ).to.eql( [ "5.000000:10.000000:0.000000", "6.000000:12.000000:0.000000", "7.000000:14.000000:0.000000", "8.000000:16.000000:0.000000" ] )
+
+    /* the mean carries on (with its count), the others are worked out from the 6 raw points there were */
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=1" ] ) ).to.match( /^\d+:8\.000000\n$/ )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=2" ] ) ).to.match( /^\d+:6\.000000\n$/ )
+
+    await rrdb( [ "--command=update", `--filename=${fn}`, "--values=1:10:5" ] )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=0" ] ) ).to.match( /^\d+:9\.111111\n$/ )
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=2" ] ) ).to.match( /^\d+:7\.000000\n$/ )
+    expect( await rrdb( [ "--command=info", `--filename=${fn}` ] ) ).to.match( /\nNumber of sets 3\nNumber of samples 4\n/ )
+
+    expect( await rrdb( [ "--command=reshape", `--filename=${fn}`, "--setcount=1" ] ) ).to.match( /^ERROR: xform 0 is of set 1 which the file won't have/ )
+  } )
+
+  it( "moves the archive and archives what no longer fits", async function () {
+    const fn = genfilename()
+    const start = Date.parse( "2025-10-31T12:00:00Z" ) / 1000
+    const updates = 140
+
+    await rrdb( [ "--command=create", `--filename=${fn}`, "--setcount=1", "--samplecount=10", "--xform=RRDBSUM:FIVEMINUTE:0" ] )
+    await rrdb( [ "--command=archive", `--filename=${fn}` ] )
+    for( let i = 0; i < updates; i++ ) {
+      await rrdb( [ "--command=update", `--filename=${fn}`, `--values=${ i % 7 }.25` ], at( start + i * 300 ) )
+    }
+
+    /* the sum is now the second xform, and its ring shorter */
+    await rrdb( [ "--command=reshape", `--filename=${fn}`, "--samplecount=4", "--xform=RRDBMAX:ONEHOUR:0:RRDBSUM:FIVEMINUTE:0" ], at( start + updates * 300 ) )
+
+    const rows = ( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=1" ] ) ).trim().split( "\n" )
+    expect( rows.length ).to.equal( updates )
+    rows.forEach( ( row, i ) => expect( row ).to.equal( `${ start + i * 300 }:${ i % 7 }.250000` ) )
+
+    /* the last 10 updates were at 22:50 to 23:35 */
+    expect( await rrdb( [ "--command=fetch", `--filename=${fn}`, "--xform=0" ] ) ).to.equal( `${ start + 10 * 3600 }:5.250000\n${ start + 11 * 3600 }:6.250000\n` )
+    expect( await rrdb( [ "--command=info", `--filename=${fn}` ] ) ).to.match( /\nArchived #128 points in #1 blocks \(\d+ bytes\)\n/ )
+  } )
+} )
@@ -0,0 +1,84 @@
+
+import { execFile, spawn } from "node:child_process"
+import { promisify } from "node:util"
+import { randomUUID } from "node:crypto"
+import { mkdir } from "node:fs/promises"
+import { expect } from "chai"
+
+const execFileAsync = promisify( execFile )
+const rrbdbin = "/usr/bin/rrdb"
+
+async function rrdb( args ) {
+  const { stdout } = await execFileAsync( rrbdbin, [ "--dir=/tmp", ...args ] )
+  return stdout
+}
+
+function pipe( lines ) {
+  return new Promise( ( resolve, reject ) => {
+    const proc = spawn( rrbdbin, [ "--command=-", "--dir=/tmp" ] )
+    let out = ""
+    proc.stdout.on( "data", ( d ) => out += d )
+    proc.on( "error", reject )
+    proc.on( "close", () => resolve( out ) )
+    proc.stdin.end( lines.join( "\n" ) + "\n" )
+  } )
+}
+
+/**
+ * The records of a scan in the order they finished.
+ * @returns { Array } of { path, lines }
+ */
+function records( out ) {
+  const found = []
+  const open = {}
+  for( const line of out.split( "\n" ) ) {
+    const m = line.match( /^@(\S+) (.*)$/ )
+    if( !m ) continue
+    if( !open[ m[ 1 ] ] ) open[ m[ 1 ] ] = []
+    if( "END" === m[ 2 ] ) {
+      found.push( { path: m[ 1 ], lines: open[ m[ 1 ] ] } )
+      delete open[ m[ 1 ] ]
+    } else {
+      open[ m[ 1 ] ].push( m[ 2 ] )
+    }
+  }
+  expect( open ).to.eql( {} )
+  return found
+}
+
+describe( "rrdb scan", function () {
+  this.timeout( 20000 )
+
+  const dir = randomUUID()
+  const files = [ "a.rrdb", "b.rrdb", "x/c.rrdb", "x/y/d.rrdb" ]
+
+  before( async function () {
+    await mkdir( `/tmp/${dir}/x/y`, { recursive: true } )
+    for( const [ i, fn ] of files.entries() ) {
+      await rrdb( [ "--command=create", `--filename=${dir}/${fn}`, "--setcount=1", "--samplecount=10", "--xform=RRDBSUM:ONEDAY:0" ] )
+      await rrdb( [ "--command=update", `--filename=${dir}/${fn}`, `--values=${i + 1}` ] )
+    }
+  } )
+
+  it( "info and fetch of every file, ordered by path", async function () {
+    const out = await rrdb( [ "--command=scan", `--filename=${dir}`, "--emit=info,fetch,ordered", "--xform=0", "--threads=3" ] )
+    const found = records( out )
+
+    expect( found.map( ( r ) => r.path ) ).to.eql( files )
+    found.forEach( ( r, i ) => {
+      expect( r.lines[ 0 ] ).to.equal( "Version is 1" )
+      expect( r.lines[ r.lines.length - 1 ] ).to.match( new RegExp( `^\\d+:${i + 1}\\.000000$` ) )
+    } )
+    expect( out ).to.match( /\nfiles:4\nfailed:0\nseconds:[\d.]+\nfilespersec:[\d.]+\n$/ )
+  } )
+
+  it( "a file which can't be read fails on its own, in a pipe", async function () {
+    const out = await pipe( [ `create ${dir}/x/t.rrdb 1 10`, `scan ${dir}/x fetch 2 0` ] )
+    const found = records( out )
+
+    expect( found.map( ( r ) => r.path ).sort() ).to.eql( [ "c.rrdb", "t.rrdb", "y/d.rrdb" ] )
+    expect( found.find( ( r ) => "t.rrdb" === r.path ).lines[ 0 ] ).to.match( /^ERROR:/ )
+    expect( found.find( ( r ) => "c.rrdb" === r.path ).lines ).to.have.lengthOf( 1 )
+    expect( out ).to.match( /\nfiles:3\nfailed:1\n/ )
+  } )
+} )
@@ -1,4 +1,5 @@
-import { execFile } from "node:child_process"
+import { execFile, spawnSync } from "node:child_process"
+import { readFile, stat } from "node:fs/promises"
 import { expect } from "chai"
 import { promisify } from "node:util"
 import { randomUUID } from "node:crypto"
@@ -14,6 +15,32 @@ function genfilename() {
   return `${randomUUID()}.rrdb`
 }
 
+/**
+ * One touch over the binary protocol, which returns the library's status as well as its text.
+ * @returns { { status: number, text: string } }
+ */
+function binarytouch( fn, path, period, value, env ) {
+  const str = ( s ) => {
+    const b = Buffer.alloc( 2 )
+    b.writeUInt16LE( Buffer.byteLength( s ), 0 )
+    return Buffer.concat( [ b, Buffer.from( s ) ] )
+  }
+  /* maxsets and samples 0 for the defaults, then a count of 1 now and the value if there is one */
+  const geometry = Buffer.alloc( 8 )
+  const rest = Buffer.alloc( 4 + 8 + ( undefined === value ? 0 : 8 ) )
+  rest.writeUInt32LE( 1, 0 )
+  if( undefined !== value ) rest.writeDoubleLE( value, 12 )
+  const request = Buffer.concat( [ str( fn ), geometry, str( path ), str( period ), rest ] )
+
+  const head = Buffer.alloc( 5 )
+  head.writeUInt32LE( request.length + 1, 0 )
+  head.writeUInt8( 4, 4 )
+
+  const out = spawnSync( rrbdbin, [ "--command=-", "--dir=/tmp/" ], { env, input: Buffer.concat( [ Buffer.from( "binary\n" ), head, request ] ) } ).stdout
+  const frame = out.subarray( out.indexOf( "\n" ) + 1 )
+  return { status: frame.readUInt8( 4 ), text: frame.subarray( 5, 4 + frame.readUInt32LE( 0 ) ).toString() }
+}
+
 describe("rrdb touch", function () {
   it( "rrdb very simple touch then fetch at a fixed time", async function () {
 
@@ -848,4 +875,345 @@ test:3600`
 
 
   } )
-} )
\ No newline at end of file
+
+  it( "rrdb touch with a count and a timestamp", async function () {
+
+    const env = {
+      ...process.env,
+      FAKETIME: "@2025-10-31 12:16:00",
+      LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+    }
+
+    const fn = genfilename()
+
+    const touchflags = [
+      "--command=touch",
+      "--dir=/tmp/",
+      "--filename=" + fn,
+      "--touchpath=test",
+      "--samplecount=10",
+      "--setcount=1",
+      "--period=FIVEMINUTE"
+    ]
+
+    const fetchflags = [
+      "--command=fetch",
+      "--dir=/tmp/",
+      "--filename=" + fn,
+      "--period=FIVEMINUTE",
+      "--touchpath=test"
+    ]
+
+    /* now */
+    await execFileAsync( rrbdbin, [ ...touchflags, "--values=5" ], { env } )
+    /* 12:05 and 12:00 - still in the ring */
+    await execFileAsync( rrbdbin, [ ...touchflags, "--values=3:1761912300" ], { env } )
+    await execFileAsync( rrbdbin, [ ...touchflags, "--values=2:1761912000" ], { env } )
+    /* an hour ago - rolled out of the ring, ignored */
+    await execFileAsync( rrbdbin, [ ...touchflags, "--values=7:1761909000" ], { env } )
+
+    /* a later touch clears the stale bins between */
+    env[ "FAKETIME" ] = "@2025-10-31 12:26:00"
+    await execFileAsync( rrbdbin, [ ...touchflags, "--values=4" ], { env } )
+
+    const { stdout } = await execFileAsync( rrbdbin, fetchflags, { env } )
+
+    const expected = [
+      "1761913500:4",
+      "1761912900:5",
+      "1761912300:3",
+      "1761912000:2"
+    ].join( "\n" )
+
+    expect( stdout.trim() ).to.equal( expected )
+
+    /* pipe form */
+    const { stdout: piped } = await execFileAsync( "/bin/sh", [ "-c",
+      `printf 'touch ${fn} 1 10 test FIVEMINUTE 6:1761912000\\nfetch ${fn} test FIVEMINUTE\\n' | ${rrbdbin} --command=- --dir=/tmp` ], { env } )
+
+    expect( piped ).to.match( /1761912000:8\n/ )
+  } )
+
+  it( "rrdb a full file gives a set to the busiest path", async function () {
+
+    const env = {
+      ...process.env,
+      FAKETIME: "@2025-10-31 12:16:00",
+      LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+    }
+
+    const fn = genfilename()
+
+    const touch = ( path, values = "1" ) => execFileAsync( rrbdbin, [
+      "--command=touch",
+      "--dir=/tmp/",
+      "--filename=" + fn,
+      "--touchpath=" + path,
+      "--samplecount=10",
+      "--setcount=2",
+      "--period=FIVEMINUTE",
+      "--values=" + values
+    ], { env } )
+
+    const info = async () => ( await execFileAsync( rrbdbin, [ "--command=info", "--dir=/tmp/", "--filename=" + fn ], { env } ) ).stdout
+
+    /* 12:10, 12:11 and 12:12 */
+    await touch( "a", "1:1761912600" )
+    await touch( "b", "3:1761912660" )
+
+    /* no more than 2 sets - c is counted but hasn't had more touches than a, the least recently touched */
+    await touch( "c", "1:1761912720" )
+    expect( await info() ).to.equal( "2:2:10\na:300\nb:300\n" )
+
+    /* now it has */
+    await touch( "c", "1:1761912720" )
+    expect( await info() ).to.equal( "2:2:10\nc:300\nb:300\n" )
+
+    /* b is the least recently touched now, a (counted when it lost its set) needs more than b's 3 */
+    for( let i = 0; i < 2; i++ ) {
+      await touch( "a" )
+      expect( await info() ).to.equal( "2:2:10\nc:300\nb:300\n" )
+    }
+    await touch( "a" )
+    expect( await info() ).to.equal( "2:2:10\nc:300\na:300\n" )
+
+    const { stdout } = await execFileAsync( rrbdbin, [ "--command=fetch", "--dir=/tmp/", "--filename=" + fn, "--period=FIVEMINUTE", "--touchpath=c" ], { env } )
+    expect( stdout ).to.equal( "1761912600:1\n" )
+  } )
+
+  it( "rrdb touch paths of any length, each path stored once", async function () {
+
+    const fn = genfilename()
+    const long = "x".repeat( 300 )
+
+    const touch = ( path ) => execFileAsync( rrbdbin, [
+      "--command=touch",
+      "--dir=/tmp/",
+      "--filename=" + fn,
+      "--touchpath=" + path,
+      "--period=ONEHOUR,ONEDAY"
+    ] )
+
+    await touch( `main/${long}` )
+    await touch( long )
+
+    const { stdout: info } = await execFileAsync( rrbdbin, [ "--command=info", "--dir=/tmp/", "--filename=" + fn ] )
+    expect( info ).to.equal( `2:4:2000\nmain:3600\nmain:86400\n${long}:3600\n${long}:86400\n` )
+
+    const { stdout } = await execFileAsync( rrbdbin, [ "--command=fetch", "--dir=/tmp/", "--filename=" + fn, "--period=ONEDAY", "--touchpath=" + long ] )
+    expect( stdout ).to.match( /^\d+:2\n$/ )
+
+    /* version 4, with main and the long path in the string table once for both periods */
+    const data = await readFile( "/tmp/" + fn )
+    expect( data.readInt32LE( 0 ) ).to.equal( 4 )
+    expect( data.toString().split( long ).length ).to.equal( 2 )
+  } )
+
+  it( "rrdb a ring is sparse until enough of its bins are touched", async function () {
+
+    const env = {
+      ...process.env,
+      TZ: "UTC",
+      FAKETIME: "@2025-10-31 17:00:00",
+      LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+    }
+
+    const fn = genfilename()
+    const pipe = ( lines ) => execFileAsync( "sh", [ "-c",
+      `printf '${lines.join( "\\n" )}\\n' | ${rrbdbin} --command=- --dir=/tmp` ], { env } )
+    const touch = ( path, count, at ) => `touch ${fn} 10 100 ${path} FIVEMINUTE ${count}:${at}`
+
+    /* a dense ring of 100 bins would be 400 bytes on its own */
+    await pipe( [ touch( "quiet", 2, 1761912000 ), touch( "quiet", 1, 1761912000 ) ] )
+    expect( ( await stat( "/tmp/" + fn ) ).size ).to.be.below( 400 )
+
+    const busy = []
+    for( let i = 0; i < 60; i++ ) busy.push( touch( "busy", i + 1, 1761912000 + i * 300 ) )
+    await pipe( busy )
+
+    const fetch = async ( path ) => ( await execFileAsync( rrbdbin, [ "--command=fetch", "--dir=/tmp/", "--filename=" + fn,
+      "--touchpath=" + path, "--period=FIVEMINUTE" ], { env } ) ).stdout
+
+    /* grown to dense on the way, the same bins either way */
+    const bins = ( await fetch( "busy" ) ).trim().split( "\n" )
+    expect( bins.length ).to.equal( 60 )
+    expect( bins[ 0 ] ).to.equal( `${1761912000 + 59 * 300}:60` )
+    expect( bins[ 59 ] ).to.equal( "1761912000:1" )
+
+    expect( await fetch( "quiet" ) ).to.equal( "1761912000:3\n" )
+  } )
+
+  it( "rrdb coarser periods roll up from the finest period touched", async function () {
+
+    const env = {
+      ...process.env,
+      TZ: "UTC",
+      FAKETIME: "@2025-11-01 04:40:00",
+      LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+    }
+
+    const fine = genfilename()
+    const both = genfilename()
+    const lines = []
+    for( let i = 0; i < 30; i++ ) {
+      const at = 1761972000 - i * 7200
+      lines.push( `touch ${fine} 10 100 main/sales ONEHOUR ${i + 1}:${at}`, `touch ${both} 10 100 main/sales ONEHOUR,SIXHOUR,ONEDAY ${i + 1}:${at}` )
+    }
+    await execFileAsync( "sh", [ "-c", `printf '${lines.join( "\\n" )}\\n' | ${rrbdbin} --command=- --dir=/tmp` ], { env } )
+
+    const run = async ( args ) => ( await execFileAsync( rrbdbin, [ "--dir=/tmp/", ...args ], { env } ) ).stdout
+    const fetch = ( fn, period ) => run( [ "--command=fetch", "--filename=" + fn, "--touchpath=sales", "--period=" + period ] )
+
+    /* one set per path, the same bins as sets of their own */
+    expect( await run( [ "--command=info", "--filename=" + fine ] ) ).to.equal( "2:2:100\nmain:3600\nsales:3600\n" )
+    for( const period of [ "SIXHOUR", "TWELVEHOUR", "ONEDAY" ] ) {
+      expect( await fetch( fine, period ) ).to.equal( await fetch( both, period ) )
+    }
+    expect( ( await fetch( fine, "ONEDAY" ) ).split( "\n" )[ 0 ] ).to.equal( "1761955200:6" )
+
+    /* nothing finer to roll up from */
+    expect( await fetch( fine, "FIVEMINUTE" ) ).to.equal( "" )
+  } )
+
+  it( "rrdb a prefix fetches paths summed and top lists the busiest of them", async function () {
+
+    const env = {
+      ...process.env,
+      TZ: "UTC",
+      FAKETIME: "@2025-11-01 04:40:00",
+      LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+    }
+
+    const fn = genfilename()
+    const lines = [
+      `touch ${fn} 20 10 main/sales ONEHOUR 5`,
+      `touch ${fn} 20 10 main/support ONEHOUR 3`,
+      `touch ${fn} 20 10 mainframe ONEHOUR 3`,
+      `touch ${fn} 20 10 other ONEHOUR,ONEDAY 7`,
+      /* two hours ago */
+      `touch ${fn} 20 10 main/sales ONEHOUR 2:1761964800`
+    ]
+    await execFileAsync( "sh", [ "-c", `printf '${lines.join( "\\n" )}\\n' | ${rrbdbin} --command=- --dir=/tmp` ], { env } )
+
+    const run = async ( args ) => ( await execFileAsync( rrbdbin, [ "--dir=/tmp/", "--filename=" + fn, ...args ], { env } ) ).stdout
+    const top = ( prefix, period, values ) => run( [ "--command=top", "--touchpath=" + prefix, "--period=" + period, "--values=" + values ] )
+
+    expect( await run( [ "--command=fetch", "--touchpath=main*", "--period=ONEHOUR" ] ) ).to.equal( "1761969600:11\n1761962400:2\n" )
+    /* other's ONEDAY set, the rest rolled up */
+    expect( await run( [ "--command=fetch", "--touchpath=*", "--period=ONEDAY" ] ) ).to.equal( "1761955200:30\n" )
+
+    expect( await top( "*", "ONEHOUR", "0" ) ).to.equal( "main:10\nother:7\nsales:7\nmainframe:3\nsupport:3\n" )
+    expect( await top( "main*", "ONEDAY", "2" ) ).to.equal( "main:10\nmainframe:3\n" )
+    /* only this hour */
+    expect( await top( "s*", "ONEHOUR", "5:1" ) ).to.equal( "sales:5\nsupport:3\n" )
+  } )
+
+  it( "rrdb touches with a value keep the sum, min and max and fetch gives the mean", async function () {
+
+    const env = {
+      ...process.env,
+      TZ: "UTC",
+      FAKETIME: "@2025-11-01 04:40:00",
+      LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+    }
+
+    const fn = genfilename()
+    const run = async ( args ) => ( await execFileAsync( rrbdbin, [ "--dir=/tmp/", "--filename=" + fn, ...args ], { env } ) ).stdout
+    const touch = ( values ) => run( [ "--command=touch", "--touchpath=main/sales", "--period=ONEHOUR", ...( values ? [ "--values=" + values ] : [] ) ] )
+    const fetch = ( path, period ) => run( [ "--command=fetch", "--touchpath=" + path, "--period=" + period ] )
+
+    await touch( "1::250" )
+    await touch( "2::50" )
+    /* two hours ago */
+    await touch( "1:1761962400:10" )
+
+    const hourly = "1761969600:3:350.000000:50.000000:250.000000:116.666667\n1761962400:1:10.000000:10.000000:10.000000:10.000000\n"
+    expect( await fetch( "sales", "ONEHOUR" ) ).to.equal( hourly )
+    expect( await fetch( "sales", "ONEDAY" ) ).to.equal( "1761955200:4:360.000000:10.000000:250.000000:90.000000\n" )
+
+    /* the first touch decided the file keeps values, and the touch fails */
+    expect( await touch() ).to.equal( "ERROR: touches of this file carry a value\n" )
+    expect( binarytouch( fn, "main/sales", "ONEHOUR", undefined, env ) ).to.eql( { status: 1, text: "ERROR: touches of this file carry a value" } )
+
+    /* version 3 keeps them, version 2 can't */
+    await run( [ "--command=convert", "--format=3" ] )
+    expect( await fetch( "sales", "ONEHOUR" ) ).to.equal( hourly )
+    expect( await run( [ "--command=convert", "--format=2" ] ) ).to.match( /keeps values, which version 2 can't\n$/ )
+    await run( [ "--command=convert", "--format=4" ] )
+    await touch( "1::5" )
+    expect( ( await fetch( "main", "ONEHOUR" ) ).split( "\n" )[ 0 ] ).to.equal( "1761969600:4:355.000000:5.000000:250.000000:88.750000" )
+  } )
+
+  it( "rrdb expired sets are reused and the file only shrinks once many are free", async function () {
+
+    const env = {
+      ...process.env,
+      TZ: "UTC",
+      LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+    }
+
+    const fn = genfilename()
+
+    const touch = ( at, path ) => execFileAsync( rrbdbin, [
+      "--command=touch",
+      "--dir=/tmp/",
+      "--filename=" + fn,
+      "--touchpath=" + path,
+      "--samplecount=10",
+      "--setcount=10",
+      "--period=FIVEMINUTE"
+    ], { env: { ...env, FAKETIME: "@2025-10-31 " + at } } )
+
+    const info = async ( at ) => ( await execFileAsync( rrbdbin, [ "--command=info", "--dir=/tmp/", "--filename=" + fn ],
+      { env: { ...env, FAKETIME: "@2025-10-31 " + at } } ) ).stdout
+
+    const size = async () => ( await stat( "/tmp/" + fn ) ).size
+
+    await touch( "12:00:00", "a/b/c/d" )
+    await touch( "12:30:00", "e/f/g" )
+    const full = await size()
+
+    /* a to d have expired (the ring is 50 minutes), h takes the first - the other 3 of 7 aren't enough to shrink for */
+    await touch( "13:00:00", "h" )
+    expect( await info( "13:00:00" ) ).to.equal( "2:4:10\nh:300\ne:300\nf:300\ng:300\n" )
+    /* only h's path added to the string table */
+    expect( await size() ).to.equal( full + 8 )
+
+    /* now e to g have too, 5 of 7 free */
+    await touch( "13:25:00", "i" )
+    expect( await info( "13:25:00" ) ).to.equal( "2:2:10\nh:300\ni:300\n" )
+    expect( await size() ).to.be.below( full )
+  } )
+
+  it( "rrdb a set expires on a quiet file when another set is touched", async function () {
+
+    const env = {
+      ...process.env,
+      TZ: "UTC",
+      LD_PRELOAD: "/usr/lib/faketime/libfaketime.so.1"
+    }
+
+    const fn = genfilename()
+
+    const touch = ( at, path ) => execFileAsync( rrbdbin, [
+      "--command=touch",
+      "--dir=/tmp/",
+      "--filename=" + fn,
+      "--touchpath=" + path,
+      "--samplecount=10",
+      "--setcount=10",
+      "--period=FIVEMINUTE"
+    ], { env: { ...env, FAKETIME: "@2025-10-31 " + at } } )
+
+    const info = async ( at ) => ( await execFileAsync( rrbdbin, [ "--command=info", "--dir=/tmp/", "--filename=" + fn ],
+      { env: { ...env, FAKETIME: "@2025-10-31 " + at } } ) ).stdout
+
+    await touch( "12:00:00", "a" )
+    await touch( "12:40:00", "b" )
+    expect( await info( "12:40:00" ) ).to.equal( "2:2:10\na:300\nb:300\n" )
+
+    /* three touches in all and this one to a set which exists - a's ring (50 minutes) is past, so it goes */
+    await touch( "13:00:00", "b" )
+    expect( await info( "13:00:00" ) ).to.equal( "2:1:10\nb:300\n" )
+  } )
+} )
@@ -225,4 +225,26 @@ describe( "rrdb xform suite", function () {
     ]
     expect(val).to.eql(expected)
   })
+
+  it("create rejects an unknown xform or period and leaves no file", async function () {
+    for (const [xform, error] of [
+      ["RRDBSUM:ONEDAY:0:RRDBMEDIAN:ONEHOUR:1", "ERROR: unknown xform 'RRDBMEDIAN'"],
+      ["RRDBSUM:ONEWEEK:0", "ERROR: unknown period 'ONEWEEK'"]
+    ]) {
+      const badfile = genFilename()
+      const out = await rrdb([
+        "--command=create",
+        `--dir=${dir}`,
+        `--filename=${badfile}`,
+        "--setcount=2",
+        "--samplecount=10",
+        `--xform=${xform}`
+      ])
+      expect(out.trim()).to.equal(error)
+
+      let exists = true
+      await fs.access(`${dir}/${badfile}`).catch(() => exists = false)
+      expect(exists).to.equal(false)
+    }
+  })
 })